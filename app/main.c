@@ -1,7 +1,178 @@
+#include <errno.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/lab.h"
 
-int main(void)
+static void usage(const char *prog)
 {
-  printf("hello world\n");
-  return 0;
+  fprintf(stderr,
+          "usage: %s [-v] [-c command] [--connect socket] [script]\n"
+          "       %s --explain [-c command]\n"
+          "       %s --compile script...\n"
+          "       %s --server socket [--workers N]\n",
+          prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option long_options[] = {
+      {"server", required_argument, NULL, 's'},
+      {"workers", required_argument, NULL, 'w'},
+      {"connect", required_argument, NULL, 'C'},
+      {"explain", no_argument, NULL, 'e'},
+      {"compile", no_argument, NULL, 'p'},
+      {NULL, 0, NULL, 0},
+  };
+  const char *command = NULL;
+  const char *script = NULL;
+  const char *server = NULL;
+  /* LAB_SERVER sends -c to a server without changing the command line,
+   * falling back to running here when no server answers */
+  const char *connect = getenv("LAB_SERVER");
+  bool connect_required = false;
+  bool explain = false;
+  bool compile = false;
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int c;
+  while ((c = getopt_long(argc, argv, "c:v", long_options, NULL)) != -1)
+    {
+      switch (c)
+        {
+        case 'c':
+          command = optarg;
+          break;
+        case 'v':
+          printf("%s version %d.%d\n", argv[0], lab_VERSION_MAJOR, lab_VERSION_MINOR);
+          return 0;
+        case 's':
+          server = optarg;
+          break;
+        case 'w':
+          workers = atol(optarg);
+          break;
+        case 'C':
+          connect = optarg;
+          connect_required = true;
+          break;
+        case 'e':
+          explain = true;
+          break;
+        case 'p':
+          compile = true;
+          break;
+        default:
+          usage(argv[0]);
+          return 2;
+        }
+    }
+
+  if (compile)
+    {
+      /* writes script.labc next to every script, reporting syntax errors */
+      if (optind == argc)
+        {
+          usage(argv[0]);
+          return 2;
+        }
+      int status = 0;
+      for (int i = optind; i < argc; i++)
+        {
+          struct program prog;
+          if (script_compile(&prog, argv[i], NULL) < 0)
+            {
+              fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+              status = 1;
+              continue;
+            }
+          if (prog.errors > 0)
+            {
+              program_report(&prog, argv[i], STDERR_FILENO);
+              if (status == 0)
+                status = 2;
+            }
+          program_destroy(&prog);
+        }
+      return status;
+    }
+  if (!command && optind < argc)
+    script = argv[optind];
+  if (server)
+    {
+      if (sh_server(server, workers > 0 ? (int)workers : 1) < 0)
+        {
+          fprintf(stderr, "%s: %s: %s\n", argv[0], server, strerror(errno));
+          return 1;
+        }
+      return 0;
+    }
+  if (command && connect && *connect && !explain)
+    {
+      int status = sh_client(connect, command, strlen(command));
+      if (status >= 0)
+        return status;
+      if (connect_required || errno == EPROTO)
+        {
+          fprintf(stderr, "%s: %s: %s\n", argv[0], connect, strerror(errno));
+          return 1;
+        }
+    }
+
+  struct shell sh;
+  sh_init(&sh);
+  int status;
+  if (explain && command)
+    {
+      status = sh_explain(&sh, command, strlen(command), STDOUT_FILENO) < 0 ? 2 : 0;
+    }
+  else if (explain)
+    {
+      /* the plan of every line of the script on stdin */
+      struct batch_input in;
+      const char *line;
+      size_t n;
+      status = 0;
+      if (batch_open(&in, STDIN_FILENO) < 0)
+        {
+          fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+          status = 1;
+        }
+      else
+        {
+          while ((line = batch_line(&in, &n)))
+            if (sh_explain(&sh, line, n, STDOUT_FILENO) < 0)
+              status = 2;
+          batch_close(&in);
+        }
+    }
+  else if (command)
+    {
+      status = sh_execute(&sh, command, strlen(command));
+    }
+  else if (script)
+    {
+      status = sh_run_script(&sh, script);
+      if (status < 0)
+        {
+          fprintf(stderr, "%s: %s: %s\n", argv[0], script, strerror(errno));
+          status = 127;
+        }
+    }
+  else if (sh.shell_is_interactive)
+    {
+      status = sh_loop(&sh);
+    }
+  else
+    {
+      status = sh_run_batch(&sh, STDIN_FILENO);
+      if (status < 0)
+        {
+          fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+          status = 1;
+        }
+    }
+  sh_destroy(&sh);
+  return status;
 }
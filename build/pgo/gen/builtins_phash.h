@@ -0,0 +1,23 @@
+/* Generated by tools/phash-gen from src/builtins.def, do not edit */
+#ifndef BUILTINS_PHASH_H
+#define BUILTINS_PHASH_H
+
+#define BUILTIN_PHASH_N 10u
+
+static const int32_t builtin_phash_g[BUILTIN_PHASH_N] = {
+    19, 1, 1, 0, -1, 0, 0, 0,
+    0, -3
+};
+
+#define BUILTIN_SLOT_wait 0 /* wait */
+#define BUILTIN_SLOT_parallel 1 /* parallel */
+#define BUILTIN_SLOT_history 2 /* history */
+#define BUILTIN_SLOT_fg 3 /* fg */
+#define BUILTIN_SLOT_hash 4 /* hash */
+#define BUILTIN_SLOT_pwd 5 /* pwd */
+#define BUILTIN_SLOT_jobs 6 /* jobs */
+#define BUILTIN_SLOT_cd 7 /* cd */
+#define BUILTIN_SLOT_exit 8 /* exit */
+#define BUILTIN_SLOT_bg 9 /* bg */
+
+#endif
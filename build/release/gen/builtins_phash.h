@@ -0,0 +1,35 @@
+/* Generated by tools/phash-gen from src/builtins.def, do not edit */
+#ifndef BUILTINS_PHASH_H
+#define BUILTINS_PHASH_H
+
+#define BUILTIN_PHASH_N 21u
+
+static const int32_t builtin_phash_g[BUILTIN_PHASH_N] = {
+    0, 0, 0, 0, -4, -6, 0, 1,
+    2, 0, 5, 1, 0, 1, -8, 0,
+    0, 11, -17, 0, 1
+};
+
+#define BUILTIN_SLOT_echo 0 /* echo */
+#define BUILTIN_SLOT_dbracket 1 /* [[ */
+#define BUILTIN_SLOT_hash 2 /* hash */
+#define BUILTIN_SLOT_jobs 3 /* jobs */
+#define BUILTIN_SLOT_bg 4 /* bg */
+#define BUILTIN_SLOT_test 5 /* test */
+#define BUILTIN_SLOT_head 6 /* head */
+#define BUILTIN_SLOT_wait 7 /* wait */
+#define BUILTIN_SLOT_parallel 8 /* parallel */
+#define BUILTIN_SLOT_cat 9 /* cat */
+#define BUILTIN_SLOT_history 10 /* history */
+#define BUILTIN_SLOT_bracket 11 /* [ */
+#define BUILTIN_SLOT_set 12 /* set */
+#define BUILTIN_SLOT_builtin 13 /* builtin */
+#define BUILTIN_SLOT_fg 14 /* fg */
+#define BUILTIN_SLOT_wc 15 /* wc */
+#define BUILTIN_SLOT_tail 16 /* tail */
+#define BUILTIN_SLOT_exit 17 /* exit */
+#define BUILTIN_SLOT_pwd 18 /* pwd */
+#define BUILTIN_SLOT_printf 19 /* printf */
+#define BUILTIN_SLOT_cd 20 /* cd */
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Client side of the shell server, kept apart from lab.c so
+ * tools/lab-client can link it without readline or the rest of the shell.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+
+#include "lab.h"
+#include "server.h"
+
+extern char **environ;
+
+int sh_client(const char *path, const char *command, size_t len)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  strcpy(addr.sun_path, path);
+  struct server_request rq = {SERVER_MAGIC, (uint32_t)len, 0, 0};
+  for (char **e = environ; *e; e++, rq.nenv++)
+    rq.env_len += (uint32_t)strlen(*e) + 1;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  char *body = malloc(len + rq.env_len + 1);
+  int err = 0;
+  if (cwd < 0 || !body || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    err = errno;
+  else
+    {
+      memcpy(body, command, len);
+      char *p = body + len;
+      for (char **e = environ; *e; e++)
+        p = stpcpy(p, *e) + 1;
+
+      int fds[SERVER_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd};
+      union
+      {
+        char buf[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+        struct cmsghdr align;
+      } control;
+      memset(&control, 0, sizeof(control));
+      struct iovec iov = {&rq, sizeof(rq)};
+      struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+      struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(sizeof(fds));
+      memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+      ssize_t n;
+      while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+      /* the server runs nothing until it has the whole request */
+      if (n < 0)
+        err = errno;
+      else if (n != sizeof(rq))
+        err = EPIPE;
+      else if (server_send(sock, body, len + rq.env_len) < 0)
+        err = errno;
+    }
+  free(body);
+  if (cwd >= 0)
+    close(cwd);
+
+  struct server_reply reply;
+  if (!err && (server_recv(sock, &reply, sizeof(reply)) < 0 || reply.magic != SERVER_MAGIC))
+    err = EPROTO;
+  close(sock);
+  if (err)
+    {
+      errno = err;
+      return -1;
+    }
+  return reply.status;
+}
@@ -1 +1,7910 @@
-/**Update this file with the starter code**/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/pidfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+
+#include "lab.h"
+#include "phash.h"
+#include "server.h"
+#include "builtins_phash.h"
+
+/* ------------------------------------------------------------------ */
+/* Arena allocator                                                     */
+/* ------------------------------------------------------------------ */
+
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+struct arena_chunk
+{
+  struct arena_chunk *next;
+  size_t cap;
+  size_t used;
+  max_align_t data[];
+};
+
+static size_t align_up(size_t n, size_t a)
+{
+  return (n + a - 1) & ~(a - 1);
+}
+
+static struct arena_chunk *arena_chunk_new(struct arena *a, size_t size)
+{
+  size_t cap = size > a->chunk_size ? size : a->chunk_size;
+  struct arena_chunk *c = malloc(sizeof(*c) + cap);
+  if (!c)
+    return NULL;
+  c->next = NULL;
+  c->cap = cap;
+  c->used = 0;
+  a->mallocs++;
+  return c;
+}
+
+void arena_init(struct arena *a, size_t chunk_size)
+{
+  a->head = NULL;
+  a->chunk_size = chunk_size ? align_up(chunk_size, ARENA_ALIGN) : ARENA_DEFAULT_CHUNK;
+  a->mallocs = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+  size = align_up(size ? size : 1, ARENA_ALIGN);
+  struct arena_chunk *c = a->head;
+  if (!c || c->cap - c->used < size)
+    {
+      /* Grow geometrically so a huge line needs O(log n) chunks */
+      size_t want = size;
+      if (c && c->cap * 2 > want)
+        want = c->cap * 2;
+      struct arena_chunk *n = arena_chunk_new(a, want);
+      if (!n)
+        return NULL;
+      n->next = c;
+      a->head = c = n;
+    }
+  void *p = (char *)c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+void arena_reset(struct arena *a)
+{
+  struct arena_chunk *c = a->head;
+  if (!c)
+    return;
+  if (!c->next)
+    {
+      c->used = 0;
+      return;
+    }
+  /* The line outgrew one chunk: replace the list with a single chunk that
+   * fits everything so the next line of the same shape stays in it. */
+  size_t total = 0;
+  while (c)
+    {
+      struct arena_chunk *next = c->next;
+      total += c->cap;
+      free(c);
+      c = next;
+    }
+  a->head = arena_chunk_new(a, total);
+}
+
+void arena_destroy(struct arena *a)
+{
+  struct arena_chunk *c = a->head;
+  while (c)
+    {
+      struct arena_chunk *next = c->next;
+      free(c);
+      c = next;
+    }
+  a->head = NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Tokenizer                                                           */
+/* ------------------------------------------------------------------ */
+
+#define TOK_INITIAL_CAP 64
+
+void cmd_line_init(struct cmd_line *cl)
+{
+  arena_init(&cl->arena, 0);
+  cl->tok = NULL;
+  cl->ntok = 0;
+  cl->cap = 0;
+  cl->error = NULL;
+}
+
+void cmd_line_reset(struct cmd_line *cl)
+{
+  arena_reset(&cl->arena);
+  cl->tok = NULL;
+  cl->ntok = 0;
+  cl->cap = 0;
+  cl->error = NULL;
+}
+
+void cmd_line_destroy(struct cmd_line *cl)
+{
+  arena_destroy(&cl->arena);
+  cl->tok = NULL;
+  cl->ntok = 0;
+  cl->cap = 0;
+}
+
+static struct token *tok_push(struct cmd_line *cl)
+{
+  if (cl->ntok == cl->cap)
+    {
+      size_t cap = cl->cap ? cl->cap * 2 : TOK_INITIAL_CAP;
+      struct token *t = arena_alloc(&cl->arena, cap * sizeof(*t));
+      if (!t)
+        return NULL;
+      if (cl->ntok)
+        memcpy(t, cl->tok, cl->ntok * sizeof(*t));
+      cl->tok = t;
+      cl->cap = cap;
+    }
+  struct token *t = &cl->tok[cl->ntok++];
+  t->io_number = -1;
+  return t;
+}
+
+static bool is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_operator(char c)
+{
+  return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+/*
+ * Returns the number of input bytes consumed by the operator at p, or 0 if
+ * p does not start an operator.
+ */
+static size_t scan_operator(const char *p, const char *end, enum tok_kind *kind, const char **text)
+{
+  char c = *p;
+  bool twice = p + 1 < end && p[1] == c;
+  switch (c)
+    {
+    case '|':
+      *kind = twice ? TOK_OR_IF : TOK_PIPE;
+      *text = twice ? "||" : "|";
+      return twice ? 2 : 1;
+    case '&':
+      *kind = twice ? TOK_AND_IF : TOK_AMP;
+      *text = twice ? "&&" : "&";
+      return twice ? 2 : 1;
+    case ';':
+      *kind = TOK_SEMI;
+      *text = ";";
+      return 1;
+    case '<':
+      *kind = TOK_LESS;
+      *text = "<";
+      return 1;
+    case '>':
+      if (twice)
+        {
+          *kind = TOK_DGREAT;
+          *text = ">>";
+          return 2;
+        }
+      if (p + 1 < end && p[1] == '&')
+        {
+          *kind = TOK_GREATAND;
+          *text = ">&";
+          return 2;
+        }
+      *kind = TOK_GREAT;
+      *text = ">";
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+int cmd_tokenize(struct cmd_line *cl, const char *line, size_t len)
+{
+  cmd_line_reset(cl);
+
+  /* Unquoted text is never longer than its source and operators point at
+   * static strings, so one NUL per word fits in len + 1 bytes. */
+  char *out = arena_alloc(&cl->arena, len + 1);
+  if (!out)
+    {
+      cl->error = "out of memory";
+      return -1;
+    }
+
+  const char *p = line;
+  const char *end = line + len;
+  bool cmd_start = true; /* the next word names a command */
+  bool in_test = false;  /* between [[ and ]] */
+  while (p < end)
+    {
+      while (p < end && is_blank(*p))
+        p++;
+      if (p == end)
+        break;
+      if (*p == '#')
+        break;
+
+      enum tok_kind kind;
+      const char *text;
+      size_t n = scan_operator(p, end, &kind, &text);
+      if (n)
+        {
+          struct token *t = tok_push(cl);
+          if (!t)
+            goto oom;
+          t->str = (char *)text;
+          t->len = n;
+          t->kind = kind;
+          p += n;
+          /* && || < and > are operands of [[, the operators stay static
+           * strings so they need no arena space */
+          if (in_test && (kind == TOK_AND_IF || kind == TOK_OR_IF || kind == TOK_LESS ||
+                          (kind == TOK_GREAT && n == 1)))
+            t->kind = TOK_WORD;
+          else
+            cmd_start = kind == TOK_PIPE || kind == TOK_AND_IF || kind == TOK_OR_IF ||
+                        kind == TOK_AMP || kind == TOK_SEMI || (cmd_start && t->kind != TOK_WORD);
+          continue;
+        }
+
+      /* A word: copy it into the arena removing quotes as we go */
+      char *start = out;
+      bool quoted = false;
+      while (p < end && !is_blank(*p) && !is_operator(*p))
+        {
+          char c = *p++;
+          if (c == '\\')
+            {
+              if (p == end)
+                break;
+              if (*p == '\n')
+                p++; /* line continuation */
+              else
+                *out++ = *p++;
+              quoted = true;
+            }
+          else if (c == '\'')
+            {
+              const char *q = memchr(p, '\'', (size_t)(end - p));
+              if (!q)
+                {
+                  cl->error = "unterminated single quote";
+                  return -1;
+                }
+              memcpy(out, p, (size_t)(q - p));
+              out += q - p;
+              p = q + 1;
+              quoted = true;
+            }
+          else if (c == '"')
+            {
+              while (p < end && *p != '"')
+                {
+                  if (*p == '\\' && p + 1 < end &&
+                      (p[1] == '$' || p[1] == '`' || p[1] == '"' || p[1] == '\\' || p[1] == '\n'))
+                    {
+                      if (p[1] != '\n')
+                        *out++ = p[1];
+                      p += 2;
+                    }
+                  else
+                    {
+                      *out++ = *p++;
+                    }
+                }
+              if (p == end)
+                {
+                  cl->error = "unterminated double quote";
+                  return -1;
+                }
+              p++;
+              quoted = true;
+            }
+          else
+            {
+              *out++ = c;
+            }
+        }
+
+      size_t wlen = (size_t)(out - start);
+      /* An unquoted all-digit word directly followed by a redirection is
+       * the io_number of that redirection, e.g. 2>file */
+      if (!quoted && !in_test && wlen > 0 && wlen <= 4 && p < end && (*p == '<' || *p == '>'))
+        {
+          int fd = 0;
+          size_t i;
+          for (i = 0; i < wlen && start[i] >= '0' && start[i] <= '9'; i++)
+            fd = fd * 10 + (start[i] - '0');
+          if (i == wlen)
+            {
+              n = scan_operator(p, end, &kind, &text);
+              struct token *t = tok_push(cl);
+              if (!t)
+                goto oom;
+              t->str = (char *)text;
+              t->len = n;
+              t->kind = kind;
+              t->io_number = fd;
+              p += n;
+              out = start;
+              continue;
+            }
+        }
+
+      *out++ = '\0';
+      struct token *t = tok_push(cl);
+      if (!t)
+        goto oom;
+      t->str = start;
+      t->len = wlen;
+      t->kind = TOK_WORD;
+      if (!quoted && cmd_start && strcmp(start, "[[") == 0)
+        in_test = true;
+      else if (!quoted && in_test && strcmp(start, "]]") == 0)
+        in_test = false;
+      cmd_start = false;
+    }
+  return 0;
+
+oom:
+  cl->error = "out of memory";
+  return -1;
+}
+
+char **cmd_parse(char const *line)
+{
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+  if (cmd_tokenize(&cl, line, strlen(line)) < 0)
+    {
+      cmd_line_destroy(&cl);
+      return NULL;
+    }
+
+  size_t bytes = (cl.ntok + 1) * sizeof(char *);
+  for (size_t i = 0; i < cl.ntok; i++)
+    bytes += cl.tok[i].len + 1;
+
+  char **argv = malloc(bytes);
+  if (argv)
+    {
+      char *s = (char *)(argv + cl.ntok + 1);
+      for (size_t i = 0; i < cl.ntok; i++)
+        {
+          memcpy(s, cl.tok[i].str, cl.tok[i].len + 1);
+          argv[i] = s;
+          s += cl.tok[i].len + 1;
+        }
+      argv[cl.ntok] = NULL;
+    }
+  cmd_line_destroy(&cl);
+  return argv;
+}
+
+void cmd_free(char **line)
+{
+  free(line);
+}
+
+/* ------------------------------------------------------------------ */
+/* Process launcher                                                    */
+/* ------------------------------------------------------------------ */
+
+extern char **environ;
+
+/* Signals the interactive shell ignores or handles that children must see
+ * with their default disposition */
+static const int child_default_signals[] = {
+    SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE, SIGWINCH,
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+void launch_init(struct launch *l, char *const *argv)
+{
+  memset(l, 0, sizeof(*l));
+  l->argv = argv;
+  l->fd_in = -1;
+  l->fd_out = -1;
+  l->pgid = -1;
+  l->dir_fd = -1;
+}
+
+static int redir_open_flags(enum redir_kind kind)
+{
+  switch (kind)
+    {
+    case REDIR_IN:
+      return O_RDONLY;
+    case REDIR_OUT:
+      return O_WRONLY | O_CREAT | O_TRUNC;
+    case REDIR_APPEND:
+      return O_WRONLY | O_CREAT | O_APPEND;
+    default:
+      return -1;
+    }
+}
+
+static int spawn_fast(const struct launch *l, pid_t *pid)
+{
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t set;
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  int rc;
+
+  if ((rc = posix_spawn_file_actions_init(&fa)) != 0)
+    return rc;
+  if ((rc = posix_spawnattr_init(&attr)) != 0)
+    {
+      posix_spawn_file_actions_destroy(&fa);
+      return rc;
+    }
+
+  /* first, so relative redirections open in the new directory */
+  if (l->dir_fd >= 0)
+    rc = posix_spawn_file_actions_addfchdir_np(&fa, l->dir_fd);
+  if (l->fd_in >= 0 && l->fd_in != STDIN_FILENO)
+    rc = rc ? rc : posix_spawn_file_actions_adddup2(&fa, l->fd_in, STDIN_FILENO);
+  if (l->fd_out >= 0 && l->fd_out != STDOUT_FILENO)
+    rc = rc ? rc : posix_spawn_file_actions_adddup2(&fa, l->fd_out, STDOUT_FILENO);
+  for (size_t i = 0; i < l->nredir && !rc; i++)
+    {
+      const struct redir *r = &l->redirs[i];
+      if (r->kind != REDIR_DUP)
+        rc = posix_spawn_file_actions_addopen(&fa, r->fd, r->target, redir_open_flags(r->kind), 0666);
+      else if (r->dup_fd < 0)
+        rc = posix_spawn_file_actions_addclose(&fa, r->fd);
+      else if (r->dup_fd != r->fd)
+        rc = posix_spawn_file_actions_adddup2(&fa, r->dup_fd, r->fd);
+    }
+
+  sigemptyset(&set);
+  for (size_t i = 0; i < NELEMS(child_default_signals); i++)
+    sigaddset(&set, child_default_signals[i]);
+  rc = rc ? rc : posix_spawnattr_setsigdefault(&attr, &set);
+  sigemptyset(&set);
+  rc = rc ? rc : posix_spawnattr_setsigmask(&attr, &set);
+  if (l->pgid >= 0)
+    {
+      flags |= POSIX_SPAWN_SETPGROUP;
+      rc = rc ? rc : posix_spawnattr_setpgroup(&attr, l->pgid);
+    }
+  rc = rc ? rc : posix_spawnattr_setflags(&attr, flags);
+
+  if (!rc)
+    {
+      char *const *envp = l->envp ? l->envp : environ;
+      if (l->path)
+        rc = posix_spawn(pid, l->path, &fa, &attr, l->argv, envp);
+      else
+        rc = posix_spawnp(pid, l->argv[0], &fa, &attr, l->argv, envp);
+    }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  return rc;
+}
+
+/* Process group, signals, directory and descriptors of a new child, done
+ * in the child itself. Returns 0 or the errno of the step that failed */
+static int child_setup(const struct launch *l)
+{
+  sigset_t set;
+
+  if (l->pgid >= 0 && setpgid(0, l->pgid) < 0)
+    return errno;
+  for (size_t i = 0; i < NELEMS(child_default_signals); i++)
+    signal(child_default_signals[i], SIG_DFL);
+  sigemptyset(&set);
+  sigprocmask(SIG_SETMASK, &set, NULL);
+
+  if (l->dir_fd >= 0 && fchdir(l->dir_fd) < 0)
+    return errno;
+  if (l->fd_in >= 0 && l->fd_in != STDIN_FILENO && dup2(l->fd_in, STDIN_FILENO) < 0)
+    return errno;
+  if (l->fd_out >= 0 && l->fd_out != STDOUT_FILENO && dup2(l->fd_out, STDOUT_FILENO) < 0)
+    return errno;
+  for (size_t i = 0; i < l->nredir; i++)
+    {
+      const struct redir *r = &l->redirs[i];
+      if (r->kind != REDIR_DUP)
+        {
+          int fd = open(r->target, redir_open_flags(r->kind), 0666);
+          if (fd < 0)
+            return errno;
+          if (fd != r->fd)
+            {
+              if (dup2(fd, r->fd) < 0)
+                return errno;
+              close(fd);
+            }
+        }
+      else if (r->dup_fd < 0)
+        close(r->fd);
+      else if (r->dup_fd != r->fd && dup2(r->dup_fd, r->fd) < 0)
+        return errno;
+    }
+  return 0;
+}
+
+/*
+ * Runs in the forked child. Failures are reported to the parent as an errno
+ * value over the close-on-exec pipe errfd so both launch paths fail the
+ * same way.
+ */
+static void spawn_child(const struct launch *l, int errfd)
+{
+  int err = child_setup(l);
+  if (err)
+    goto fail;
+
+  if (l->child_fn)
+    {
+      close(errfd);
+      fflush(NULL);
+      int status = l->child_fn(l->child_arg);
+      fflush(NULL);
+      _exit(status);
+    }
+
+  char *const *envp = l->envp ? l->envp : environ;
+  if (l->path)
+    execve(l->path, l->argv, envp);
+  else
+    execvpe(l->argv[0], l->argv, envp);
+  err = errno;
+
+fail:
+  if (write(errfd, &err, sizeof(err)) < 0)
+    {
+      /* nothing left to report to */
+    }
+  _exit(127);
+}
+
+static int spawn_fork(const struct launch *l, pid_t *pid)
+{
+  int errpipe[2];
+  if (pipe2(errpipe, O_CLOEXEC) < 0)
+    return errno;
+
+  pid_t child = fork();
+  if (child < 0)
+    {
+      int err = errno;
+      close(errpipe[0]);
+      close(errpipe[1]);
+      return err;
+    }
+  if (child == 0)
+    {
+      close(errpipe[0]);
+      spawn_child(l, errpipe[1]);
+    }
+
+  close(errpipe[1]);
+  /* Mirror what the child does so there is no window where the child
+   * runs before it joins its process group */
+  if (l->pgid >= 0)
+    setpgid(child, l->pgid ? l->pgid : child);
+
+  int err = 0;
+  ssize_t n;
+  do
+    n = read(errpipe[0], &err, sizeof(err));
+  while (n < 0 && errno == EINTR);
+  close(errpipe[0]);
+  if (n == sizeof(err))
+    {
+      waitpid(child, NULL, 0);
+      return err;
+    }
+  *pid = child;
+  return 0;
+}
+
+pid_t lab_spawn(const struct launch *l)
+{
+  pid_t pid = -1;
+  int rc;
+  if (l->child_fn || (l->flags & LAUNCH_FORCE_FORK))
+    rc = spawn_fork(l, &pid);
+  else
+    rc = spawn_fast(l, &pid);
+  if (rc)
+    {
+      errno = rc;
+      return -1;
+    }
+  return pid;
+}
+
+ssize_t lab_relay(int in, int out, size_t max)
+{
+  struct stat st;
+  bool in_pipe = fstat(in, &st) == 0 && S_ISFIFO(st.st_mode);
+  bool out_pipe = fstat(out, &st) == 0 && S_ISFIFO(st.st_mode);
+  size_t total = 0;
+  enum { RELAY_SPLICE, RELAY_SENDFILE, RELAY_COPY } how;
+  how = (in_pipe || out_pipe) ? RELAY_SPLICE : RELAY_SENDFILE;
+
+  while (total < max)
+    {
+      size_t want = max - total;
+      if (want > (size_t)1 << 30)
+        want = (size_t)1 << 30;
+      ssize_t n;
+      if (how == RELAY_SPLICE)
+        n = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+      else if (how == RELAY_SENDFILE)
+        n = sendfile(out, in, NULL, want);
+      else
+        {
+          char buf[64 * 1024];
+          n = read(in, buf, want < sizeof(buf) ? want : sizeof(buf));
+          for (ssize_t off = 0; n > 0 && off < n;)
+            {
+              ssize_t w = write(out, buf + off, (size_t)(n - off));
+              if (w < 0 && errno == EINTR)
+                continue;
+              if (w < 0)
+                return total ? (ssize_t)total : -1;
+              off += w;
+            }
+        }
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS) && how != RELAY_COPY && total == 0)
+        {
+          /* descriptor type the fast path does not support */
+          how = RELAY_COPY;
+          continue;
+        }
+      if (n < 0)
+        return total ? (ssize_t)total : -1;
+      if (n == 0)
+        break;
+      total += (size_t)n;
+    }
+  return (ssize_t)total;
+}
+
+/* ------------------------------------------------------------------ */
+/* Zygote                                                              */
+/* ------------------------------------------------------------------ */
+
+#define ZYGOTE_MSG_MAX (64 * 1024)
+#define ZYGOTE_STACK (256 * 1024)
+#define ZYGOTE_FDS 4 /* stdin, stdout, stderr and the working directory */
+
+/* Fixed part of a launch request. nredir struct zygote_redir follow, then
+ * the path, argv, envp and the targets of the file redirections as NUL
+ * terminated strings */
+struct zygote_request
+{
+  int32_t pgid;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t nredir;
+  uint32_t nfds;
+};
+
+struct zygote_redir
+{
+  int32_t kind;
+  int32_t fd;
+  int32_t dup_fd;
+};
+
+struct zygote_reply
+{
+  int32_t pid;
+  int32_t err; /* errno of the launch, 0 when it worked */
+};
+
+/* What the zygote hands the child it clones; the child shares the
+ * zygote's memory until it execs, so err comes back without a pipe */
+struct zygote_child
+{
+  struct launch l;
+  int err;
+};
+
+/* Not instrumented: ASan cannot tell the clone's stack from a corrupt one
+ * at _exit */
+__attribute__((no_sanitize_address)) static int zygote_child_main(void *arg)
+{
+  struct zygote_child *c = arg;
+  c->err = child_setup(&c->l);
+  if (!c->err)
+    {
+      execve(c->l.path, c->l.argv, c->l.envp);
+      c->err = errno;
+    }
+  _exit(127);
+}
+
+/* Next NUL terminated string of a request, NULL when it runs past end */
+static char *zygote_string(char **p, const char *end)
+{
+  char *s = *p;
+  char *nul = s < end ? memchr(s, '\0', (size_t)(end - s)) : NULL;
+  if (!nul)
+    return NULL;
+  *p = nul + 1;
+  return s;
+}
+
+/* Decodes one request and clones its child. Returns 0 with *pid set or
+ * an errno value; *pid is also set when the child failed before exec */
+static int zygote_launch(char *buf, size_t n, const int *fds, size_t nfds, char **ptrs,
+                         struct redir *redirs, char *stack, pid_t *pid)
+{
+  struct zygote_request rq;
+  if (n < sizeof(rq))
+    return EINVAL;
+  memcpy(&rq, buf, sizeof(rq));
+  size_t off = sizeof(rq);
+  if (rq.nfds != nfds || nfds < 3 || rq.nredir > (n - off) / sizeof(struct zygote_redir))
+    return EINVAL;
+
+  struct zygote_child c;
+  launch_init(&c.l, ptrs);
+  c.l.pgid = rq.pgid;
+  c.l.fd_in = fds[0];
+  c.l.fd_out = fds[1];
+  c.l.dir_fd = nfds > 3 ? fds[3] : -1;
+  /* the shell's stderr goes first, the command's own redirections after */
+  redirs[0] = (struct redir){REDIR_DUP, STDERR_FILENO, NULL, fds[2]};
+  for (uint32_t i = 0; i < rq.nredir; i++, off += sizeof(struct zygote_redir))
+    {
+      struct zygote_redir zr;
+      memcpy(&zr, buf + off, sizeof(zr));
+      redirs[i + 1] = (struct redir){(enum redir_kind)zr.kind, zr.fd, NULL, zr.dup_fd};
+    }
+  c.l.redirs = redirs;
+  c.l.nredir = rq.nredir + 1;
+
+  char *p = buf + off, *end = buf + n;
+  size_t k = 0;
+  if (!(c.l.path = zygote_string(&p, end)))
+    return EINVAL;
+  for (uint32_t i = 0; i < rq.argc; i++)
+    if (!(ptrs[k++] = zygote_string(&p, end)))
+      return EINVAL;
+  ptrs[k++] = NULL;
+  c.l.envp = ptrs + k;
+  for (uint32_t i = 0; i < rq.envc; i++)
+    if (!(ptrs[k++] = zygote_string(&p, end)))
+      return EINVAL;
+  ptrs[k++] = NULL;
+  for (size_t i = 1; i < c.l.nredir; i++)
+    if (redirs[i].kind != REDIR_DUP && !(redirs[i].target = zygote_string(&p, end)))
+      return EINVAL;
+
+  c.err = 0;
+  *pid = clone(zygote_child_main, stack + ZYGOTE_STACK, CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &c);
+  if (*pid < 0)
+    return errno;
+  return c.err;
+}
+
+static void zygote_main(int sock)
+{
+  /* every string takes at least its NUL, so a request never has more
+   * strings or redirections than bytes */
+  char *buf = malloc(ZYGOTE_MSG_MAX);
+  char **ptrs = malloc((ZYGOTE_MSG_MAX + 2) * sizeof(*ptrs));
+  struct redir *redirs = malloc((ZYGOTE_MSG_MAX / sizeof(struct zygote_redir) + 1) * sizeof(*redirs));
+  char *stack = mmap(NULL, ZYGOTE_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (!buf || !ptrs || !redirs || stack == MAP_FAILED)
+    _exit(1);
+
+  for (;;)
+    {
+      union
+      {
+        char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+        struct cmsghdr align;
+      } control;
+      struct iovec iov = {buf, ZYGOTE_MSG_MAX};
+      struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+      ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        _exit(0);
+
+      int fds[ZYGOTE_FDS];
+      size_t nfds = 0;
+      for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+          {
+            size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++)
+              {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(fd));
+                if (nfds < ZYGOTE_FDS)
+                  fds[nfds++] = fd;
+                else
+                  close(fd);
+              }
+          }
+
+      pid_t pid = -1;
+      struct zygote_reply reply;
+      reply.err = (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ? E2BIG
+                  : zygote_launch(buf, (size_t)n, fds, nfds, ptrs, redirs, stack, &pid);
+      reply.pid = pid;
+      for (size_t i = 0; i < nfds; i++)
+        close(fds[i]);
+      if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+        _exit(0);
+    }
+}
+
+void zygote_init(struct zygote *z)
+{
+  z->pid = -1;
+  z->sock = -1;
+  z->buf = NULL;
+}
+
+int zygote_start(struct zygote *z)
+{
+  int sv[2];
+  if (!(z->buf = malloc(ZYGOTE_MSG_MAX)))
+    return -1;
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+      free(z->buf);
+      z->buf = NULL;
+      return -1;
+    }
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      /* Keep nothing of the shell but the socket, with signals blocked so
+       * no handler runs on the stack the clones share. Children get the
+       * shell's stdio passed with every request */
+      sigset_t all;
+      sigfillset(&all);
+      sigprocmask(SIG_SETMASK, &all, NULL);
+      int sock = fcntl(sv[1], F_DUPFD, 3);
+      int null = open("/dev/null", O_RDWR);
+      if (sock < 0 || null < 0)
+        _exit(1);
+      for (int fd = 0; fd < 3; fd++)
+        if (fd != null)
+          dup2(null, fd);
+      if (sock > 3)
+        close_range(3, (unsigned)sock - 1, 0);
+      close_range((unsigned)sock + 1, ~0u, 0);
+      zygote_main(sock);
+    }
+  close(sv[1]);
+  if (pid < 0)
+    {
+      close(sv[0]);
+      free(z->buf);
+      z->buf = NULL;
+      return -1;
+    }
+  z->pid = pid;
+  z->sock = sv[0];
+  return 0;
+}
+
+void zygote_stop(struct zygote *z)
+{
+  if (z->pid > 0)
+    {
+      /* end of file on the socket makes the zygote exit */
+      close(z->sock);
+      while (waitpid(z->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    }
+  free(z->buf);
+  zygote_init(z);
+}
+
+/* Appends len bytes to the request being built, false once it is full */
+static bool zygote_put(char *buf, size_t *off, const void *data, size_t len)
+{
+  if (len > ZYGOTE_MSG_MAX - *off)
+    return false;
+  memcpy(buf + *off, data, len);
+  *off += len;
+  return true;
+}
+
+pid_t zygote_spawn(struct zygote *z, const struct launch *l)
+{
+  if (z->pid <= 0)
+    {
+      errno = EPIPE;
+      return -1;
+    }
+  bool fits = !l->child_fn && !(l->flags & LAUNCH_FORCE_FORK) && l->path;
+  for (size_t i = 0; i < l->nredir && fits; i++)
+    fits = l->redirs[i].kind != REDIR_DUP || l->redirs[i].dup_fd <= STDERR_FILENO;
+
+  char *const *envp = l->envp ? l->envp : environ;
+  struct zygote_request rq = {l->pgid, 0, 0, (uint32_t)l->nredir, l->dir_fd >= 0 ? 4 : 3};
+  while (l->argv[rq.argc])
+    rq.argc++;
+  while (envp[rq.envc])
+    rq.envc++;
+  size_t off = 0;
+  fits = fits && zygote_put(z->buf, &off, &rq, sizeof(rq));
+  for (size_t i = 0; i < l->nredir && fits; i++)
+    {
+      struct zygote_redir zr = {l->redirs[i].kind, l->redirs[i].fd, l->redirs[i].dup_fd};
+      fits = zygote_put(z->buf, &off, &zr, sizeof(zr));
+    }
+  fits = fits && zygote_put(z->buf, &off, l->path, strlen(l->path) + 1);
+  for (uint32_t i = 0; i < rq.argc && fits; i++)
+    fits = zygote_put(z->buf, &off, l->argv[i], strlen(l->argv[i]) + 1);
+  for (uint32_t i = 0; i < rq.envc && fits; i++)
+    fits = zygote_put(z->buf, &off, envp[i], strlen(envp[i]) + 1);
+  for (size_t i = 0; i < l->nredir && fits; i++)
+    if (l->redirs[i].kind != REDIR_DUP)
+      fits = zygote_put(z->buf, &off, l->redirs[i].target, strlen(l->redirs[i].target) + 1);
+  if (!fits)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  int fds[ZYGOTE_FDS] = {l->fd_in >= 0 ? l->fd_in : STDIN_FILENO,
+                         l->fd_out >= 0 ? l->fd_out : STDOUT_FILENO, STDERR_FILENO, l->dir_fd};
+  union
+  {
+    char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {z->buf, off};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                       .msg_controllen = CMSG_SPACE(rq.nfds * sizeof(int))};
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(rq.nfds * sizeof(int));
+  memcpy(CMSG_DATA(cm), fds, rq.nfds * sizeof(int));
+
+  ssize_t n;
+  while ((n = sendmsg(z->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    ;
+  if (n < 0 && (errno == EBADF || errno == EMSGSIZE))
+    {
+      /* one of our descriptors is closed, or the socket buffer is small */
+      errno = ENOTSUP;
+      return -1;
+    }
+  struct zygote_reply reply;
+  if (n == (ssize_t)off)
+    while ((n = recv(z->sock, &reply, sizeof(reply), 0)) < 0 && errno == EINTR)
+      ;
+  if (n != sizeof(reply))
+    {
+      zygote_stop(z);
+      errno = EPIPE;
+      return -1;
+    }
+  if (reply.err)
+    {
+      /* the child is ours, not the zygote's, so we reap it */
+      if (reply.pid > 0)
+        waitpid(reply.pid, NULL, 0);
+      errno = reply.err;
+      return -1;
+    }
+  return reply.pid;
+}
+
+/* ------------------------------------------------------------------ */
+/* Command and pipeline parsing                                        */
+/* ------------------------------------------------------------------ */
+
+static bool tok_is_redirect(enum tok_kind kind)
+{
+  return kind == TOK_LESS || kind == TOK_GREAT || kind == TOK_DGREAT || kind == TOK_GREATAND;
+}
+
+/* Builds one command from the tokens [*pos, end) stopping at the first
+ * pipe or list operator */
+static int build_command(struct cmd_line *cl, size_t *pos, struct command *cmd)
+{
+  size_t i = *pos;
+  size_t nwords = 0;
+  size_t nredir = 0;
+
+  for (size_t j = i; j < cl->ntok && (cl->tok[j].kind == TOK_WORD || tok_is_redirect(cl->tok[j].kind)); j++)
+    {
+      if (cl->tok[j].kind == TOK_WORD)
+        nwords++;
+      else
+        {
+          if (j + 1 >= cl->ntok || cl->tok[j + 1].kind != TOK_WORD)
+            {
+              cl->error = "syntax error: redirection without a target";
+              return -1;
+            }
+          nredir++;
+          j++;
+        }
+    }
+  if (nwords == 0 && nredir == 0)
+    {
+      cl->error = "syntax error: empty command";
+      return -1;
+    }
+
+  cmd->argv = arena_alloc(&cl->arena, (nwords + 1) * sizeof(char *));
+  cmd->redirs = nredir ? arena_alloc(&cl->arena, nredir * sizeof(struct redir)) : NULL;
+  if (!cmd->argv || (nredir && !cmd->redirs))
+    {
+      cl->error = "out of memory";
+      return -1;
+    }
+  cmd->argc = 0;
+  cmd->nredir = 0;
+  cmd->cut = false;
+
+  for (; i < cl->ntok && (cl->tok[i].kind == TOK_WORD || tok_is_redirect(cl->tok[i].kind)); i++)
+    {
+      struct token *t = &cl->tok[i];
+      if (t->kind == TOK_WORD)
+        {
+          cmd->argv[cmd->argc++] = t->str;
+          continue;
+        }
+      struct redir *r = &cmd->redirs[cmd->nredir++];
+      const char *target = cl->tok[++i].str;
+      r->target = target;
+      r->dup_fd = -1;
+      switch (t->kind)
+        {
+        case TOK_LESS:
+          r->kind = REDIR_IN;
+          r->fd = t->io_number >= 0 ? t->io_number : STDIN_FILENO;
+          break;
+        case TOK_GREAT:
+          r->kind = REDIR_OUT;
+          r->fd = t->io_number >= 0 ? t->io_number : STDOUT_FILENO;
+          break;
+        case TOK_DGREAT:
+          r->kind = REDIR_APPEND;
+          r->fd = t->io_number >= 0 ? t->io_number : STDOUT_FILENO;
+          break;
+        default:
+          r->kind = REDIR_DUP;
+          r->fd = t->io_number >= 0 ? t->io_number : STDOUT_FILENO;
+          r->target = NULL;
+          if (strcmp(target, "-") != 0)
+            {
+              char *end;
+              long fd = strtol(target, &end, 10);
+              if (*target == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX)
+                {
+                  cl->error = "syntax error: bad file descriptor in >&";
+                  return -1;
+                }
+              r->dup_fd = (int)fd;
+            }
+          break;
+        }
+    }
+  cmd->argv[cmd->argc] = NULL;
+  *pos = i;
+  return 0;
+}
+
+int cmd_build(struct cmd_line *cl, struct cmd_list *list)
+{
+  list->pipes = NULL;
+  list->npipes = 0;
+  if (cl->ntok == 0)
+    return 0;
+
+  /* Upper bounds from the operator counts so every array is allocated once */
+  size_t npipes = 1, ncmds = 1;
+  for (size_t i = 0; i < cl->ntok; i++)
+    {
+      enum tok_kind k = cl->tok[i].kind;
+      if (k == TOK_PIPE)
+        ncmds++;
+      else if (k == TOK_SEMI || k == TOK_AMP || k == TOK_AND_IF || k == TOK_OR_IF)
+        npipes++, ncmds++;
+    }
+  list->pipes = arena_alloc(&cl->arena, npipes * sizeof(struct pipeline));
+  struct command *cmds = arena_alloc(&cl->arena, ncmds * sizeof(struct command));
+  if (!list->pipes || !cmds)
+    {
+      cl->error = "out of memory";
+      return -1;
+    }
+
+  size_t pos = 0;
+  while (pos < cl->ntok)
+    {
+      struct pipeline *p = &list->pipes[list->npipes++];
+      p->cmds = cmds;
+      p->ncmds = 0;
+      p->op = LIST_SEQ;
+      for (;;)
+        {
+          if (build_command(cl, &pos, &p->cmds[p->ncmds++]) < 0)
+            return -1;
+          if (pos < cl->ntok && cl->tok[pos].kind == TOK_PIPE)
+            {
+              pos++;
+              continue;
+            }
+          break;
+        }
+      cmds += p->ncmds;
+      if (pos == cl->ntok)
+        break;
+      switch (cl->tok[pos++].kind)
+        {
+        case TOK_AMP:
+          p->op = LIST_BG;
+          break;
+        case TOK_AND_IF:
+          p->op = LIST_AND;
+          break;
+        case TOK_OR_IF:
+          p->op = LIST_OR;
+          break;
+        default:
+          p->op = LIST_SEQ;
+          break;
+        }
+      if ((p->op == LIST_AND || p->op == LIST_OR) && pos == cl->ntok)
+        {
+          cl->error = "syntax error: unexpected end of line";
+          return -1;
+        }
+    }
+  return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Command lookup cache                                                */
+/* ------------------------------------------------------------------ */
+
+#define PATH_CACHE_INITIAL_CAP 256
+#define PATH_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                         IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static uint32_t hash_str_n(const char *s, size_t n)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; i++)
+    {
+      h ^= (unsigned char)s[i];
+      h *= 16777619u;
+    }
+  return h;
+}
+
+static uint32_t hash_str(const char *s)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+  while (*s)
+    {
+      h ^= (unsigned char)*s++;
+      h *= 16777619u;
+    }
+  return h;
+}
+
+void path_cache_init(struct path_cache *pc)
+{
+  memset(pc, 0, sizeof(*pc));
+  pc->inotify_fd = -1;
+}
+
+static void path_entry_free(struct path_entry *e)
+{
+  free(e->name);
+  free(e->path);
+  e->name = NULL;
+  e->path = NULL;
+}
+
+void path_cache_clear(struct path_cache *pc)
+{
+  for (size_t i = 0; i < pc->cap; i++)
+    if (pc->slots[i].name)
+      path_entry_free(&pc->slots[i]);
+  pc->count = 0;
+}
+
+void path_cache_destroy(struct path_cache *pc)
+{
+  path_cache_clear(pc);
+  free(pc->slots);
+  free(pc->path_env);
+  if (pc->inotify_fd >= 0)
+    close(pc->inotify_fd);
+  path_cache_init(pc);
+}
+
+static struct path_entry *path_cache_find(struct path_cache *pc, const char *name, uint32_t h)
+{
+  if (!pc->cap)
+    return NULL;
+  size_t mask = pc->cap - 1;
+  for (size_t i = h & mask;; i = (i + 1) & mask)
+    {
+      struct path_entry *e = &pc->slots[i];
+      if (!e->name)
+        return NULL;
+      if (e->hash == h && strcmp(e->name, name) == 0)
+        return e;
+    }
+}
+
+static int path_cache_grow(struct path_cache *pc)
+{
+  size_t cap = pc->cap ? pc->cap * 2 : PATH_CACHE_INITIAL_CAP;
+  struct path_entry *slots = calloc(cap, sizeof(*slots));
+  if (!slots)
+    return -1;
+  for (size_t i = 0; i < pc->cap; i++)
+    {
+      struct path_entry *e = &pc->slots[i];
+      if (!e->name)
+        continue;
+      size_t j = e->hash & (cap - 1);
+      while (slots[j].name)
+        j = (j + 1) & (cap - 1);
+      slots[j] = *e;
+    }
+  free(pc->slots);
+  pc->slots = slots;
+  pc->cap = cap;
+  return 0;
+}
+
+int path_cache_insert(struct path_cache *pc, const char *name, const char *path)
+{
+  uint32_t h = hash_str(name);
+  struct path_entry *e = path_cache_find(pc, name, h);
+  if (e)
+    {
+      char *copy = strdup(path);
+      if (!copy)
+        return -1;
+      free(e->path);
+      e->path = copy;
+      return 0;
+    }
+  /* keep the load factor under 3/4 so probe chains stay short */
+  if ((pc->count + 1) * 4 > pc->cap * 3 && path_cache_grow(pc) < 0)
+    return -1;
+
+  size_t mask = pc->cap - 1;
+  size_t i = h & mask;
+  while (pc->slots[i].name)
+    i = (i + 1) & mask;
+  e = &pc->slots[i];
+  e->name = strdup(name);
+  e->path = strdup(path);
+  if (!e->name || !e->path)
+    {
+      path_entry_free(e);
+      return -1;
+    }
+  e->hash = h;
+  pc->count++;
+  return 0;
+}
+
+void path_cache_remove(struct path_cache *pc, const char *name)
+{
+  uint32_t h = hash_str(name);
+  struct path_entry *e = path_cache_find(pc, name, h);
+  if (!e)
+    return;
+  path_entry_free(e);
+  pc->count--;
+
+  /* Backward shift deletion: move later members of the probe chain into
+   * the hole so lookups never need tombstones */
+  size_t mask = pc->cap - 1;
+  size_t hole = (size_t)(e - pc->slots);
+  for (size_t i = (hole + 1) & mask; pc->slots[i].name; i = (i + 1) & mask)
+    {
+      size_t home = pc->slots[i].hash & mask;
+      /* the entry may move if its home is not cyclically in (hole, i] */
+      bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+      if (stays)
+        continue;
+      pc->slots[hole] = pc->slots[i];
+      pc->slots[i].name = NULL;
+      pc->slots[i].path = NULL;
+      hole = i;
+    }
+}
+
+/* Drops every entry and watches the directories of the current PATH */
+static void path_cache_rewatch(struct path_cache *pc, const char *path_env)
+{
+  path_cache_clear(pc);
+  free(pc->path_env);
+  pc->path_env = strdup(path_env);
+  if (pc->inotify_fd >= 0)
+    close(pc->inotify_fd);
+  pc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (pc->inotify_fd < 0)
+    return;
+
+  const char *p = path_env;
+  while (*p)
+    {
+      const char *colon = strchrnul(p, ':');
+      size_t len = (size_t)(colon - p);
+      char dir[PATH_MAX];
+      if (len == 0)
+        strcpy(dir, ".");
+      else if (len < sizeof(dir))
+        {
+          memcpy(dir, p, len);
+          dir[len] = '\0';
+        }
+      else
+        dir[0] = '\0';
+      /* missing directories simply are not watched */
+      if (dir[0])
+        inotify_add_watch(pc->inotify_fd, dir, PATH_WATCH_MASK);
+      p = *colon ? colon + 1 : colon;
+    }
+}
+
+void path_cache_sync(struct path_cache *pc)
+{
+  if (pc->inotify_fd < 0)
+    return;
+  char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;)
+    {
+      ssize_t n = read(pc->inotify_fd, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      for (char *p = buf; p < buf + n;)
+        {
+          struct inotify_event *ev = (struct inotify_event *)p;
+          if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            path_cache_clear(pc);
+          else if (ev->len)
+            path_cache_remove(pc, ev->name);
+          p += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+/* Walks PATH the way execvp does, returns a malloc'd path or NULL */
+static char *path_search(const char *path_env, const char *name)
+{
+  size_t nlen = strlen(name);
+  const char *p = path_env;
+  for (;;)
+    {
+      const char *colon = strchrnul(p, ':');
+      size_t len = (size_t)(colon - p);
+      char *full = malloc(len + nlen + 3);
+      if (!full)
+        return NULL;
+      if (len == 0)
+        full[0] = '.', len = 1;
+      else
+        memcpy(full, p, len);
+      full[len] = '/';
+      memcpy(full + len + 1, name, nlen + 1);
+
+      struct stat st;
+      if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0)
+        return full;
+      free(full);
+      if (!*colon)
+        return NULL;
+      p = colon + 1;
+    }
+}
+
+const char *path_cache_lookup(struct path_cache *pc, const char *name)
+{
+  return path_cache_lookup_env(pc, getenv("PATH"), name);
+}
+
+const char *path_cache_lookup_env(struct path_cache *pc, const char *path_env, const char *name)
+{
+  if (!path_env)
+    path_env = "/usr/local/bin:/usr/bin:/bin";
+  if (!pc->path_env || strcmp(pc->path_env, path_env) != 0)
+    path_cache_rewatch(pc, path_env);
+  else
+    path_cache_sync(pc);
+
+  struct path_entry *e = path_cache_find(pc, name, hash_str(name));
+  if (e)
+    {
+      pc->hits++;
+      return e->path;
+    }
+  pc->misses++;
+
+  char *full = path_search(path_env, name);
+  if (!full)
+    return NULL;
+  if (path_cache_insert(pc, name, full) < 0)
+    {
+      free(full);
+      return NULL;
+    }
+  free(full);
+  return path_cache_find(pc, name, hash_str(name))->path;
+}
+
+/* ------------------------------------------------------------------ */
+/* Environment store                                                   */
+/* ------------------------------------------------------------------ */
+
+#define ENV_INITIAL_CAP 64
+
+static struct env_data *env_data_new(size_t cap, size_t envp_cap)
+{
+  struct env_data *d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+  d->refs = 1;
+  d->cap = cap;
+  d->envp_cap = envp_cap;
+  d->slots = calloc(cap, sizeof(*d->slots));
+  d->envp = calloc(envp_cap, sizeof(*d->envp));
+  if (!d->slots || !d->envp)
+    {
+      free(d->slots);
+      free(d->envp);
+      free(d);
+      return NULL;
+    }
+  return d;
+}
+
+static void env_data_release(struct env_data *d)
+{
+  if (!d || __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  for (size_t i = 0; i < d->cap; i++)
+    free(d->slots[i].entry);
+  free(d->slots);
+  free(d->envp);
+  free(d);
+}
+
+static struct env_var *env_find(const struct env_data *d, const char *name, size_t len, uint32_t h)
+{
+  size_t mask = d->cap - 1;
+  for (size_t i = h & mask;; i = (i + 1) & mask)
+    {
+      struct env_var *v = &d->slots[i];
+      if (!v->entry)
+        return NULL;
+      if (v->hash == h && v->name_len == len && memcmp(v->entry, name, len) == 0)
+        return v;
+    }
+}
+
+/* Before the first change to a shared copy, give the store its own. Every
+ * string is duplicated but slots and envp keep their positions. */
+static int env_unshare(struct env_store *e)
+{
+  struct env_data *old = e->data;
+  if (__atomic_load_n(&old->refs, __ATOMIC_ACQUIRE) == 1)
+    return 0;
+  struct env_data *d = env_data_new(old->cap, old->envp_cap);
+  if (!d)
+    return -1;
+  for (size_t i = 0; i < old->cap; i++)
+    {
+      const struct env_var *v = &old->slots[i];
+      if (!v->entry)
+        continue;
+      d->slots[i] = *v;
+      if (!(d->slots[i].entry = strdup(v->entry)))
+        {
+          d->refs = 1;
+          env_data_release(d);
+          return -1;
+        }
+      if (v->exported)
+        d->envp[v->envp_index] = d->slots[i].entry;
+      d->count++;
+    }
+  d->nexported = old->nexported;
+  e->data = d;
+  env_data_release(old);
+  return 0;
+}
+
+static int env_grow(struct env_data *d)
+{
+  size_t cap = d->cap * 2;
+  struct env_var *slots = calloc(cap, sizeof(*slots));
+  if (!slots)
+    return -1;
+  for (size_t i = 0; i < d->cap; i++)
+    {
+      struct env_var *v = &d->slots[i];
+      if (!v->entry)
+        continue;
+      size_t j = v->hash & (cap - 1);
+      while (slots[j].entry)
+        j = (j + 1) & (cap - 1);
+      slots[j] = *v;
+    }
+  free(d->slots);
+  d->slots = slots;
+  d->cap = cap;
+  return 0;
+}
+
+static int envp_add(struct env_data *d, struct env_var *v)
+{
+  if (d->nexported + 1 >= d->envp_cap)
+    {
+      size_t cap = d->envp_cap * 2;
+      char **envp = realloc(d->envp, cap * sizeof(*envp));
+      if (!envp)
+        return -1;
+      d->envp = envp;
+      d->envp_cap = cap;
+    }
+  v->envp_index = d->nexported;
+  v->exported = true;
+  d->envp[d->nexported++] = v->entry;
+  d->envp[d->nexported] = NULL;
+  return 0;
+}
+
+/* The last entry fills the hole, so envp is never compacted */
+static void envp_remove(struct env_data *d, struct env_var *v)
+{
+  size_t last = --d->nexported;
+  if (v->envp_index != last)
+    {
+      char *moved = d->envp[last];
+      size_t len = (size_t)(strchr(moved, '=') - moved);
+      struct env_var *m = env_find(d, moved, len, hash_str_n(moved, len));
+      m->envp_index = v->envp_index;
+      d->envp[v->envp_index] = moved;
+    }
+  d->envp[last] = NULL;
+  v->exported = false;
+}
+
+int env_init(struct env_store *e, char *const *vars)
+{
+  size_t n = 0;
+  while (vars && vars[n])
+    n++;
+  size_t cap = ENV_INITIAL_CAP;
+  while (cap * 3 < n * 4 + 4)
+    cap *= 2;
+  if (!(e->data = env_data_new(cap, n + 16)))
+    return -1;
+  for (size_t i = 0; i < n; i++)
+    {
+      const char *eq = strchr(vars[i], '=');
+      if (!eq || eq == vars[i])
+        continue;
+      char *name = strndup(vars[i], (size_t)(eq - vars[i]));
+      int rc = name ? env_set(e, name, eq + 1, true) : -1;
+      free(name);
+      if (rc < 0)
+        {
+          env_destroy(e);
+          return -1;
+        }
+    }
+  return 0;
+}
+
+void env_destroy(struct env_store *e)
+{
+  env_data_release(e->data);
+  e->data = NULL;
+}
+
+void env_clone(struct env_store *dst, const struct env_store *src)
+{
+  __atomic_add_fetch(&src->data->refs, 1, __ATOMIC_RELAXED);
+  dst->data = src->data;
+}
+
+const char *env_get(const struct env_store *e, const char *name)
+{
+  size_t len = strlen(name);
+  struct env_var *v = env_find(e->data, name, len, hash_str_n(name, len));
+  return v ? v->entry + len + 1 : NULL;
+}
+
+int env_set(struct env_store *e, const char *name, const char *value, bool exported)
+{
+  size_t len = strlen(name);
+  if (len == 0 || len > UINT32_MAX || memchr(name, '=', len))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  char *entry = malloc(len + strlen(value) + 2);
+  if (!entry || env_unshare(e) < 0)
+    {
+      free(entry);
+      return -1;
+    }
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  strcpy(entry + len + 1, value);
+
+  struct env_data *d = e->data;
+  uint32_t h = hash_str_n(name, len);
+  struct env_var *v = env_find(d, name, len, h);
+  if (v)
+    {
+      free(v->entry);
+      v->entry = entry;
+      if (v->exported)
+        d->envp[v->envp_index] = entry;
+      else if (exported && envp_add(d, v) < 0)
+        return -1;
+      return 0;
+    }
+
+  /* keep the load factor under 3/4 so probe chains stay short */
+  if ((d->count + 1) * 4 > d->cap * 3 && env_grow(d) < 0)
+    {
+      free(entry);
+      return -1;
+    }
+  size_t mask = d->cap - 1;
+  size_t i = h & mask;
+  while (d->slots[i].entry)
+    i = (i + 1) & mask;
+  v = &d->slots[i];
+  v->entry = entry;
+  v->hash = h;
+  v->name_len = (uint32_t)len;
+  v->exported = false;
+  d->count++;
+  return exported ? envp_add(d, v) : 0;
+}
+
+int env_unset(struct env_store *e, const char *name)
+{
+  size_t len = strlen(name);
+  uint32_t h = hash_str_n(name, len);
+  if (!env_find(e->data, name, len, h))
+    return 0;
+  if (env_unshare(e) < 0)
+    return -1;
+  struct env_data *d = e->data;
+  struct env_var *v = env_find(d, name, len, h);
+  if (v->exported)
+    envp_remove(d, v);
+  free(v->entry);
+  v->entry = NULL;
+  d->count--;
+
+  /* Backward shift deletion, as in the path cache */
+  size_t mask = d->cap - 1;
+  size_t hole = (size_t)(v - d->slots);
+  for (size_t i = (hole + 1) & mask; d->slots[i].entry; i = (i + 1) & mask)
+    {
+      size_t home = d->slots[i].hash & mask;
+      bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+      if (stays)
+        continue;
+      d->slots[hole] = d->slots[i];
+      d->slots[i].entry = NULL;
+      hole = i;
+    }
+  return 0;
+}
+
+int env_export(struct env_store *e, const char *name, bool exported)
+{
+  size_t len = strlen(name);
+  uint32_t h = hash_str_n(name, len);
+  struct env_var *v = env_find(e->data, name, len, h);
+  if (!v)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+  if (v->exported == exported)
+    return 0;
+  if (env_unshare(e) < 0)
+    return -1;
+  v = env_find(e->data, name, len, h);
+  if (!exported)
+    {
+      envp_remove(e->data, v);
+      return 0;
+    }
+  return envp_add(e->data, v);
+}
+
+char *const *env_envp(const struct env_store *e)
+{
+  return e->data->envp;
+}
+
+/* ------------------------------------------------------------------ */
+/* History store                                                       */
+/* ------------------------------------------------------------------ */
+
+#define HIST_MAGIC "LABHIST1"
+#define HIST_IDX_MAGIC "LABHIDX1"
+#define HIST_INITIAL_LOG (64 * 1024)
+#define HIST_INITIAL_SLOTS 1024
+
+/* The log is this header followed by records. A record is padded to 8
+ * bytes and its last four bytes repeat its size so the log can be walked
+ * backwards from the end. */
+struct hist_header
+{
+  char magic[8];
+  uint64_t end;  /* bytes in use, a record counts once end covers it */
+  uint64_t nrec; /* records appended */
+  uint64_t reserved[5];
+};
+
+struct hist_rec
+{
+  uint32_t size;
+  uint32_t hash; /* of the text */
+  uint64_t text; /* offset of the record holding the text, its own offset
+                    for a text record which is followed by the line */
+};
+
+struct hist_idx_header
+{
+  char magic[8];
+  uint64_t cap;     /* slots, always a power of two */
+  uint64_t count;
+  uint64_t log_end; /* log offset the index covers */
+  uint64_t nrec;    /* records it covers */
+  uint64_t log_ino; /* the index belongs to this log */
+  uint64_t reserved[2];
+};
+
+struct hist_slot
+{
+  uint64_t text; /* 0 marks an empty slot */
+  uint64_t seq;  /* record number of the last use, counting from 1 */
+  uint32_t hash;
+  uint32_t reserved;
+};
+
+static struct hist_header *hist_hdr(struct hist_store *h)
+{
+  return (struct hist_header *)h->map;
+}
+
+static struct hist_idx_header *hist_ihdr(struct hist_store *h)
+{
+  return (struct hist_idx_header *)h->idx;
+}
+
+static struct hist_slot *hist_slots(struct hist_store *h)
+{
+  return (struct hist_slot *)(h->idx + sizeof(struct hist_idx_header));
+}
+
+static struct hist_rec *hist_rec_at(struct hist_store *h, uint64_t off)
+{
+  return (struct hist_rec *)(h->map + off);
+}
+
+static const char *hist_text(struct hist_store *h, uint64_t text)
+{
+  return h->map + text + sizeof(struct hist_rec);
+}
+
+void hist_init(struct hist_store *h)
+{
+  memset(h, 0, sizeof(*h));
+  h->fd = -1;
+  h->idx_fd = -1;
+}
+
+/* Maps all of fd, replacing the old mapping if the file changed size */
+static int hist_map(int fd, char **map, size_t *len)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if ((size_t)st.st_size == *len)
+    return 0;
+  if (*map)
+    munmap(*map, *len);
+  *map = NULL;
+  *len = 0;
+  if (st.st_size == 0)
+    return 0;
+  void *m = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED)
+    return -1;
+  *map = m;
+  *len = (size_t)st.st_size;
+  return 0;
+}
+
+/* Grows the file to hold at least need bytes, doubling its size */
+static int hist_reserve(int fd, char **map, size_t *len, size_t need)
+{
+  if (need <= *len)
+    return 0;
+  size_t size = *len ? *len : need;
+  while (size < need)
+    size *= 2;
+  if (ftruncate(fd, (off_t)size) < 0)
+    return -1;
+  return hist_map(fd, map, len);
+}
+
+/* Locks the log and picks up growth by other shells sharing it */
+static int hist_lock(struct hist_store *h, int op)
+{
+  if (h->fd < 0 || flock(h->fd, op) < 0)
+    return -1;
+  if (hist_map(h->fd, &h->map, &h->map_len) < 0 || hist_map(h->idx_fd, &h->idx, &h->idx_len) < 0)
+    {
+      flock(h->fd, LOCK_UN);
+      return -1;
+    }
+  return 0;
+}
+
+static void hist_unlock(struct hist_store *h)
+{
+  flock(h->fd, LOCK_UN);
+}
+
+/* Slot holding line, or the empty slot where it belongs */
+static struct hist_slot *hist_find(struct hist_store *h, const char *line, uint32_t hash)
+{
+  struct hist_slot *slots = hist_slots(h);
+  size_t mask = hist_ihdr(h)->cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask)
+    if (!slots[i].text || (slots[i].hash == hash && strcmp(hist_text(h, slots[i].text), line) == 0))
+      return &slots[i];
+}
+
+/* Slot of the text record at text, NULL if it is not indexed */
+static struct hist_slot *hist_find_text(struct hist_store *h, uint64_t text)
+{
+  if (text < sizeof(struct hist_header) || text >= hist_hdr(h)->end)
+    return NULL;
+  struct hist_slot *slots = hist_slots(h);
+  size_t mask = hist_ihdr(h)->cap - 1;
+  for (size_t i = hist_rec_at(h, text)->hash & mask; slots[i].text; i = (i + 1) & mask)
+    if (slots[i].text == text)
+      return &slots[i];
+  return NULL;
+}
+
+/* Empties the index, it has to be caught up with the log afterwards */
+static int hist_index_reset(struct hist_store *h, uint64_t cap)
+{
+  size_t need = sizeof(struct hist_idx_header) + cap * sizeof(struct hist_slot);
+  struct stat st;
+  if (fstat(h->fd, &st) < 0 || ftruncate(h->idx_fd, 0) < 0 || ftruncate(h->idx_fd, (off_t)need) < 0 ||
+      hist_map(h->idx_fd, &h->idx, &h->idx_len) < 0)
+    return -1;
+  struct hist_idx_header *ih = hist_ihdr(h);
+  memcpy(ih->magic, HIST_IDX_MAGIC, sizeof(ih->magic));
+  ih->cap = cap;
+  ih->count = 0;
+  ih->log_end = sizeof(struct hist_header);
+  ih->nrec = 0;
+  ih->log_ino = st.st_ino;
+  return 0;
+}
+
+static int hist_index_grow(struct hist_store *h)
+{
+  struct hist_idx_header old = *hist_ihdr(h);
+  struct hist_slot *copy = malloc(old.cap * sizeof(*copy));
+  if (!copy)
+    return -1;
+  memcpy(copy, hist_slots(h), old.cap * sizeof(*copy));
+  if (hist_index_reset(h, old.cap * 2) < 0)
+    {
+      free(copy);
+      return -1;
+    }
+  struct hist_idx_header *ih = hist_ihdr(h);
+  ih->log_end = old.log_end;
+  ih->nrec = old.nrec;
+  struct hist_slot *slots = hist_slots(h);
+  size_t mask = ih->cap - 1;
+  for (size_t i = 0; i < old.cap; i++)
+    {
+      if (!copy[i].text)
+        continue;
+      size_t j = copy[i].hash & mask;
+      while (slots[j].text)
+        j = (j + 1) & mask;
+      slots[j] = copy[i];
+      ih->count++;
+    }
+  free(copy);
+  return 0;
+}
+
+static bool hist_rec_valid(struct hist_store *h, uint64_t off)
+{
+  uint64_t end = hist_hdr(h)->end;
+  if (off + sizeof(struct hist_rec) + 4 > end)
+    return false;
+  struct hist_rec *r = hist_rec_at(h, off);
+  return r->size % 8 == 0 && r->size >= sizeof(*r) + 4 && r->size <= end - off && r->text <= off;
+}
+
+/* Indexes the records appended since the index was last brought up to date */
+static int hist_index_catch_up(struct hist_store *h)
+{
+  while (hist_ihdr(h)->log_end < hist_hdr(h)->end)
+    {
+      uint64_t off = hist_ihdr(h)->log_end;
+      if (!hist_rec_valid(h, off))
+        {
+          errno = EINVAL;
+          return -1;
+        }
+      struct hist_rec *r = hist_rec_at(h, off);
+      struct hist_slot *s;
+      if (r->text == off)
+        {
+          struct hist_idx_header *ih = hist_ihdr(h);
+          if ((ih->count + 1) * 2 > ih->cap && hist_index_grow(h) < 0)
+            return -1;
+          s = hist_find(h, hist_text(h, off), r->hash);
+          if (!s->text)
+            {
+              s->text = off;
+              s->hash = r->hash;
+              hist_ihdr(h)->count++;
+            }
+        }
+      else
+        s = hist_find_text(h, r->text);
+      struct hist_idx_header *ih = hist_ihdr(h);
+      ih->nrec++;
+      if (s)
+        s->seq = ih->nrec;
+      ih->log_end = off + r->size;
+    }
+  return 0;
+}
+
+int hist_open(struct hist_store *h, const char *path)
+{
+  hist_init(h);
+  char *idx_path;
+  if (asprintf(&idx_path, "%s.idx", path) < 0)
+    return -1;
+  h->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (h->fd >= 0)
+    h->idx_fd = open(idx_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  free(idx_path);
+  if (h->idx_fd < 0 || hist_lock(h, LOCK_EX) < 0)
+    goto fail;
+
+  if (h->map_len < sizeof(struct hist_header))
+    {
+      if (hist_reserve(h->fd, &h->map, &h->map_len, HIST_INITIAL_LOG) < 0)
+        goto fail_locked;
+      memcpy(hist_hdr(h)->magic, HIST_MAGIC, sizeof(hist_hdr(h)->magic));
+      hist_hdr(h)->end = sizeof(struct hist_header);
+      hist_hdr(h)->nrec = 0;
+    }
+  struct hist_header *hh = hist_hdr(h);
+  if (memcmp(hh->magic, HIST_MAGIC, sizeof(hh->magic)) != 0 || hh->end < sizeof(*hh) || hh->end > h->map_len)
+    {
+      errno = EINVAL;
+      goto fail_locked;
+    }
+
+  /* A missing or foreign index is rebuilt, otherwise only the records other
+   * shells appended without indexing them are read */
+  struct stat st;
+  if (fstat(h->fd, &st) < 0)
+    goto fail_locked;
+  struct hist_idx_header *ih = h->idx_len >= sizeof(*ih) ? hist_ihdr(h) : NULL;
+  if (!ih || memcmp(ih->magic, HIST_IDX_MAGIC, sizeof(ih->magic)) != 0 || ih->log_ino != st.st_ino ||
+      ih->log_end > hh->end || ih->cap == 0 || (ih->cap & (ih->cap - 1)) ||
+      ih->cap > (h->idx_len - sizeof(*ih)) / sizeof(struct hist_slot))
+    {
+      if (hist_index_reset(h, HIST_INITIAL_SLOTS) < 0)
+        goto fail_locked;
+    }
+  if (hist_index_catch_up(h) < 0)
+    goto fail_locked;
+  hist_unlock(h);
+  return 0;
+
+fail_locked:
+  hist_unlock(h);
+fail:;
+  int saved = errno;
+  hist_close(h);
+  errno = saved;
+  return -1;
+}
+
+void hist_close(struct hist_store *h)
+{
+  if (h->map)
+    munmap(h->map, h->map_len);
+  if (h->idx)
+    munmap(h->idx, h->idx_len);
+  if (h->fd >= 0)
+    close(h->fd);
+  if (h->idx_fd >= 0)
+    close(h->idx_fd);
+  for (size_t i = 0; i < h->tri_cap; i++)
+    free(h->tri[i].offs);
+  free(h->tri);
+  hist_init(h);
+}
+
+int hist_add(struct hist_store *h, const char *line)
+{
+  if (hist_lock(h, LOCK_EX) < 0)
+    return -1;
+  int ret = -1;
+  if (hist_index_catch_up(h) < 0)
+    goto out;
+
+  uint32_t hash = hash_str(line);
+  uint64_t text = hist_find(h, line, hash)->text;
+  size_t len = strlen(line);
+  uint64_t off = hist_hdr(h)->end;
+  uint32_t size = (uint32_t)sizeof(struct hist_rec) + 4 + (text ? 0 : (uint32_t)len + 1);
+  size = (size + 7) & ~7u;
+  if (hist_reserve(h->fd, &h->map, &h->map_len, off + size) < 0)
+    goto out;
+  struct hist_rec *r = hist_rec_at(h, off);
+  r->size = size;
+  r->hash = hash;
+  r->text = text ? text : off;
+  if (!text)
+    memcpy(r + 1, line, len + 1);
+  memcpy(h->map + off + size - 4, &size, 4);
+  hist_hdr(h)->nrec++;
+  hist_hdr(h)->end = off + size;
+  ret = hist_index_catch_up(h);
+out:
+  hist_unlock(h);
+  return ret;
+}
+
+size_t hist_count(struct hist_store *h, size_t *distinct)
+{
+  if (distinct)
+    *distinct = 0;
+  if (hist_lock(h, LOCK_SH) < 0)
+    return 0;
+  size_t n = hist_hdr(h)->nrec;
+  if (distinct)
+    *distinct = hist_ihdr(h)->count;
+  hist_unlock(h);
+  return n;
+}
+
+/* Steps from the record ending at off to the one before it, 0 at the start */
+static uint64_t hist_prev(struct hist_store *h, uint64_t off)
+{
+  if (off <= sizeof(struct hist_header))
+    return 0;
+  uint32_t size;
+  memcpy(&size, h->map + off - 4, 4);
+  if (size < sizeof(struct hist_rec) + 4 || size > off - sizeof(struct hist_header))
+    return 0;
+  return off - size;
+}
+
+size_t hist_recent(struct hist_store *h, const char **lines, size_t max)
+{
+  if (hist_lock(h, LOCK_SH) < 0)
+    return 0;
+  size_t n = 0;
+  for (uint64_t off = hist_prev(h, hist_hdr(h)->end); off && n < max; off = hist_prev(h, off))
+    {
+      uint64_t text = hist_rec_at(h, off)->text;
+      if (text > off)
+        break;
+      lines[n++] = hist_text(h, text);
+    }
+  hist_unlock(h);
+  for (size_t i = 0; i < n / 2; i++)
+    {
+      const char *t = lines[i];
+      lines[i] = lines[n - 1 - i];
+      lines[n - 1 - i] = t;
+    }
+  return n;
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write(fd, buf, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return -1;
+      buf += n;
+      len -= (size_t)n;
+    }
+  return 0;
+}
+
+int hist_export(struct hist_store *h, int fd)
+{
+  if (hist_lock(h, LOCK_SH) < 0)
+    return -1;
+  char buf[64 * 1024];
+  size_t used = 0;
+  int ret = 0;
+  uint64_t end = hist_hdr(h)->end;
+  for (uint64_t off = sizeof(struct hist_header); off < end && ret == 0; off += hist_rec_at(h, off)->size)
+    {
+      if (!hist_rec_valid(h, off))
+        break;
+      const char *text = hist_text(h, hist_rec_at(h, off)->text);
+      size_t len = strlen(text);
+      if (used + len + 1 > sizeof(buf))
+        {
+          ret = write_full(fd, buf, used);
+          used = 0;
+        }
+      if (len + 1 > sizeof(buf))
+        {
+          if (ret == 0)
+            ret = write_full(fd, text, len);
+          if (ret == 0)
+            ret = write_full(fd, "\n", 1);
+          continue;
+        }
+      memcpy(buf + used, text, len);
+      buf[used + len] = '\n';
+      used += len + 1;
+    }
+  if (ret == 0)
+    ret = write_full(fd, buf, used);
+  hist_unlock(h);
+  return ret;
+}
+
+static uint32_t hist_tri_key(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  return ((uint32_t)u[0] << 16 | (uint32_t)u[1] << 8 | u[2]) + 1;
+}
+
+static struct hist_trigram *hist_tri_slot(struct hist_trigram *tri, size_t cap, uint32_t key)
+{
+  size_t mask = cap - 1;
+  for (size_t i = (key * 2654435761u) & mask;; i = (i + 1) & mask)
+    if (tri[i].key == key || !tri[i].key)
+      return &tri[i];
+}
+
+static int hist_tri_grow(struct hist_store *h)
+{
+  size_t cap = h->tri_cap ? h->tri_cap * 2 : 4096;
+  struct hist_trigram *tri = calloc(cap, sizeof(*tri));
+  if (!tri)
+    return -1;
+  for (size_t i = 0; i < h->tri_cap; i++)
+    if (h->tri[i].key)
+      *hist_tri_slot(tri, cap, h->tri[i].key) = h->tri[i];
+  free(h->tri);
+  h->tri = tri;
+  h->tri_cap = cap;
+  return 0;
+}
+
+static int hist_tri_add(struct hist_store *h, uint32_t key, uint64_t text)
+{
+  if ((h->tri_count + 1) * 2 > h->tri_cap && hist_tri_grow(h) < 0)
+    return -1;
+  struct hist_trigram *t = hist_tri_slot(h->tri, h->tri_cap, key);
+  if (!t->key)
+    {
+      t->key = key;
+      h->tri_count++;
+    }
+  /* a trigram repeated within one line is listed once */
+  if (t->count && t->offs[t->count - 1] == text)
+    return 0;
+  if (t->count == t->cap)
+    {
+      uint32_t cap = t->cap ? t->cap * 2 : 4;
+      uint64_t *offs = realloc(t->offs, cap * sizeof(*offs));
+      if (!offs)
+        return -1;
+      t->offs = offs;
+      t->cap = cap;
+    }
+  t->offs[t->count++] = text;
+  return 0;
+}
+
+/* Adds the lines stored since the last search to the trigram index */
+static int hist_tri_catch_up(struct hist_store *h)
+{
+  if (h->tri_end < sizeof(struct hist_header))
+    h->tri_end = sizeof(struct hist_header);
+  while (h->tri_end < hist_hdr(h)->end)
+    {
+      uint64_t off = h->tri_end;
+      if (!hist_rec_valid(h, off))
+        return -1;
+      if (hist_rec_at(h, off)->text == off)
+        for (const char *t = hist_text(h, off); t[0] && t[1] && t[2]; t++)
+          if (hist_tri_add(h, hist_tri_key(t), off) < 0)
+            return -1;
+      h->tri_end = off + hist_rec_at(h, off)->size;
+    }
+  return 0;
+}
+
+/* Short queries have no trigram: walk back from the newest record and
+ * take each line at its last use */
+static const char *hist_search_recent(struct hist_store *h, const char *query, size_t skip)
+{
+  uint64_t seq = hist_hdr(h)->nrec;
+  for (uint64_t off = hist_prev(h, hist_hdr(h)->end); off; off = hist_prev(h, off), seq--)
+    {
+      uint64_t text = hist_rec_at(h, off)->text;
+      if (text > off)
+        break;
+      const char *line = hist_text(h, text);
+      if (!strstr(line, query))
+        continue;
+      struct hist_slot *s = hist_find_text(h, text);
+      if (s && s->seq == seq && skip-- == 0)
+        return line;
+    }
+  return NULL;
+}
+
+struct hist_match
+{
+  uint64_t seq;
+  uint64_t text;
+};
+
+static int hist_match_newer(const void *a, const void *b)
+{
+  const struct hist_match *x = a, *y = b;
+  return x->seq < y->seq ? 1 : x->seq > y->seq ? -1 : 0;
+}
+
+/* Checks the lines listed under the query's rarest trigram */
+static const char *hist_search_trigrams(struct hist_store *h, const char *query, size_t skip)
+{
+  if (hist_tri_catch_up(h) < 0)
+    return NULL;
+  struct hist_trigram *rarest = NULL;
+  for (const char *q = query; q[0] && q[1] && q[2]; q++)
+    {
+      struct hist_trigram *t = hist_tri_slot(h->tri, h->tri_cap, hist_tri_key(q));
+      if (!t->key)
+        return NULL;
+      if (!rarest || t->count < rarest->count)
+        rarest = t;
+    }
+
+  struct hist_match *m = malloc(rarest->count * sizeof(*m));
+  if (!m)
+    return NULL;
+  size_t n = 0;
+  for (uint32_t i = 0; i < rarest->count; i++)
+    {
+      uint64_t text = rarest->offs[i];
+      struct hist_slot *s;
+      if (strstr(hist_text(h, text), query) && (s = hist_find_text(h, text)))
+        m[n++] = (struct hist_match){s->seq, text};
+    }
+  qsort(m, n, sizeof(*m), hist_match_newer);
+  const char *found = skip < n ? hist_text(h, m[skip].text) : NULL;
+  free(m);
+  return found;
+}
+
+const char *hist_search(struct hist_store *h, const char *query, size_t skip)
+{
+  if (hist_lock(h, LOCK_SH) < 0)
+    return NULL;
+  const char *found = strlen(query) < 3 ? hist_search_recent(h, query, skip)
+                                        : hist_search_trigrams(h, query, skip);
+  hist_unlock(h);
+  return found;
+}
+
+/* ------------------------------------------------------------------ */
+/* Completion                                                          */
+/* ------------------------------------------------------------------ */
+
+/* Names collected for an index, packed one after another */
+struct name_list
+{
+  char *block;
+  size_t len;
+  size_t cap;
+  size_t count;
+};
+
+static int name_list_add(struct name_list *l, const char *name)
+{
+  size_t n = strlen(name) + 1;
+  if (l->len + n > l->cap)
+    {
+      size_t cap = l->cap ? l->cap * 2 : 4096;
+      while (cap < l->len + n)
+        cap *= 2;
+      char *block = realloc(l->block, cap);
+      if (!block)
+        return -1;
+      l->block = block;
+      l->cap = cap;
+    }
+  memcpy(l->block + l->len, name, n);
+  l->len += n;
+  l->count++;
+  return 0;
+}
+
+static int cmp_name_hidden_last(const void *a, const void *b)
+{
+  const char *x = *(char *const *)a, *y = *(char *const *)b;
+  if ((x[0] == '.') != (y[0] == '.'))
+    return x[0] == '.' ? 1 : -1;
+  return strcmp(x, y);
+}
+
+/* Sorts the names and drops duplicates, the index takes over the block */
+static int name_index_build(struct name_index *ix, struct name_list *l)
+{
+  ix->names = malloc((l->count ? l->count : 1) * sizeof(char *));
+  if (!ix->names)
+    return -1;
+  char *p = l->block;
+  for (size_t i = 0; i < l->count; i++)
+    {
+      ix->names[i] = p;
+      p += strlen(p) + 1;
+    }
+  qsort(ix->names, l->count, sizeof(char *), cmp_name_hidden_last);
+  size_t n = 0;
+  for (size_t i = 0; i < l->count; i++)
+    if (n == 0 || strcmp(ix->names[n - 1], ix->names[i]) != 0)
+      ix->names[n++] = ix->names[i];
+  ix->count = n;
+  for (ix->hidden = 0; ix->hidden < n && ix->names[ix->hidden][0] != '.'; ix->hidden++)
+    ;
+  ix->block = l->block;
+  l->block = NULL;
+  return 0;
+}
+
+static void name_index_free(struct name_index *ix)
+{
+  free(ix->names);
+  free(ix->block);
+  free(ix->dir_mtimes);
+  memset(ix, 0, sizeof(*ix));
+}
+
+/* The names starting with prefix are one run of the sorted array: binary
+ * search for where the run starts and where it ends */
+static size_t name_index_range(const struct name_index *ix, const char *prefix, char *const **first)
+{
+  size_t len = strlen(prefix);
+  size_t lo = prefix[0] == '.' ? ix->hidden : 0;
+  size_t hi = prefix[0] == '.' ? ix->count : ix->hidden;
+  size_t end = hi;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (strcmp(ix->names[mid], prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  size_t start = lo;
+  hi = end;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (strncmp(ix->names[mid], prefix, len) == 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *first = ix->names + start;
+  return lo - start;
+}
+
+static bool dot_or_dotdot(const char *name)
+{
+  return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+/* Indexes the builtins and the executables in the directories of path */
+static int name_index_scan_path(struct name_index *ix, const char *path)
+{
+  struct name_list l = {0};
+  ix->ndirs = 1;
+  for (const char *p = path; *p; p++)
+    ix->ndirs += *p == ':';
+  ix->dir_mtimes = calloc(ix->ndirs, sizeof(*ix->dir_mtimes));
+  if (!ix->dir_mtimes)
+    return -1;
+  for (size_t i = 0; i < builtin_table_size; i++)
+    if (name_list_add(&l, builtin_table[i].name) < 0)
+      goto fail;
+
+  const char *p = path;
+  for (size_t d = 0; d < ix->ndirs; d++)
+    {
+      const char *colon = strchrnul(p, ':');
+      char dir[PATH_MAX];
+      snprintf(dir, sizeof(dir), "%.*s", (int)(colon - p), colon == p ? "." : p);
+      p = *colon ? colon + 1 : colon;
+
+      int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      struct stat st;
+      if (dfd < 0)
+        continue;
+      if (fstat(dfd, &st) == 0)
+        ix->dir_mtimes[d] = st.st_mtim;
+      DIR *dp = fdopendir(dfd);
+      if (!dp)
+        {
+          close(dfd);
+          continue;
+        }
+      struct dirent *de;
+      while ((de = readdir(dp)))
+        {
+          if (dot_or_dotdot(de->d_name) || de->d_type == DT_DIR)
+            continue;
+          if (fstatat(dfd, de->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111) &&
+              name_list_add(&l, de->d_name) < 0)
+            {
+              closedir(dp);
+              goto fail;
+            }
+        }
+      closedir(dp);
+    }
+  if (name_index_build(ix, &l) < 0)
+    goto fail;
+  return 0;
+
+fail:
+  free(l.block);
+  return -1;
+}
+
+static void *completer_main(void *arg)
+{
+  struct completer *c = arg;
+  struct name_index *ix = calloc(1, sizeof(*ix));
+  if (ix && name_index_scan_path(ix, c->path_env) < 0)
+    {
+      name_index_free(ix);
+      free(ix);
+      ix = NULL;
+    }
+  pthread_mutex_lock(&c->lock);
+  if (ix)
+    {
+      if (c->pending)
+        {
+          name_index_free(c->pending);
+          free(c->pending);
+        }
+      c->pending = ix;
+    }
+  c->finished = true;
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+void completer_init(struct completer *c)
+{
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_init(&c->lock, NULL);
+}
+
+/* Switches lookups to a finished build, only the calling thread ever
+ * frees an index so names handed out stay valid until its next call */
+static void completer_adopt(struct completer *c)
+{
+  pthread_mutex_lock(&c->lock);
+  bool finished = c->finished;
+  struct name_index *ix = c->pending;
+  c->pending = NULL;
+  pthread_mutex_unlock(&c->lock);
+  if (ix)
+    {
+      if (c->commands)
+        {
+          name_index_free(c->commands);
+          free(c->commands);
+        }
+      c->commands = ix;
+    }
+  if (c->building && finished)
+    {
+      pthread_join(c->thread, NULL);
+      c->building = false;
+    }
+}
+
+void completer_wait(struct completer *c)
+{
+  if (c->building)
+    {
+      pthread_join(c->thread, NULL);
+      c->building = false;
+    }
+  completer_adopt(c);
+}
+
+static void dir_listing_free(struct dir_listing *d)
+{
+  free(d->dir);
+  name_index_free(&d->names);
+  memset(d, 0, sizeof(*d));
+}
+
+void completer_destroy(struct completer *c)
+{
+  completer_wait(c);
+  if (c->commands)
+    {
+      name_index_free(c->commands);
+      free(c->commands);
+    }
+  for (size_t i = 0; i < COMPLETER_DIRS; i++)
+    dir_listing_free(&c->dirs[i]);
+  free(c->path_env);
+  pthread_mutex_destroy(&c->lock);
+  memset(c, 0, sizeof(*c));
+}
+
+int completer_start(struct completer *c, const char *path)
+{
+  completer_adopt(c);
+  /* the build in progress stays, a later refresh notices it is stale */
+  if (c->building)
+    return 0;
+  if (!path)
+    path = getenv("PATH");
+  char *copy = strdup(path ? path : "");
+  if (!copy)
+    return -1;
+  free(c->path_env);
+  c->path_env = copy;
+  c->finished = false;
+  if (pthread_create(&c->thread, NULL, completer_main, c) != 0)
+    return -1;
+  c->building = true;
+  return 0;
+}
+
+void completer_refresh(struct completer *c, const char *path)
+{
+  completer_adopt(c);
+  if (c->building)
+    return;
+  if (!path)
+    path = getenv("PATH");
+  path = path ? path : "";
+  bool stale = !c->commands || !c->path_env || strcmp(path, c->path_env) != 0;
+  const char *p = path;
+  for (size_t d = 0; !stale && d < c->commands->ndirs; d++)
+    {
+      const char *colon = strchrnul(p, ':');
+      char dir[PATH_MAX];
+      snprintf(dir, sizeof(dir), "%.*s", (int)(colon - p), colon == p ? "." : p);
+      p = *colon ? colon + 1 : colon;
+      struct stat st;
+      struct timespec t = stat(dir, &st) == 0 ? st.st_mtim : (struct timespec){0};
+      const struct timespec *seen = &c->commands->dir_mtimes[d];
+      stale = t.tv_sec != seen->tv_sec || t.tv_nsec != seen->tv_nsec;
+    }
+  if (stale)
+    completer_start(c, path);
+}
+
+size_t completer_commands(struct completer *c, const char *prefix, char *const **names)
+{
+  completer_adopt(c);
+  if (!c->commands)
+    return 0;
+  return name_index_range(c->commands, prefix, names);
+}
+
+static int dir_listing_load(struct dir_listing *d, const char *dir, const struct stat *st)
+{
+  struct name_list l = {0};
+  DIR *dp = opendir(dir);
+  if (!dp)
+    return -1;
+  struct dirent *de;
+  while ((de = readdir(dp)))
+    if (!dot_or_dotdot(de->d_name) && name_list_add(&l, de->d_name) < 0)
+      break;
+  closedir(dp);
+  if (de || name_index_build(&d->names, &l) < 0 || !(d->dir = strdup(dir)))
+    {
+      free(l.block);
+      dir_listing_free(d);
+      return -1;
+    }
+  d->mtime = st->st_mtim;
+  d->dev = st->st_dev;
+  d->ino = st->st_ino;
+  return 0;
+}
+
+size_t completer_files(struct completer *c, const char *dir, const char *prefix, char *const **names)
+{
+  /* The mtime is taken before listing, a change made while listing shows
+   * up as a newer mtime next time */
+  struct stat st;
+  if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+    return 0;
+  struct dir_listing *d = NULL, *victim = &c->dirs[0];
+  for (size_t i = 0; i < COMPLETER_DIRS && !d; i++)
+    {
+      if (c->dirs[i].dir && strcmp(c->dirs[i].dir, dir) == 0)
+        d = &c->dirs[i];
+      else if (victim->dir && (!c->dirs[i].dir || c->dirs[i].used < victim->used))
+        victim = &c->dirs[i];
+    }
+  if (d && (d->mtime.tv_sec != st.st_mtim.tv_sec || d->mtime.tv_nsec != st.st_mtim.tv_nsec ||
+            d->dev != st.st_dev || d->ino != st.st_ino))
+    {
+      dir_listing_free(d);
+      victim = d;
+      d = NULL;
+    }
+  if (d)
+    c->dir_hits++;
+  else
+    {
+      dir_listing_free(victim);
+      if (dir_listing_load(victim, dir, &st) < 0)
+        return 0;
+      d = victim;
+      c->dir_misses++;
+    }
+  d->used = ++c->clock;
+  return name_index_range(&d->names, prefix, names);
+}
+
+/* ------------------------------------------------------------------ */
+/* Stat cache                                                          */
+/* ------------------------------------------------------------------ */
+
+void stat_cache_init(struct stat_cache *sc)
+{
+  sc->enabled = true;
+  sc->dir_fd = -1;
+  sc->count = 0;
+  sc->next = 0;
+  sc->hits = 0;
+  sc->misses = 0;
+}
+
+void stat_cache_clear(struct stat_cache *sc)
+{
+  sc->count = 0;
+  sc->next = 0;
+}
+
+int stat_cache_get(struct stat_cache *sc, int dir_fd, const char *path, bool follow, struct stat *st)
+{
+  int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+  size_t len = strlen(path);
+  if (!sc->enabled || len >= STAT_CACHE_PATH)
+    return fstatat(dir_fd, path, st, flags);
+  if (dir_fd != sc->dir_fd)
+    {
+      stat_cache_clear(sc);
+      sc->dir_fd = dir_fd;
+    }
+
+  uint32_t h = hash_str_n(path, len);
+  for (size_t i = 0; i < sc->count; i++)
+    {
+      struct stat_entry *e = &sc->entries[i];
+      if (e->hash == h && e->follow == follow && strcmp(e->path, path) == 0)
+        {
+          sc->hits++;
+          if (e->err)
+            {
+              errno = e->err;
+              return -1;
+            }
+          *st = e->st;
+          return 0;
+        }
+    }
+
+  sc->misses++;
+  int rc = fstatat(dir_fd, path, st, flags);
+  struct stat_entry *e;
+  if (sc->count < STAT_CACHE_SIZE)
+    e = &sc->entries[sc->count++];
+  else
+    {
+      e = &sc->entries[sc->next];
+      sc->next = (sc->next + 1) % STAT_CACHE_SIZE;
+    }
+  e->hash = h;
+  e->follow = follow;
+  e->err = rc < 0 ? errno : 0;
+  if (rc == 0)
+    e->st = *st;
+  memcpy(e->path, path, len + 1);
+  return rc;
+}
+
+/* ------------------------------------------------------------------ */
+/* Builtins                                                            */
+/* ------------------------------------------------------------------ */
+
+static int builtin_exit(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  UNUSED(io);
+  sh->exit_requested = true;
+  return argv[1] ? atoi(argv[1]) & 0xff : sh->last_status;
+}
+
+/* $HOME, or the password database entry copied into buf */
+static const char *home_dir(const struct shell *sh, char *buf, size_t len)
+{
+  const char *home = sh_getenv(sh, "HOME");
+  if (home && *home)
+    return home;
+  struct passwd pwbuf, *pw = NULL;
+  char scratch[1024];
+  if (getpwuid_r(getuid(), &pwbuf, scratch, sizeof(scratch), &pw) != 0 || !pw ||
+      (size_t)snprintf(buf, len, "%s", pw->pw_dir) >= len)
+    return NULL;
+  return buf;
+}
+
+static int builtin_cd(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  char home[PATH_MAX];
+  const char *dir = argv[1] ? argv[1] : home_dir(sh, home, sizeof(home));
+  if (!dir)
+    {
+      dprintf(io->err, "cd: HOME not set\n");
+      return 1;
+    }
+  if (sh_chdir(sh, dir) < 0)
+    {
+      dprintf(io->err, "cd: %s: %s\n", dir, strerror(errno));
+      return 1;
+    }
+  return 0;
+}
+
+static int builtin_pwd(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  UNUSED(argv);
+  dprintf(io->out, "%s\n", sh->cwd);
+  return 0;
+}
+
+/*
+ * history          list the lines readline holds
+ * history -w file  write the whole persistent history as a plain text
+ *                  history file
+ */
+static int builtin_history(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  if (argv[1] && strcmp(argv[1], "-w") == 0)
+    {
+      if (!argv[2])
+        {
+          dprintf(io->err, "history: -w: file name required\n");
+          return 2;
+        }
+      if (sh->history.fd < 0)
+        {
+          int err = write_history(argv[2]);
+          if (err)
+            dprintf(io->err, "history: %s: %s\n", argv[2], strerror(err));
+          return err ? 1 : 0;
+        }
+      int fd = openat(sh->cwd_fd, argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if (fd < 0 || hist_export(&sh->history, fd) < 0)
+        {
+          dprintf(io->err, "history: %s: %s\n", argv[2], strerror(errno));
+          if (fd >= 0)
+            close(fd);
+          return 1;
+        }
+      close(fd);
+      return 0;
+    }
+  if (sh->history.fd >= 0)
+    {
+      /* the shell's own store, readline's list is shared by the process */
+      size_t n = hist_count(&sh->history, NULL);
+      const char **lines = malloc((n ? n : 1) * sizeof(*lines));
+      if (!lines)
+        {
+          dprintf(io->err, "history: %s\n", strerror(errno));
+          return 1;
+        }
+      n = hist_recent(&sh->history, lines, n);
+      for (size_t i = 0; i < n; i++)
+        dprintf(io->out, "%5zu  %s\n", i + 1, lines[i]);
+      free(lines);
+      return 0;
+    }
+  HIST_ENTRY **list = history_list();
+  for (int i = 0; list && list[i]; i++)
+    dprintf(io->out, "%5d  %s\n", i + history_base, list[i]->line);
+  return 0;
+}
+
+/*
+ * hash            list remembered locations
+ * hash -r         forget all locations
+ * hash name...    look up and remember each name
+ * hash -p path name  remember path for name
+ */
+static int builtin_hash(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  struct path_cache *pc = &sh->paths;
+  if (!argv[1])
+    {
+      path_cache_sync(pc);
+      for (size_t i = 0; i < pc->cap; i++)
+        if (pc->slots[i].name)
+          dprintf(io->out, "%s\t%s\n", pc->slots[i].name, pc->slots[i].path);
+      return 0;
+    }
+  if (strcmp(argv[1], "-r") == 0)
+    {
+      path_cache_clear(pc);
+      return 0;
+    }
+  if (strcmp(argv[1], "-p") == 0)
+    {
+      if (!argv[2] || !argv[3])
+        {
+          dprintf(io->err, "hash: usage: hash -p path name\n");
+          return 2;
+        }
+      return path_cache_insert(pc, argv[3], argv[2]) == 0 ? 0 : 1;
+    }
+  int status = 0;
+  for (int i = 1; argv[i]; i++)
+    {
+      if (strchr(argv[i], '/') || builtin_lookup(argv[i]))
+        continue;
+      if (!path_cache_lookup_env(pc, sh_getenv(sh, "PATH"), argv[i]))
+        {
+          dprintf(io->err, "hash: %s: not found\n", argv[i]);
+          status = 1;
+        }
+    }
+  return status;
+}
+
+/*
+ * set -o          list the options and whether they are on
+ * set -o name     turn an option on
+ * set +o name     turn it off
+ */
+static const struct
+{
+  const char *name;
+  size_t offset; /* of the bool in struct shell */
+} sh_options[] = {
+  {"coreutils", offsetof(struct shell, use_coreutils)},
+  {"optimize", offsetof(struct shell, optimize)},
+  {"threads", offsetof(struct shell, use_threads)},
+  {"statcache", offsetof(struct shell, stats.enabled)},
+  {"zygote", offsetof(struct shell, use_zygote)},
+};
+
+static int builtin_set(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  if (!argv[1] || ((strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "+o") == 0) && !argv[2]))
+    {
+      for (size_t i = 0; i < NELEMS(sh_options); i++)
+        dprintf(io->out, "%-15s %s\n", sh_options[i].name,
+                *(bool *)((char *)sh + sh_options[i].offset) ? "on" : "off");
+      return 0;
+    }
+  if (strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0)
+    {
+      dprintf(io->err, "set: %s: invalid option\n", argv[1]);
+      return 2;
+    }
+  for (size_t i = 0; i < NELEMS(sh_options); i++)
+    if (strcmp(argv[2], sh_options[i].name) == 0)
+      {
+        *(bool *)((char *)sh + sh_options[i].offset) = argv[1][0] == '-';
+        return 0;
+      }
+  dprintf(io->err, "set: %s: invalid option name\n", argv[2]);
+  return 2;
+}
+
+/* ------------------------------------------------------------------ */
+/* Test builtins                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * test expr, [ expr ] and [[ expr ]]
+ *
+ * The arguments are evaluated by recursive descent. test and [ take the
+ * POSIX operators with -a, -o and parentheses; [[ takes && and || in
+ * their place, matches the right side of == and != as a glob pattern and
+ * adds =~ for extended regular expressions. Files are looked up relative
+ * to the shell's working directory through its stat cache, so a line of
+ * tests on the same file stats it once.
+ */
+
+struct test_state
+{
+  struct shell *sh;
+  struct builtin_io *io;
+  const char *name; /* for messages */
+  char **args;
+  size_t n;
+  size_t pos;
+  bool extended; /* [[ */
+  bool failed;   /* syntax or operand error, the status is 2 */
+};
+
+static void test_error(struct test_state *t, const char *arg, const char *what)
+{
+  if (!t->failed)
+    {
+      if (arg)
+        dprintf(t->io->err, "%s: %s: %s\n", t->name, arg, what);
+      else
+        dprintf(t->io->err, "%s: %s\n", t->name, what);
+    }
+  t->failed = true;
+}
+
+static const char *test_peek(const struct test_state *t, size_t off)
+{
+  return t->pos + off < t->n ? t->args[t->pos + off] : NULL;
+}
+
+static bool test_is_binary(const struct test_state *t, const char *s)
+{
+  static const char *const ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt",
+                                    "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+  for (size_t i = 0; i < NELEMS(ops); i++)
+    if (strcmp(s, ops[i]) == 0)
+      return true;
+  return t->extended && strcmp(s, "=~") == 0;
+}
+
+static bool test_is_unary(const char *s)
+{
+  return s[0] == '-' && s[1] && !s[2] && strchr("bcdefghknprstuwxzGLNOS", s[1]);
+}
+
+static long long test_int(struct test_state *t, const char *s)
+{
+  char *end;
+  errno = 0;
+  long long v = strtoll(s, &end, 10);
+  while (is_blank(*end))
+    end++;
+  if (end == s || *end || errno)
+    test_error(t, s, "integer expression expected");
+  return v;
+}
+
+static bool test_stat(struct test_state *t, const char *path, bool follow, struct stat *st)
+{
+  return stat_cache_get(&t->sh->stats, t->sh->cwd_fd, path, follow, st) == 0;
+}
+
+static bool test_access(struct test_state *t, const char *path, int mode)
+{
+  /* a file that is not there needs no access check */
+  struct stat st;
+  return test_stat(t, path, true, &st) && faccessat(t->sh->cwd_fd, path, mode, AT_EACCESS) == 0;
+}
+
+static int timespec_cmp(struct timespec a, struct timespec b)
+{
+  if (a.tv_sec != b.tv_sec)
+    return a.tv_sec < b.tv_sec ? -1 : 1;
+  return a.tv_nsec < b.tv_nsec ? -1 : a.tv_nsec > b.tv_nsec;
+}
+
+static bool test_unary(struct test_state *t, char op, const char *arg)
+{
+  struct stat st;
+  switch (op)
+    {
+    case 'n':
+      return *arg;
+    case 'z':
+      return !*arg;
+    case 't':
+      {
+        long long fd = test_int(t, arg);
+        return !t->failed && fd >= 0 && fd <= INT_MAX && isatty((int)fd);
+      }
+    case 'r':
+      return test_access(t, arg, R_OK);
+    case 'w':
+      return test_access(t, arg, W_OK);
+    case 'x':
+      return test_access(t, arg, X_OK);
+    case 'h':
+    case 'L':
+      return test_stat(t, arg, false, &st) && S_ISLNK(st.st_mode);
+    }
+  if (!test_stat(t, arg, true, &st))
+    return false;
+  switch (op)
+    {
+    case 'e':
+      return true;
+    case 'f':
+      return S_ISREG(st.st_mode);
+    case 'd':
+      return S_ISDIR(st.st_mode);
+    case 'b':
+      return S_ISBLK(st.st_mode);
+    case 'c':
+      return S_ISCHR(st.st_mode);
+    case 'p':
+      return S_ISFIFO(st.st_mode);
+    case 'S':
+      return S_ISSOCK(st.st_mode);
+    case 's':
+      return st.st_size > 0;
+    case 'g':
+      return st.st_mode & S_ISGID;
+    case 'u':
+      return st.st_mode & S_ISUID;
+    case 'k':
+      return st.st_mode & S_ISVTX;
+    case 'O':
+      return st.st_uid == geteuid();
+    case 'G':
+      return st.st_gid == getegid();
+    case 'N':
+      return timespec_cmp(st.st_mtim, st.st_atim) > 0;
+    }
+  return false;
+}
+
+static bool test_regex(struct test_state *t, const char *s, const char *pattern)
+{
+  regex_t re;
+  if (regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB) != 0)
+    {
+      test_error(t, pattern, "invalid regular expression");
+      return false;
+    }
+  bool match = regexec(&re, s, 0, NULL, 0) == 0;
+  regfree(&re);
+  return match;
+}
+
+static bool test_binary(struct test_state *t, const char *a, const char *op, const char *b)
+{
+  if (op[0] != '-')
+    {
+      bool eq = t->extended ? fnmatch(b, a, 0) == 0 : strcmp(a, b) == 0;
+      switch (op[0])
+        {
+        case '<':
+          return strcmp(a, b) < 0;
+        case '>':
+          return strcmp(a, b) > 0;
+        case '!':
+          return !eq;
+        }
+      return op[1] == '~' ? test_regex(t, a, b) : eq;
+    }
+
+  if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0)
+    {
+      /* a file that exists is newer than one that does not */
+      struct stat sa, sb;
+      bool ha = test_stat(t, a, true, &sa), hb = test_stat(t, b, true, &sb);
+      if (op[1] == 'n')
+        return ha && (!hb || timespec_cmp(sa.st_mtim, sb.st_mtim) > 0);
+      if (op[1] == 'o')
+        return hb && (!ha || timespec_cmp(sa.st_mtim, sb.st_mtim) < 0);
+      return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+
+  long long x = test_int(t, a), y = test_int(t, b);
+  if (strcmp(op, "-eq") == 0)
+    return x == y;
+  if (strcmp(op, "-ne") == 0)
+    return x != y;
+  if (strcmp(op, "-lt") == 0)
+    return x < y;
+  if (strcmp(op, "-le") == 0)
+    return x <= y;
+  if (strcmp(op, "-gt") == 0)
+    return x > y;
+  return x >= y;
+}
+
+static bool test_or(struct test_state *t);
+
+static bool test_primary(struct test_state *t)
+{
+  const char *a = test_peek(t, 0), *b = test_peek(t, 1);
+  if (!a)
+    {
+      test_error(t, NULL, "argument expected");
+      return false;
+    }
+  /* a binary operator in second place wins, so [ -f = -f ] compares */
+  if (b && test_peek(t, 2) && test_is_binary(t, b))
+    {
+      t->pos += 3;
+      return test_binary(t, a, b, t->args[t->pos - 1]);
+    }
+  if (strcmp(a, "(") == 0 && b)
+    {
+      t->pos++;
+      bool v = test_or(t);
+      const char *close = test_peek(t, 0);
+      if (!close || strcmp(close, ")") != 0)
+        test_error(t, NULL, "`)' expected");
+      t->pos++;
+      return v;
+    }
+  if (b && test_is_unary(a))
+    {
+      t->pos += 2;
+      return test_unary(t, a[1], b);
+    }
+  t->pos++;
+  return *a;
+}
+
+static bool test_not(struct test_state *t)
+{
+  const char *a = test_peek(t, 0), *b = test_peek(t, 1);
+  if (a && b && strcmp(a, "!") == 0 && !(test_peek(t, 2) && test_is_binary(t, b)))
+    {
+      t->pos++;
+      return !test_not(t);
+    }
+  return test_primary(t);
+}
+
+static bool test_and(struct test_state *t)
+{
+  bool v = test_not(t);
+  const char *op;
+  while ((op = test_peek(t, 0)) && strcmp(op, t->extended ? "&&" : "-a") == 0)
+    {
+      t->pos++;
+      bool rhs = test_not(t);
+      v = v && rhs;
+    }
+  return v;
+}
+
+static bool test_or(struct test_state *t)
+{
+  bool v = test_and(t);
+  const char *op;
+  while ((op = test_peek(t, 0)) && strcmp(op, t->extended ? "||" : "-o") == 0)
+    {
+      t->pos++;
+      bool rhs = test_and(t);
+      v = v || rhs;
+    }
+  return v;
+}
+
+/* close is the argument that has to end the expression, NULL for test */
+static int test_run(struct shell *sh, char **argv, struct builtin_io *io, const char *close)
+{
+  struct test_state t = {sh, io, argv[0], argv + 1, 0, 0, close && close[1], false};
+  while (t.args[t.n])
+    t.n++;
+  if (close)
+    {
+      if (t.n == 0 || strcmp(t.args[t.n - 1], close) != 0)
+        {
+          dprintf(io->err, "%s: missing `%s'\n", t.name, close);
+          return 2;
+        }
+      t.n--;
+    }
+  if (t.n == 0)
+    return 1;
+  bool v = test_or(&t);
+  if (t.pos < t.n)
+    test_error(&t, t.args[t.pos], "unexpected argument");
+  return t.failed ? 2 : !v;
+}
+
+static int builtin_test(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  return test_run(sh, argv, io, NULL);
+}
+
+static int builtin_bracket(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  return test_run(sh, argv, io, "]");
+}
+
+static int builtin_dbracket(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  return test_run(sh, argv, io, "]]");
+}
+
+/* Whether b only reads the file system, so the stat cache stays valid */
+static bool builtin_is_test(const struct builtin *b)
+{
+  return b->fn == builtin_test || b->fn == builtin_bracket || b->fn == builtin_dbracket;
+}
+
+/* ------------------------------------------------------------------ */
+/* Ring buffers                                                        */
+/* ------------------------------------------------------------------ */
+
+int ring_init(struct ring *r, size_t cap)
+{
+  memset(r, 0, sizeof(*r));
+  r->buf = malloc(cap);
+  if (!r->buf)
+    return -1;
+  r->cap = cap;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->readable, NULL);
+  pthread_cond_init(&r->writable, NULL);
+  return 0;
+}
+
+void ring_destroy(struct ring *r)
+{
+  if (!r->buf)
+    return;
+  pthread_cond_destroy(&r->writable);
+  pthread_cond_destroy(&r->readable);
+  pthread_mutex_destroy(&r->lock);
+  free(r->buf);
+  r->buf = NULL;
+}
+
+void *ring_reserve(struct ring *r, size_t *len)
+{
+  pthread_mutex_lock(&r->lock);
+  while (r->tail - r->head == r->cap && !r->read_closed)
+    pthread_cond_wait(&r->writable, &r->lock);
+  bool closed = r->read_closed;
+  size_t space = r->cap - (r->tail - r->head);
+  size_t off = r->tail % r->cap;
+  pthread_mutex_unlock(&r->lock);
+  if (closed)
+    {
+      *len = 0;
+      errno = EPIPE;
+      return NULL;
+    }
+  /* the reader only ever adds space while we write */
+  *len = space < r->cap - off ? space : r->cap - off;
+  return r->buf + off;
+}
+
+void ring_reset(struct ring *r)
+{
+  r->head = r->tail = 0;
+  r->write_closed = r->read_closed = false;
+}
+
+void ring_commit(struct ring *r, size_t len)
+{
+  pthread_mutex_lock(&r->lock);
+  r->tail += len;
+  pthread_cond_signal(&r->readable);
+  pthread_mutex_unlock(&r->lock);
+}
+
+const void *ring_peek(struct ring *r, size_t *len)
+{
+  pthread_mutex_lock(&r->lock);
+  while (r->tail == r->head && !r->write_closed)
+    pthread_cond_wait(&r->readable, &r->lock);
+  size_t avail = r->tail - r->head;
+  size_t off = r->head % r->cap;
+  pthread_mutex_unlock(&r->lock);
+  *len = avail < r->cap - off ? avail : r->cap - off;
+  return r->buf + off;
+}
+
+void ring_consume(struct ring *r, size_t len)
+{
+  pthread_mutex_lock(&r->lock);
+  r->head += len;
+  pthread_cond_signal(&r->writable);
+  pthread_mutex_unlock(&r->lock);
+}
+
+int ring_write(struct ring *r, const void *data, size_t len)
+{
+  const char *p = data;
+  while (len > 0)
+    {
+      size_t n;
+      char *dst = ring_reserve(r, &n);
+      if (!dst)
+        return -1;
+      if (n > len)
+        n = len;
+      memcpy(dst, p, n);
+      ring_commit(r, n);
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+size_t ring_read(struct ring *r, void *buf, size_t len)
+{
+  size_t n;
+  const void *src = ring_peek(r, &n);
+  if (n > len)
+    n = len;
+  memcpy(buf, src, n);
+  ring_consume(r, n);
+  return n;
+}
+
+void ring_close_write(struct ring *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->write_closed = true;
+  pthread_cond_broadcast(&r->readable);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void ring_close_read(struct ring *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->read_closed = true;
+  r->head = r->tail;
+  pthread_cond_broadcast(&r->writable);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Utility builtins                                                    */
+/* ------------------------------------------------------------------ */
+
+/*
+ * cat, echo, head, printf, tail and wc run in the shell instead of a
+ * child while set -o coreutils is on, the default. They take the options
+ * scripts use; on any other they return UTIL_EXTERNAL before reading
+ * anything and the command runs from PATH as usual. cat, head -c and
+ * tail move file data with lab_relay, so it stays in the kernel.
+ *
+ * Run on threads by start_pipeline, a stage may read from or write to a
+ * ring instead of a descriptor. Input and output go through util_next,
+ * util_read, util_relay and util_out, which handle both.
+ */
+
+#define UTIL_EXTERNAL (-1)
+#define UTIL_BUF (64 * 1024)
+#define TAIL_TRIM (1024 * 1024) /* buffered input tail starts dropping lines at */
+
+/* Output collected in the shell and written to fd when full */
+struct util_out
+{
+  struct builtin_io *io;
+  int err; /* errno of the first failed write */
+  size_t len;
+  char buf[16 * 1024];
+};
+
+/* Writes all of data to the output of the builtin */
+static int util_write(struct builtin_io *io, const void *data, size_t len)
+{
+  if (io->out_ring)
+    return ring_write(io->out_ring, data, len);
+  return write_full(io->out, data, len) < 0 ? -1 : 0;
+}
+
+/* Whether err from writing the output only means that the stage after
+ * stopped reading, which ends a threaded stage as quietly as SIGPIPE
+ * ends a child */
+static bool util_cut_off(const struct builtin_io *io, int err)
+{
+  return err == EPIPE && io->out_ring;
+}
+
+static void out_init(struct util_out *o, struct builtin_io *io)
+{
+  o->io = io;
+  o->err = 0;
+  o->len = 0;
+}
+
+static void out_flush(struct util_out *o)
+{
+  if (o->len && !o->err && util_write(o->io, o->buf, o->len) < 0)
+    o->err = errno;
+  o->len = 0;
+}
+
+static void out_put(struct util_out *o, const void *data, size_t len)
+{
+  if (o->len + len > sizeof(o->buf))
+    {
+      out_flush(o);
+      if (len > sizeof(o->buf))
+        {
+          if (!o->err && util_write(o->io, data, len) < 0)
+            o->err = errno;
+          return;
+        }
+    }
+  memcpy(o->buf + o->len, data, len);
+  o->len += len;
+}
+
+static void out_char(struct util_out *o, char c)
+{
+  out_put(o, &c, 1);
+}
+
+__attribute__((format(printf, 2, 3))) static void out_printf(struct util_out *o, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n < sizeof(o->buf) - o->len)
+    {
+      o->len += n > 0 ? (size_t)n : 0;
+      return;
+    }
+  out_flush(o);
+  char *big = (size_t)n < sizeof(o->buf) ? o->buf : malloc((size_t)n + 1);
+  if (!big)
+    {
+      o->err = ENOMEM;
+      return;
+    }
+  va_start(ap, fmt);
+  vsnprintf(big, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  if (big == o->buf)
+    o->len = (size_t)n;
+  else
+    {
+      out_put(o, big, (size_t)n);
+      free(big);
+    }
+}
+
+/* Flushes o, returning the status of a utility that has nothing else to
+ * report */
+static int out_done(struct util_out *o, const char *util, struct builtin_io *io)
+{
+  out_flush(o);
+  if (!o->err)
+    return 0;
+  if (!util_cut_off(io, o->err))
+    dprintf(io->err, "%s: write error: %s\n", util, strerror(o->err));
+  return 1;
+}
+
+/* Opens operand name into *fd, "-" being the builtin's input, which is -1
+ * when it is a ring. Returns false after reporting why it cannot be
+ * read */
+static bool util_open(struct shell *sh, struct builtin_io *io, const char *util, const char *name, int *fd)
+{
+  if (strcmp(name, "-") == 0)
+    {
+      *fd = io->in;
+      return true;
+    }
+  *fd = openat(sh->cwd_fd, name, O_RDONLY | O_CLOEXEC);
+  if (*fd < 0)
+    dprintf(io->err, "%s: %s: %s\n", util, name, strerror(errno));
+  return *fd >= 0;
+}
+
+/* The ring fd stands for, NULL when it is a descriptor */
+static struct ring *util_ring(const struct builtin_io *io, int fd)
+{
+  return fd == io->in ? io->in_ring : NULL;
+}
+
+/*
+ * Reads the next bytes of fd and points *data at them: at buf, or into
+ * the ring without copying. util_done must follow before the next read,
+ * telling how many of the n bytes were used; the rest are left to
+ * whoever reads fd next.
+ */
+static ssize_t util_next(struct builtin_io *io, int fd, char *buf, size_t len, const char **data)
+{
+  struct ring *r = util_ring(io, fd);
+  if (r)
+    {
+      size_t n;
+      *data = ring_peek(r, &n);
+      return (ssize_t)n;
+    }
+  *data = buf;
+  ssize_t n;
+  while ((n = read(fd, buf, len)) < 0 && errno == EINTR)
+    ;
+  return n;
+}
+
+static void util_done(struct builtin_io *io, int fd, size_t used, size_t n)
+{
+  struct ring *r = util_ring(io, fd);
+  if (r)
+    ring_consume(r, used);
+  else if (used < n)
+    /* as head does when the input can seek */
+    lseek(fd, (off_t)used - (off_t)n, SEEK_CUR);
+}
+
+/* Copies up to len bytes of fd to buf */
+static ssize_t util_read(struct builtin_io *io, int fd, void *buf, size_t len)
+{
+  struct ring *r = util_ring(io, fd);
+  if (r)
+    return (ssize_t)ring_read(r, buf, len);
+  ssize_t n;
+  while ((n = read(fd, buf, len)) < 0 && errno == EINTR)
+    ;
+  return n;
+}
+
+/* Copies up to max bytes of fd to the output: lab_relay between two
+ * descriptors, one copy straight from or into a ring otherwise */
+static ssize_t util_relay(struct builtin_io *io, int fd, size_t max)
+{
+  struct ring *in = util_ring(io, fd);
+  if (!in && !io->out_ring)
+    return lab_relay(fd, io->out, max);
+  size_t done = 0;
+  while (done < max)
+    {
+      size_t n;
+      if (in)
+        {
+          const void *src = ring_peek(in, &n);
+          if (n == 0)
+            break;
+          if (n > max - done)
+            n = max - done;
+          if (util_write(io, src, n) < 0)
+            return -1;
+          ring_consume(in, n);
+        }
+      else
+        {
+          char *dst = ring_reserve(io->out_ring, &n);
+          if (!dst)
+            return -1;
+          ssize_t got = read(fd, dst, n < max - done ? n : max - done);
+          if (got < 0 && errno == EINTR)
+            continue;
+          if (got <= 0)
+            {
+              if (got < 0)
+                return -1;
+              break;
+            }
+          ring_commit(io->out_ring, (size_t)got);
+          n = (size_t)got;
+        }
+      done += n;
+    }
+  return (ssize_t)done;
+}
+
+static void util_close(struct builtin_io *io, int fd)
+{
+  if (fd != io->in)
+    close(fd);
+}
+
+static char *util_stdin[] = {"-", NULL};
+
+/*
+ * Decodes the backslash escape after s[-1] into *c, returning how many
+ * characters it took. echo -e and %b write octal as \0nnn, a printf
+ * format as \nnn. \c sets *c to -1; an unknown escape is the backslash
+ * alone, so the character after it is printed as it is.
+ */
+static size_t util_escape(const char *s, bool zero_octal, int *c)
+{
+  static const char simple[] = "\\\\a\ab\be\033f\fn\nr\rt\tv\v\"\"";
+  for (const char *e = simple; *e; e += 2)
+    if (*s == e[0])
+      {
+        *c = (unsigned char)e[1];
+        return 1;
+      }
+  size_t n = 0;
+  if (*s == 'c')
+    {
+      *c = -1;
+      return 1;
+    }
+  if (*s == 'x' && isxdigit((unsigned char)s[1]))
+    {
+      int v = 0;
+      for (n = 1; n < 3 && isxdigit((unsigned char)s[n]); n++)
+        v = v * 16 + (isdigit((unsigned char)s[n]) ? s[n] - '0' : (tolower((unsigned char)s[n]) - 'a' + 10));
+      *c = v;
+      return n;
+    }
+  if (zero_octal ? *s == '0' : (*s >= '0' && *s <= '7'))
+    {
+      size_t first = zero_octal ? 1 : 0;
+      int v = 0;
+      for (n = first; n < first + 3 && s[n] >= '0' && s[n] <= '7'; n++)
+        v = v * 8 + (s[n] - '0');
+      *c = v & 0xff;
+      return n;
+    }
+  *c = '\\';
+  return 0;
+}
+
+/* Writes s with its escapes decoded, returning false when \c ended it */
+static bool util_unescape(struct util_out *o, const char *s, bool zero_octal)
+{
+  while (*s)
+    {
+      const char *bs = strchr(s, '\\');
+      size_t plain = bs ? (size_t)(bs - s) : strlen(s);
+      out_put(o, s, plain);
+      s += plain;
+      if (!*s)
+        break;
+      int c;
+      s += 1 + util_escape(s + 1, zero_octal, &c);
+      if (c < 0)
+        return false;
+      out_char(o, (char)c);
+    }
+  return true;
+}
+
+/* Decodes the escapes of s into dst, which has room for s: none of them
+ * is longer decoded. Returns false when \c ended it */
+static bool util_decode(char *dst, const char *s)
+{
+  bool more = true;
+  while (*s)
+    {
+      if (*s != '\\')
+        {
+          *dst++ = *s++;
+          continue;
+        }
+      int c;
+      s += 1 + util_escape(s + 1, true, &c);
+      if (c < 0)
+        {
+          more = false;
+          break;
+        }
+      *dst++ = (char)c;
+    }
+  *dst = '\0';
+  return more;
+}
+
+/* The operands of cat, NULL for an option it leaves to the command from
+ * PATH */
+static char **cat_options(char **argv)
+{
+  size_t i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+      if (strcmp(argv[i], "--") == 0)
+        return argv + i + 1;
+      if (strcmp(argv[i], "-u") != 0)
+        return NULL;
+    }
+  return argv + i;
+}
+
+/* cat [-u] [file ...] */
+static int builtin_cat(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  char **files = cat_options(argv);
+  if (!files)
+    return UTIL_EXTERNAL;
+  int status = 0;
+  for (files = *files ? files : util_stdin; *files; files++)
+    {
+      int fd;
+      if (!util_open(sh, io, "cat", *files, &fd))
+        {
+          status = 1;
+          continue;
+        }
+      ssize_t n = util_relay(io, fd, (size_t)-1);
+      int err = errno;
+      util_close(io, fd);
+      if (n < 0)
+        {
+          if (!util_cut_off(io, err))
+            dprintf(io->err, "cat: %s: %s\n", *files, strerror(err));
+          status = 1;
+          if (err == EPIPE)
+            break;
+        }
+    }
+  return status;
+}
+
+/* echo [-neE] [string ...], as bash and coreutils take it */
+static int builtin_echo(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  UNUSED(sh);
+  bool newline = true, escapes = false;
+  size_t i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1] && !argv[i][1 + strspn(argv[i] + 1, "neE")]; i++)
+    for (const char *f = argv[i] + 1; *f; f++)
+      {
+        if (*f == 'n')
+          newline = false;
+        else
+          escapes = *f == 'e';
+      }
+  struct util_out o;
+  out_init(&o, io);
+  for (; argv[i]; i++)
+    {
+      if (!escapes)
+        out_put(&o, argv[i], strlen(argv[i]));
+      else if (!util_unescape(&o, argv[i], true))
+        return out_done(&o, "echo", io);
+      if (argv[i + 1])
+        out_char(&o, ' ');
+    }
+  if (newline)
+    out_char(&o, '\n');
+  return out_done(&o, "echo", io);
+}
+
+struct printf_state
+{
+  struct builtin_io *io;
+  char **args;
+  int status;
+};
+
+static const char *printf_arg(struct printf_state *ps)
+{
+  return *ps->args ? *ps->args++ : NULL;
+}
+
+/* Reports a numeric argument strto* did not take whole */
+static void printf_check(struct printf_state *ps, const char *a, const char *end)
+{
+  if (end == a || *end || errno == ERANGE)
+    {
+      dprintf(ps->io->err, "printf: %s: %s\n", a, errno == ERANGE ? strerror(ERANGE) : "invalid number");
+      ps->status = 1;
+    }
+}
+
+/* Numeric argument; 'c or "c is the value of the character c */
+static long long printf_int(struct printf_state *ps, bool is_unsigned)
+{
+  const char *a = printf_arg(ps);
+  if (!a || !*a)
+    return 0;
+  if (a[0] == '\'' || a[0] == '"')
+    return (unsigned char)a[1];
+  char *end;
+  errno = 0;
+  long long v = is_unsigned ? (long long)strtoull(a, &end, 0) : strtoll(a, &end, 0);
+  printf_check(ps, a, end);
+  return v;
+}
+
+static long double printf_float(struct printf_state *ps)
+{
+  const char *a = printf_arg(ps);
+  if (!a || !*a)
+    return 0;
+  if (a[0] == '\'' || a[0] == '"')
+    return (unsigned char)a[1];
+  char *end;
+  errno = 0;
+  long double v = strtold(a, &end);
+  printf_check(ps, a, end);
+  return v;
+}
+
+/* Copies a field width or precision into spec, taking it from the
+ * arguments for * */
+static const char *printf_number(struct printf_state *ps, const char *p, char *spec, size_t *n)
+{
+  if (*p == '*')
+    {
+      *n += (size_t)snprintf(spec + *n, 16, "%d", (int)printf_int(ps, false));
+      return p + 1;
+    }
+  for (size_t digits = 0; *p >= '0' && *p <= '9'; p++)
+    if (digits++ < 9)
+      spec[(*n)++] = *p;
+  return p;
+}
+
+/* One pass over the format. Returns false when output has to stop */
+static bool printf_format(struct util_out *o, const char *p, struct printf_state *ps)
+{
+  while (*p)
+    {
+      if (*p == '\\')
+        {
+          int c;
+          p += 1 + util_escape(p + 1, false, &c);
+          if (c < 0)
+            return false;
+          out_char(o, (char)c);
+          continue;
+        }
+      if (*p != '%')
+        {
+          size_t plain = strcspn(p, "\\%");
+          out_put(o, p, plain);
+          p += plain;
+          continue;
+        }
+      if (p[1] == '%')
+        {
+          out_char(o, '%');
+          p += 2;
+          continue;
+        }
+
+      /* %[flags][width][.precision][length]conversion */
+      char spec[64];
+      size_t n = 0;
+      spec[n++] = '%';
+      for (p++; *p && strchr("-+ #0'", *p); p++)
+        if (n < 8)
+          spec[n++] = *p;
+      p = printf_number(ps, p, spec, &n);
+      if (*p == '.')
+        {
+          spec[n++] = '.';
+          p = printf_number(ps, p + 1, spec, &n);
+        }
+      while (*p && strchr("hlLqjzt", *p))
+        p++;
+      char conv = *p;
+      if (!conv)
+        {
+          dprintf(ps->io->err, "printf: %%: missing conversion\n");
+          ps->status = 1;
+          return false;
+        }
+      p++;
+      switch (conv)
+        {
+        case 'd':
+        case 'i':
+          memcpy(spec + n, "lld", 4);
+          out_printf(o, spec, printf_int(ps, false));
+          break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+          snprintf(spec + n, sizeof(spec) - n, "ll%c", conv);
+          out_printf(o, spec, (unsigned long long)printf_int(ps, true));
+          break;
+        case 'a':
+        case 'A':
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+          snprintf(spec + n, sizeof(spec) - n, "L%c", conv);
+          out_printf(o, spec, printf_float(ps));
+          break;
+        case 'c':
+          {
+            const char *a = printf_arg(ps);
+            memcpy(spec + n, "c", 2);
+            if (a && *a)
+              out_printf(o, spec, *a);
+            break;
+          }
+        case 's':
+          {
+            const char *a = printf_arg(ps);
+            memcpy(spec + n, "s", 2);
+            out_printf(o, spec, a ? a : "");
+            break;
+          }
+        case 'b':
+          {
+            const char *a = printf_arg(ps);
+            if (!a)
+              break;
+            if (n == 1)
+              {
+                if (!util_unescape(o, a, true))
+                  return false;
+                break;
+              }
+            /* decode into a copy, then pad it like %s */
+            char *copy = malloc(strlen(a) + 1);
+            if (!copy)
+              {
+                o->err = ENOMEM;
+                return false;
+              }
+            bool more = util_decode(copy, a);
+            memcpy(spec + n, "s", 2);
+            out_printf(o, spec, copy);
+            free(copy);
+            if (!more)
+              return false;
+            break;
+          }
+        default:
+          dprintf(ps->io->err, "printf: %%%c: invalid conversion\n", conv);
+          ps->status = 1;
+          return false;
+        }
+    }
+  return true;
+}
+
+/* printf format [argument ...]; the format is reused while arguments are
+ * left and it takes some */
+static int builtin_printf(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  UNUSED(sh);
+  size_t i = 1;
+  if (argv[i] && strcmp(argv[i], "--") == 0)
+    i++;
+  if (!argv[i])
+    {
+      dprintf(io->err, "printf: usage: printf format [argument ...]\n");
+      return 2;
+    }
+  struct printf_state ps = {io, argv + i + 1, 0};
+  struct util_out o;
+  out_init(&o, io);
+  for (;;)
+    {
+      char **before = ps.args;
+      if (!printf_format(&o, argv[i], &ps) || !*ps.args || ps.args == before)
+        break;
+    }
+  return out_done(&o, "printf", io) || ps.status;
+}
+
+/* How much head or tail prints: the last n lines or bytes, or with
+ * from_start everything from line or byte n on */
+struct util_count
+{
+  bool bytes;
+  bool from_start;
+  uint64_t n;
+};
+
+/* A count of head, or with plus of tail, which also takes -N and +N */
+static bool util_parse_count(const char *s, bool plus, struct util_count *c)
+{
+  c->from_start = plus && *s == '+';
+  if (plus && (*s == '+' || *s == '-'))
+    s++;
+  if (*s < '0' || *s > '9')
+    return false;
+  char *end;
+  errno = 0;
+  c->n = strtoull(s, &end, 10);
+  return !*end && errno == 0;
+}
+
+/*
+ * Takes -n N, -nN, -c N and the old -N of head and tail, plus +N for
+ * tail, and returns the first operand. NULL for any other option, which
+ * the command from PATH gets to handle.
+ */
+static char **util_count_options(char **argv, bool plus, struct util_count *c)
+{
+  size_t i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+      const char *a = argv[i];
+      if (strcmp(a, "--") == 0)
+        return argv + i + 1;
+      if (a[1] == 'n' || a[1] == 'c')
+        {
+          c->bytes = a[1] == 'c';
+          const char *v = a[2] ? a + 2 : argv[i + 1];
+          if (!a[2])
+            i++;
+          if (!v || !util_parse_count(v, plus, c))
+            return NULL;
+        }
+      else if (!util_parse_count(a + 1, false, c))
+        return NULL;
+      else
+        c->bytes = false;
+    }
+  return argv + i;
+}
+
+/* The ==> name <== line before each file when there are several */
+static void util_header(struct util_out *o, char **files, char **file)
+{
+  if (files[1])
+    out_printf(o, "%s==> %s <==\n", file == files ? "" : "\n",
+               strcmp(*file, "-") == 0 ? "standard input" : *file);
+}
+
+static int head_fd(int fd, struct builtin_io *io, const struct util_count *c, struct util_out *o)
+{
+  out_flush(o);
+  if (c->bytes)
+    return util_relay(io, fd, c->n) < 0 ? -1 : 0;
+  char buf[UTIL_BUF];
+  uint64_t left = c->n;
+  while (left > 0)
+    {
+      const char *data;
+      ssize_t n = util_next(io, fd, buf, sizeof(buf), &data);
+      if (n <= 0)
+        return n < 0 ? -1 : 0;
+      size_t used = 0;
+      while (left > 0 && used < (size_t)n)
+        {
+          const char *nl = memchr(data + used, '\n', (size_t)n - used);
+          used = nl ? (size_t)(nl - data) + 1 : (size_t)n;
+          left -= nl != NULL;
+        }
+      out_put(o, data, used);
+      /* leave what was not printed to whoever reads next */
+      util_done(io, fd, used, (size_t)n);
+    }
+  return 0;
+}
+
+/* head [-n lines | -c bytes | -lines] [file ...] */
+static int builtin_head(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  struct util_count c = {false, false, 10};
+  char **files = util_count_options(argv, false, &c);
+  if (!files)
+    return UTIL_EXTERNAL;
+  if (!*files)
+    files = util_stdin;
+  struct util_out o;
+  out_init(&o, io);
+  int status = 0;
+  for (char **f = files; *f && !o.err; f++)
+    {
+      int fd;
+      if (!util_open(sh, io, "head", *f, &fd))
+        {
+          status = 1;
+          continue;
+        }
+      util_header(&o, files, f);
+      if (head_fd(fd, io, &c, &o) < 0)
+        {
+          if (!util_cut_off(io, errno))
+            dprintf(io->err, "head: %s: %s\n", *f, strerror(errno));
+          status = 1;
+        }
+      util_close(io, fd);
+    }
+  return out_done(&o, "head", io) || status;
+}
+
+/* Offset in p where its last n lines start, the final newline ending the
+ * last line rather than starting an empty one */
+static size_t tail_lines_start(const char *p, size_t len, uint64_t n)
+{
+  if (n == 0)
+    return len;
+  size_t end = len > 0 && p[len - 1] == '\n' ? len - 1 : len;
+  const char *nl;
+  while ((nl = memrchr(p, '\n', end)))
+    {
+      if (--n == 0)
+        return (size_t)(nl - p) + 1;
+      end = (size_t)(nl - p);
+    }
+  return 0;
+}
+
+static size_t tail_start(const char *p, size_t len, const struct util_count *c)
+{
+  if (c->bytes)
+    return len > c->n ? len - c->n : 0;
+  return tail_lines_start(p, len, c->n);
+}
+
+/* Regular files: find where the output starts by walking back from the
+ * end of a mapping, then relay from there */
+static int tail_file(int fd, struct builtin_io *io, const struct util_count *c, const struct stat *st, off_t pos)
+{
+  off_t start = pos;
+  size_t len = st->st_size > pos ? (size_t)(st->st_size - pos) : 0;
+  if (c->bytes)
+    start = len > c->n ? st->st_size - (off_t)c->n : pos;
+  else if (len > 0)
+    {
+      off_t base = pos & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+      size_t map_len = (size_t)(st->st_size - base);
+      char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, base);
+      if (map == MAP_FAILED)
+        return -1;
+      madvise(map, map_len, MADV_RANDOM);
+      start = pos + (off_t)tail_lines_start(map + (pos - base), len, c->n);
+      munmap(map, map_len);
+    }
+  if (lseek(fd, start, SEEK_SET) < 0)
+    return -1;
+  return util_relay(io, fd, (size_t)-1) < 0 ? -1 : 0;
+}
+
+static int tail_fd(int fd, struct builtin_io *io, const struct util_count *c, struct util_out *o)
+{
+  struct stat st;
+  off_t pos;
+  out_flush(o);
+  if (!c->from_start && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (pos = lseek(fd, 0, SEEK_CUR)) >= 0)
+    return tail_file(fd, io, c, &st, pos);
+
+  if (c->from_start)
+    {
+      /* skip to line or byte n, then relay the rest */
+      char buf[UTIL_BUF];
+      uint64_t skip = c->n > 0 ? c->n - 1 : 0;
+      while (skip > 0)
+        {
+          const char *data;
+          ssize_t n = util_next(io, fd, buf, sizeof(buf), &data);
+          if (n <= 0)
+            return n < 0 ? -1 : 0;
+          size_t used = 0;
+          if (c->bytes)
+            {
+              used = skip < (uint64_t)n ? (size_t)skip : (size_t)n;
+              skip -= used;
+            }
+          else
+            while (skip > 0 && used < (size_t)n)
+              {
+                const char *nl = memchr(data + used, '\n', (size_t)n - used);
+                used = nl ? (size_t)(nl - data) + 1 : (size_t)n;
+                skip -= nl != NULL;
+              }
+          out_put(o, data + used, (size_t)n - used);
+          util_done(io, fd, (size_t)n, (size_t)n);
+        }
+      out_flush(o);
+      return util_relay(io, fd, (size_t)-1) < 0 ? -1 : 0;
+    }
+
+  /* Pipes and terminals: buffer the input, dropping what is already
+   * older than the last n lines whenever the buffer doubles */
+  char *data = NULL;
+  size_t len = 0, cap = 0, trim_at = TAIL_TRIM;
+  for (;;)
+    {
+      if (cap - len < UTIL_BUF)
+        {
+          size_t ncap = cap ? cap * 2 : 2 * UTIL_BUF;
+          char *nd = realloc(data, ncap);
+          if (!nd)
+            {
+              free(data);
+              return -1;
+            }
+          data = nd;
+          cap = ncap;
+        }
+      ssize_t n = util_read(io, fd, data + len, cap - len);
+      if (n < 0)
+        {
+          free(data);
+          return -1;
+        }
+      if (n == 0)
+        break;
+      len += (size_t)n;
+      if (len >= trim_at)
+        {
+          size_t start = tail_start(data, len, c);
+          memmove(data, data + start, len - start);
+          len -= start;
+          trim_at = len * 2 > TAIL_TRIM ? len * 2 : TAIL_TRIM;
+        }
+    }
+  size_t start = tail_start(data, len, c);
+  out_put(o, data + start, len - start);
+  free(data);
+  return 0;
+}
+
+/* tail [-n [+]lines | -c [+]bytes | -lines] [file ...] */
+static int builtin_tail(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  struct util_count c = {false, false, 10};
+  char **files = util_count_options(argv, true, &c);
+  if (!files)
+    return UTIL_EXTERNAL;
+  if (!*files)
+    files = util_stdin;
+  struct util_out o;
+  out_init(&o, io);
+  int status = 0;
+  for (char **f = files; *f && !o.err; f++)
+    {
+      int fd;
+      if (!util_open(sh, io, "tail", *f, &fd))
+        {
+          status = 1;
+          continue;
+        }
+      util_header(&o, files, f);
+      if (tail_fd(fd, io, &c, &o) < 0)
+        {
+          if (!util_cut_off(io, errno))
+            dprintf(io->err, "tail: %s: %s\n", *f, strerror(errno));
+          status = 1;
+        }
+      util_close(io, fd);
+    }
+  return out_done(&o, "tail", io) || status;
+}
+
+enum
+{
+  WC_LINES,
+  WC_WORDS,
+  WC_CHARS,
+  WC_BYTES,
+  WC_NCOUNTS
+};
+
+/*
+ * Newlines in p, compared 16 bytes at a time: the width SSE2 and NEON
+ * give every x86-64 and arm64 build, where wider vectors would be split
+ * up again. Every lane counts up to 255 matches before the lanes are
+ * summed.
+ */
+static size_t wc_newlines(const char *p, size_t n)
+{
+  typedef signed char vec __attribute__((vector_size(16)));
+  size_t count = 0;
+  while (n >= sizeof(vec))
+    {
+      vec acc = {0};
+      size_t blocks = n / sizeof(vec) < 255 ? n / sizeof(vec) : 255;
+      for (size_t b = 0; b < blocks; b++, p += sizeof(vec))
+        {
+          vec v;
+          memcpy(&v, p, sizeof(v));
+          acc -= v == '\n';
+        }
+      for (size_t k = 0; k < sizeof(vec); k++)
+        count += (unsigned char)acc[k];
+      n -= blocks * sizeof(vec);
+    }
+  for (; n > 0; n--)
+    count += *p++ == '\n';
+  return count;
+}
+
+static int wc_fd(struct builtin_io *io, int fd, const bool *show, uint64_t *counts)
+{
+  struct stat st;
+  off_t pos;
+  memset(counts, 0, WC_NCOUNTS * sizeof(*counts));
+  if (!show[WC_LINES] && !show[WC_WORDS] && !show[WC_CHARS] && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > 0)
+    {
+      /* bytes of a regular file without reading it */
+      counts[WC_BYTES] = st.st_size > pos ? (uint64_t)(st.st_size - pos) : 0;
+      return 0;
+    }
+
+  bool utf8 = MB_CUR_MAX > 1;
+  bool in_word = false;
+  char buf[UTIL_BUF];
+  for (;;)
+    {
+      const char *data;
+      ssize_t n = util_next(io, fd, buf, sizeof(buf), &data);
+      if (n <= 0)
+        return n < 0 ? -1 : 0;
+      counts[WC_BYTES] += (uint64_t)n;
+      if (show[WC_LINES])
+        counts[WC_LINES] += wc_newlines(data, (size_t)n);
+      if (show[WC_WORDS] || show[WC_CHARS])
+        for (ssize_t i = 0; i < n; i++)
+          {
+            unsigned char b = (unsigned char)data[i];
+            bool space = b == ' ' || (b >= '\t' && b <= '\r');
+            counts[WC_WORDS] += !space && !in_word;
+            in_word = !space;
+            counts[WC_CHARS] += !utf8 || (b & 0xc0) != 0x80;
+          }
+      util_done(io, fd, (size_t)n, (size_t)n);
+    }
+}
+
+static void wc_print(struct util_out *o, const bool *show, const uint64_t *counts, int width, const char *name)
+{
+  const char *sep = "";
+  for (int k = 0; k < WC_NCOUNTS; k++)
+    if (show[k])
+      {
+        out_printf(o, "%s%*" PRIu64, sep, width, counts[k]);
+        sep = " ";
+      }
+  if (name)
+    out_printf(o, " %s", name);
+  out_char(o, '\n');
+}
+
+/* Sets the counts wc shows and returns its operands, NULL for an option
+ * it leaves to the command from PATH */
+static char **wc_options(char **argv, bool *show)
+{
+  size_t i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+      if (strcmp(argv[i], "--") == 0)
+        return argv + i + 1;
+      for (const char *f = argv[i] + 1; *f; f++)
+        {
+          const char *k = strchr("lwmc", *f);
+          if (!k)
+            return NULL;
+          show[k - "lwmc"] = true;
+        }
+    }
+  return argv + i;
+}
+
+/* wc [-clmw] [file ...] */
+static int builtin_wc(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  bool show[WC_NCOUNTS] = {false};
+  char **files = wc_options(argv, show);
+  if (!files)
+    return UTIL_EXTERNAL;
+  if (!show[WC_LINES] && !show[WC_WORDS] && !show[WC_CHARS] && !show[WC_BYTES])
+    show[WC_LINES] = show[WC_WORDS] = show[WC_BYTES] = true;
+  if (!*files)
+    files = util_stdin;
+
+  /* Columns are as wide as the total size of the files, 7 when one of
+   * them is not a regular file; a single count of one input is not
+   * padded */
+  int width = 1;
+  if (files[1] || show[WC_LINES] + show[WC_WORDS] + show[WC_CHARS] + show[WC_BYTES] > 1)
+    {
+      uint64_t total = 0;
+      for (char **f = files; *f; f++)
+        {
+          struct stat st;
+          bool in = strcmp(*f, "-") == 0;
+          if (in && io->in_ring)
+            {
+              width = 7;
+              continue;
+            }
+          int rc = in ? fstat(io->in, &st) : fstatat(sh->cwd_fd, *f, &st, 0);
+          if (rc == 0 && S_ISREG(st.st_mode) && !(in && io->in_stage))
+            total += (uint64_t)st.st_size;
+          else if (rc == 0)
+            width = 7;
+        }
+      int digits = 1;
+      for (; total >= 10; total /= 10)
+        digits++;
+      if (digits > width)
+        width = digits;
+    }
+
+  struct util_out o;
+  out_init(&o, io);
+  uint64_t totals[WC_NCOUNTS] = {0};
+  int status = 0;
+  for (char **f = files; *f; f++)
+    {
+      int fd;
+      if (!util_open(sh, io, "wc", *f, &fd))
+        {
+          status = 1;
+          continue;
+        }
+      uint64_t counts[WC_NCOUNTS];
+      if (wc_fd(io, fd, show, counts) < 0)
+        {
+          dprintf(io->err, "wc: %s: %s\n", *f, strerror(errno));
+          status = 1;
+        }
+      util_close(io, fd);
+      wc_print(&o, show, counts, width, files == util_stdin ? NULL : *f);
+      for (int k = 0; k < WC_NCOUNTS; k++)
+        totals[k] += counts[k];
+    }
+  if (files[1])
+    wc_print(&o, show, totals, width, "total");
+  return out_done(&o, "wc", io) || status;
+}
+
+/*
+ * builtin name [argument ...] runs the builtin even where set +o
+ * coreutils would run the command from PATH. builtin --external name
+ * [argument ...] does the opposite; start_pipeline handles it.
+ */
+static int builtin_builtin(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  if (!argv[1] || strcmp(argv[1], "--external") == 0)
+    {
+      dprintf(io->err, "builtin: usage: builtin [--external] name [argument ...]\n");
+      return 2;
+    }
+  const struct builtin *b = builtin_lookup(argv[1]);
+  if (!b)
+    {
+      dprintf(io->err, "builtin: %s: not a shell builtin\n", argv[1]);
+      return 1;
+    }
+  int status = b->fn(sh, argv + 1, io);
+  if (status == UTIL_EXTERNAL)
+    {
+      dprintf(io->err, "builtin: %s: option not supported in the shell\n", argv[1]);
+      return 2;
+    }
+  return status;
+}
+
+static bool builtin_is_utility(const struct builtin *b)
+{
+  return b->fn == builtin_cat || b->fn == builtin_echo || b->fn == builtin_head || b->fn == builtin_printf ||
+         b->fn == builtin_tail || b->fn == builtin_wc;
+}
+
+/* Whether the utility builtin b runs argv itself rather than returning
+ * UTIL_EXTERNAL */
+static bool utility_supports(const struct builtin *b, char **argv)
+{
+  struct util_count c;
+  bool show[WC_NCOUNTS];
+  if (b->fn == builtin_cat)
+    return cat_options(argv) != NULL;
+  if (b->fn == builtin_head || b->fn == builtin_tail)
+    return util_count_options(argv, b->fn == builtin_tail, &c) != NULL;
+  if (b->fn == builtin_wc)
+    return wc_options(argv, show) != NULL;
+  return true;
+}
+
+/* ------------------------------------------------------------------ */
+/* Shell                                                               */
+/* ------------------------------------------------------------------ */
+
+const char *sh_getenv(const struct shell *sh, const char *name)
+{
+  return env_get(&sh->env, name);
+}
+
+int sh_setenv(struct shell *sh, const char *name, const char *value)
+{
+  return value ? env_set(&sh->env, name, value, true) : env_unset(&sh->env, name);
+}
+
+/* Absolute path of the directory fd refers to, name is what it was opened
+ * as relative to base in case /proc is not mounted */
+static char *dir_fd_path(int fd, const char *base, const char *name)
+{
+  char link[64], buf[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, buf, sizeof(buf) - 1);
+  if (n > 0 && buf[0] == '/')
+    {
+      buf[n] = '\0';
+      return strdup(buf);
+    }
+  char *path;
+  if (name[0] == '/' || !base)
+    return strdup(name);
+  return asprintf(&path, "%s/%s", strcmp(base, "/") ? base : "", name) < 0 ? NULL : path;
+}
+
+int sh_chdir(struct shell *sh, const char *dir)
+{
+  /* an O_PATH descriptor does not need search permission, children do */
+  if (faccessat(sh->cwd_fd, dir, X_OK, 0) < 0)
+    return -1;
+  int fd = openat(sh->cwd_fd, dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  char *path = dir_fd_path(fd, sh->cwd, dir);
+  if (!path)
+    {
+      close(fd);
+      return -1;
+    }
+  close(sh->cwd_fd);
+  free(sh->cwd);
+  sh->cwd_fd = fd;
+  sh->cwd = path;
+  sh_setenv(sh, "PWD", path);
+  return 0;
+}
+
+/* Everything but the environment, working directory and terminal */
+static void sh_init_common(struct shell *sh)
+{
+  memset(sh, 0, sizeof(*sh));
+  sh->shell_terminal = STDIN_FILENO;
+  sh->pipe_size = SH_PIPE_SIZE;
+  sh->epoll_fd = -1;
+  sh->signal_fd = -1;
+  sh->input_fd = STDIN_FILENO;
+  sh->use_coreutils = true;
+  sh->use_threads = true;
+  cmd_line_init(&sh->line);
+  path_cache_init(&sh->paths);
+  hist_init(&sh->history);
+  completer_init(&sh->completer);
+  stat_cache_init(&sh->stats);
+  zygote_init(&sh->zygote);
+  if (job_table_init(&sh->jobs) < 0)
+    {
+      perror("Couldn't create the job table");
+      exit(1);
+    }
+}
+
+void sh_init_subshell(struct shell *sh, const struct shell *parent)
+{
+  sh_init_common(sh);
+  sh->pipe_size = parent->pipe_size;
+  sh->stats.enabled = parent->stats.enabled;
+  sh->use_zygote = parent->use_zygote;
+  sh->use_coreutils = parent->use_coreutils;
+  sh->optimize = parent->optimize;
+  sh->use_threads = parent->use_threads;
+  sh->last_status = parent->last_status;
+  env_clone(&sh->env, &parent->env);
+  sh->cwd_fd = fcntl(parent->cwd_fd, F_DUPFD_CLOEXEC, 0);
+  if (sh->cwd_fd < 0 || !(sh->cwd = strdup(parent->cwd)))
+    {
+      perror("Couldn't open the working directory");
+      exit(1);
+    }
+}
+
+void sh_init(struct shell *sh)
+{
+  sh_init_common(sh);
+  sh->shell_is_interactive = isatty(sh->shell_terminal);
+  if (env_init(&sh->env, environ) < 0)
+    {
+      perror("Couldn't copy the environment");
+      exit(1);
+    }
+  sh->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (sh->cwd_fd < 0 || !(sh->cwd = dir_fd_path(sh->cwd_fd, NULL, ".")))
+    {
+      perror("Couldn't open the working directory");
+      exit(1);
+    }
+
+  if (sh->shell_is_interactive)
+    {
+      /* Loop until we are in the foreground */
+      while (tcgetpgrp(sh->shell_terminal) != (sh->shell_pgid = getpgrp()))
+        kill(-sh->shell_pgid, SIGTTIN);
+
+      signal(SIGINT, SIG_IGN);
+      signal(SIGQUIT, SIG_IGN);
+      signal(SIGTSTP, SIG_IGN);
+      signal(SIGTTIN, SIG_IGN);
+      signal(SIGTTOU, SIG_IGN);
+
+      sh->shell_pgid = getpid();
+      if (setpgid(sh->shell_pgid, sh->shell_pgid) < 0 && errno != EPERM)
+        {
+          perror("Couldn't put the shell in its own process group");
+          exit(1);
+        }
+      tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+      tcgetattr(sh->shell_terminal, &sh->shell_tmodes);
+    }
+}
+
+static void workers_stop(struct shell *sh);
+
+void sh_destroy(struct shell *sh)
+{
+  /* do not leave stopped jobs behind with nobody to continue them */
+  for (size_t i = 0; i < sh->jobs.cap; i++)
+    {
+      struct job *j = sh->jobs.slots[i];
+      if (j && j->stopped && j->pgid > 0)
+        {
+          kill(-j->pgid, SIGHUP);
+          kill(-j->pgid, SIGCONT);
+        }
+    }
+  job_table_destroy(&sh->jobs);
+  cmd_line_destroy(&sh->line);
+  path_cache_destroy(&sh->paths);
+  hist_close(&sh->history);
+  completer_destroy(&sh->completer);
+  workers_stop(sh);
+  zygote_stop(&sh->zygote);
+  env_destroy(&sh->env);
+  close(sh->cwd_fd);
+  sh->cwd_fd = -1;
+  free(sh->cwd);
+  sh->cwd = NULL;
+  free(sh->prompt);
+  sh->prompt = NULL;
+}
+
+static int status_code(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+/* Applies the redirections of a command that runs inside the shell to io,
+ * returning -1 after reporting the first one that fails */
+static int builtin_redirect(struct shell *sh, const struct command *cmd, struct builtin_io *io, int opened[3])
+{
+  for (size_t i = 0; i < cmd->nredir; i++)
+    {
+      const struct redir *r = &cmd->redirs[i];
+      int *slot = r->fd == 0 ? &io->in : r->fd == 1 ? &io->out : r->fd == 2 ? &io->err : NULL;
+      if (!slot)
+        continue;
+      int fd;
+      if (r->kind == REDIR_DUP)
+        {
+          fd = r->dup_fd == 0 ? io->in : r->dup_fd == 1 ? io->out : r->dup_fd == 2 ? io->err : r->dup_fd;
+        }
+      else
+        {
+          fd = openat(sh->cwd_fd, r->target, redir_open_flags(r->kind) | O_CLOEXEC, 0666);
+          if (fd < 0)
+            {
+              dprintf(io->err, "%s: %s\n", r->target, strerror(errno));
+              return -1;
+            }
+          if (opened[r->fd] >= 0)
+            close(opened[r->fd]);
+          opened[r->fd] = fd;
+        }
+      *slot = fd;
+      if (slot == &io->in)
+        {
+          io->in_stage = false;
+          io->in_ring = NULL;
+        }
+      if (slot == &io->out)
+        io->out_ring = NULL;
+    }
+  return 0;
+}
+
+static int run_builtin(struct shell *sh, const struct builtin *b, const struct command *cmd, struct builtin_io *io)
+{
+  int opened[3] = {-1, -1, -1};
+  int status = 1;
+  if (builtin_redirect(sh, cmd, io, opened) == 0)
+    status = b->fn(sh, cmd->argv, io);
+  for (int i = 0; i < 3; i++)
+    if (opened[i] >= 0)
+      close(opened[i]);
+  return status;
+}
+
+/* Starts l through the zygote when the option is on, falling back to
+ * lab_spawn for what the zygote cannot carry */
+static pid_t sh_spawn(struct shell *sh, const struct launch *l)
+{
+  if (!sh->use_zygote || (sh->zygote.pid < 0 && zygote_start(&sh->zygote) < 0))
+    return lab_spawn(l);
+  pid_t pid = zygote_spawn(&sh->zygote, l);
+  if (pid < 0 && (errno == ENOTSUP || errno == EPIPE))
+    return lab_spawn(l);
+  return pid;
+}
+
+static void grow_pipe(struct shell *sh, int fd)
+{
+  /* Best effort: unprivileged users are capped by fs.pipe-max-size */
+  if (sh->pipe_size > 0)
+    fcntl(fd, F_SETPIPE_SZ, sh->pipe_size);
+}
+
+/* ------------------------------------------------------------------ */
+/* Jobs                                                                */
+/* ------------------------------------------------------------------ */
+
+/* epoll tags for the event sources of the interactive loop */
+#define EV_INPUT ((uint64_t)-1)
+#define EV_SIGNAL ((uint64_t)-2)
+#define EV_PATHS ((uint64_t)-3)
+#define EV_JOBS ((uint64_t)-4)
+
+#define JOB_TABLE_INITIAL_CAP 16
+#define PID_INDEX_INITIAL_CAP 64
+
+int job_table_init(struct job_table *jt)
+{
+  memset(jt, 0, sizeof(*jt));
+  jt->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  return jt->epoll_fd < 0 ? -1 : 0;
+}
+
+static void job_free(struct job *j)
+{
+  for (size_t i = 0; i < j->nprocs; i++)
+    if (j->procs[i].pidfd >= 0)
+      close(j->procs[i].pidfd);
+  free(j->text);
+  free(j->procs);
+  free(j);
+}
+
+void job_table_destroy(struct job_table *jt)
+{
+  for (size_t i = 0; i < jt->cap; i++)
+    if (jt->slots[i])
+      job_free(jt->slots[i]);
+  while (jt->done)
+    {
+      struct job *j = jt->done;
+      jt->done = j->next;
+      job_free(j);
+    }
+  free(jt->slots);
+  free(jt->free_ids);
+  free(jt->pids);
+  if (jt->epoll_fd >= 0)
+    close(jt->epoll_fd);
+  memset(jt, 0, sizeof(*jt));
+  jt->epoll_fd = -1;
+}
+
+struct job *job_table_get(struct job_table *jt, int id)
+{
+  if (id < 1 || (size_t)id > jt->cap)
+    return NULL;
+  return jt->slots[id - 1];
+}
+
+static struct pid_slot *pid_index_find(struct job_table *jt, pid_t pid)
+{
+  if (!jt->pid_cap)
+    return NULL;
+  size_t mask = jt->pid_cap - 1;
+  for (size_t i = hash_str_n((const char *)&pid, sizeof(pid)) & mask;; i = (i + 1) & mask)
+    {
+      if (jt->pids[i].pid == pid)
+        return &jt->pids[i];
+      if (jt->pids[i].pid == 0)
+        return NULL;
+    }
+}
+
+struct job *job_table_find_pid(struct job_table *jt, pid_t pid, struct proc **proc)
+{
+  struct pid_slot *s = pid_index_find(jt, pid);
+  if (!s)
+    return NULL;
+  struct job *j = job_table_get(jt, (int)s->job_id);
+  if (j && proc)
+    *proc = &j->procs[s->proc];
+  return j;
+}
+
+static void pid_index_put(struct pid_slot *pids, size_t cap, struct pid_slot s)
+{
+  size_t mask = cap - 1;
+  size_t i = hash_str_n((const char *)&s.pid, sizeof(s.pid)) & mask;
+  while (pids[i].pid)
+    i = (i + 1) & mask;
+  pids[i] = s;
+}
+
+static int pid_index_add(struct job_table *jt, pid_t pid, uint32_t job_id, uint32_t proc)
+{
+  if ((jt->pid_count + 1) * 4 > jt->pid_cap * 3)
+    {
+      size_t cap = jt->pid_cap ? jt->pid_cap * 2 : PID_INDEX_INITIAL_CAP;
+      struct pid_slot *pids = calloc(cap, sizeof(*pids));
+      if (!pids)
+        return -1;
+      for (size_t i = 0; i < jt->pid_cap; i++)
+        if (jt->pids[i].pid)
+          pid_index_put(pids, cap, jt->pids[i]);
+      free(jt->pids);
+      jt->pids = pids;
+      jt->pid_cap = cap;
+    }
+  pid_index_put(jt->pids, jt->pid_cap, (struct pid_slot){pid, job_id, proc});
+  jt->pid_count++;
+  return 0;
+}
+
+static void pid_index_remove(struct job_table *jt, pid_t pid)
+{
+  struct pid_slot *s = pid_index_find(jt, pid);
+  if (!s)
+    return;
+  s->pid = 0;
+  jt->pid_count--;
+
+  /* backward shift deletion, see path_cache_remove */
+  size_t mask = jt->pid_cap - 1;
+  size_t hole = (size_t)(s - jt->pids);
+  for (size_t i = (hole + 1) & mask; jt->pids[i].pid; i = (i + 1) & mask)
+    {
+      size_t home = hash_str_n((const char *)&jt->pids[i].pid, sizeof(pid_t)) & mask;
+      bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+      if (stays)
+        continue;
+      jt->pids[hole] = jt->pids[i];
+      jt->pids[i].pid = 0;
+      hole = i;
+    }
+}
+
+/* Takes a free id from the table for j */
+static int job_table_add(struct job_table *jt, struct job *j)
+{
+  if (jt->nfree == 0)
+    {
+      size_t cap = jt->cap ? jt->cap * 2 : JOB_TABLE_INITIAL_CAP;
+      struct job **slots = realloc(jt->slots, cap * sizeof(*slots));
+      if (!slots)
+        return -1;
+      jt->slots = slots;
+      uint32_t *ids = realloc(jt->free_ids, cap * sizeof(*ids));
+      if (!ids)
+        return -1;
+      jt->free_ids = ids;
+      /* push the new ids so the lowest is handed out first */
+      for (size_t id = cap; id > jt->cap; id--)
+        {
+          slots[id - 1] = NULL;
+          ids[jt->nfree++] = (uint32_t)id;
+        }
+      jt->cap = cap;
+    }
+  j->id = (int)jt->free_ids[--jt->nfree];
+  jt->slots[j->id - 1] = j;
+  jt->count++;
+  return 0;
+}
+
+static void job_table_remove(struct job_table *jt, struct job *j)
+{
+  for (size_t i = 0; i < j->nprocs; i++)
+    if (!j->procs[i].done)
+      pid_index_remove(jt, j->procs[i].pid);
+  if (j->background && j->nalive)
+    jt->nbackground--;
+  jt->slots[j->id - 1] = NULL;
+  jt->free_ids[jt->nfree++] = (uint32_t)j->id;
+  jt->count--;
+  if (jt->current == j->id)
+    jt->current = 0;
+}
+
+static void job_set_background(struct job_table *jt, struct job *j, bool background)
+{
+  if (j->background == background)
+    return;
+  j->background = background;
+  if (j->nalive)
+    jt->nbackground += background ? 1 : (size_t)-1;
+  if (background)
+    jt->current = j->id;
+}
+
+/* Joins the words of p into the text jobs shows */
+static char *pipeline_text(const struct pipeline *p)
+{
+  size_t len = 1;
+  for (size_t i = 0; i < p->ncmds; i++)
+    for (size_t k = 0; k < p->cmds[i].argc; k++)
+      len += strlen(p->cmds[i].argv[k]) + 3;
+  char *text = malloc(len);
+  if (!text)
+    return NULL;
+  char *t = text;
+  for (size_t i = 0; i < p->ncmds; i++)
+    {
+      if (i)
+        t = stpcpy(t, "| ");
+      for (size_t k = 0; k < p->cmds[i].argc; k++)
+        {
+          t = stpcpy(t, p->cmds[i].argv[k]);
+          *t++ = ' ';
+        }
+    }
+  if (t > text)
+    t--;
+  *t = '\0';
+  return text;
+}
+
+static struct job *job_new(struct shell *sh, const struct pipeline *p)
+{
+  struct job *j = calloc(1, sizeof(*j));
+  if (!j)
+    return NULL;
+  j->procs = calloc(p->ncmds ? p->ncmds : 1, sizeof(struct proc));
+  j->text = pipeline_text(p);
+  if (!j->procs || !j->text || job_table_add(&sh->jobs, j) < 0)
+    {
+      free(j->text);
+      free(j->procs);
+      free(j);
+      return NULL;
+    }
+  return j;
+}
+
+/* Removes j from the table and frees it */
+static void job_release(struct shell *sh, struct job *j)
+{
+  job_table_remove(&sh->jobs, j);
+  job_free(j);
+}
+
+static void job_add_proc(struct shell *sh, struct job *j, pid_t pid)
+{
+  struct proc *p = &j->procs[j->nprocs];
+  p->pid = pid;
+  p->pidfd = pidfd_open(pid, 0);
+  if (p->pidfd >= 0)
+    {
+      fcntl(p->pidfd, F_SETFD, FD_CLOEXEC);
+      struct epoll_event ev = {.events = EPOLLIN, .data.u64 = (uint64_t)pid};
+      epoll_ctl(sh->jobs.epoll_fd, EPOLL_CTL_ADD, p->pidfd, &ev);
+    }
+  p->cut = false;
+  pid_index_add(&sh->jobs, pid, (uint32_t)j->id, (uint32_t)j->nprocs);
+  j->nprocs++;
+  j->nalive++;
+}
+
+/* A cut stage exited: end the first nprocs processes of j, which fed it */
+static void job_cut(struct job *j, size_t nprocs)
+{
+  for (size_t i = 0; i < nprocs; i++)
+    if (!j->procs[i].done)
+      kill(j->procs[i].pid, SIGPIPE);
+}
+
+/* Records the wait status ws for p */
+static void proc_update(struct shell *sh, struct job *j, struct proc *p, int ws)
+{
+  if (WIFSTOPPED(ws))
+    {
+      p->stopped = true;
+      j->stopped = true;
+      return;
+    }
+  if (WIFCONTINUED(ws))
+    {
+      p->stopped = false;
+      return;
+    }
+  p->done = true;
+  p->stopped = false;
+  p->status = status_code(ws);
+  /* closing the pidfd also drops it from the epoll set */
+  if (p->pidfd >= 0)
+    close(p->pidfd);
+  p->pidfd = -1;
+  pid_index_remove(&sh->jobs, p->pid);
+  if (--j->nalive == 0 && j->background)
+    sh->jobs.nbackground--;
+  if (j->last_is_proc && p == &j->procs[j->nprocs - 1])
+    j->status = p->status;
+  if (p->cut)
+    job_cut(j, (size_t)(p - j->procs));
+}
+
+/* Reaps p if it changed state, without blocking */
+static void proc_poll(struct shell *sh, struct job *j, struct proc *p)
+{
+  int ws;
+  if (!p->done && waitpid(p->pid, &ws, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+    proc_update(sh, j, p, ws);
+}
+
+static void job_update_stopped(struct job *j)
+{
+  bool any_stopped = false;
+  for (size_t i = 0; i < j->nprocs; i++)
+    any_stopped |= !j->procs[i].done && j->procs[i].stopped;
+  j->stopped = j->nalive > 0 && any_stopped;
+}
+
+/* Reports and forgets background jobs that have finished */
+static void sh_notify_jobs(struct shell *sh)
+{
+  while (sh->jobs.done)
+    {
+      struct job *j = sh->jobs.done;
+      sh->jobs.done = j->next;
+      if (sh->shell_is_interactive)
+        printf("[%d]   Done                    %s\n", j->id, j->text);
+      job_free(j);
+    }
+}
+
+/* A background job has no live processes left: take it out of the table
+ * and queue it for the next notification */
+static void job_finished_background(struct shell *sh, struct job *j)
+{
+  job_table_remove(&sh->jobs, j);
+  j->next = sh->jobs.done;
+  sh->jobs.done = j;
+}
+
+/*
+ * Job control builtins. A job is named by %n or n, with no argument the
+ * current job (the one most recently started in or moved to the
+ * background) is used.
+ */
+static struct job *job_from_spec(struct shell *sh, const char *spec, struct builtin_io *io, const char *who)
+{
+  struct job_table *jt = &sh->jobs;
+  struct job *j = NULL;
+  if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+    {
+      j = job_table_get(jt, jt->current);
+      /* fall back to the highest numbered background job */
+      for (size_t i = jt->cap; !j && i > 0; i--)
+        if (jt->slots[i - 1] && jt->slots[i - 1]->background)
+          j = jt->slots[i - 1];
+      if (!j)
+        dprintf(io->err, "%s: no current job\n", who);
+      return j;
+    }
+  char *end;
+  long id = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+  if (*end == '\0' && id > 0 && id <= INT_MAX)
+    j = job_table_get(jt, (int)id);
+  if (!j || !j->background)
+    {
+      dprintf(io->err, "%s: %s: no such job\n", who, spec);
+      return NULL;
+    }
+  return j;
+}
+
+static void job_continue(struct shell *sh, struct job *j)
+{
+  for (size_t i = 0; i < j->nprocs; i++)
+    j->procs[i].stopped = false;
+  j->stopped = false;
+  if (sh->shell_is_interactive && j->pgid > 0)
+    kill(-j->pgid, SIGCONT);
+  else
+    for (size_t i = 0; i < j->nprocs; i++)
+      if (!j->procs[i].done)
+        kill(j->procs[i].pid, SIGCONT);
+}
+
+static int builtin_jobs(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  UNUSED(argv);
+  struct job_table *jt = &sh->jobs;
+  for (size_t i = 0; i < jt->cap; i++)
+    {
+      struct job *j = jt->slots[i];
+      if (!j || !j->background)
+        continue;
+      dprintf(io->out, "[%d]%c  %-22s %s\n", j->id, j->id == jt->current ? '+' : ' ',
+              j->stopped ? "Stopped" : "Running", j->text);
+    }
+  return 0;
+}
+
+static int builtin_fg(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  struct job *j = job_from_spec(sh, argv[1], io, "fg");
+  if (!j)
+    return 1;
+  dprintf(io->out, "%s\n", j->text);
+  job_set_background(&sh->jobs, j, false);
+  job_continue(sh, j);
+  /* sh_continue waits for it once this pipeline is done */
+  sh->resume = j;
+  return 0;
+}
+
+static int builtin_bg(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  struct job *j = job_from_spec(sh, argv[1], io, "bg");
+  if (!j)
+    return 1;
+  job_continue(sh, j);
+  dprintf(io->out, "[%d] %s &\n", j->id, j->text);
+  return 0;
+}
+
+static bool any_running_background(struct job_table *jt)
+{
+  for (size_t i = 0; i < jt->cap; i++)
+    if (jt->slots[i] && jt->slots[i]->background && !jt->slots[i]->stopped)
+      return true;
+  return false;
+}
+
+/*
+ * wait            wait for every running background job
+ * wait %n|pid...  wait for those jobs or processes, status of the last
+ */
+static int builtin_wait(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  struct job_table *jt = &sh->jobs;
+  if (!argv[1])
+    {
+      while (jt->nbackground > 0)
+        {
+          /* stopped jobs never become ready, check for them only when
+           * nothing has happened for a while */
+          if (sh_reap_ready(sh, 100) == 0 && !any_running_background(jt))
+            break;
+        }
+      return 0;
+    }
+
+  int status = 0;
+  for (int i = 1; argv[i]; i++)
+    {
+      if (argv[i][0] == '%')
+        {
+          struct job *j = job_from_spec(sh, argv[i], io, "wait");
+          if (!j)
+            {
+              status = 127;
+              continue;
+            }
+          /* a finished job stays allocated on the notification queue */
+          while (j->nalive > 0 && !j->stopped)
+            sh_reap_ready(sh, -1);
+          status = j->status;
+          continue;
+        }
+      struct proc *p;
+      pid_t pid = (pid_t)atoi(argv[i]);
+      struct job *j = pid > 0 ? job_table_find_pid(jt, pid, &p) : NULL;
+      if (!j)
+        {
+          dprintf(io->err, "wait: pid %s is not a child of this shell\n", argv[i]);
+          status = 127;
+          continue;
+        }
+      while (!p->done && !j->stopped)
+        sh_reap_ready(sh, -1);
+      status = p->status;
+    }
+  return status;
+}
+
+/* ------------------------------------------------------------------ */
+/* Parallel builtin                                                    */
+/* ------------------------------------------------------------------ */
+
+/*
+ * parallel [-j N] [-a file] command [arg...]
+ *
+ * Runs command once per input line (stdin or file), replacing {} in the
+ * arguments with the line or appending it when there is no {}. N launcher
+ * threads each run one child at a time, which caps the outstanding
+ * children at N. Lines are dealt out to per-thread deques up front; a
+ * thread works from the back of its own deque and steals from the front of
+ * the others once it runs dry, so one slow line does not hold up the rest.
+ * Each child writes stdout and stderr into its own memfd, which is copied
+ * to our output in one piece when the child finishes so jobs never
+ * interleave.
+ */
+
+struct par_deque
+{
+  pthread_mutex_t lock;
+  size_t *items; /* indexes into the line table */
+  size_t head;   /* thieves take from here */
+  size_t tail;   /* the owner takes from here */
+};
+
+struct par_pool
+{
+  char **tmpl;     /* command template */
+  size_t tmpl_argc;
+  const char *path; /* resolved command */
+  char *const *envp;
+  int dir_fd;
+  char **lines;
+  size_t nlines;
+  struct par_deque *deques;
+  size_t nworkers;
+  int out;
+  pthread_mutex_t out_lock;
+  size_t failures;  /* protected by out_lock */
+  size_t steals;    /* protected by out_lock */
+};
+
+struct par_worker
+{
+  struct par_pool *pool;
+  size_t self;
+};
+
+static bool par_pop(struct par_deque *d, size_t *item, bool steal)
+{
+  bool ok = false;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail)
+    {
+      *item = steal ? d->items[d->head++] : d->items[--d->tail];
+      ok = true;
+    }
+  pthread_mutex_unlock(&d->lock);
+  return ok;
+}
+
+static bool par_next(struct par_pool *pool, size_t self, size_t *item, bool *stolen)
+{
+  *stolen = false;
+  if (par_pop(&pool->deques[self], item, false))
+    return true;
+  for (size_t k = 1; k < pool->nworkers; k++)
+    if (par_pop(&pool->deques[(self + k) % pool->nworkers], item, true))
+      {
+        *stolen = true;
+        return true;
+      }
+  return false;
+}
+
+/* Builds argv for one line, the strings point into the template or line
+ * except for arguments where {} had to be substituted */
+static char **par_argv(struct par_pool *pool, char *line, char ***owned, size_t *nowned)
+{
+  bool has_braces = false;
+  for (size_t i = 0; i < pool->tmpl_argc; i++)
+    has_braces |= strstr(pool->tmpl[i], "{}") != NULL;
+  char **argv = calloc(pool->tmpl_argc + 2, sizeof(char *));
+  *owned = calloc(pool->tmpl_argc + 1, sizeof(char *));
+  *nowned = 0;
+  if (!argv || !*owned)
+    {
+      free(argv);
+      free(*owned);
+      return NULL;
+    }
+  size_t llen = strlen(line);
+  size_t n = 0;
+  for (size_t i = 0; i < pool->tmpl_argc; i++)
+    {
+      const char *t = pool->tmpl[i];
+      if (!strstr(t, "{}"))
+        {
+          argv[n++] = pool->tmpl[i];
+          continue;
+        }
+      size_t count = 0;
+      for (const char *q = t; (q = strstr(q, "{}")); q += 2)
+        count++;
+      char *arg = malloc(strlen(t) + count * llen + 1);
+      if (!arg)
+        continue;
+      char *o = arg;
+      for (const char *q = t; *q;)
+        {
+          if (q[0] == '{' && q[1] == '}')
+            {
+              o = stpcpy(o, line);
+              q += 2;
+            }
+          else
+            *o++ = *q++;
+        }
+      *o = '\0';
+      (*owned)[(*nowned)++] = arg;
+      argv[n++] = arg;
+    }
+  if (!has_braces)
+    argv[n++] = line;
+  argv[n] = NULL;
+  return argv;
+}
+
+static int par_run_one(struct par_pool *pool, char *line)
+{
+  char **owned;
+  size_t nowned;
+  char **argv = par_argv(pool, line, &owned, &nowned);
+  if (!argv)
+    return 1;
+
+  int status = 1;
+  int out = memfd_create("parallel-job", MFD_CLOEXEC);
+  if (out >= 0)
+    {
+      struct redir err_to_out = {REDIR_DUP, STDERR_FILENO, NULL, STDOUT_FILENO};
+      struct launch l;
+      launch_init(&l, argv);
+      l.path = pool->path;
+      l.envp = pool->envp;
+      l.dir_fd = pool->dir_fd;
+      l.fd_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      l.fd_out = out;
+      l.redirs = &err_to_out;
+      l.nredir = 1;
+      pid_t pid = lab_spawn(&l);
+      if (l.fd_in >= 0)
+        close(l.fd_in);
+      if (pid < 0)
+        dprintf(out, "parallel: %s: %s\n", argv[0], strerror(errno));
+      else
+        {
+          int ws;
+          while (waitpid(pid, &ws, 0) < 0 && errno == EINTR)
+            ;
+          status = status_code(ws);
+        }
+
+      lseek(out, 0, SEEK_SET);
+      pthread_mutex_lock(&pool->out_lock);
+      lab_relay(out, pool->out, (size_t)-1);
+      if (status != 0)
+        pool->failures++;
+      pthread_mutex_unlock(&pool->out_lock);
+      close(out);
+    }
+  for (size_t i = 0; i < nowned; i++)
+    free(owned[i]);
+  free(owned);
+  free(argv);
+  return status;
+}
+
+static void *par_worker_main(void *arg)
+{
+  struct par_worker *w = arg;
+  struct par_pool *pool = w->pool;
+  size_t item;
+  bool stolen;
+  while (par_next(pool, w->self, &item, &stolen))
+    {
+      if (stolen)
+        {
+          pthread_mutex_lock(&pool->out_lock);
+          pool->steals++;
+          pthread_mutex_unlock(&pool->out_lock);
+        }
+      par_run_one(pool, pool->lines[item]);
+    }
+  return NULL;
+}
+
+/* Reads all of fd into a NUL terminated buffer and splits it into lines */
+static char *par_read_lines(int fd, char ***lines, size_t *nlines)
+{
+  size_t cap = 64 * 1024, len = 0;
+  char *buf = malloc(cap);
+  if (!buf)
+    return NULL;
+  for (;;)
+    {
+      if (len + 1 == cap)
+        {
+          char *grown = realloc(buf, cap * 2);
+          if (!grown)
+            {
+              free(buf);
+              return NULL;
+            }
+          buf = grown;
+          cap *= 2;
+        }
+      ssize_t n = read(fd, buf + len, cap - len - 1);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      len += (size_t)n;
+    }
+  buf[len] = '\0';
+
+  size_t count = 0;
+  for (size_t i = 0; i < len; i++)
+    count += buf[i] == '\n';
+  *lines = malloc((count + 1) * sizeof(char *));
+  if (!*lines)
+    {
+      free(buf);
+      return NULL;
+    }
+  *nlines = 0;
+  for (char *p = buf; p < buf + len;)
+    {
+      char *nl = memchr(p, '\n', (size_t)(buf + len - p));
+      if (nl)
+        *nl = '\0';
+      if (*p)
+        (*lines)[(*nlines)++] = p;
+      p = nl ? nl + 1 : buf + len;
+    }
+  return buf;
+}
+
+static int builtin_parallel(struct shell *sh, char **argv, struct builtin_io *io)
+{
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *arg_file = NULL;
+  int i = 1;
+  for (; argv[i] && argv[i][0] == '-'; i++)
+    {
+      if (strcmp(argv[i], "--") == 0)
+        {
+          i++;
+          break;
+        }
+      if (strcmp(argv[i], "-j") == 0 && argv[i + 1])
+        jobs = atol(argv[++i]);
+      else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2])
+        jobs = atol(argv[i] + 2);
+      else if (strcmp(argv[i], "-a") == 0 && argv[i + 1])
+        arg_file = argv[++i];
+      else
+        break;
+    }
+  if (!argv[i] || jobs < 1)
+    {
+      dprintf(io->err, "parallel: usage: parallel [-j N] [-a file] command [arg...]\n");
+      return 2;
+    }
+
+  struct par_pool pool = {0};
+  pool.tmpl = &argv[i];
+  for (; argv[i]; i++)
+    pool.tmpl_argc++;
+  pool.out = io->out;
+  pool.envp = env_envp(&sh->env);
+  pool.dir_fd = sh->cwd_fd;
+  if (strchr(pool.tmpl[0], '/'))
+    pool.path = pool.tmpl[0];
+  else if (!(pool.path = path_cache_lookup_env(&sh->paths, sh_getenv(sh, "PATH"), pool.tmpl[0])))
+    {
+      dprintf(io->err, "parallel: %s: command not found\n", pool.tmpl[0]);
+      return 127;
+    }
+
+  int in = io->in;
+  if (arg_file && (in = openat(sh->cwd_fd, arg_file, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      dprintf(io->err, "parallel: %s: %s\n", arg_file, strerror(errno));
+      return 1;
+    }
+  char *text = par_read_lines(in, &pool.lines, &pool.nlines);
+  if (arg_file)
+    close(in);
+  if (!text)
+    return 1;
+
+  pool.nworkers = (size_t)jobs < pool.nlines ? (size_t)jobs : pool.nlines;
+  if (pool.nworkers == 0)
+    {
+      free(pool.lines);
+      free(text);
+      return 0;
+    }
+  pool.deques = calloc(pool.nworkers, sizeof(*pool.deques));
+  struct par_worker *workers = calloc(pool.nworkers, sizeof(*workers));
+  pthread_t *threads = calloc(pool.nworkers, sizeof(*threads));
+  size_t *items = malloc(pool.nlines * sizeof(size_t));
+  int status = 1;
+  if (!pool.deques || !workers || !threads || !items)
+    goto out;
+
+  /* contiguous runs of lines per worker, popped from the back so the
+   * owner and a thief start at opposite ends */
+  pthread_mutex_init(&pool.out_lock, NULL);
+  for (size_t w = 0, start = 0; w < pool.nworkers; w++)
+    {
+      size_t share = pool.nlines / pool.nworkers + (w < pool.nlines % pool.nworkers);
+      struct par_deque *d = &pool.deques[w];
+      pthread_mutex_init(&d->lock, NULL);
+      d->items = items + start;
+      for (size_t k = 0; k < share; k++)
+        d->items[share - 1 - k] = start + k;
+      d->head = 0;
+      d->tail = share;
+      start += share;
+    }
+
+  size_t started = 0;
+  for (; started < pool.nworkers; started++)
+    {
+      workers[started].pool = &pool;
+      workers[started].self = started;
+      if (pthread_create(&threads[started], NULL, par_worker_main, &workers[started]) != 0)
+        break;
+    }
+  /* if fewer threads started the others steal their lines */
+  if (started == 0)
+    par_worker_main(&(struct par_worker){&pool, 0});
+  for (size_t w = 0; w < started; w++)
+    pthread_join(threads[w], NULL);
+  for (size_t w = 0; w < pool.nworkers; w++)
+    pthread_mutex_destroy(&pool.deques[w].lock);
+  pthread_mutex_destroy(&pool.out_lock);
+
+  /* like GNU parallel: the number of failed jobs, capped */
+  status = pool.failures > 100 ? 101 : (int)pool.failures;
+
+out:
+  free(items);
+  free(threads);
+  free(workers);
+  free(pool.deques);
+  free(pool.lines);
+  free(text);
+  return status;
+}
+
+/* ------------------------------------------------------------------ */
+/* Builtin dispatch                                                    */
+/* ------------------------------------------------------------------ */
+
+#define BUILTIN(id, name, fn) [BUILTIN_SLOT_##id] = {name, fn},
+const struct builtin builtin_table[] = {
+#include "builtins.def"
+};
+#undef BUILTIN
+
+const size_t builtin_table_size = NELEMS(builtin_table);
+
+const struct builtin *builtin_lookup(const char *name)
+{
+  const struct builtin *b = &builtin_table[phash_slot(builtin_phash_g, BUILTIN_PHASH_N, name)];
+  return strcmp(b->name, name) == 0 ? b : NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Pipeline optimizer                                                  */
+/* ------------------------------------------------------------------ */
+
+/*
+ * With set -o optimize every pipeline of a line is rewritten just before
+ * it starts:
+ *
+ *   cat file | cmd ...   becomes cmd < file ..., when file is a readable
+ *                        regular file so the open cannot fail differently
+ *   ... | cat | ...      loses the cat, between two other stages only: a
+ *                        last cat decides the status and hides a terminal
+ *                        from the stage before, a first one a terminal or
+ *                        file from the stage after
+ *   ... | head ...       is marked cut: once head exits, the stages before
+ *                        it get SIGPIPE instead of running on until their
+ *                        next write finds the pipe closed
+ *
+ * None of this changes what the pipeline writes or its status. A cut
+ * stage does end its producers sooner, so side effects they would have
+ * had before their next write, such as tee writing a file, are lost.
+ */
+
+/* The command a stage runs and its arguments, past builtin --external */
+static char **plan_argv(const struct command *cmd, size_t *argc)
+{
+  *argc = cmd->argc;
+  if (cmd->argc > 2 && strcmp(cmd->argv[0], "builtin") == 0 && strcmp(cmd->argv[1], "--external") == 0)
+    {
+      *argc -= 2;
+      return cmd->argv + 2;
+    }
+  return cmd->argv;
+}
+
+static bool plan_is(const struct command *cmd, const char *name)
+{
+  size_t argc;
+  char **argv = plan_argv(cmd, &argc);
+  return argc && strcmp(argv[0], name) == 0;
+}
+
+/* cat copying its input unchanged */
+static bool plan_is_passthrough(const struct command *cmd)
+{
+  size_t argc;
+  char **argv = plan_argv(cmd, &argc);
+  if (cmd->nredir || !plan_is(cmd, "cat"))
+    return false;
+  for (size_t i = 1; i < argc; i++)
+    if (strcmp(argv[i], "-") != 0 && strcmp(argv[i], "-u") != 0 && strcmp(argv[i], "--") != 0)
+      return false;
+  return true;
+}
+
+/* The file of cat file when the stage is that and nothing more */
+static const char *plan_cat_file(struct shell *sh, const struct command *cmd)
+{
+  size_t argc;
+  char **argv = plan_argv(cmd, &argc);
+  if (cmd->nredir || argc != 2 || !plan_is(cmd, "cat") || argv[1][0] == '-')
+    return NULL;
+  struct stat st;
+  if (fstatat(sh->cwd_fd, argv[1], &st, 0) < 0 || !S_ISREG(st.st_mode) ||
+      faccessat(sh->cwd_fd, argv[1], R_OK, AT_EACCESS) < 0)
+    return NULL;
+  return argv[1];
+}
+
+static bool plan_redirects_input(const struct command *cmd)
+{
+  for (size_t i = 0; i < cmd->nredir; i++)
+    if (cmd->redirs[i].fd == 0)
+      return true;
+  return false;
+}
+
+/* Writes word so the shell reads it back as one word */
+static void plan_word(int fd, const char *w)
+{
+  if (*w && !w[strspn(w, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_./=:,@%+-")])
+    {
+      dprintf(fd, "%s", w);
+      return;
+    }
+  dprintf(fd, "'");
+  for (const char *q; (q = strchr(w, '\'')); w = q + 1)
+    dprintf(fd, "%.*s'\\''", (int)(q - w), w);
+  dprintf(fd, "%s'", w);
+}
+
+static void plan_print(int fd, const struct pipeline *p)
+{
+  for (size_t i = 0; i < p->ncmds; i++)
+    {
+      const struct command *cmd = &p->cmds[i];
+      if (i)
+        dprintf(fd, " | ");
+      for (size_t k = 0; k < cmd->argc; k++)
+        {
+          if (k)
+            dprintf(fd, " ");
+          plan_word(fd, cmd->argv[k]);
+        }
+      for (size_t k = 0; k < cmd->nredir; k++)
+        {
+          const struct redir *r = &cmd->redirs[k];
+          bool out = r->kind != REDIR_IN;
+          if (cmd->argc || k)
+            dprintf(fd, " ");
+          if (r->fd != (out ? 1 : 0))
+            dprintf(fd, "%d", r->fd);
+          if (r->kind == REDIR_DUP)
+            {
+              if (r->dup_fd < 0)
+                dprintf(fd, ">&-");
+              else
+                dprintf(fd, ">&%d", r->dup_fd);
+              continue;
+            }
+          dprintf(fd, "%s ", r->kind == REDIR_IN ? "<" : r->kind == REDIR_OUT ? ">" : ">>");
+          plan_word(fd, r->target);
+        }
+    }
+  if (p->op == LIST_BG)
+    dprintf(fd, " &");
+}
+
+/*
+ * Rewrites p in place, allocating from a. Every rewrite is described on
+ * note_fd unless it is -1.
+ */
+static void plan_optimize(struct shell *sh, struct pipeline *p, struct arena *a, int note_fd)
+{
+  for (size_t i = 1; i + 1 < p->ncmds;)
+    {
+      if (!plan_is_passthrough(&p->cmds[i]))
+        {
+          i++;
+          continue;
+        }
+      if (note_fd >= 0)
+        dprintf(note_fd, "  cat between two stages copies its input unchanged: dropped\n");
+      memmove(&p->cmds[i], &p->cmds[i + 1], (p->ncmds - i - 1) * sizeof(*p->cmds));
+      p->ncmds--;
+    }
+
+  const char *file;
+  struct command *next = &p->cmds[1];
+  struct redir *r;
+  if (p->ncmds > 1 && !plan_redirects_input(next) && (file = plan_cat_file(sh, &p->cmds[0])) &&
+      (r = arena_alloc(a, (next->nredir + 1) * sizeof(*r))))
+    {
+      if (note_fd >= 0)
+        {
+          dprintf(note_fd, "  cat ");
+          plan_word(note_fd, file);
+          dprintf(note_fd, " at the start: the next stage reads the file itself\n");
+        }
+      r[0] = (struct redir){REDIR_IN, 0, file, -1};
+      if (next->nredir)
+        memcpy(r + 1, next->redirs, next->nredir * sizeof(*r));
+      next->redirs = r;
+      next->nredir++;
+      p->cmds++;
+      p->ncmds--;
+    }
+
+  for (size_t i = 1; i < p->ncmds; i++)
+    if (plan_is(&p->cmds[i], "head"))
+      {
+        if (note_fd >= 0)
+          dprintf(note_fd, "  head: the stages before it get SIGPIPE when it exits\n");
+        p->cmds[i].cut = true;
+      }
+}
+
+int sh_explain(struct shell *sh, const char *line, size_t len, int fd)
+{
+  struct cmd_line cl;
+  struct cmd_list list;
+  cmd_line_init(&cl);
+  int ret = 0;
+  if (cmd_tokenize(&cl, line, len) < 0 || cmd_build(&cl, &list) < 0)
+    {
+      dprintf(fd, "%s\n", cl.error);
+      ret = -1;
+      list.npipes = 0;
+    }
+  for (size_t i = 0; i < list.npipes; i++)
+    {
+      struct pipeline *p = &list.pipes[i];
+      plan_print(fd, p);
+      dprintf(fd, "\n");
+      plan_optimize(sh, p, &cl.arena, fd);
+      dprintf(fd, "  => ");
+      plan_print(fd, p);
+      dprintf(fd, "\n");
+    }
+  cmd_line_destroy(&cl);
+  return ret;
+}
+
+/* ------------------------------------------------------------------ */
+/* Running lines                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Whether the utility builtin for cmd can run in the shell. Background
+ * jobs keep a child, and so does a stage of an interactive shell reading
+ * the terminal, so ^C and ^Z still reach it.
+ */
+static bool utility_in_shell(const struct shell *sh, const struct command *cmd, int in_fd, bool background)
+{
+  if (!sh->use_coreutils || background)
+    return false;
+  if (!sh->shell_is_interactive || in_fd >= 0)
+    return true;
+  for (size_t i = 0; i < cmd->nredir; i++)
+    if (cmd->redirs[i].fd == 0)
+      return true;
+  return false;
+}
+
+/*
+ * With set -o threads, the default, consecutive stages that are all
+ * utility builtins run at the same time on threads, each connected to the
+ * next by a ring instead of one after the other through memfds. The last
+ * stage of the run stays on the shell's thread, the others go to workers
+ * the shell keeps from one run to the next together with the rings they
+ * write: a new thread and ring would cost more than the stages of a short
+ * run, mostly in faulting in the stack and buffer. Once a stage
+ * returns, its input ring is closed for reading and its output ring for
+ * writing, so the stage before gets EPIPE, which it takes as quietly as
+ * SIGPIPE, and the stage after reads end of file.
+ */
+
+struct stage_thread
+{
+  struct shell *sh;
+  const struct builtin *b;
+  const struct command *cmd;
+  struct builtin_io io;
+  struct ring *in;  /* kept apart from io, which redirections change */
+  struct ring *out;
+  struct stage_worker *worker; /* NULL for the last stage, which runs on the shell's thread */
+  int status;
+};
+
+struct stage_worker
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;      /* the task was handed over or finished */
+  struct stage_thread *task; /* NULL when idle */
+  bool quit;
+  struct ring out;           /* what its stage writes */
+};
+
+static void stage_main(struct stage_thread *t)
+{
+  t->status = run_builtin(t->sh, t->b, t->cmd, &t->io);
+  if (t->in)
+    ring_close_read(t->in);
+  if (t->out)
+    ring_close_write(t->out);
+}
+
+static void *worker_main(void *arg)
+{
+  struct stage_worker *w = arg;
+  pthread_mutex_lock(&w->lock);
+  for (;;)
+    {
+      while (!w->task && !w->quit)
+        pthread_cond_wait(&w->cond, &w->lock);
+      if (!w->task)
+        break;
+      pthread_mutex_unlock(&w->lock);
+      stage_main(w->task);
+      pthread_mutex_lock(&w->lock);
+      w->task = NULL;
+      pthread_cond_signal(&w->cond);
+    }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* The k-th worker of sh, started the first time a run needs it. Returns
+ * NULL with errno set if it cannot be */
+static struct stage_worker *worker_get(struct shell *sh, size_t k)
+{
+  if (k < sh->nworkers)
+    return sh->workers[k];
+  struct stage_worker **ws = realloc(sh->workers, (k + 1) * sizeof(*ws));
+  if (!ws)
+    return NULL;
+  sh->workers = ws;
+  struct stage_worker *w = calloc(1, sizeof(*w));
+  if (!w)
+    return NULL;
+  if (ring_init(&w->out, RING_SIZE) < 0)
+    {
+      free(w);
+      return NULL;
+    }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  int err = pthread_create(&w->thread, NULL, worker_main, w);
+  if (err)
+    {
+      pthread_cond_destroy(&w->cond);
+      pthread_mutex_destroy(&w->lock);
+      ring_destroy(&w->out);
+      free(w);
+      errno = err;
+      return NULL;
+    }
+  sh->workers[sh->nworkers++] = w;
+  return w;
+}
+
+static void worker_run(struct stage_worker *w, struct stage_thread *t)
+{
+  pthread_mutex_lock(&w->lock);
+  w->task = t;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void worker_wait(struct stage_worker *w)
+{
+  pthread_mutex_lock(&w->lock);
+  while (w->task)
+    pthread_cond_wait(&w->cond, &w->lock);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void workers_stop(struct shell *sh)
+{
+  for (size_t k = 0; k < sh->nworkers; k++)
+    {
+      struct stage_worker *w = sh->workers[k];
+      pthread_mutex_lock(&w->lock);
+      w->quit = true;
+      pthread_cond_signal(&w->cond);
+      pthread_mutex_unlock(&w->lock);
+      pthread_join(w->thread, NULL);
+      pthread_cond_destroy(&w->cond);
+      pthread_mutex_destroy(&w->lock);
+      ring_destroy(&w->out);
+      free(w);
+    }
+  free(sh->workers);
+  sh->workers = NULL;
+  sh->nworkers = 0;
+}
+
+/*
+ * How many stages from cmds on run_threads can take: utility builtins
+ * that run in the shell with the options they are given and do not
+ * duplicate descriptors, which a ring is not. A run of echo or printf,
+ * or of a memfd small enough for one ring, is not worth its threads and
+ * gets 0.
+ */
+static size_t utility_run(const struct shell *sh, const struct command *cmds, size_t n, int in_fd, bool in_stage,
+                          bool background)
+{
+  if (!sh->use_threads || n < 2)
+    return 0;
+  struct stat st;
+  if (in_stage && fstat(in_fd, &st) == 0 && st.st_size <= RING_SIZE)
+    return 0;
+  size_t k = 0;
+  for (; k < n; k++)
+    {
+      const struct command *cmd = &cmds[k];
+      const struct builtin *b = cmd->argc ? builtin_lookup(cmd->argv[0]) : NULL;
+      if (!b || !builtin_is_utility(b) || !utility_supports(b, cmd->argv) ||
+          !utility_in_shell(sh, cmd, k ? 0 : in_fd, background))
+        break;
+      if (k == 0 && (b->fn == builtin_echo || b->fn == builtin_printf))
+        return 0;
+      size_t r = 0;
+      while (r < cmd->nredir && cmd->redirs[r].kind != REDIR_DUP)
+        r++;
+      if (r < cmd->nredir)
+        break;
+    }
+  return k;
+}
+
+/* Runs the count stages of cmds at the same time, the first reading
+ * io->in and the last writing io->out. Returns the status of the last */
+static int run_threads(struct shell *sh, const struct command *cmds, size_t count, const struct builtin_io *io)
+{
+  struct stage_thread *t = calloc(count, sizeof(*t));
+  if (!t)
+    {
+      dprintf(io->err, "%s: %s\n", cmds[0].argv[0], strerror(errno));
+      return 1;
+    }
+  for (size_t k = 0; k + 1 < count; k++)
+    if (!(t[k].worker = worker_get(sh, k)))
+      {
+        dprintf(io->err, "%s: %s\n", cmds[k].argv[0], strerror(errno));
+        free(t);
+        return 1;
+      }
+
+  for (size_t k = 0; k < count; k++)
+    {
+      struct stage_thread *s = &t[k];
+      s->sh = sh;
+      s->b = builtin_lookup(cmds[k].argv[0]);
+      s->cmd = &cmds[k];
+      s->io = *io;
+      s->in = k > 0 ? &t[k - 1].worker->out : NULL;
+      s->out = k + 1 < count ? &s->worker->out : NULL;
+      if (s->out)
+        ring_reset(s->out);
+      s->io.in_ring = s->in;
+      s->io.out_ring = s->out;
+      if (s->in)
+        {
+          s->io.in = -1;
+          s->io.in_stage = false;
+        }
+      if (s->out)
+        s->io.out = -1;
+    }
+  for (size_t k = 0; k + 1 < count; k++)
+    worker_run(t[k].worker, &t[k]);
+  stage_main(&t[count - 1]);
+  for (size_t k = 0; k + 1 < count; k++)
+    worker_wait(t[k].worker);
+
+  int status = t[count - 1].status;
+  free(t);
+  return status;
+}
+
+/*
+ * Starts every stage of p. Returns the job holding its processes, or NULL
+ * when nothing is left running; *status then holds the pipeline's status.
+ */
+static struct job *start_pipeline(struct shell *sh, const struct pipeline *p, bool background, int *status)
+{
+  size_t n = p->ncmds;
+  int in_fd = -1; /* read side feeding the next stage, owned by us */
+  bool in_stage = false; /* and it is a builtin's memfd */
+  struct job *j = job_new(sh, p);
+  if (!j)
+    {
+      *status = 1;
+      return NULL;
+    }
+  *status = 0;
+
+  for (size_t i = 0; i < n; i++)
+    {
+      const struct command *cmd = &p->cmds[i];
+      bool has_next = i + 1 < n;
+      char **argv = cmd->argv;
+      const struct builtin *b = NULL;
+      if (cmd->argc > 2 && strcmp(argv[0], "builtin") == 0 && strcmp(argv[1], "--external") == 0)
+        argv += 2;
+      else if (cmd->argc)
+        b = builtin_lookup(argv[0]);
+      if (b && builtin_is_utility(b) && !utility_in_shell(sh, cmd, in_fd, background))
+        b = NULL;
+      /* the stages from here to last run together on threads */
+      size_t run = b ? utility_run(sh, cmd, n - i, in_fd, in_stage, background) : 0;
+      size_t last = run > 1 ? i + run - 1 : i;
+      has_next = last + 1 < n;
+      j->last_is_proc = false;
+      /* anything else may change what the tests before it saw */
+      if (!b || !builtin_is_test(b) || cmd->nredir)
+        stat_cache_clear(&sh->stats);
+
+      if (b)
+        {
+          /* The builtin reads the previous stage if it wants to. Closing
+           * the pipe afterwards gives the writer EPIPE just like a
+           * subshell that exits without reading everything */
+          struct builtin_io io = {in_fd >= 0 ? in_fd : STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, in_stage, NULL, NULL};
+          int out = -1;
+          if (has_next)
+            {
+              out = memfd_create("builtin-stage", MFD_CLOEXEC);
+              if (out < 0)
+                {
+                  perror("memfd_create");
+                  *status = 1;
+                  continue;
+                }
+              io.out = out;
+            }
+          int rc = run > 1 ? run_threads(sh, cmd, run, &io) : run_builtin(sh, b, cmd, &io);
+          bool cut = false;
+          for (size_t k = i; k <= last; k++)
+            cut = cut || p->cmds[k].cut;
+          if (rc != UTIL_EXTERNAL && cut)
+            job_cut(j, j->nprocs);
+          if (rc != UTIL_EXTERNAL)
+            {
+              i = last;
+              *status = rc;
+              if (in_fd >= 0)
+                close(in_fd);
+              in_fd = -1;
+              if (out >= 0)
+                {
+                  lseek(out, 0, SEEK_SET);
+                  in_fd = out;
+                }
+              in_stage = out >= 0;
+              continue;
+            }
+          /* an option the utility leaves to the command from PATH */
+          if (out >= 0)
+            close(out);
+        }
+
+      int pfd[2] = {-1, -1};
+      if (has_next)
+        {
+          if (pipe2(pfd, O_CLOEXEC) < 0)
+            {
+              perror("pipe2");
+              *status = 1;
+              break;
+            }
+          grow_pipe(sh, pfd[1]);
+        }
+
+      if (cmd->argc == 0)
+        {
+          /* Only redirections: open them for their side effects */
+          struct builtin_io io = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, false, NULL, NULL};
+          int opened[3] = {-1, -1, -1};
+          *status = builtin_redirect(sh, cmd, &io, opened) == 0 ? 0 : 1;
+          for (int k = 0; k < 3; k++)
+            if (opened[k] >= 0)
+              close(opened[k]);
+        }
+      else
+        {
+          struct launch l;
+          launch_init(&l, argv);
+          l.redirs = cmd->redirs;
+          l.nredir = cmd->nredir;
+          l.fd_in = in_fd;
+          l.fd_out = pfd[1];
+          l.envp = env_envp(&sh->env);
+          l.dir_fd = sh->cwd_fd;
+          if (sh->shell_is_interactive)
+            l.pgid = j->pgid;
+
+          pid_t pid = -1;
+          if (!strchr(argv[0], '/') &&
+              !(l.path = path_cache_lookup_env(&sh->paths, sh_getenv(sh, "PATH"), argv[0])))
+            errno = ENOENT;
+          else
+            pid = sh_spawn(sh, &l);
+          if (pid < 0)
+            {
+              fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+              *status = errno == ENOENT ? 127 : 126;
+            }
+          else
+            {
+              if (j->pgid == 0)
+                j->pgid = pid;
+              job_add_proc(sh, j, pid);
+              j->procs[j->nprocs - 1].cut = cmd->cut;
+              j->last_is_proc = true;
+            }
+        }
+      if (in_fd >= 0)
+        close(in_fd);
+      if (pfd[1] >= 0)
+        close(pfd[1]);
+      in_fd = pfd[0];
+      in_stage = false;
+    }
+  if (in_fd >= 0)
+    close(in_fd);
+
+  j->status = *status;
+  if (j->nprocs == 0)
+    {
+      job_release(sh, j);
+      return NULL;
+    }
+  return j;
+}
+
+/* Hands the terminal to the foreground job or takes it back */
+static void sh_terminal(struct shell *sh, pid_t pgid)
+{
+  if (!sh->shell_is_interactive)
+    return;
+  tcsetpgrp(sh->shell_terminal, pgid ? pgid : sh->shell_pgid);
+  if (!pgid)
+    tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+}
+
+/* Starts p. Returns the job to wait for in the foreground, or NULL when
+ * there is none and sh->last_status holds the status of p */
+static struct job *sh_start(struct shell *sh, struct pipeline *p)
+{
+  if (sh->optimize)
+    plan_optimize(sh, p, &sh->line.arena, -1);
+  int status;
+  struct job *j = start_pipeline(sh, p, p->op == LIST_BG, &status);
+  struct job *resume = sh->resume;
+  sh->resume = NULL;
+  if (!j && resume)
+    {
+      /* the fg builtin handed us a job to wait for */
+      j = resume;
+    }
+  else if (!j)
+    {
+      sh->last_status = status;
+      return NULL;
+    }
+  else if (p->op == LIST_BG)
+    {
+      job_set_background(&sh->jobs, j, true);
+      if (sh->shell_is_interactive)
+        printf("[%d] %d\n", j->id, (int)j->procs[j->nprocs - 1].pid);
+      sh->last_status = 0;
+      return NULL;
+    }
+  sh->fg = j;
+  sh_terminal(sh, j->pgid);
+  return j;
+}
+
+/* Runs pipelines of the current line until one leaves a foreground job */
+static bool sh_continue(struct shell *sh)
+{
+  struct run_state *r = &sh->run;
+  while (r->next < r->list.npipes && !sh->exit_requested)
+    {
+      struct pipeline *p = &r->list.pipes[r->next++];
+      /* && and || skip pipelines based on the status so far */
+      bool skip = (r->op == LIST_AND && sh->last_status != 0) ||
+                  (r->op == LIST_OR && sh->last_status == 0);
+      r->op = p->op;
+      if (!skip && sh_start(sh, p))
+        return true;
+    }
+  return false;
+}
+
+/* The foreground job finished or stopped: take the terminal back and keep
+ * its status, or keep it as a stopped job */
+static void sh_fg_done(struct shell *sh)
+{
+  struct job *j = sh->fg;
+  sh->fg = NULL;
+  sh_terminal(sh, 0);
+  if (j->nalive > 0)
+    {
+      /* stopped: it becomes a background job until fg or bg resumes it */
+      job_set_background(&sh->jobs, j, true);
+      fprintf(stderr, "\n[%d]+  Stopped                 %s\n", j->id, j->text);
+      sh->last_status = 128 + SIGTSTP;
+    }
+  else
+    {
+      sh->last_status = j->status;
+      job_release(sh, j);
+    }
+}
+
+/* The foreground job finished or stopped: carry on with the rest of the
+ * line */
+static bool sh_fg_finished(struct shell *sh)
+{
+  sh_fg_done(sh);
+  return sh_continue(sh);
+}
+
+bool sh_submit(struct shell *sh, const char *line, size_t len)
+{
+  sh->run.list.npipes = 0;
+  sh->run.next = 0;
+  sh->run.op = LIST_SEQ;
+  stat_cache_clear(&sh->stats);
+  if (cmd_tokenize(&sh->line, line, len) < 0 || cmd_build(&sh->line, &sh->run.list) < 0)
+    {
+      fprintf(stderr, "%s\n", sh->line.error);
+      sh->last_status = 2;
+      return false;
+    }
+  return sh_continue(sh);
+}
+
+bool sh_job_event(struct shell *sh, pid_t pid)
+{
+  struct proc *p;
+  struct job *j = job_table_find_pid(&sh->jobs, pid, &p);
+  if (!j)
+    return sh->fg != NULL;
+  proc_poll(sh, j, p);
+  job_update_stopped(j);
+  if (j == sh->fg)
+    {
+      if (j->nalive == 0 || j->stopped)
+        return sh_fg_finished(sh);
+      return true;
+    }
+  if (j->nalive == 0 && j->background)
+    job_finished_background(sh, j);
+  return sh->fg != NULL;
+}
+
+int sh_reap_ready(struct shell *sh, int timeout_ms)
+{
+  struct epoll_event events[256];
+  int total = 0;
+  for (;;)
+    {
+      int n = epoll_wait(sh->jobs.epoll_fd, events, NELEMS(events), timeout_ms);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return total;
+      for (int i = 0; i < n; i++)
+        sh_job_event(sh, (pid_t)events[i].data.u64);
+      total += n;
+      if (n < (int)NELEMS(events))
+        return total;
+      timeout_ms = 0;
+    }
+}
+
+/* Blocks until the foreground job exits or stops */
+static void proc_wait(struct shell *sh, struct job *j, struct proc *p)
+{
+  int ws;
+  while (!p->done && !p->stopped)
+    {
+      pid_t r = waitpid(p->pid, &ws, WUNTRACED);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r < 0)
+        {
+          /* somebody else reaped it */
+          proc_update(sh, j, p, 0);
+          break;
+        }
+      proc_update(sh, j, p, ws);
+    }
+  job_update_stopped(j);
+}
+
+static void sh_wait_fg(struct shell *sh)
+{
+  struct job *j = sh->fg;
+  /* cut stages first: their exit is what ends the stages before them */
+  for (size_t i = 0; i < j->nprocs && !j->stopped; i++)
+    if (j->procs[i].cut)
+      proc_wait(sh, j, &j->procs[i]);
+  for (size_t i = 0; i < j->nprocs && !j->stopped; i++)
+    proc_wait(sh, j, &j->procs[i]);
+}
+
+int sh_run_pipeline(struct shell *sh, const struct pipeline *p, bool background)
+{
+  int status;
+  struct job *j = start_pipeline(sh, p, background, &status);
+  if (!j)
+    return status;
+  if (background)
+    {
+      job_set_background(&sh->jobs, j, true);
+      return 0;
+    }
+  struct job *outer = sh->fg;
+  sh->fg = j;
+  sh_terminal(sh, j->pgid);
+  sh_wait_fg(sh);
+  sh->fg = outer;
+  sh_terminal(sh, 0);
+  if (j->nalive > 0)
+    {
+      job_set_background(&sh->jobs, j, true);
+      return 128 + SIGTSTP;
+    }
+  status = j->status;
+  job_release(sh, j);
+  return status;
+}
+
+int sh_execute(struct shell *sh, const char *line, size_t len)
+{
+  sh_reap_ready(sh, 0);
+  sh_notify_jobs(sh);
+  bool waiting = sh_submit(sh, line, len);
+  while (waiting)
+    {
+      sh_wait_fg(sh);
+      waiting = sh_fg_finished(sh);
+    }
+  return sh->last_status;
+}
+
+/* ------------------------------------------------------------------ */
+/* Batch input                                                         */
+/* ------------------------------------------------------------------ */
+
+int batch_open(struct batch_input *in, int fd)
+{
+  memset(in, 0, sizeof(*in));
+  in->fd = fd;
+  struct stat st;
+  off_t off = lseek(fd, 0, SEEK_CUR);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && off >= 0)
+    {
+      if (st.st_size <= off)
+        {
+          in->eof = true;
+          return 0;
+        }
+      /* mapped from the start, offsets have to be page aligned */
+      size_t size = (size_t)st.st_size;
+      void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        {
+          madvise(map, size, MADV_SEQUENTIAL);
+          in->data = map;
+          in->len = size;
+          in->pos = (size_t)off;
+          in->mapped = true;
+          return 0;
+        }
+    }
+  in->buf = malloc(BATCH_BUFFER);
+  if (!in->buf)
+    return -1;
+  in->cap = BATCH_BUFFER;
+  in->data = in->buf;
+  return 0;
+}
+
+const char *batch_line(struct batch_input *in, size_t *len)
+{
+  if (in->seek)
+    {
+      /* a command that read the script itself moved past its own line */
+      off_t off = lseek(in->fd, 0, SEEK_CUR);
+      if (off > (off_t)in->pos)
+        in->pos = (size_t)off < in->len ? (size_t)off : in->len;
+    }
+  for (;;)
+    {
+      const char *start = in->data + in->pos;
+      size_t avail = in->len - in->pos;
+      const char *nl = memchr(start, '\n', avail);
+      if (nl || (avail > 0 && (in->mapped || in->eof)))
+        {
+          *len = nl ? (size_t)(nl - start) + 1 : avail;
+          in->pos += *len;
+          in->line++;
+          if (in->seek)
+            lseek(in->fd, (off_t)in->pos, SEEK_SET);
+          return start;
+        }
+      if (in->mapped || in->eof)
+        return NULL;
+
+      /* keep the partial line and read more behind it */
+      if (in->pos > 0)
+        {
+          memmove(in->buf, start, avail);
+          in->len = avail;
+          in->pos = 0;
+        }
+      else if (in->len == in->cap)
+        {
+          char *grown = realloc(in->buf, in->cap * 2);
+          if (!grown)
+            {
+              in->error = ENOMEM;
+              return NULL;
+            }
+          in->buf = grown;
+          in->data = grown;
+          in->cap *= 2;
+        }
+      ssize_t n = read(in->fd, in->buf + in->len, in->cap - in->len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          in->error = errno;
+          return NULL;
+        }
+      if (n == 0)
+        in->eof = true;
+      in->len += (size_t)n;
+    }
+}
+
+void batch_close(struct batch_input *in)
+{
+  if (in->mapped)
+    munmap((void *)in->data, in->len);
+  free(in->buf);
+  in->data = in->buf = NULL;
+  in->len = in->pos = in->cap = 0;
+}
+
+int sh_run_batch(struct shell *sh, int fd)
+{
+  struct batch_input in;
+  if (batch_open(&in, fd) < 0)
+    return -1;
+  /* commands that read the same file go on after the current line */
+  in.seek = in.mapped;
+  const char *line;
+  size_t len;
+  while (!sh->exit_requested && (line = batch_line(&in, &len)))
+    sh_execute(sh, line, len);
+  int err = in.error;
+  batch_close(&in);
+  if (err)
+    {
+      errno = err;
+      return -1;
+    }
+  return sh->last_status;
+}
+
+/* ------------------------------------------------------------------ */
+/* Compiled scripts                                                    */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The code is a sequence of 32 bit words:
+ *
+ *   OP_LINE n      line n starts: reap jobs as sh_execute does
+ *   OP_RUN rec     run the pipeline record at data[rec]
+ *   OP_AND         skip the OP_RUN after it unless the status is 0
+ *   OP_OR          skip the OP_RUN after it if the status is 0
+ *   OP_ERROR str   report the syntax error strings[str], status 2
+ *
+ * A pipeline record is its list_op and number of commands, then for every
+ * command its argc and nredir, the string offsets of its words and four
+ * words per redirection: kind, fd, target offset or PROG_NONE, dup_fd.
+ */
+
+#define PROGRAM_MAGIC "LABPROG"
+#define PROGRAM_VERSION 1
+#define PROGRAM_ORDER 0x01020304u
+#define PROG_NONE UINT32_MAX
+
+enum prog_op
+{
+  OP_LINE,
+  OP_RUN,
+  OP_AND,
+  OP_OR,
+  OP_ERROR,
+};
+
+/* Starts the image, written as is: a cache only loads on the kind of
+ * machine that wrote it */
+struct program_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t ncode, ndata, nstrings, errors;
+};
+
+struct prog_words
+{
+  uint32_t *v;
+  size_t n, cap;
+};
+
+struct prog_builder
+{
+  struct prog_words code, data;
+  char *strings;
+  size_t nstrings, strings_cap;
+  struct cmd_line cl;
+  uint32_t lineno;
+  size_t errors;
+  bool failed;
+};
+
+static void prog_init(struct prog_builder *b)
+{
+  memset(b, 0, sizeof(*b));
+  cmd_line_init(&b->cl);
+}
+
+static void prog_free(struct prog_builder *b)
+{
+  cmd_line_destroy(&b->cl);
+  free(b->code.v);
+  free(b->data.v);
+  free(b->strings);
+}
+
+static void prog_push(struct prog_builder *b, struct prog_words *w, uint32_t x)
+{
+  if (w->n == w->cap)
+    {
+      size_t cap = w->cap ? w->cap * 2 : 1024;
+      uint32_t *v = realloc(w->v, cap * sizeof(*v));
+      if (!v)
+        {
+          b->failed = true;
+          return;
+        }
+      w->v = v;
+      w->cap = cap;
+    }
+  w->v[w->n++] = x;
+}
+
+/* Appends s to the string pool and returns its offset */
+static uint32_t prog_string(struct prog_builder *b, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  if (b->nstrings + len > b->strings_cap)
+    {
+      size_t cap = b->strings_cap ? b->strings_cap : 4096;
+      while (b->nstrings + len > cap)
+        cap *= 2;
+      char *grown = realloc(b->strings, cap);
+      if (!grown)
+        {
+          b->failed = true;
+          return 0;
+        }
+      b->strings = grown;
+      b->strings_cap = cap;
+    }
+  uint32_t off = (uint32_t)b->nstrings;
+  memcpy(b->strings + b->nstrings, s, len);
+  b->nstrings += len;
+  return off;
+}
+
+/* Lowers p into a record and returns its offset */
+static uint32_t prog_record(struct prog_builder *b, const struct pipeline *p)
+{
+  uint32_t off = (uint32_t)b->data.n;
+  prog_push(b, &b->data, (uint32_t)p->op);
+  prog_push(b, &b->data, (uint32_t)p->ncmds);
+  for (size_t i = 0; i < p->ncmds; i++)
+    {
+      const struct command *c = &p->cmds[i];
+      prog_push(b, &b->data, (uint32_t)c->argc);
+      prog_push(b, &b->data, (uint32_t)c->nredir);
+      for (size_t k = 0; k < c->argc; k++)
+        prog_push(b, &b->data, prog_string(b, c->argv[k]));
+      for (size_t k = 0; k < c->nredir; k++)
+        {
+          const struct redir *r = &c->redirs[k];
+          prog_push(b, &b->data, (uint32_t)r->kind);
+          prog_push(b, &b->data, (uint32_t)r->fd);
+          prog_push(b, &b->data, r->target ? prog_string(b, r->target) : PROG_NONE);
+          prog_push(b, &b->data, (uint32_t)r->dup_fd);
+        }
+    }
+  return off;
+}
+
+/* Lowers the next line of the script, len bytes including its newline */
+static void prog_line(struct prog_builder *b, const char *line, size_t len)
+{
+  struct cmd_list list;
+  b->lineno++;
+  if (cmd_tokenize(&b->cl, line, len) < 0 || cmd_build(&b->cl, &list) < 0)
+    {
+      prog_push(b, &b->code, OP_LINE);
+      prog_push(b, &b->code, b->lineno);
+      prog_push(b, &b->code, OP_ERROR);
+      prog_push(b, &b->code, prog_string(b, b->cl.error));
+      b->errors++;
+      return;
+    }
+  if (list.npipes == 0)
+    return; /* blank and comment lines leave nothing to do */
+  prog_push(b, &b->code, OP_LINE);
+  prog_push(b, &b->code, b->lineno);
+  for (size_t i = 0; i < list.npipes; i++)
+    {
+      if (i > 0 && list.pipes[i - 1].op == LIST_AND)
+        prog_push(b, &b->code, OP_AND);
+      else if (i > 0 && list.pipes[i - 1].op == LIST_OR)
+        prog_push(b, &b->code, OP_OR);
+      prog_push(b, &b->code, OP_RUN);
+      prog_push(b, &b->code, prog_record(b, &list.pipes[i]));
+    }
+}
+
+/* Views what b has built so far as a program, valid until b grows */
+static void prog_view(const struct prog_builder *b, struct program *prog)
+{
+  memset(prog, 0, sizeof(*prog));
+  prog->code = b->code.v;
+  prog->ncode = b->code.n;
+  prog->data = b->data.v;
+  prog->ndata = b->data.n;
+  prog->strings = b->strings;
+  prog->nstrings = b->nstrings;
+  prog->errors = b->errors;
+}
+
+/* Points the fields of prog into its image */
+static void program_layout(struct program *prog)
+{
+  const struct program_header *h = prog->image;
+  prog->code = (const uint32_t *)(h + 1);
+  prog->ncode = (size_t)h->ncode;
+  prog->data = prog->code + prog->ncode;
+  prog->ndata = (size_t)h->ndata;
+  prog->strings = (char *)(prog->data + prog->ndata);
+  prog->nstrings = (size_t)h->nstrings;
+  prog->errors = (size_t)h->errors;
+}
+
+static void program_key(struct program_header *h, const struct stat *st)
+{
+  h->dev = (uint64_t)st->st_dev;
+  h->ino = (uint64_t)st->st_ino;
+  h->size = (uint64_t)st->st_size;
+  h->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+  h->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+}
+
+/* Copies what b built into the image of prog and frees b */
+static int prog_finish(struct prog_builder *b, struct program *prog, const struct stat *st)
+{
+  memset(prog, 0, sizeof(*prog));
+  size_t size = sizeof(struct program_header) + (b->code.n + b->data.n) * sizeof(uint32_t) + b->nstrings;
+  int err = ENOMEM;
+  if (!b->failed && (b->data.n >= PROG_NONE || b->nstrings >= PROG_NONE))
+    {
+      /* offsets are 32 bits */
+      err = EFBIG;
+      b->failed = true;
+    }
+  else if (!b->failed && !(prog->image = malloc(size)))
+    {
+      b->failed = true;
+    }
+  if (!b->failed)
+    {
+      struct program_header *h = prog->image;
+      memset(h, 0, sizeof(*h));
+      memcpy(h->magic, PROGRAM_MAGIC, sizeof(h->magic));
+      h->version = PROGRAM_VERSION;
+      h->order = PROGRAM_ORDER;
+      if (st)
+        program_key(h, st);
+      h->ncode = b->code.n;
+      h->ndata = b->data.n;
+      h->nstrings = b->nstrings;
+      h->errors = b->errors;
+      char *p = (char *)(h + 1);
+      memcpy(p, b->code.v, b->code.n * sizeof(uint32_t));
+      p += b->code.n * sizeof(uint32_t);
+      memcpy(p, b->data.v, b->data.n * sizeof(uint32_t));
+      p += b->data.n * sizeof(uint32_t);
+      memcpy(p, b->strings, b->nstrings);
+      prog->size = size;
+      program_layout(prog);
+    }
+  bool failed = b->failed;
+  prog_free(b);
+  if (failed)
+    {
+      errno = err;
+      return -1;
+    }
+  return 0;
+}
+
+int program_compile(struct program *prog, const char *text, size_t len, const struct stat *st)
+{
+  struct prog_builder b;
+  prog_init(&b);
+  const char *end = text + len;
+  for (const char *line = text; line < end && !b.failed;)
+    {
+      const char *nl = memchr(line, '\n', (size_t)(end - line));
+      size_t n = nl ? (size_t)(nl - line) + 1 : (size_t)(end - line);
+      prog_line(&b, line, n);
+      line += n;
+    }
+  return prog_finish(&b, prog, st);
+}
+
+/* Checks the record at off, so that running it needs no checks */
+static bool program_record_ok(const struct program *prog, uint32_t off)
+{
+  const uint32_t *d = prog->data;
+  size_t n = prog->ndata, i = off;
+  if (i + 2 > n || d[i] > LIST_OR || d[i + 1] == 0)
+    return false;
+  size_t ncmds = d[i + 1];
+  i += 2;
+  for (size_t c = 0; c < ncmds; c++)
+    {
+      if (i + 2 > n)
+        return false;
+      size_t argc = d[i], nredir = d[i + 1];
+      i += 2;
+      if (argc > n - i || nredir > (n - i - argc) / 4)
+        return false;
+      for (size_t k = 0; k < argc; k++)
+        if (d[i++] >= prog->nstrings)
+          return false;
+      for (size_t k = 0; k < nredir; k++, i += 4)
+        if (d[i] > REDIR_DUP || (d[i + 2] != PROG_NONE && d[i + 2] >= prog->nstrings))
+          return false;
+    }
+  return true;
+}
+
+/* Checks the instruction at pc. Only a mapped cache needs it: it is checked
+ * as it runs rather than up front, so loading it costs the same for any
+ * size of script */
+static bool program_step_ok(const struct program *prog, size_t pc)
+{
+  const uint32_t *code = prog->code;
+  if (!prog->mapped)
+    return true;
+  if (pc + 1 >= prog->ncode)
+    return false;
+  switch (code[pc])
+    {
+    case OP_LINE:
+      return true;
+    case OP_RUN:
+      return program_record_ok(prog, code[pc + 1]);
+    case OP_AND:
+    case OP_OR:
+      return code[pc + 1] == OP_RUN;
+    case OP_ERROR:
+      return code[pc + 1] < prog->nstrings;
+    default:
+      return false;
+    }
+}
+
+int program_open(struct program *prog, const char *path, const struct stat *st)
+{
+  memset(prog, 0, sizeof(*prog));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat cst;
+  if (fstat(fd, &cst) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  size_t size = (size_t)cst.st_size;
+  if (!S_ISREG(cst.st_mode) || size < sizeof(struct program_header))
+    {
+      close(fd);
+      errno = EINVAL;
+      return -1;
+    }
+  /* private and writable: argv points straight into the strings */
+  void *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return -1;
+  madvise(image, size, MADV_SEQUENTIAL);
+
+  const struct program_header *h = image;
+  struct program_header key = {0};
+  program_key(&key, st);
+  int err = 0;
+  if (memcmp(h->magic, PROGRAM_MAGIC, sizeof(h->magic)) != 0 || h->version != PROGRAM_VERSION ||
+      h->order != PROGRAM_ORDER || h->ncode > size / 4 || h->ndata > size / 4 ||
+      sizeof(*h) + (h->ncode + h->ndata) * sizeof(uint32_t) + h->nstrings != size)
+    err = EINVAL;
+  else if (h->nstrings > 0 && ((const char *)image)[size - 1] != '\0')
+    err = EINVAL;
+  else if (h->dev != key.dev || h->ino != key.ino || h->size != key.size || h->mtime_sec != key.mtime_sec ||
+           h->mtime_nsec != key.mtime_nsec)
+    err = ESTALE;
+  if (err)
+    {
+      munmap(image, size);
+      errno = err;
+      return -1;
+    }
+  prog->image = image;
+  prog->size = size;
+  prog->mapped = true;
+  program_layout(prog);
+  return 0;
+}
+
+int program_write(const struct program *prog, const char *path)
+{
+  size_t len = strlen(path);
+  char *tmp = malloc(len + 8);
+  if (!tmp)
+    return -1;
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".XXXXXX", 8);
+  int fd = mkostemp(tmp, O_CLOEXEC);
+  if (fd < 0)
+    {
+      free(tmp);
+      return -1;
+    }
+  fchmod(fd, 0644);
+  const char *p = prog->image;
+  size_t left = prog->size;
+  int rc = 0;
+  while (left > 0 && rc == 0)
+    {
+      ssize_t n = write(fd, p, left);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        rc = -1;
+      else
+        {
+          p += n;
+          left -= (size_t)n;
+        }
+    }
+  if (close(fd) < 0)
+    rc = -1;
+  /* readers see the old cache or the new one, never part of one */
+  if (rc == 0 && rename(tmp, path) < 0)
+    rc = -1;
+  if (rc < 0)
+    {
+      int err = errno;
+      unlink(tmp);
+      errno = err;
+    }
+  free(tmp);
+  return rc;
+}
+
+void program_report(const struct program *prog, const char *name, int fd)
+{
+  uint32_t lineno = 0;
+  for (size_t pc = 0; pc < prog->ncode && program_step_ok(prog, pc);)
+    {
+      switch (prog->code[pc])
+        {
+        case OP_LINE:
+          lineno = prog->code[pc + 1];
+          pc += 2;
+          break;
+        case OP_ERROR:
+          dprintf(fd, "%s:%" PRIu32 ": %s\n", name, lineno, prog->strings + prog->code[pc + 1]);
+          pc += 2;
+          break;
+        case OP_RUN:
+          pc += 2;
+          break;
+        default:
+          pc++;
+          break;
+        }
+    }
+}
+
+void program_destroy(struct program *prog)
+{
+  if (prog->mapped)
+    munmap(prog->image, prog->size);
+  else
+    free(prog->image);
+  memset(prog, 0, sizeof(*prog));
+}
+
+/* Returns path with PROGRAM_SUFFIX appended, malloced */
+static char *script_cache_path(const char *path)
+{
+  size_t len = strlen(path);
+  char *cache = malloc(len + sizeof(PROGRAM_SUFFIX));
+  if (cache)
+    {
+      memcpy(cache, path, len);
+      memcpy(cache + len, PROGRAM_SUFFIX, sizeof(PROGRAM_SUFFIX));
+    }
+  return cache;
+}
+
+/* Opens the script at path and, when it is a regular file, the path of its
+ * cache. Returns the script's descriptor or -1 with errno set */
+static int script_open(const char *path, struct stat *st, char **cache)
+{
+  *cache = NULL;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, st) < 0)
+    {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+  /* a pipe or a device has nothing to key a cache on */
+  if (S_ISREG(st->st_mode))
+    *cache = script_cache_path(path);
+  return fd;
+}
+
+int script_compile(struct program *prog, const char *path, bool *cached)
+{
+  if (cached)
+    *cached = false;
+  struct stat st;
+  char *cache;
+  int fd = script_open(path, &st, &cache);
+  if (fd < 0)
+    return -1;
+  if (cache && program_open(prog, cache, &st) == 0)
+    {
+      close(fd);
+      free(cache);
+      if (cached)
+        *cached = true;
+      return 0;
+    }
+
+  struct batch_input in;
+  struct prog_builder b;
+  int rc = batch_open(&in, fd);
+  if (rc == 0)
+    {
+      prog_init(&b);
+      const char *line;
+      size_t len;
+      while (!b.failed && (line = batch_line(&in, &len)))
+        prog_line(&b, line, len);
+      rc = in.error ? -1 : 0;
+      batch_close(&in);
+      if (rc < 0)
+        {
+          prog_free(&b);
+          errno = in.error;
+        }
+      else
+        {
+          rc = prog_finish(&b, prog, &st);
+        }
+    }
+  int err = errno;
+  close(fd);
+  if (rc == 0 && cache)
+    program_write(prog, cache);
+  free(cache);
+  errno = err;
+  return rc;
+}
+
+/* Builds the pipeline of record rec in the line arena */
+static struct pipeline *program_pipeline(struct shell *sh, const struct program *prog, uint32_t rec)
+{
+  const uint32_t *d = prog->data + rec;
+  struct arena *a = &sh->line.arena;
+  struct pipeline *p = arena_alloc(a, sizeof(*p));
+  if (!p)
+    return NULL;
+  p->op = (enum list_op)d[0];
+  p->ncmds = d[1];
+  p->cmds = arena_alloc(a, p->ncmds * sizeof(*p->cmds));
+  if (!p->cmds)
+    return NULL;
+  d += 2;
+  for (size_t i = 0; i < p->ncmds; i++)
+    {
+      struct command *c = &p->cmds[i];
+      c->argc = d[0];
+      c->nredir = d[1];
+      c->cut = false;
+      d += 2;
+      c->argv = arena_alloc(a, (c->argc + 1) * sizeof(*c->argv));
+      c->redirs = c->nredir ? arena_alloc(a, c->nredir * sizeof(*c->redirs)) : NULL;
+      if (!c->argv || (c->nredir && !c->redirs))
+        return NULL;
+      for (size_t k = 0; k < c->argc; k++)
+        c->argv[k] = prog->strings + *d++;
+      c->argv[c->argc] = NULL;
+      for (size_t k = 0; k < c->nredir; k++, d += 4)
+        {
+          struct redir *r = &c->redirs[k];
+          r->kind = (enum redir_kind)d[0];
+          r->fd = (int)d[1];
+          r->target = d[2] == PROG_NONE ? NULL : prog->strings + d[2];
+          r->dup_fd = (int)d[3];
+        }
+    }
+  return p;
+}
+
+/* Runs the code of prog from pc up to end */
+static void program_exec(struct shell *sh, const struct program *prog, size_t pc, size_t end)
+{
+  const uint32_t *code = prog->code;
+  while (pc < end && !sh->exit_requested)
+    {
+      if (!program_step_ok(prog, pc))
+        {
+          fprintf(stderr, "compiled script is damaged at %zu\n", pc);
+          sh->last_status = 2;
+          return;
+        }
+      switch (code[pc])
+        {
+        case OP_LINE:
+          sh_reap_ready(sh, 0);
+          sh_notify_jobs(sh);
+          stat_cache_clear(&sh->stats);
+          cmd_line_reset(&sh->line);
+          pc += 2;
+          break;
+        case OP_AND:
+          pc += sh->last_status != 0 ? 3 : 1;
+          break;
+        case OP_OR:
+          pc += sh->last_status == 0 ? 3 : 1;
+          break;
+        case OP_ERROR:
+          fprintf(stderr, "%s\n", prog->strings + code[pc + 1]);
+          sh->last_status = 2;
+          pc += 2;
+          break;
+        case OP_RUN:
+          {
+            struct pipeline *p = program_pipeline(sh, prog, code[pc + 1]);
+            pc += 2;
+            if (!p)
+              {
+                fprintf(stderr, "%s\n", strerror(ENOMEM));
+                sh->last_status = 2;
+              }
+            else if (sh_start(sh, p))
+              {
+                sh_wait_fg(sh);
+                sh_fg_done(sh);
+              }
+            break;
+          }
+        }
+    }
+}
+
+int sh_run_program(struct shell *sh, const struct program *prog)
+{
+  program_exec(sh, prog, 0, prog->ncode);
+  return sh->last_status;
+}
+
+int sh_run_script(struct shell *sh, const char *path)
+{
+  struct stat st;
+  char *cache;
+  int fd = script_open(path, &st, &cache);
+  if (fd < 0)
+    return -1;
+  struct program prog;
+  if (cache && program_open(&prog, cache, &st) == 0)
+    {
+      close(fd);
+      free(cache);
+      program_exec(sh, &prog, 0, prog.ncode);
+      program_destroy(&prog);
+      return sh->last_status;
+    }
+
+  /* no current cache: every line is compiled just before it runs, so the
+   * first command does not wait for the rest of the script */
+  struct batch_input in;
+  if (batch_open(&in, fd) < 0)
+    {
+      int err = errno;
+      close(fd);
+      free(cache);
+      errno = err;
+      return -1;
+    }
+  struct prog_builder b;
+  prog_init(&b);
+  const char *line;
+  size_t len;
+  while (!sh->exit_requested && (line = batch_line(&in, &len)))
+    {
+      size_t pc = b.code.n;
+      if (!b.failed)
+        prog_line(&b, line, len);
+      if (b.failed)
+        {
+          /* out of memory for the program: carry on without it */
+          sh_execute(sh, line, len);
+          continue;
+        }
+      struct program view;
+      prog_view(&b, &view);
+      program_exec(sh, &view, pc, view.ncode);
+    }
+  /* a script that exited early has lines that were never compiled */
+  bool whole = !in.error && (!sh->exit_requested || !batch_line(&in, &len));
+  int err = in.error;
+  batch_close(&in);
+  close(fd);
+  if (!whole || b.failed || !cache)
+    {
+      prog_free(&b);
+    }
+  else if (prog_finish(&b, &prog, &st) == 0)
+    {
+      program_write(&prog, cache);
+      program_destroy(&prog);
+    }
+  free(cache);
+  if (err)
+    {
+      errno = err;
+      return -1;
+    }
+  return sh->last_status;
+}
+
+/* ------------------------------------------------------------------ */
+/* Interactive event loop                                              */
+/* ------------------------------------------------------------------ */
+
+char *get_prompt(const char *env)
+{
+  const char *p = env ? getenv(env) : NULL;
+  return strdup(p ? p : "shell>");
+}
+
+/*
+ * readline's callback interface has no user data pointer, so the line
+ * handler finds its shell here. readline's own state is per process, not
+ * per thread, so sh_loop claims this for one shell of the process at a
+ * time; it is the only mutable global of the shell.
+ */
+static struct shell *_Atomic loop_shell;
+
+static void sh_input_enable(struct shell *sh, bool on)
+{
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EV_INPUT};
+  epoll_ctl(sh->epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, sh->input_fd, &ev);
+}
+
+static void sh_line_handler(char *line);
+
+static void sh_prompt(struct shell *sh)
+{
+  sh_notify_jobs(sh);
+  rl_callback_handler_install(sh->prompt, sh_line_handler);
+  sh_input_enable(sh, true);
+}
+
+static void sh_line_handler(char *line)
+{
+  struct shell *sh = loop_shell;
+  if (!line)
+    {
+      /* EOF */
+      sh->exit_requested = true;
+      rl_callback_handler_remove();
+      return;
+    }
+  /* Stop reading the terminal while a command runs so the foreground job
+   * owns it */
+  rl_callback_handler_remove();
+  sh_input_enable(sh, false);
+  if (*line)
+    {
+      add_history(line);
+      hist_add(&sh->history, line);
+    }
+  bool waiting = sh_submit(sh, line, strlen(line));
+  free(line);
+  if (!waiting && !sh->exit_requested)
+    sh_prompt(sh);
+}
+
+/*
+ * Incremental reverse search over the persistent history, bound to C-r in
+ * place of readline's own which only sees the lines loaded into readline.
+ * C-r steps to the next older match, C-g restores the original line and
+ * any other key ends the search and is then handled as usual.
+ */
+static int sh_history_search(int count, int key)
+{
+  struct shell *sh = loop_shell;
+  if (!sh || sh->history.fd < 0)
+    return rl_reverse_search_history(count, key);
+
+  char *saved = strdup(rl_line_buffer);
+  int saved_point = rl_point;
+  char query[256];
+  size_t qlen = 0, skip = 0;
+  bool failed = false;
+  int c;
+  for (;;)
+    {
+      query[qlen] = '\0';
+      if (qlen)
+        {
+          const char *match = hist_search(&sh->history, query, skip);
+          if (!match && skip > 0)
+            {
+              /* no older match, stay on the last one */
+              skip--;
+              rl_ding();
+            }
+          else if (match)
+            {
+              rl_replace_line(match, 0);
+              rl_point = (int)(strstr(match, query) - match);
+            }
+          failed = !match && skip == 0;
+        }
+      rl_message("(%sreverse-i-search)`%s': ", failed ? "failed " : "", query);
+      rl_redisplay();
+
+      c = rl_read_key();
+      if (c == CTRL('R'))
+        skip++;
+      else if (c == RUBOUT || c == CTRL('H'))
+        {
+          if (qlen)
+            qlen--;
+          skip = 0;
+        }
+      else if (c == CTRL('G') || c < 0)
+        {
+          if (saved)
+            rl_replace_line(saved, 0);
+          rl_point = saved_point;
+          break;
+        }
+      else if (c >= ' ' && c != RUBOUT && qlen + 1 < sizeof(query))
+        {
+          query[qlen++] = (char)c;
+          skip = 0;
+        }
+      else
+        {
+          rl_execute_next(c);
+          break;
+        }
+    }
+  rl_clear_message();
+  free(saved);
+  return 0;
+}
+
+/* True when the word starting at start is in command position */
+static bool sh_command_position(const char *line, int start)
+{
+  while (start > 0 && (line[start - 1] == ' ' || line[start - 1] == '\t'))
+    start--;
+  return start == 0 || strchr("|;&", line[start - 1]);
+}
+
+/* Readline's match list: the longest common prefix, then every match with
+ * the directory part of the word in front */
+static char **sh_completion_list(const char *text, size_t dir_len, char *const *names, size_t n)
+{
+  if (n == 0)
+    return NULL;
+  char **m = calloc(n + 2, sizeof(char *));
+  if (!m)
+    return NULL;
+  for (size_t i = 0; i < n; i++)
+    if (asprintf(&m[i + 1], "%.*s%s", (int)dir_len, text, names[i]) < 0)
+      m[i + 1] = NULL;
+  if (n == 1)
+    {
+      m[0] = m[1];
+      m[1] = NULL;
+      return m;
+    }
+  /* the names are sorted so the first and last share the least */
+  size_t common = 0;
+  while (names[0][common] && names[0][common] == names[n - 1][common])
+    common++;
+  if (asprintf(&m[0], "%.*s%.*s", (int)dir_len, text, (int)common, names[0]) < 0)
+    m[0] = NULL;
+  return m;
+}
+
+/* The shell's PATH for the completer, which treats NULL as the process's */
+static const char *sh_path(const struct shell *sh)
+{
+  const char *path = sh_getenv(sh, "PATH");
+  return path ? path : "";
+}
+
+static char **sh_complete(const char *text, int start, int end)
+{
+  UNUSED(end);
+  struct shell *sh = loop_shell;
+  /* readline's own completion still handles ~user and $VAR */
+  if (!sh || text[0] == '~' || text[0] == '$')
+    return NULL;
+  rl_attempted_completion_over = 1;
+
+  char *const *names;
+  size_t n;
+  const char *slash = strrchr(text, '/');
+  if (!slash && sh_command_position(rl_line_buffer, start))
+    {
+      completer_refresh(&sh->completer, sh_path(sh));
+      n = completer_commands(&sh->completer, text, &names);
+      return sh_completion_list(text, 0, names, n);
+    }
+  size_t dir_len = slash ? (size_t)(slash - text) + 1 : 0;
+  char dir[PATH_MAX];
+  /* relative to the shell's directory, not the process's */
+  if (dir_len && text[0] == '/')
+    snprintf(dir, sizeof(dir), "%.*s", (int)dir_len, text);
+  else
+    snprintf(dir, sizeof(dir), "%s/%.*s", sh->cwd, (int)dir_len, text);
+  n = completer_files(&sh->completer, dir, text + dir_len, &names);
+  rl_filename_completion_desired = 1;
+  return sh_completion_list(text, dir_len, names, n);
+}
+
+/* Number of the newest history entries handed to readline for C-p */
+#define SH_HISTORY_RECENT 1000
+
+static void sh_history_open(struct shell *sh)
+{
+  const char *path = sh_getenv(sh, "LAB_HISTFILE");
+  char *owned = NULL;
+  char buf[PATH_MAX];
+  if (!path)
+    {
+      const char *home = home_dir(sh, buf, sizeof(buf));
+      if (!home || asprintf(&owned, "%s/.lab_history", home) < 0)
+        return;
+      path = owned;
+    }
+  if (hist_open(&sh->history, path) < 0)
+    fprintf(stderr, "history: %s: %s\n", path, strerror(errno));
+  else
+    {
+      const char **recent = malloc(SH_HISTORY_RECENT * sizeof(*recent));
+      size_t n = recent ? hist_recent(&sh->history, recent, SH_HISTORY_RECENT) : 0;
+      for (size_t i = 0; i < n; i++)
+        add_history(recent[i]);
+      free(recent);
+      rl_bind_keyseq("\\C-r", sh_history_search);
+    }
+  free(owned);
+}
+
+static void sh_signal(struct shell *sh)
+{
+  struct signalfd_siginfo si;
+  while (read(sh->signal_fd, &si, sizeof(si)) == sizeof(si))
+    {
+      switch (si.ssi_signo)
+        {
+        case SIGWINCH:
+          rl_resize_terminal();
+          break;
+        case SIGINT:
+          if (!sh->fg)
+            {
+              /* discard the line being edited and start over */
+              rl_free_line_state();
+              rl_crlf();
+              rl_on_new_line();
+              rl_replace_line("", 0);
+              rl_redisplay();
+            }
+          break;
+        case SIGCHLD:
+          /* pidfds only report exits, stops arrive here */
+          if (sh->fg)
+            {
+              for (size_t i = 0; i < sh->fg->nprocs; i++)
+                proc_poll(sh, sh->fg, &sh->fg->procs[i]);
+              job_update_stopped(sh->fg);
+              if (sh->fg->stopped && !sh_fg_finished(sh) && !sh->exit_requested)
+                sh_prompt(sh);
+            }
+          break;
+        }
+    }
+}
+
+int sh_loop(struct shell *sh)
+{
+  struct shell *none = NULL;
+  if (!atomic_compare_exchange_strong(&loop_shell, &none, sh))
+    {
+      fprintf(stderr, "shell: readline is in use by another shell\n");
+      return 1;
+    }
+
+  sigset_t mask, saved;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGWINCH);
+  sigaddset(&mask, SIGINT);
+  sigprocmask(SIG_BLOCK, &mask, &saved);
+  /* an ignored signal is discarded instead of queued for the signalfd */
+  signal(SIGINT, SIG_DFL);
+
+  sh->input_fd = STDIN_FILENO;
+  sh->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (sh->signal_fd < 0 || sh->epoll_fd < 0)
+    {
+      perror("shell event loop");
+      loop_shell = NULL;
+      return 1;
+    }
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EV_SIGNAL};
+  epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->signal_fd, &ev);
+  /* the job table's own epoll set turns readable when any child exits */
+  ev.data.u64 = EV_JOBS;
+  epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->jobs.epoll_fd, &ev);
+
+  if (!sh->prompt)
+    {
+      const char *prompt = sh_getenv(sh, "MY_PROMPT");
+      sh->prompt = prompt ? strdup(prompt) : get_prompt(NULL);
+    }
+  rl_catch_signals = 0;
+  rl_catch_sigwinch = 0;
+  if (sh->history.fd < 0)
+    sh_history_open(sh);
+  rl_attempted_completion_function = sh_complete;
+  completer_start(&sh->completer, sh_path(sh));
+  sh_prompt(sh);
+
+  int watched_paths = -1;
+  while (!sh->exit_requested)
+    {
+      /* PATH changes replace the inotify descriptor */
+      if (sh->paths.inotify_fd != watched_paths && sh->paths.inotify_fd >= 0)
+        {
+          struct epoll_event pev = {.events = EPOLLIN, .data.u64 = EV_PATHS};
+          watched_paths = sh->paths.inotify_fd;
+          epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, watched_paths, &pev);
+        }
+
+      struct epoll_event events[64];
+      int n = epoll_wait(sh->epoll_fd, events, 64, -1);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          perror("epoll_wait");
+          break;
+        }
+      for (int i = 0; i < n && !sh->exit_requested; i++)
+        {
+          uint64_t tag = events[i].data.u64;
+          if (tag == EV_INPUT)
+            rl_callback_read_char();
+          else if (tag == EV_SIGNAL)
+            sh_signal(sh);
+          else if (tag == EV_PATHS)
+            path_cache_sync(&sh->paths);
+          else if (tag == EV_JOBS)
+            {
+              bool had_fg = sh->fg != NULL;
+              sh_reap_ready(sh, 0);
+              if (had_fg && !sh->fg && !sh->exit_requested)
+                sh_prompt(sh);
+            }
+        }
+    }
+
+  rl_callback_handler_remove();
+  loop_shell = NULL;
+  close(sh->epoll_fd);
+  close(sh->signal_fd);
+  sh->epoll_fd = -1;
+  sh->signal_fd = -1;
+  if (sh->shell_is_interactive)
+    signal(SIGINT, SIG_IGN);
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+  return sh->last_status;
+}
+
+/* ------------------------------------------------------------------ */
+/* Server                                                              */
+/* ------------------------------------------------------------------ */
+
+/* Receives the fixed part of a request and the descriptors sent with it */
+static int server_recv_request(int conn, struct server_request *rq, int fds[SERVER_FDS])
+{
+  union
+  {
+    char buf[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {rq, sizeof(*rq)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+  ssize_t n;
+  while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) < 0 && errno == EINTR)
+    ;
+  size_t nfds = 0;
+  for (struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cm; cm = CMSG_NXTHDR(&msg, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+      for (size_t i = 0; i < (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+        {
+          int fd;
+          memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(fd));
+          if (nfds < SERVER_FDS)
+            fds[nfds++] = fd;
+          else
+            close(fd);
+        }
+  if (n == sizeof(*rq) && nfds == SERVER_FDS && rq->magic == SERVER_MAGIC)
+    return 0;
+  for (size_t i = 0; i < nfds; i++)
+    close(fds[i]);
+  return -1;
+}
+
+/* Runs one request on sh with the client's descriptors and environment */
+static void server_handle(struct shell *sh, int conn, int null_fd)
+{
+  struct server_request rq;
+  int fds[SERVER_FDS];
+  if (server_recv_request(conn, &rq, fds) < 0)
+    return;
+  char *body = malloc((size_t)rq.cmd_len + rq.env_len + 1);
+  char **vars = malloc(((size_t)rq.nenv + 1) * sizeof(*vars));
+  int status = -1;
+  if (body && vars && server_recv(conn, body, (size_t)rq.cmd_len + rq.env_len) == 0)
+    {
+      /* the environment strings are NUL terminated by the client, the
+       * terminator added here only guards a malformed request */
+      body[rq.cmd_len + rq.env_len] = '\0';
+      char *p = body + rq.cmd_len, *end = p + rq.env_len;
+      size_t n = 0;
+      for (; n < rq.nenv && p < end; n++)
+        {
+          vars[n] = p;
+          p += strlen(p) + 1;
+        }
+      vars[n] = NULL;
+      char *cwd = dir_fd_path(fds[3], NULL, ".");
+      struct env_store env;
+      if (cwd && env_init(&env, vars) == 0)
+        {
+          env_destroy(&sh->env);
+          sh->env = env;
+          close(sh->cwd_fd);
+          free(sh->cwd);
+          sh->cwd_fd = fds[3];
+          sh->cwd = cwd;
+          fds[3] = -1;
+          for (int i = 0; i < 3; i++)
+            dup2(fds[i], i);
+          sh->last_status = 0;
+          sh->exit_requested = false;
+          status = sh_execute(sh, body, rq.cmd_len);
+          fflush(stdout);
+          fflush(stderr);
+          /* let go of the client's descriptors so its readers see EOF */
+          for (int i = 0; i < 3; i++)
+            dup2(null_fd, i);
+        }
+      else
+        free(cwd);
+    }
+  free(body);
+  free(vars);
+  for (int i = 0; i < SERVER_FDS; i++)
+    if (fds[i] >= 0)
+      close(fds[i]);
+  if (status >= 0)
+    {
+      struct server_reply reply = {SERVER_MAGIC, status};
+      server_send(conn, &reply, sizeof(reply));
+    }
+}
+
+static void server_worker(int listen_fd)
+{
+  /* workers never own a terminal and survive clients that go away */
+  int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (null_fd < 0)
+    _exit(1);
+  for (int i = 0; i < 3; i++)
+    dup2(null_fd, i);
+  signal(SIGPIPE, SIG_IGN);
+  struct shell sh;
+  sh_init(&sh);
+  for (;;)
+    {
+      int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          _exit(1);
+        }
+      server_handle(&sh, conn, null_fd);
+      close(conn);
+    }
+}
+
+static pid_t server_worker_start(int listen_fd, const sigset_t *mask)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      sigprocmask(SIG_SETMASK, mask, NULL);
+      server_worker(listen_fd);
+    }
+  return pid;
+}
+
+int sh_server(const char *path, int workers)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (workers < 1 || strlen(path) >= sizeof(addr.sun_path))
+    {
+      errno = workers < 1 ? EINVAL : ENAMETOOLONG;
+      return -1;
+    }
+  strcpy(addr.sun_path, path);
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+
+  sigset_t set, saved;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGHUP);
+  sigprocmask(SIG_BLOCK, &set, &saved);
+  pid_t *pids = calloc((size_t)workers, sizeof(*pids));
+  int running = 0;
+  for (int i = 0; pids && i < workers; i++)
+    if ((pids[i] = server_worker_start(fd, &saved)) > 0)
+      running++;
+
+  int rc = 0;
+  while (running > 0)
+    {
+      siginfo_t info;
+      int sig = sigwaitinfo(&set, &info);
+      if (sig < 0)
+        continue;
+      if (sig != SIGCHLD)
+        break;
+      pid_t pid;
+      int ws;
+      while ((pid = waitpid(-1, &ws, WNOHANG)) > 0)
+        for (int i = 0; i < workers; i++)
+          if (pids[i] == pid)
+            {
+              /* a crash is replaced, a worker that gave up is not */
+              pids[i] = WIFSIGNALED(ws) ? server_worker_start(fd, &saved) : -1;
+              if (pids[i] <= 0)
+                running--;
+            }
+    }
+  if (running == 0)
+    {
+      rc = -1;
+      errno = pids ? ECHILD : ENOMEM;
+    }
+
+  for (int i = 0; pids && i < workers; i++)
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  for (int i = 0; pids && i < workers; i++)
+    if (pids[i] > 0)
+      while (waitpid(pids[i], NULL, 0) < 0 && errno == EINTR)
+        ;
+  free(pids);
+  close(fd);
+  unlink(path);
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+  return rc;
+}
@@ -1 +1,1520 @@
-/**Update this file with the starter code**/
+#ifndef LAB_H
+#define LAB_H
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <termios.h>
+
+#define lab_VERSION_MAJOR 1
+#define lab_VERSION_MINOR 0
+#define UNUSED(x) (void)x;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /*
+   * Arena allocator
+   *
+   * Every command line is parsed into one arena. All token text, token
+   * arrays and argv vectors for a line live in the arena so the whole line
+   * is released with a single arena_reset(). After the first few lines the
+   * arena has grown to fit the workload and parsing does no heap
+   * allocation at all.
+   */
+
+  struct arena_chunk;
+
+  struct arena
+  {
+    struct arena_chunk *head; /* chunk currently being carved */
+    size_t chunk_size;        /* minimum size of a new chunk */
+    size_t mallocs;           /* heap allocations performed so far */
+  };
+
+  /**
+   * @brief Initialize an empty arena. No memory is allocated until the
+   * first call to arena_alloc.
+   *
+   * @param a The arena to initialize
+   * @param chunk_size The minimum chunk size, 0 selects a default
+   */
+  void arena_init(struct arena *a, size_t chunk_size);
+
+  /**
+   * @brief Allocate size bytes aligned for any scalar type. The memory is
+   * valid until the next arena_reset or arena_destroy.
+   *
+   * @param a The arena
+   * @param size Number of bytes
+   * @return Pointer to the memory or NULL if out of memory
+   */
+  void *arena_alloc(struct arena *a, size_t size);
+
+  /**
+   * @brief Release everything allocated from the arena. If the arena had
+   * to grow past one chunk the chunks are coalesced into a single chunk
+   * big enough for the high water mark, so the next line of the same size
+   * needs no allocation.
+   *
+   * @param a The arena
+   */
+  void arena_reset(struct arena *a);
+
+  /**
+   * @brief Free all memory owned by the arena.
+   *
+   * @param a The arena
+   */
+  void arena_destroy(struct arena *a);
+
+  /*
+   * Command line tokenizer
+   */
+
+  enum tok_kind
+  {
+    TOK_WORD,
+    TOK_PIPE,      /* |  */
+    TOK_AND_IF,    /* && */
+    TOK_OR_IF,     /* || */
+    TOK_AMP,       /* &  */
+    TOK_SEMI,      /* ;  */
+    TOK_LESS,      /* [n]<  */
+    TOK_GREAT,     /* [n]>  */
+    TOK_DGREAT,    /* [n]>> */
+    TOK_GREATAND,  /* [n]>& */
+  };
+
+  /**
+   * A token is a slice of the line arena. str is always NUL terminated so a
+   * run of TOK_WORD tokens can be handed to exec without copying. For
+   * redirection operators io_number holds the explicit file descriptor or
+   * -1 when the default should be used.
+   */
+  struct token
+  {
+    char *str;
+    size_t len;
+    enum tok_kind kind;
+    int io_number;
+  };
+
+  struct cmd_line
+  {
+    struct arena arena;
+    struct token *tok;
+    size_t ntok;
+    size_t cap;
+    const char *error; /* static description of the last parse error */
+  };
+
+  /**
+   * @brief Initialize a reusable command line parser.
+   *
+   * @param cl The parser state
+   */
+  void cmd_line_init(struct cmd_line *cl);
+
+  /**
+   * @brief Split line into tokens. Quotes and backslash escapes are removed
+   * in the same pass that finds token boundaries. Any tokens from a
+   * previous call are released first.
+   *
+   * Single quotes preserve everything literally, double quotes allow \\ to
+   * escape $, `, ", \\ and newline, and an unquoted backslash escapes the
+   * next character. An unquoted # at the start of a word starts a comment.
+   * From an unquoted [[ naming a command to the next unquoted ]], &&, ||,
+   * < and > are words for the [[ builtin rather than operators.
+   *
+   * @param cl The parser state
+   * @param line The text to split, it does not need to be NUL terminated
+   * @param len Length of line in bytes
+   * @return 0 on success, -1 on a syntax error with cl->error set
+   */
+  int cmd_tokenize(struct cmd_line *cl, const char *line, size_t len);
+
+  /**
+   * @brief Release the tokens of the current line, keeping the arena
+   * capacity for the next one.
+   *
+   * @param cl The parser state
+   */
+  void cmd_line_reset(struct cmd_line *cl);
+
+  /**
+   * @brief Free all memory owned by the parser.
+   *
+   * @param cl The parser state
+   */
+  void cmd_line_destroy(struct cmd_line *cl);
+
+  /**
+   * @brief Convenience wrapper that parses a NUL terminated line into a
+   * NULL terminated argv. Operators are returned as words. The result is a
+   * single allocation and must be released with cmd_free.
+   *
+   * @param line The line to parse
+   * @return argv or NULL on a syntax error
+   */
+  char **cmd_parse(char const *line);
+
+  /**
+   * @brief Free an argv returned by cmd_parse.
+   *
+   * @param line The argv to free
+   */
+  void cmd_free(char **line);
+
+  /*
+   * Process launcher
+   */
+
+  enum redir_kind
+  {
+    REDIR_IN,     /* fd < target        */
+    REDIR_OUT,    /* fd > target        */
+    REDIR_APPEND, /* fd >> target       */
+    REDIR_DUP,    /* fd >& dup_fd, or close fd when dup_fd is -1 */
+  };
+
+  struct redir
+  {
+    enum redir_kind kind;
+    int fd;
+    const char *target;
+    int dup_fd;
+  };
+
+  /* Always fork even when posix_spawn could express the request */
+  #define LAUNCH_FORCE_FORK 0x1
+
+  /**
+   * Everything needed to start one external command. fd_in and fd_out are
+   * moved onto stdin and stdout before redirs are applied in order, pass -1
+   * to inherit. pgid -1 keeps the shell's process group, 0 makes the child
+   * the leader of a new group and any other value joins that group.
+   *
+   * When child_fn is set the child does not exec at all: it runs
+   * child_fn(child_arg) and exits with its return value. This is the only
+   * request posix_spawn cannot express and it always uses fork.
+   */
+  struct launch
+  {
+    char *const *argv;
+    char *const *envp; /* NULL inherits environ */
+    int dir_fd;        /* directory to run in, -1 inherits the cwd */
+    const char *path;  /* executable, NULL searches PATH for argv[0] */
+    const struct redir *redirs;
+    size_t nredir;
+    int fd_in;
+    int fd_out;
+    pid_t pgid;
+    int flags;
+    int (*child_fn)(void *arg);
+    void *child_arg;
+  };
+
+  /**
+   * @brief Initialize a launch request for argv with every other field
+   * defaulted.
+   *
+   * @param l The request
+   * @param argv NULL terminated argument vector
+   */
+  void launch_init(struct launch *l, char *const *argv);
+
+  /**
+   * @brief Start a child process. The fast path is posix_spawn, which glibc
+   * implements with clone(CLONE_VM|CLONE_VFORK) so the cost does not grow
+   * with the size of the shell's address space. Redirections become spawn
+   * file actions. Signal dispositions the shell changed are reset to the
+   * default and the signal mask is cleared in the child.
+   *
+   * @param l The request
+   * @return The child's pid or -1 with errno set
+   */
+  pid_t lab_spawn(const struct launch *l);
+
+  /**
+   * @brief Move data from in to out without passing it through user space
+   * when possible. splice(2) is used whenever either descriptor is a pipe,
+   * sendfile(2) for file to socket or file copies and read/write otherwise.
+   *
+   * @param in Source descriptor
+   * @param out Destination descriptor
+   * @param max Maximum number of bytes to move, (size_t)-1 for until EOF
+   * @return Number of bytes moved or -1 with errno set
+   */
+  ssize_t lab_relay(int in, int out, size_t max);
+
+  /*
+   * Zygote
+   *
+   * A helper process that starts children on the shell's behalf. It is
+   * forked once, keeps only its socket, and receives every launch request
+   * over a SOCK_SEQPACKET socketpair: argv, envp and the redirections in
+   * the message, stdin, stdout, stderr and the working directory as
+   * SCM_RIGHTS. It starts each child with clone(CLONE_VM | CLONE_VFORK |
+   * CLONE_PARENT), so the child belongs to the shell, which reaps it and
+   * puts it in process groups exactly as if it had spawned it itself.
+   */
+
+  struct zygote
+  {
+    pid_t pid; /* -1 when not running */
+    int sock;
+    char *buf; /* request being built */
+  };
+
+  /**
+   * @brief Initialize a zygote that is not running.
+   *
+   * @param z The zygote
+   */
+  void zygote_init(struct zygote *z);
+
+  /**
+   * @brief Fork the helper process. Start it early, while the caller's
+   * address space is small: the helper never touches the memory it shares
+   * with the caller, but fork copies the page tables that map it.
+   *
+   * @param z The zygote
+   * @return 0 on success, -1 with errno set
+   */
+  int zygote_start(struct zygote *z);
+
+  /**
+   * @brief Close the socket, which ends the helper, and reap it.
+   *
+   * @param z The zygote
+   */
+  void zygote_stop(struct zygote *z);
+
+  /**
+   * @brief Start a child like lab_spawn, through the helper. Requests it
+   * cannot carry fail with ENOTSUP: child_fn, LAUNCH_FORCE_FORK, a NULL
+   * path, duplicating a descriptor above 2 and requests over 64 KiB. If
+   * the helper is gone it is stopped and the call fails with EPIPE. In
+   * both cases the caller can fall back to lab_spawn.
+   *
+   * @param z A started zygote
+   * @param l The request
+   * @return The child's pid or -1 with errno set
+   */
+  pid_t zygote_spawn(struct zygote *z, const struct launch *l);
+
+  /*
+   * Commands and pipelines
+   */
+
+  struct command
+  {
+    char **argv; /* NULL terminated, points into the line arena */
+    size_t argc;
+    struct redir *redirs;
+    size_t nredir;
+    bool cut; /* set by the optimizer: the stages before get SIGPIPE once it exits */
+  };
+
+  /* What separates a pipeline from the next one in a list */
+  enum list_op
+  {
+    LIST_SEQ, /* ; or end of line */
+    LIST_BG,  /* &  */
+    LIST_AND, /* && */
+    LIST_OR,  /* || */
+  };
+
+  struct pipeline
+  {
+    struct command *cmds;
+    size_t ncmds;
+    enum list_op op;
+  };
+
+  struct cmd_list
+  {
+    struct pipeline *pipes;
+    size_t npipes;
+  };
+
+  /**
+   * @brief Group the tokens of cl into pipelines of commands. All memory is
+   * carved from the cl arena and is released with the next tokenize.
+   *
+   * @param cl A tokenized line
+   * @param list Receives the parsed list
+   * @return 0 on success, -1 on a syntax error with cl->error set
+   */
+  int cmd_build(struct cmd_line *cl, struct cmd_list *list);
+
+  /*
+   * Command lookup cache
+   *
+   * Maps command names to the absolute path PATH resolves them to. Entries
+   * are filled lazily on first use. Every PATH directory is watched with
+   * inotify and any create, delete, rename or attribute change of a name in
+   * one of them drops that name from the table, so a hit never needs a
+   * stat() to be trusted.
+   */
+
+  struct path_entry
+  {
+    char *name; /* NULL marks an empty slot */
+    char *path;
+    uint32_t hash;
+  };
+
+  struct path_cache
+  {
+    struct path_entry *slots; /* open addressing, linear probing */
+    size_t cap;               /* always a power of two */
+    size_t count;
+    int inotify_fd;
+    char *path_env;           /* PATH the watches were created for */
+    size_t hits;
+    size_t misses;
+  };
+
+  /**
+   * @brief Initialize an empty cache.
+   *
+   * @param pc The cache
+   */
+  void path_cache_init(struct path_cache *pc);
+
+  /**
+   * @brief Free the table and close the inotify descriptor.
+   *
+   * @param pc The cache
+   */
+  void path_cache_destroy(struct path_cache *pc);
+
+  /**
+   * @brief Apply pending inotify events. Called by path_cache_lookup, an
+   * event loop may also call it when inotify_fd becomes readable.
+   *
+   * @param pc The cache
+   */
+  void path_cache_sync(struct path_cache *pc);
+
+  /**
+   * @brief Resolve name through the cache, walking PATH on a miss. If PATH
+   * changed since the last call the whole table is dropped first.
+   *
+   * @param pc The cache
+   * @param name A command name without a slash
+   * @return Absolute path owned by the cache, valid until the next call
+   * that modifies it, or NULL if name is not found
+   */
+  const char *path_cache_lookup(struct path_cache *pc, const char *name);
+
+  /**
+   * @brief Same as path_cache_lookup but searches path_env instead of the
+   * process's PATH, so every shell can search its own.
+   *
+   * @param pc The cache
+   * @param path_env Colon separated directories, NULL for a default PATH
+   * @param name A command name without a slash
+   * @return Absolute path owned by the cache or NULL if name is not found
+   */
+  const char *path_cache_lookup_env(struct path_cache *pc, const char *path_env, const char *name);
+
+  /**
+   * @brief Add or replace the path remembered for name.
+   *
+   * @param pc The cache
+   * @param name Command name
+   * @param path Path to remember
+   * @return 0 on success, -1 if out of memory
+   */
+  int path_cache_insert(struct path_cache *pc, const char *name, const char *path);
+
+  /**
+   * @brief Forget name.
+   *
+   * @param pc The cache
+   * @param name Command name
+   */
+  void path_cache_remove(struct path_cache *pc, const char *name);
+
+  /**
+   * @brief Forget every entry.
+   *
+   * @param pc The cache
+   */
+  void path_cache_clear(struct path_cache *pc);
+
+  /*
+   * Environment store
+   *
+   * Variables live in an open addressing table keyed by name. Exported
+   * ones are also in envp, the vector every exec is handed. Setting,
+   * exporting or removing a variable patches its one envp slot in place,
+   * so starting a command costs nothing however large the environment.
+   * A clone shares the table and envp with the store it was cloned from
+   * until either side changes a variable, which copies them first.
+   */
+
+  struct env_var
+  {
+    char *entry;       /* "NAME=value", NULL marks an empty slot */
+    uint32_t hash;     /* of the name */
+    uint32_t name_len;
+    size_t envp_index; /* slot in envp while exported */
+    bool exported;
+  };
+
+  struct env_data
+  {
+    size_t refs;           /* stores sharing this copy */
+    struct env_var *slots; /* open addressing, linear probing */
+    size_t cap;            /* always a power of two */
+    size_t count;
+    char **envp;           /* exported entries, NULL terminated */
+    size_t nexported;
+    size_t envp_cap;
+  };
+
+  struct env_store
+  {
+    struct env_data *data;
+  };
+
+  /**
+   * @brief Initialize a store with the variables of vars, all exported.
+   *
+   * @param e The store
+   * @param vars NAME=value strings, NULL terminated, or NULL for none
+   * @return 0 on success, -1 if out of memory
+   */
+  int env_init(struct env_store *e, char *const *vars);
+
+  /**
+   * @brief Drop the store's reference to its variables.
+   *
+   * @param e The store
+   */
+  void env_destroy(struct env_store *e);
+
+  /**
+   * @brief Make dst share src's variables copy-on-write, in O(1). Either
+   * store may be used from another thread afterwards.
+   *
+   * @param dst An uninitialized store
+   * @param src The store to share
+   */
+  void env_clone(struct env_store *dst, const struct env_store *src);
+
+  /**
+   * @brief Look up a variable.
+   *
+   * @param e The store
+   * @param name Variable name
+   * @return The value, valid until the store changes, or NULL
+   */
+  const char *env_get(const struct env_store *e, const char *name);
+
+  /**
+   * @brief Set a variable. A new variable is exported if exported is set,
+   * an existing one keeps its export state unless exported is set.
+   *
+   * @param e The store
+   * @param name Variable name, must not be empty or contain '='
+   * @param value The value
+   * @param exported Export the variable
+   * @return 0 on success, -1 with errno set
+   */
+  int env_set(struct env_store *e, const char *name, const char *value, bool exported);
+
+  /**
+   * @brief Remove a variable if it is set.
+   *
+   * @param e The store
+   * @param name Variable name
+   * @return 0 on success, -1 if out of memory copying a shared store
+   */
+  int env_unset(struct env_store *e, const char *name);
+
+  /**
+   * @brief Add a set variable to envp or take it out again.
+   *
+   * @param e The store
+   * @param name Variable name
+   * @param exported Whether commands see it
+   * @return 0 on success, -1 with errno ENOENT if name is not set
+   */
+  int env_export(struct env_store *e, const char *name, bool exported);
+
+  /**
+   * @brief The environment for exec, already up to date.
+   *
+   * @param e The store
+   * @return NULL terminated NAME=value vector, valid until the store changes
+   */
+  char *const *env_envp(const struct env_store *e);
+
+  /*
+   * Persistent history
+   *
+   * An append-only binary log mapped with mmap. Each distinct line is
+   * stored once; running it again appends a small record that refers back
+   * to the first copy. A hash index over the distinct lines lives in a
+   * second mapped file (<log>.idx) so opening the store only maps the two
+   * files and indexes records other shells appended since. Substring search
+   * uses an in-memory trigram index built on the first search.
+   */
+
+  /* Lines containing one trigram, as log offsets of their text records */
+  struct hist_trigram
+  {
+    uint32_t key;   /* three bytes plus one, 0 marks an empty slot */
+    uint32_t count;
+    uint32_t cap;
+    uint64_t *offs;
+  };
+
+  struct hist_store
+  {
+    int fd;                    /* log, -1 when closed */
+    int idx_fd;
+    char *map;
+    size_t map_len;
+    char *idx;
+    size_t idx_len;
+    struct hist_trigram *tri; /* open addressing, linear probing */
+    size_t tri_cap;           /* always a power of two */
+    size_t tri_count;
+    uint64_t tri_end;         /* log offset the trigram index covers */
+  };
+
+  /**
+   * @brief Initialize a closed store.
+   *
+   * @param h The store
+   */
+  void hist_init(struct hist_store *h);
+
+  /**
+   * @brief Open or create the log at path and its index. Cost does not
+   * depend on the size of the log unless the index is missing or stale.
+   *
+   * @param h The store
+   * @param path Log file
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int hist_open(struct hist_store *h, const char *path);
+
+  /**
+   * @brief Unmap and close the store.
+   *
+   * @param h The store
+   */
+  void hist_close(struct hist_store *h);
+
+  /**
+   * @brief Append line, storing its text only if it was never seen before.
+   *
+   * @param h The store
+   * @param line Line without the trailing newline
+   * @return 0 on success, -1 on failure
+   */
+  int hist_add(struct hist_store *h, const char *line);
+
+  /**
+   * @brief Find distinct lines containing query, most recently used first.
+   *
+   * @param h The store
+   * @param query Substring to look for
+   * @param skip Number of newer matches to skip
+   * @return The line, valid until the next call on h, or NULL
+   */
+  const char *hist_search(struct hist_store *h, const char *query, size_t skip);
+
+  /**
+   * @brief Collect the newest entries by walking the log backwards.
+   *
+   * @param h The store
+   * @param lines Receives up to max lines, oldest first, valid until the
+   * next call on h
+   * @param max Capacity of lines
+   * @return Number of lines stored
+   */
+  size_t hist_recent(struct hist_store *h, const char **lines, size_t max);
+
+  /**
+   * @brief Write every entry in order as a plain text history file that
+   * readline's read_history understands.
+   *
+   * @param h The store
+   * @param fd Destination
+   * @return 0 on success, -1 on failure
+   */
+  int hist_export(struct hist_store *h, int fd);
+
+  /**
+   * @brief Number of entries and distinct lines in the store.
+   *
+   * @param h The store
+   * @param distinct Receives the number of distinct lines, may be NULL
+   * @return Number of entries
+   */
+  size_t hist_count(struct hist_store *h, size_t *distinct);
+
+  /*
+   * Completion
+   *
+   * Command names come from a sorted array of every executable on PATH,
+   * built on a background thread so the prompt never waits for it; the
+   * matches for a prefix are one contiguous range found by binary search.
+   * File names come from a small cache of directory listings that is
+   * checked against the directory's mtime on every use.
+   */
+
+  /* Sorted, duplicate free names sharing one string block, the ones
+   * starting with a dot sorted after all others */
+  struct name_index
+  {
+    char **names;
+    size_t count;
+    char *block;
+    size_t hidden;               /* names from here on start with a dot */
+    struct timespec *dir_mtimes; /* of each PATH directory when it was read */
+    size_t ndirs;
+  };
+
+  struct dir_listing
+  {
+    char *dir;              /* NULL marks an empty entry */
+    struct timespec mtime;
+    dev_t dev;
+    ino_t ino;
+    struct name_index names;
+    uint64_t used;          /* for evicting the least recently used */
+  };
+
+  #define COMPLETER_DIRS 16
+
+  struct completer
+  {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool building;              /* thread has to be joined */
+    bool finished;              /* thread is done, under lock */
+    char *path_env;             /* PATH of the newest build */
+    struct name_index *commands;/* NULL until the first build finished */
+    struct name_index *pending; /* finished build not yet adopted, under lock */
+    struct dir_listing dirs[COMPLETER_DIRS];
+    uint64_t clock;
+    size_t dir_hits;
+    size_t dir_misses;
+  };
+
+  /**
+   * @brief Initialize an empty completer.
+   *
+   * @param c The completer
+   */
+  void completer_init(struct completer *c);
+
+  /**
+   * @brief Wait for a running build and free everything.
+   *
+   * @param c The completer
+   */
+  void completer_destroy(struct completer *c);
+
+  /**
+   * @brief Index the executables of path on a background thread. Lookups
+   * keep using the previous index until the new one is ready.
+   *
+   * @param c The completer
+   * @param path Colon separated directories, NULL for the current PATH
+   * @return 0 on success, -1 if the thread could not be started
+   */
+  int completer_start(struct completer *c, const char *path);
+
+  /**
+   * @brief Block until a running build finished.
+   *
+   * @param c The completer
+   */
+  void completer_wait(struct completer *c);
+
+  /**
+   * @brief Start a new build if PATH or one of its directories changed
+   * since the last one.
+   *
+   * @param c The completer
+   * @param path Colon separated directories, NULL for the current PATH
+   */
+  void completer_refresh(struct completer *c, const char *path);
+
+  /**
+   * @brief Find the commands starting with prefix. Never blocks on a build
+   * in progress, there are no matches before the first one finished.
+   *
+   * @param c The completer
+   * @param prefix Start of a command name
+   * @param names Receives the first match, valid until the next call
+   * @return Number of matches
+   */
+  size_t completer_commands(struct completer *c, const char *prefix, char *const **names);
+
+  /**
+   * @brief Find the entries of dir starting with prefix through the
+   * listing cache. Names starting with a dot only match such a prefix.
+   *
+   * @param c The completer
+   * @param dir Directory to list
+   * @param prefix Start of an entry name
+   * @param names Receives the first match, valid until the next call
+   * @return Number of matches
+   */
+  size_t completer_files(struct completer *c, const char *dir, const char *prefix, char *const **names);
+
+  /*
+   * Stat cache
+   *
+   * test, [ and [[ look up file metadata through a handful of results kept
+   * for the current command line, so [ -e f ] && [ -f f ] && [ -r f ]
+   * costs one fstatat. Failures are kept as well. The shell clears the
+   * cache at the start of every line and before any command other than
+   * the test builtins runs, since that command may change the file system.
+   */
+
+  #define STAT_CACHE_SIZE 16
+  #define STAT_CACHE_PATH 256 /* longer paths are never cached */
+
+  struct stat_entry
+  {
+    uint32_t hash;
+    bool follow; /* stat, else lstat */
+    int err;     /* errno of the call, 0 when st is valid */
+    struct stat st;
+    char path[STAT_CACHE_PATH];
+  };
+
+  struct stat_cache
+  {
+    bool enabled;
+    int dir_fd; /* what the cached relative paths are relative to */
+    size_t count;
+    size_t next; /* entry replaced once all are in use */
+    struct stat_entry entries[STAT_CACHE_SIZE];
+    size_t hits;
+    size_t misses;
+  };
+
+  /**
+   * @brief Initialize an empty, enabled cache.
+   *
+   * @param sc The cache
+   */
+  void stat_cache_init(struct stat_cache *sc);
+
+  /**
+   * @brief Forget every cached result.
+   *
+   * @param sc The cache
+   */
+  void stat_cache_clear(struct stat_cache *sc);
+
+  /**
+   * @brief fstatat path relative to dir_fd, answered from the cache when
+   * the same path was looked up the same way since the last clear.
+   *
+   * @param sc The cache
+   * @param dir_fd Directory relative paths start from
+   * @param path The file
+   * @param follow Follow a final symbolic link, like stat rather than lstat
+   * @param st Receives the metadata
+   * @return 0 on success, -1 with errno set
+   */
+  int stat_cache_get(struct stat_cache *sc, int dir_fd, const char *path, bool follow, struct stat *st);
+
+  /*
+   * Ring buffers
+   */
+
+  /* Capacity of the rings between builtin stages running on threads */
+  #define RING_SIZE (256 * 1024)
+
+  /* A bounded byte queue between one writer thread and one reader thread.
+   * Data is copied in and out without the lock held; the lock only guards
+   * the positions and the closed flags. */
+  struct ring
+  {
+    pthread_mutex_t lock;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+    char *buf;
+    size_t cap;
+    size_t head;       /* bytes read so far */
+    size_t tail;       /* bytes written so far */
+    bool write_closed; /* no more data: the reader gets end of file */
+    bool read_closed;  /* nobody reads: the writer gets EPIPE */
+  };
+
+  /**
+   * @brief Initialize an empty ring.
+   *
+   * @param r The ring
+   * @param cap Capacity in bytes
+   * @return 0 on success, -1 if the buffer could not be allocated
+   */
+  int ring_init(struct ring *r, size_t cap);
+
+  /**
+   * @brief Free the buffer. Both sides must be done with the ring.
+   *
+   * @param r The ring
+   */
+  void ring_destroy(struct ring *r);
+
+  /**
+   * @brief Empty the ring and reopen both sides for another use. Nobody
+   * may be using it meanwhile.
+   *
+   * @param r The ring
+   */
+  void ring_reset(struct ring *r);
+
+  /**
+   * @brief Wait for free space and return where the next bytes go. Once
+   * written, ring_commit() hands them to the reader.
+   *
+   * @param r The ring
+   * @param len Receives how many contiguous bytes may be written
+   * @return The space, or NULL with errno EPIPE once the reader closed
+   */
+  void *ring_reserve(struct ring *r, size_t *len);
+
+  /**
+   * @brief Make len bytes written to the space of ring_reserve() readable.
+   *
+   * @param r The ring
+   * @param len At most what ring_reserve() returned
+   */
+  void ring_commit(struct ring *r, size_t len);
+
+  /**
+   * @brief Wait for data and return the oldest unread bytes. ring_consume()
+   * frees them once the reader is done with them.
+   *
+   * @param r The ring
+   * @param len Receives how many contiguous bytes are readable, 0 at end of file
+   * @return The data
+   */
+  const void *ring_peek(struct ring *r, size_t *len);
+
+  /**
+   * @brief Free len bytes returned by ring_peek() for the writer.
+   *
+   * @param r The ring
+   * @param len At most what ring_peek() returned
+   */
+  void ring_consume(struct ring *r, size_t len);
+
+  /**
+   * @brief Copy all of data into the ring, waiting while it is full.
+   *
+   * @param r The ring
+   * @param data The bytes
+   * @param len How many
+   * @return 0 on success, -1 with errno EPIPE once the reader closed
+   */
+  int ring_write(struct ring *r, const void *data, size_t len);
+
+  /**
+   * @brief Copy up to len bytes out of the ring, waiting while it is empty.
+   *
+   * @param r The ring
+   * @param buf Receives the bytes
+   * @param len Room in buf
+   * @return Bytes read, 0 at end of file
+   */
+  size_t ring_read(struct ring *r, void *buf, size_t len);
+
+  /**
+   * @brief Writer side: no more data follows.
+   *
+   * @param r The ring
+   */
+  void ring_close_write(struct ring *r);
+
+  /**
+   * @brief Reader side: nothing more is read. Data still in the ring is
+   * dropped and writes fail with EPIPE.
+   *
+   * @param r The ring
+   */
+  void ring_close_read(struct ring *r);
+
+  /*
+   * Shell instance
+   */
+
+  struct stage_worker;
+
+  /* Default capacity requested for pipes between pipeline stages */
+  #define SH_PIPE_SIZE (1024 * 1024)
+
+  /* One process of a running pipeline */
+  struct proc
+  {
+    pid_t pid;
+    int pidfd;  /* readable once the process exits, -1 after reaping */
+    int status; /* shell exit status once done */
+    bool done;
+    bool stopped;
+    bool cut;   /* the processes before it are ended when it exits */
+  };
+
+  /* A pipeline the shell started and has not finished reaping */
+  struct job
+  {
+    struct job *next;   /* link in the finished-job notification queue */
+    int id;             /* job number, also its slot in the job table */
+    char *text;         /* command text shown by jobs */
+    pid_t pgid;
+    struct proc *procs;
+    size_t nprocs;
+    size_t nalive;      /* processes not reaped yet */
+    int status;         /* status of the last stage */
+    bool last_is_proc;  /* last stage is procs[nprocs - 1], else a builtin */
+    bool background;
+    bool stopped;
+  };
+
+  /* Entry of the pid index: which job and process a pid belongs to */
+  struct pid_slot
+  {
+    pid_t pid; /* 0 marks an empty slot */
+    uint32_t job_id;
+    uint32_t proc;
+  };
+
+  /*
+   * Every job the shell knows about. Jobs live in a slot map indexed by job
+   * id with a free list of ids, and an open-addressing index maps each
+   * unreaped pid to its job and process, so lookups by job id and by pid
+   * are both O(1). Each process's pidfd is registered with epoll_fd, which
+   * becomes readable when any child exits: only the ready children are
+   * reaped, no matter how many are outstanding.
+   */
+  struct job_table
+  {
+    struct job **slots;    /* slots[id - 1], NULL when free */
+    uint32_t *free_ids;    /* stack of released ids */
+    size_t nfree;
+    size_t cap;
+    size_t count;          /* jobs in the table */
+    size_t nbackground;    /* background jobs with live processes */
+    struct pid_slot *pids;
+    size_t pid_cap;        /* always a power of two */
+    size_t pid_count;
+    int epoll_fd;
+    int current;           /* job %+, 0 when unknown */
+    struct job *done;      /* finished background jobs not reported yet */
+  };
+
+  /**
+   * @brief Initialize an empty job table.
+   *
+   * @param jt The table
+   * @return 0 on success, -1 with errno set
+   */
+  int job_table_init(struct job_table *jt);
+
+  /**
+   * @brief Free every job and close all descriptors. Processes are not
+   * waited for.
+   *
+   * @param jt The table
+   */
+  void job_table_destroy(struct job_table *jt);
+
+  /**
+   * @brief Look up a job by id.
+   *
+   * @param jt The table
+   * @param id Job number
+   * @return The job or NULL
+   */
+  struct job *job_table_get(struct job_table *jt, int id);
+
+  /**
+   * @brief Look up the job an unreaped pid belongs to.
+   *
+   * @param jt The table
+   * @param pid Process id
+   * @param proc Receives the process, may be NULL
+   * @return The job or NULL
+   */
+  struct job *job_table_find_pid(struct job_table *jt, pid_t pid, struct proc **proc);
+
+  /* Where the shell is in the list of pipelines of the current line */
+  struct run_state
+  {
+    struct cmd_list list;
+    size_t next;     /* next pipeline to consider */
+    enum list_op op; /* operator after the pipeline that ran last */
+  };
+
+  struct shell
+  {
+    int shell_is_interactive;
+    pid_t shell_pgid;
+    struct termios shell_tmodes;
+    int shell_terminal;
+    char *prompt;
+    struct cmd_line line;  /* reused for every line the shell runs */
+    int last_status;       /* exit status of the last pipeline */
+    int pipe_size;         /* F_SETPIPE_SZ request, 0 keeps the default */
+    struct path_cache paths;
+    struct hist_store history;
+    struct completer completer;
+    struct run_state run;
+    struct job *fg;        /* foreground job the line is waiting for */
+    struct job *resume;    /* job fg asked to bring to the foreground */
+    struct job_table jobs;
+    int epoll_fd;          /* event loop, -1 when not running */
+    int signal_fd;
+    int input_fd;
+    bool exit_requested;
+    struct env_store env;  /* variables, the exported ones go to commands */
+    int cwd_fd;            /* the shell's working directory, O_PATH */
+    char *cwd;             /* and its absolute path */
+    struct stat_cache stats; /* file tests of the current line */
+    bool use_zygote;       /* launch commands through zygote */
+    bool use_coreutils;    /* run cat, echo, head, printf, tail and wc in the shell */
+    bool optimize;         /* rewrite pipelines before running them */
+    bool use_threads;      /* run consecutive utility builtin stages on threads joined by rings */
+    struct stage_worker **workers; /* threads running those stages, kept between runs */
+    size_t nworkers;
+    struct zygote zygote;  /* forked the first time it is used */
+  };
+
+  /* Descriptors a builtin reads from and writes to */
+  struct builtin_io
+  {
+    int in;
+    int out;
+    int err;
+    bool in_stage; /* in is the output of a builtin stage, a memfd standing in for a pipe */
+    struct ring *in_ring;  /* input comes from the stage before on another thread, in is -1 */
+    struct ring *out_ring; /* output goes to the stage after on another thread, out is -1 */
+  };
+
+  typedef int (*builtin_fn)(struct shell *sh, char **argv, struct builtin_io *io);
+
+  struct builtin
+  {
+    const char *name;
+    builtin_fn fn;
+  };
+
+  /**
+   * Dispatch table indexed by a minimal perfect hash of the builtin names.
+   * The hash and the slot of every builtin are generated at build time by
+   * tools/phash-gen from src/builtins.def.
+   */
+  extern const struct builtin builtin_table[];
+  extern const size_t builtin_table_size;
+
+  /**
+   * @brief Find the builtin called name with a single hash probe and one
+   * string compare to reject names that are not builtins.
+   *
+   * @param name Command name
+   * @return The builtin or NULL if name is not a builtin
+   */
+  const struct builtin *builtin_lookup(const char *name);
+
+  /**
+   * @brief Initialize the shell. When stdin is a terminal the shell puts
+   * itself in its own process group, takes the terminal and ignores the
+   * job control signals.
+   *
+   * Everything a shell changes - its environment, working directory,
+   * history, jobs and options - lives in struct shell, so independent
+   * shells can run on different threads of one process. The environment
+   * starts as a copy of environ and the working directory as the process's;
+   * neither is changed for the process. Only sh_loop uses process wide
+   * state, the terminal and readline, and runs for one shell at a time.
+   *
+   * @param sh The shell
+   */
+  void sh_init(struct shell *sh);
+
+  /**
+   * @brief Initialize a non-interactive shell that starts with parent's
+   * working directory and shares its environment copy-on-write, so
+   * creating it costs the same however many variables parent has.
+   *
+   * @param sh The new shell
+   * @param parent The shell it inherits from
+   */
+  void sh_init_subshell(struct shell *sh, const struct shell *parent);
+
+  /**
+   * @brief Release everything owned by the shell.
+   *
+   * @param sh The shell
+   */
+  void sh_destroy(struct shell *sh);
+
+  /**
+   * @brief Look up a variable in the shell's environment.
+   *
+   * @param sh The shell
+   * @param name Variable name
+   * @return The value, valid until the variable changes, or NULL
+   */
+  const char *sh_getenv(const struct shell *sh, const char *name);
+
+  /**
+   * @brief Set a variable in the shell's environment, which every command
+   * the shell starts inherits.
+   *
+   * @param sh The shell
+   * @param name Variable name, must not contain '='
+   * @param value The value, NULL removes the variable
+   * @return 0 on success, -1 with errno set
+   */
+  int sh_setenv(struct shell *sh, const char *name, const char *value);
+
+  /**
+   * @brief Change the shell's working directory and PWD. Relative paths
+   * are resolved against the current one; the process's cwd is untouched.
+   *
+   * @param sh The shell
+   * @param dir The new directory
+   * @return 0 on success, -1 with errno set
+   */
+  int sh_chdir(struct shell *sh, const char *dir);
+
+  /**
+   * @brief Read the prompt from the environment variable env, falling back
+   * to "shell>". The caller frees the result.
+   *
+   * @param env Name of the environment variable
+   * @return The prompt
+   */
+  char *get_prompt(const char *env);
+
+  /**
+   * @brief Run one pipeline. Each external stage is started with lab_spawn
+   * and connected with pipe2(O_CLOEXEC) pipes grown to sh->pipe_size.
+   * Builtin stages run inside the shell; when a builtin feeds a later
+   * stage its output is collected in a memfd that becomes that stage's
+   * stdin directly, so no bytes are copied through a pipe.
+   *
+   * @param sh The shell
+   * @param p The pipeline
+   * @param background Do not wait for the pipeline to finish
+   * @return Exit status of the last stage
+   */
+  int sh_run_pipeline(struct shell *sh, const struct pipeline *p, bool background);
+
+  /**
+   * @brief Parse line and start running it without blocking. Pipelines run
+   * until one has to wait for a foreground job, which is left in sh->fg.
+   * The rest of the line runs from sh_job_event once that job finishes.
+   *
+   * @param sh The shell
+   * @param line The line
+   * @param len Length of line
+   * @return true while the line waits for a foreground job
+   */
+  bool sh_submit(struct shell *sh, const char *line, size_t len);
+
+  /**
+   * @brief Reap whatever processes of pid's job have changed state without
+   * blocking and continue the current line if its foreground job finished.
+   *
+   * @param sh The shell
+   * @param pid A child whose pidfd became readable
+   * @return true while the line still waits for a foreground job
+   */
+  bool sh_job_event(struct shell *sh, pid_t pid);
+
+  /**
+   * @brief Reap every child whose pidfd is ready, waiting up to timeout_ms
+   * for the first one (-1 waits forever, 0 only collects what is ready).
+   *
+   * @param sh The shell
+   * @param timeout_ms How long to wait
+   * @return Number of ready children handled
+   */
+  int sh_reap_ready(struct shell *sh, int timeout_ms);
+
+  /**
+   * @brief Interactive main loop. Input is read with readline's callback
+   * interface and everything the shell waits for - the terminal, SIGCHLD,
+   * SIGWINCH and SIGINT through a signalfd, child pidfds and the PATH
+   * watches - is multiplexed with one epoll so the shell never blocks on a
+   * child or a slow terminal. readline keeps its state in globals, so only
+   * one shell of the process can be in sh_loop at a time.
+   *
+   * @param sh The shell
+   * @return Exit status for the shell, 1 if another shell owns the loop
+   */
+  int sh_loop(struct shell *sh);
+
+  /**
+   * @brief Tokenize, parse and run a line.
+   *
+   * @param sh The shell
+   * @param line The line
+   * @param len Length of line
+   * @return Exit status of the last pipeline that ran
+   */
+  int sh_execute(struct shell *sh, const char *line, size_t len);
+
+  /**
+   * @brief Print the plan set -o optimize turns the pipelines of a line
+   * into, without running anything: each pipeline as written, one line
+   * per rewrite and the pipeline that would run after "=>". Files are
+   * looked up relative to the shell's working directory as they would be
+   * when the line runs.
+   *
+   * @param sh The shell
+   * @param line The line
+   * @param len Length of line
+   * @param fd Where to write the plan
+   * @return 0, or -1 after printing the syntax error of a line that does
+   * not parse
+   */
+  int sh_explain(struct shell *sh, const char *line, size_t len, int fd);
+
+  /*
+   * Batch input
+   *
+   * Hands out the lines of a script that is not typed at a terminal. A
+   * regular file is mapped and read ahead sequentially, its lines are
+   * parsed straight from the mapping. Pipes and other descriptors are read
+   * in large chunks into one buffer that every line reuses.
+   */
+
+  /* Size of the buffer for input that cannot be mapped, it grows for
+   * longer lines */
+  #define BATCH_BUFFER (64 * 1024)
+
+  struct batch_input
+  {
+    int fd;
+    const char *data; /* the mapping, or buf */
+    size_t len;       /* bytes at data */
+    size_t pos;       /* where the next line starts */
+    size_t line;      /* number of the last line handed out */
+    char *buf;        /* for input that cannot be mapped */
+    size_t cap;
+    bool mapped;
+    bool eof;
+    bool seek;        /* share the offset of fd with commands that read
+                       * the same file: they start after the current
+                       * line, and what they read is skipped */
+    int error;        /* errno of a failed read */
+  };
+
+  /**
+   * @brief Start reading lines from fd, at its current offset.
+   *
+   * @param in The input
+   * @param fd The script, which the caller keeps open and closes
+   * @return 0 on success, -1 with errno set
+   */
+  int batch_open(struct batch_input *in, int fd);
+
+  /**
+   * @brief Return the next line, including its newline. It is not NUL
+   * terminated and stays valid until the next call.
+   *
+   * @param in The input
+   * @param len Receives the length of the line
+   * @return The line, or NULL at the end of the input or on an error with
+   * in->error set
+   */
+  const char *batch_line(struct batch_input *in, size_t *len);
+
+  /**
+   * @brief Release the mapping or buffer of in.
+   *
+   * @param in The input
+   */
+  void batch_close(struct batch_input *in);
+
+  /**
+   * @brief Run every line of fd like sh_execute until the input ends or
+   * the script exits.
+   *
+   * @param sh The shell
+   * @param fd The script
+   * @return Exit status of the last line, or -1 with errno set if fd cannot
+   * be read
+   */
+  int sh_run_batch(struct shell *sh, int fd);
+
+  /*
+   * Compiled scripts
+   *
+   * A script is compiled once into instructions that run its lines the way
+   * sh_execute would, with the commands already parsed into flat records.
+   * Code, records and strings share one buffer, which is also written as
+   * is next to the script, in script.labc. A script whose device, inode,
+   * size and modification time still match the cache skips parsing. A
+   * cache is mapped and checked as it runs, so loading one does not grow
+   * with the script.
+   */
+
+  /* Suffix added to a script's path for its cache */
+  #define PROGRAM_SUFFIX ".labc"
+
+  struct program
+  {
+    void *image;           /* header, code, records and strings */
+    size_t size;
+    bool mapped;           /* image maps a cache file rather than being malloced */
+    const uint32_t *code;
+    size_t ncode;
+    const uint32_t *data;  /* pipeline records the code refers to */
+    size_t ndata;
+    char *strings;         /* NUL terminated words the records refer to */
+    size_t nstrings;
+    size_t errors;         /* lines that did not parse */
+  };
+
+  /**
+   * @brief Compile a script. Lines that do not parse become instructions
+   * that report the error when they run, as sh_execute would.
+   *
+   * @param prog Receives the program
+   * @param text The script
+   * @param len Length of text
+   * @param st The script's metadata, kept as the cache key; NULL for none
+   * @return 0 on success, -1 with errno set
+   */
+  int program_compile(struct program *prog, const char *text, size_t len, const struct stat *st);
+
+  /**
+   * @brief Load a cache written by program_write.
+   *
+   * @param prog Receives the program
+   * @param path The cache file
+   * @param st The script's metadata the cache has to have been compiled from
+   * @return 0 on success, -1 with errno set: ESTALE when the script changed,
+   * EINVAL when the file is not a valid cache. Instructions are checked as
+   * they run, damage past the header stops the program there.
+   */
+  int program_open(struct program *prog, const char *path, const struct stat *st);
+
+  /**
+   * @brief Write prog to path, replacing it atomically.
+   *
+   * @param prog The program
+   * @param path The cache file
+   * @return 0 on success, -1 with errno set
+   */
+  int program_write(const struct program *prog, const char *path);
+
+  /**
+   * @brief Print every line of prog that did not parse, as name:line: error.
+   *
+   * @param prog The program
+   * @param name The script's name
+   * @param fd Where to print
+   */
+  void program_report(const struct program *prog, const char *name, int fd);
+
+  /**
+   * @brief Free a program.
+   *
+   * @param prog The program
+   */
+  void program_destroy(struct program *prog);
+
+  /**
+   * @brief Compile the script at path, or load its cache when it is
+   * current. A stale or missing cache is rewritten; one that cannot be
+   * written is not an error.
+   *
+   * @param prog Receives the program
+   * @param path The script
+   * @param cached Set to whether the cache was current, may be NULL
+   * @return 0 on success, -1 with errno set if the script cannot be read
+   */
+  int script_compile(struct program *prog, const char *path, bool *cached);
+
+  /**
+   * @brief Run a program in sh, waiting for every foreground job.
+   *
+   * @param sh The shell
+   * @param prog The program
+   * @return Exit status of the last pipeline that ran
+   */
+  int sh_run_program(struct shell *sh, const struct program *prog);
+
+  /**
+   * @brief Run the script at path from its cache when that is current.
+   * Otherwise every line is compiled just before it runs, and the cache is
+   * written once the whole script has been read; a script that exits
+   * before its last line leaves none.
+   *
+   * @param sh The shell
+   * @param path The script
+   * @return Exit status of the script, or -1 with errno set if it cannot be
+   * read
+   */
+  int sh_run_script(struct shell *sh, const char *path);
+
+  /*
+   * Server
+   *
+   * A server keeps initialized shells warm in pre-forked worker processes
+   * that accept requests on a Unix stream socket. A client passes its
+   * stdin, stdout, stderr and working directory as SCM_RIGHTS along with
+   * the command and its environment. Commands therefore write to the
+   * client's own descriptors while they run, and the reply carries only
+   * the exit status. Between requests a worker keeps its command lookup
+   * cache and options; each request brings its own environment and
+   * working directory.
+   */
+
+  /**
+   * @brief Listen on path and serve requests with workers processes until
+   * SIGINT, SIGTERM or SIGHUP. A worker killed by a signal is replaced.
+   * A stale socket at path is removed first, any other file is an error.
+   *
+   * @param path Socket path
+   * @param workers Number of worker processes, at least 1
+   * @return 0 after a clean shutdown, -1 with errno set
+   */
+  int sh_server(const char *path, int workers);
+
+  /**
+   * @brief Run command on the server listening on path, in the caller's
+   * working directory, environment and standard descriptors.
+   *
+   * @param path Socket path
+   * @param command The line to run
+   * @param len Length of command
+   * @return Exit status of the command, or -1 with errno set. EPROTO means
+   * the request was delivered but no status came back; with any other
+   * errno the command did not run.
+   */
+  int sh_client(const char *path, const char *command, size_t len);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef PHASH_H
+#define PHASH_H
+#include <stdint.h>
+
+/*
+ * Hash shared by tools/phash-gen and the shell so the generated tables and
+ * the runtime lookup agree. The scheme is hash and displace: the unseeded
+ * hash picks an entry of g. A positive entry is the seed that sends every
+ * key of that bucket to a distinct slot, a negative entry -(slot + 1)
+ * places a single key directly.
+ */
+
+static inline uint32_t phash_str(uint32_t seed, const char *s)
+{
+  /* FNV-1a with the seed folded into the offset basis */
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  while (*s)
+    {
+      h ^= (unsigned char)*s++;
+      h *= 16777619u;
+    }
+  return h;
+}
+
+static inline uint32_t phash_slot(const int32_t *g, uint32_t n, const char *key)
+{
+  int32_t d = g[phash_str(0, key) % n];
+  if (d < 0)
+    return (uint32_t)(-d - 1);
+  return phash_str((uint32_t)d, key) % n;
+}
+
+#endif
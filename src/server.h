@@ -0,0 +1,69 @@
+#ifndef SERVER_H
+#define SERVER_H
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Wire format shared by the server in lab.c and sh_client in client.c,
+ * which tools/lab-client links without the rest of the shell. A request
+ * is a struct server_request sent together with SERVER_FDS descriptors
+ * (stdin, stdout, stderr and the working directory), followed by the
+ * command and then the environment as nenv NUL terminated strings. The
+ * reply is one struct server_reply once the command finished.
+ */
+
+#define SERVER_MAGIC 0x6c616273u /* "labs" */
+#define SERVER_FDS 4
+
+struct server_request
+{
+  uint32_t magic;
+  uint32_t cmd_len;
+  uint32_t env_len;
+  uint32_t nenv;
+};
+
+struct server_reply
+{
+  uint32_t magic;
+  int32_t status;
+};
+
+static inline int server_send(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0)
+    {
+      ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return -1;
+      p += n;
+      len -= (size_t)n;
+    }
+  return 0;
+}
+
+static inline int server_recv(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0)
+    {
+      ssize_t n = recv(fd, p, len, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          if (n == 0)
+            errno = ECONNRESET;
+          return -1;
+        }
+      p += n;
+      len -= (size_t)n;
+    }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,881 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+#include "harness/unity.h"
+#include "../src/lab.h"
+
+/*
+ * Benchmarks for the shell library. These are regular Unity tests that
+ * print their measurements, they only fail if the code under test breaks.
+ */
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+#define NELEMS_B(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* A generated command line of roughly size bytes mixing plain, quoted and
+ * escaped words with a few operators. */
+static char *make_line(size_t size, size_t *len)
+{
+  static const char *parts[] = {
+      "--flag=value ", "'single quoted arg' ", "\"double \\\"q\\\" $x\" ",
+      "plain ", "esc\\ aped ", "| ", "2>&1 ", "/usr/local/bin/tool ",
+  };
+  char *line = malloc(size + 64);
+  size_t n = 0;
+  for (size_t i = 0; n < size; i++)
+    {
+      const char *p = parts[i % (sizeof(parts) / sizeof(parts[0]))];
+      size_t l = strlen(p);
+      memcpy(line + n, p, l);
+      n += l;
+    }
+  *len = n;
+  return line;
+}
+
+static void bench_tokenize_size(size_t size, int lines)
+{
+  size_t len;
+  char *line = make_line(size, &len);
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+
+  /* warm up the arena */
+  TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(&cl, line, len));
+
+  size_t tokens = 0;
+  size_t mallocs = cl.arena.mallocs;
+  double start = now_sec();
+  for (int i = 0; i < lines; i++)
+    {
+      TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(&cl, line, len));
+      tokens += cl.ntok;
+    }
+  double elapsed = now_sec() - start;
+  mallocs = cl.arena.mallocs - mallocs;
+
+  printf("tokenize %7zu byte line: %10.0f tokens/s, %.3f heap allocs/line\n",
+         len, (double)tokens / elapsed, (double)mallocs / lines);
+  cmd_line_destroy(&cl);
+  free(line);
+}
+
+void bench_tokenize(void)
+{
+  bench_tokenize_size(80, 100000);
+  bench_tokenize_size(4 * 1024, 5000);
+  bench_tokenize_size(256 * 1024, 100);
+}
+
+void bench_cmd_parse_strdup_baseline(void)
+{
+  /* cmd_parse copies every line into a fresh allocation, the cost the
+   * arena tokenizer avoids */
+  size_t len;
+  char *line = make_line(4 * 1024, &len);
+  line[len] = '\0';
+  double start = now_sec();
+  int lines = 5000;
+  for (int i = 0; i < lines; i++)
+    {
+      char **argv = cmd_parse(line);
+      TEST_ASSERT_NOT_NULL(argv);
+      cmd_free(argv);
+    }
+  double elapsed = now_sec() - start;
+  printf("cmd_parse  %7zu byte line: %10.0f lines/s\n", len, lines / elapsed);
+  free(line);
+}
+
+static double spawn_latency_us(int flags, int rounds)
+{
+  char *argv[] = {"/bin/true", NULL};
+  struct launch l;
+  launch_init(&l, argv);
+  l.path = argv[0];
+  l.flags = flags;
+  double start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    {
+      pid_t pid = lab_spawn(&l);
+      TEST_ASSERT_TRUE(pid > 0);
+      waitpid(pid, NULL, 0);
+    }
+  return (now_sec() - start) / rounds * 1e6;
+}
+
+void bench_spawn_vs_rss(void)
+{
+  static const size_t sizes_mb[] = {0, 64, 256};
+  for (size_t i = 0; i < sizeof(sizes_mb) / sizeof(sizes_mb[0]); i++)
+    {
+      /* Touch every page so it is resident and fork has to copy the page
+       * tables that map it */
+      size_t bytes = sizes_mb[i] << 20;
+      char *heap = bytes ? malloc(bytes) : NULL;
+      if (heap)
+        memset(heap, 1, bytes);
+      double fast = spawn_latency_us(0, 200);
+      double forked = spawn_latency_us(LAUNCH_FORCE_FORK, 200);
+      printf("spawn with %4zu MB resident: posix_spawn %8.1f us, fork+exec %8.1f us\n",
+             sizes_mb[i], fast, forked);
+      free(heap);
+    }
+}
+
+static double zygote_latency_us(struct zygote *z, int rounds)
+{
+  char *argv[] = {"/bin/true", NULL};
+  struct launch l;
+  launch_init(&l, argv);
+  l.path = argv[0];
+  double start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    {
+      pid_t pid = zygote_spawn(z, &l);
+      TEST_ASSERT_TRUE(pid > 0);
+      waitpid(pid, NULL, 0);
+    }
+  return (now_sec() - start) / rounds * 1e6;
+}
+
+void bench_zygote_vs_spawn(void)
+{
+  /* started while the process is small, the way a shell would at startup */
+  struct zygote z;
+  zygote_init(&z);
+  TEST_ASSERT_EQUAL_INT(0, zygote_start(&z));
+  static const size_t sizes_mb[] = {0, 256, 1024};
+  for (size_t i = 0; i < NELEMS_B(sizes_mb); i++)
+    {
+      size_t bytes = sizes_mb[i] << 20;
+      char *heap = bytes ? malloc(bytes) : NULL;
+      if (heap)
+        memset(heap, 1, bytes);
+      double fast = spawn_latency_us(0, 500);
+      double zygote = zygote_latency_us(&z, 500);
+      printf("launch+wait with %4zu MB resident: posix_spawn %7.1f us, zygote %7.1f us\n",
+             sizes_mb[i], fast, zygote);
+      free(heap);
+    }
+  zygote_stop(&z);
+}
+
+/* The strcmp chain builtin_lookup replaced, kept as the baseline */
+static const struct builtin *builtin_lookup_linear(const char *name)
+{
+  for (size_t i = 0; i < builtin_table_size; i++)
+    if (strcmp(builtin_table[i].name, name) == 0)
+      return &builtin_table[i];
+  return NULL;
+}
+
+static void bench_lookup(const char *label, const struct builtin *(*lookup)(const char *),
+                         const char *const *names, size_t n, bool expect_hit)
+{
+  const int rounds = 2000000;
+  size_t found = 0;
+  double start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    found += lookup(names[(size_t)i % n]) != NULL;
+  double elapsed = now_sec() - start;
+  TEST_ASSERT_EQUAL_size_t(expect_hit ? (size_t)rounds : 0, found);
+  printf("%-22s %7.1f ns/lookup\n", label, elapsed / rounds * 1e9);
+}
+
+void bench_builtin_dispatch(void)
+{
+  static const char *const hits[] = {"cd", "exit", "hash", "history", "pwd"};
+  static const char *const misses[] = {"ls", "grep", "sed", "awk", "make", "git", "find", "sort"};
+  bench_lookup("phash hits", builtin_lookup, hits, NELEMS_B(hits), true);
+  bench_lookup("phash misses", builtin_lookup, misses, NELEMS_B(misses), false);
+  bench_lookup("strcmp chain hits", builtin_lookup_linear, hits, NELEMS_B(hits), true);
+  bench_lookup("strcmp chain misses", builtin_lookup_linear, misses, NELEMS_B(misses), false);
+}
+
+void bench_history(void)
+{
+  /* a large history with many repeated commands */
+  const size_t entries = 200000;
+  char path[] = "/tmp/bench-lab-hist-XXXXXX";
+  char idx[64], text[64];
+  int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  close(fd);
+  snprintf(idx, sizeof(idx), "%s.idx", path);
+  snprintf(text, sizeof(text), "%s.txt", path);
+
+  struct hist_store h;
+  TEST_ASSERT_EQUAL_INT(0, hist_open(&h, path));
+  char line[128];
+  double start = now_sec();
+  for (size_t i = 0; i < entries; i++)
+    {
+      snprintf(line, sizeof(line), "git commit -m 'change %zu' && make test-%zu", i % 100000, i % 97);
+      TEST_ASSERT_EQUAL_INT(0, hist_add(&h, line));
+    }
+  double add = now_sec() - start;
+  fd = open(text, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  TEST_ASSERT_EQUAL_INT(0, hist_export(&h, fd));
+  close(fd);
+  hist_close(&h);
+
+  start = now_sec();
+  TEST_ASSERT_EQUAL_INT(0, hist_open(&h, path));
+  double open_store = now_sec() - start;
+  start = now_sec();
+  TEST_ASSERT_EQUAL_INT(0, read_history(text));
+  double open_readline = now_sec() - start;
+
+  /* the first search builds the trigram index */
+  start = now_sec();
+  TEST_ASSERT_NOT_NULL(hist_search(&h, "change 123", 0));
+  double first = now_sec() - start;
+  const int rounds = 200;
+  start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    TEST_ASSERT_NOT_NULL(hist_search(&h, "change 19999", 0));
+  double indexed = (now_sec() - start) / rounds;
+  start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    {
+      history_set_pos(history_length - 1);
+      TEST_ASSERT_TRUE(history_search("change 19999", -1) >= 0);
+    }
+  double linear = (now_sec() - start) / rounds;
+
+  printf("history %zu entries: %.1f us/add, open %.3f ms (read_history %.1f ms)\n",
+         entries, add / entries * 1e6, open_store * 1e3, open_readline * 1e3);
+  printf("history search: first %.1f ms, trigram %.1f us, readline linear %.1f us\n",
+         first * 1e3, indexed * 1e6, linear * 1e6);
+  clear_history();
+  hist_close(&h);
+  unlink(path);
+  unlink(idx);
+  unlink(text);
+}
+
+void bench_completion(void)
+{
+  /* a PATH directory with 20k executables */
+  const int binaries = 20000;
+  char dir[] = "/tmp/bench-lab-comp-XXXXXX";
+  char path[128];
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  for (int i = 0; i < binaries; i++)
+    {
+      snprintf(path, sizeof(path), "%s/%c%c-tool-%d", dir, 'a' + i % 26, 'a' + i / 26 % 26, i);
+      int fd = open(path, O_WRONLY | O_CREAT, 0755);
+      TEST_ASSERT_TRUE(fd >= 0);
+      close(fd);
+    }
+
+  struct completer c;
+  completer_init(&c);
+  double start = now_sec();
+  TEST_ASSERT_EQUAL_INT(0, completer_start(&c, dir));
+  double startup = now_sec() - start;
+  completer_wait(&c);
+  double build = now_sec() - start;
+
+  static const char *const prefixes[] = {"a", "bq", "zz-tool-1", "k", "mm-", "q", "xa-tool-99", "nope"};
+  const int rounds = 1000000;
+  char *const *names;
+  size_t found = 0;
+  start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    found += completer_commands(&c, prefixes[(size_t)i % NELEMS_B(prefixes)], &names);
+  double commands = now_sec() - start;
+  TEST_ASSERT_TRUE(found > 0);
+
+  const int file_rounds = 100000;
+  start = now_sec();
+  for (int i = 0; i < file_rounds; i++)
+    found += completer_files(&c, dir, prefixes[(size_t)i % NELEMS_B(prefixes)], &names);
+  double files = now_sec() - start;
+  TEST_ASSERT_EQUAL_size_t(1, c.dir_misses);
+
+  printf("completion over %d binaries: start %.1f us, index ready after %.1f ms\n",
+         binaries, startup * 1e6, build * 1e3);
+  printf("completion: %.0f commands/s, %.0f cached file listings/s\n",
+         rounds / commands, file_rounds / files);
+  completer_destroy(&c);
+  snprintf(path, sizeof(path), "rm -rf %s", dir);
+  TEST_ASSERT_EQUAL_INT(0, system(path));
+}
+
+/* Builds envp from scratch the way a launch without the store has to */
+static char **envp_rebuild(char *const *names, char *const *values, size_t n)
+{
+  char **envp = malloc((n + 1) * sizeof(*envp));
+  for (size_t i = 0; i < n; i++)
+    {
+      size_t nl = strlen(names[i]), vl = strlen(values[i]);
+      envp[i] = malloc(nl + vl + 2);
+      memcpy(envp[i], names[i], nl);
+      envp[i][nl] = '=';
+      memcpy(envp[i] + nl + 1, values[i], vl + 1);
+    }
+  envp[n] = NULL;
+  return envp;
+}
+
+static void envp_free(char **envp)
+{
+  for (size_t i = 0; envp[i]; i++)
+    free(envp[i]);
+  free(envp);
+}
+
+static void make_env(struct env_store *e, char ***names, char ***values, size_t n)
+{
+  *names = malloc(n * sizeof(**names));
+  *values = malloc(n * sizeof(**values));
+  TEST_ASSERT_EQUAL_INT(0, env_init(e, NULL));
+  for (size_t i = 0; i < n; i++)
+    {
+      char name[40], value[128];
+      snprintf(name, sizeof(name), "CI_VARIABLE_%zu", i);
+      snprintf(value, sizeof(value), "/builds/project/job-%zu/some/typical/value/%zu", i, i * 7);
+      (*names)[i] = strdup(name);
+      (*values)[i] = strdup(value);
+      TEST_ASSERT_EQUAL_INT(0, env_set(e, name, value, true));
+    }
+}
+
+void bench_env_prepare(void)
+{
+  static const size_t sizes[] = {10, 100, 500, 1000, 5000};
+  for (size_t s = 0; s < NELEMS_B(sizes); s++)
+    {
+      size_t n = sizes[s];
+      int rounds = (int)(2000000 / n);
+      struct env_store e;
+      char **names, **values;
+      make_env(&e, &names, &values, n);
+
+      double start = now_sec();
+      for (int i = 0; i < rounds; i++)
+        envp_free(envp_rebuild(names, values, n));
+      double rebuild = (now_sec() - start) / rounds * 1e9;
+
+      /* one variable changes before every launch, as PWD does after cd */
+      char value[32];
+      size_t total = 0;
+      start = now_sec();
+      for (int i = 0; i < rounds; i++)
+        {
+          snprintf(value, sizeof(value), "%d", i);
+          TEST_ASSERT_EQUAL_INT(0, env_set(&e, names[(size_t)i % n], value, true));
+          total += env_envp(&e)[0] != NULL;
+        }
+      double patched = (now_sec() - start) / rounds * 1e9;
+      TEST_ASSERT_EQUAL_size_t((size_t)rounds, total);
+
+      /* a subshell sharing the store, and one that writes and copies it */
+      start = now_sec();
+      for (int i = 0; i < rounds; i++)
+        {
+          struct env_store sub;
+          env_clone(&sub, &e);
+          env_destroy(&sub);
+        }
+      double cloned = (now_sec() - start) / rounds * 1e9;
+      start = now_sec();
+      for (int i = 0; i < rounds / 10; i++)
+        {
+          struct env_store sub;
+          env_clone(&sub, &e);
+          TEST_ASSERT_EQUAL_INT(0, env_set(&sub, "SUBSHELL", "1", true));
+          env_destroy(&sub);
+        }
+      double copied = (now_sec() - start) / (rounds / 10) * 1e9;
+
+      printf("env %5zu vars: rebuild envp %9.0f ns, store set+envp %5.0f ns, "
+             "clone %3.0f ns, clone+write %9.0f ns\n",
+             n, rebuild, patched, cloned, copied);
+      for (size_t i = 0; i < n; i++)
+        {
+          free(names[i]);
+          free(values[i]);
+        }
+      free(names);
+      free(values);
+      env_destroy(&e);
+    }
+}
+
+/* The checks a script runs on one file, in process or forking test(1) */
+static double file_tests_us(struct shell *sh, const char *test, const char *close, int rounds)
+{
+  char line[512];
+  snprintf(line, sizeof(line), "%1$s -e /etc/passwd%2$s && %1$s -f /etc/passwd%2$s && "
+           "%1$s -r /etc/passwd%2$s && %1$s -s /etc/passwd%2$s", test, close);
+  double start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    TEST_ASSERT_EQUAL_INT(0, sh_execute(sh, line, strlen(line)));
+  return (now_sec() - start) / rounds * 1e6;
+}
+
+void bench_file_tests(void)
+{
+  const char *test = access("/usr/bin/test", X_OK) == 0 ? "/usr/bin/test" : "/bin/test";
+  struct shell sh;
+  sh_init(&sh);
+  double cached = file_tests_us(&sh, "[", " ]", 20000);
+  size_t stats = sh.stats.misses;
+  sh.stats.enabled = false;
+  double uncached = file_tests_us(&sh, "[", " ]", 20000);
+  double forked = file_tests_us(&sh, test, "", 200);
+  printf("4 file tests per line: builtin cached %6.2f us (%zu stat per line), "
+         "builtin %6.2f us (4 stat), %s %8.2f us\n",
+         cached, stats / 20000, uncached, test, forked);
+  sh_destroy(&sh);
+}
+
+static double line_us(struct shell *sh, const char *line, int rounds)
+{
+  double start = now_sec();
+  for (int i = 0; i < rounds; i++)
+    TEST_ASSERT_EQUAL_INT(0, sh_execute(sh, line, strlen(line)));
+  return (now_sec() - start) / rounds * 1e6;
+}
+
+/* Fills path, a mkstemp template, with 64 MiB of 61 byte lines */
+static void make_lines_file(char *path)
+{
+  int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  char *chunk = malloc(1 << 20);
+  for (size_t i = 0; i < 1 << 20; i++)
+    chunk[i] = i % 61 == 60 ? '\n' : 'a' + (char)(i % 26);
+  for (int i = 0; i < 64; i++)
+    TEST_ASSERT_EQUAL_INT(1 << 20, write(fd, chunk, 1 << 20));
+  close(fd);
+  free(chunk);
+}
+
+/* Lines of small utilities run in the shell and as commands from PATH */
+void bench_utility_builtins(void)
+{
+  static const char *const lines[] = {
+    "echo hello | wc -l > /dev/null",
+    "printf '%s\\n' a b c | head -n 1 > /dev/null",
+    "cat /etc/passwd | tail -n 2 > /dev/null",
+    "head -n 5 /etc/passwd | wc -c > /dev/null",
+  };
+  struct shell sh;
+  sh_init(&sh);
+  for (size_t i = 0; i < NELEMS_B(lines); i++)
+    {
+      sh.use_coreutils = true;
+      double inproc = line_us(&sh, lines[i], 2000);
+      sh.use_coreutils = false;
+      double external = line_us(&sh, lines[i], 200);
+      printf("%-44s builtin %8.2f us, external %8.2f us (%5.1fx)\n", lines[i], inproc, external,
+             external / inproc);
+    }
+
+  /* wc -l and tail over a file too big for either to be startup bound */
+  char path[] = "/tmp/bench-lab-XXXXXX";
+  make_lines_file(path);
+  char line[128];
+  static const char *const big[] = {"wc -l %s > /dev/null", "tail -n 100 %s > /dev/null",
+                                    "cat %s | wc -l > /dev/null"};
+  for (size_t i = 0; i < NELEMS_B(big); i++)
+    {
+      snprintf(line, sizeof(line), big[i], path);
+      sh.use_coreutils = true;
+      double inproc = line_us(&sh, line, 20);
+      sh.use_coreutils = false;
+      double external = line_us(&sh, line, 20);
+      snprintf(line, sizeof(line), big[i], "64M");
+      printf("%-44s builtin %8.0f us, external %8.0f us (%5.1fx)\n", line, inproc, external,
+             external / inproc);
+    }
+  unlink(path);
+  sh_destroy(&sh);
+}
+
+/* Pipelines as written and as set -o optimize rewrites them */
+void bench_optimizer(void)
+{
+  char path[] = "/tmp/bench-lab-XXXXXX";
+  make_lines_file(path);
+  struct
+  {
+    const char *fmt;
+    int rounds;
+  } lines[] = {
+    {"cat /etc/passwd | grep root | head -n 1 > /dev/null", 200},
+    {"cat %s | wc -l > /dev/null", 20},
+    {"cat %s | grep -c xyz > /dev/null", 20},
+    {"seq 1 200000 | cat | tail -n 1 > /dev/null", 20},
+    {"sh -c 'echo a; exec sleep 1' | head -n 1 > /dev/null", 2},
+  };
+  struct shell sh;
+  sh_init(&sh);
+  for (size_t i = 0; i < NELEMS_B(lines); i++)
+    {
+      char line[128];
+      snprintf(line, sizeof(line), lines[i].fmt, path);
+      sh.optimize = false;
+      double plain = line_us(&sh, line, lines[i].rounds);
+      sh.optimize = true;
+      double optimized = line_us(&sh, line, lines[i].rounds);
+      snprintf(line, sizeof(line), lines[i].fmt, "64M");
+      printf("%-52s %10.0f us, optimized %10.0f us (%6.1fx)\n", line, plain, optimized, plain / optimized);
+    }
+  sh_destroy(&sh);
+  unlink(path);
+}
+
+/* Ten stage pipelines of utility builtins on threads joined by rings, one
+ * stage after the other through memfds, and as processes */
+void bench_threaded_pipelines(void)
+{
+  char path[] = "/tmp/bench-lab-XXXXXX";
+  make_lines_file(path);
+  struct
+  {
+    const char *fmt;
+    int rounds;
+  } lines[] = {
+    {"cat /etc/passwd | cat | cat | cat | cat | cat | cat | cat | cat | wc -l > /dev/null", 200},
+    {"cat %s | cat | cat | cat | cat | cat | cat | cat | cat | wc -l > /dev/null", 5},
+    {"cat %s | cat | head -n 500000 | cat | tail -n 1000 | cat | cat | head -c 99 | cat | wc -c > /dev/null", 5},
+  };
+  struct shell sh;
+  sh_init(&sh);
+  for (size_t i = 0; i < NELEMS_B(lines); i++)
+    {
+      char line[160];
+      snprintf(line, sizeof(line), lines[i].fmt, path);
+      double threads = line_us(&sh, line, lines[i].rounds);
+      sh.use_threads = false;
+      double memfds = line_us(&sh, line, lines[i].rounds);
+      sh.use_coreutils = false;
+      double procs = line_us(&sh, line, lines[i].rounds);
+      sh.use_threads = sh.use_coreutils = true;
+      snprintf(line, sizeof(line), lines[i].fmt, "64M");
+      printf("%s\n  threads %10.0f us, memfds %10.0f us (%5.1fx), processes %10.0f us (%5.1fx)\n", line, threads,
+             memfds, memfds / threads, procs, procs / threads);
+    }
+  sh_destroy(&sh);
+  unlink(path);
+}
+
+/* A 20k line script of builtins, with the comments and blank lines of a
+ * real one: parsed line by line as it runs, compiled and run, and run from
+ * its cache */
+void bench_compiled_script(void)
+{
+  char dir[] = "/tmp/bench-lab-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char path[PATH_MAX], cache[PATH_MAX + 8];
+  snprintf(path, sizeof(path), "%s/provision.sh", dir);
+  snprintf(cache, sizeof(cache), "%s%s", path, PROGRAM_SUFFIX);
+  FILE *f = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  for (int i = 0; i < 20000; i += 4)
+    {
+      fprintf(f, "# step %d: check the host before touching it\n", i);
+      fprintf(f, "[ -d /tmp ] && cd . || echo \"step %d: no /tmp\" 'giving up' > /dev/null\n", i);
+      fprintf(f, "test -n \"host-%d\" && set -o optimize; set +o optimize\n", i);
+      fprintf(f, "[[ -e /etc/passwd ]] || echo missing\\ passwd 2> /dev/null > /dev/null\n");
+    }
+  fclose(f);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  TEST_ASSERT_EQUAL_INT(0, fstat(fd, &st));
+  char *text = malloc((size_t)st.st_size);
+  TEST_ASSERT_EQUAL_INT((int)st.st_size, (int)read(fd, text, (size_t)st.st_size));
+  close(fd);
+
+  struct shell sh;
+  sh_init(&sh);
+  const int rounds = 5;
+  double t0 = now_sec();
+  for (int r = 0; r < rounds; r++)
+    for (const char *line = text, *end = text + st.st_size; line < end;)
+      {
+        const char *nl = memchr(line, '\n', (size_t)(end - line));
+        sh_execute(&sh, line, (size_t)(nl - line) + 1);
+        line = nl + 1;
+      }
+  double lines = (now_sec() - t0) / rounds;
+
+  struct program prog;
+  t0 = now_sec();
+  for (int r = 0; r < rounds; r++)
+    {
+      TEST_ASSERT_EQUAL_INT(0, program_compile(&prog, text, (size_t)st.st_size, &st));
+      program_destroy(&prog);
+    }
+  double compile = (now_sec() - t0) / rounds;
+
+  bool cached;
+  t0 = now_sec();
+  for (int r = 0; r < rounds; r++)
+    {
+      unlink(cache);
+      TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, path, &cached));
+      TEST_ASSERT_FALSE(cached);
+      sh_run_program(&sh, &prog);
+      program_destroy(&prog);
+    }
+  double cold = (now_sec() - t0) / rounds;
+
+  double load = 0;
+  t0 = now_sec();
+  for (int r = 0; r < rounds; r++)
+    {
+      double l0 = now_sec();
+      TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, path, &cached));
+      load += now_sec() - l0;
+      TEST_ASSERT_TRUE(cached);
+      TEST_ASSERT_EQUAL_INT(0, sh_run_program(&sh, &prog));
+      program_destroy(&prog);
+    }
+  double warm = (now_sec() - t0) / rounds;
+  load /= rounds;
+  sh_destroy(&sh);
+
+  printf("20000 line script, %zu bytes:\n", (size_t)st.st_size);
+  printf("  parsed line by line %8.2f ms\n", lines * 1e3);
+  printf("  compile only        %8.2f ms\n", compile * 1e3);
+  printf("  compile and run     %8.2f ms (cache written)\n", cold * 1e3);
+  printf("  cache load          %8.2f ms\n", load * 1e3);
+  printf("  cache load and run  %8.2f ms (%5.2fx)\n", warm * 1e3, lines / warm);
+  free(text);
+  unlink(cache);
+  unlink(path);
+  rmdir(dir);
+}
+
+/* Time from opening a 5 MB script to its first command having run, for
+ * each way in: stdio as batch mode used to read stdin, reading and
+ * compiling it whole, mapped, through a pipe, and as a script argument
+ * with and without its cache */
+static double first_command_us(int how, const char *path, int rounds)
+{
+  struct shell sh;
+  sh_init(&sh);
+  double total = 0;
+  for (int r = 0; r < rounds; r++)
+    {
+      sh.exit_requested = false;
+      int p[2] = {-1, -1};
+      if (how == 3)
+        {
+          /* as much of the script as the pipe holds, written before the
+           * clock starts */
+          TEST_ASSERT_EQUAL_INT(0, pipe(p));
+          char buf[65536];
+          int fd = open(path, O_RDONLY);
+          ssize_t n = read(fd, buf, sizeof(buf));
+          close(fd);
+          TEST_ASSERT_EQUAL_INT((int)n, (int)write(p[1], buf, (size_t)n));
+          close(p[1]);
+        }
+      double t0 = now_sec();
+      int status = -1;
+      if (how == 0)
+        {
+          FILE *f = fopen(path, "r");
+          char *line = NULL;
+          size_t cap = 0;
+          ssize_t n;
+          while (!sh.exit_requested && (n = getline(&line, &cap, f)) >= 0)
+            sh_execute(&sh, line, (size_t)n);
+          status = sh.last_status;
+          free(line);
+          fclose(f);
+        }
+      else if (how == 1)
+        {
+          int fd = open(path, O_RDONLY);
+          struct stat st;
+          fstat(fd, &st);
+          char *text = malloc((size_t)st.st_size);
+          TEST_ASSERT_EQUAL_INT((int)st.st_size, (int)read(fd, text, (size_t)st.st_size));
+          close(fd);
+          struct program prog;
+          TEST_ASSERT_EQUAL_INT(0, program_compile(&prog, text, (size_t)st.st_size, &st));
+          status = sh_run_program(&sh, &prog);
+          program_destroy(&prog);
+          free(text);
+        }
+      else if (how == 2 || how == 3)
+        {
+          int fd = how == 2 ? open(path, O_RDONLY) : p[0];
+          status = sh_run_batch(&sh, fd);
+          close(fd);
+        }
+      else
+        {
+          status = sh_run_script(&sh, path);
+        }
+      total += now_sec() - t0;
+      TEST_ASSERT_EQUAL_INT(7, status);
+    }
+  sh_destroy(&sh);
+  return total / rounds * 1e6;
+}
+
+void bench_script_startup(void)
+{
+  char dir[] = "/tmp/bench-lab-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char path[PATH_MAX], cache[PATH_MAX + 8];
+  snprintf(path, sizeof(path), "%s/provision.sh", dir);
+  snprintf(cache, sizeof(cache), "%s%s", path, PROGRAM_SUFFIX);
+  FILE *f = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fputs("exit 7\n", f);
+  for (int i = 0; ftell(f) < 5 * 1024 * 1024; i++)
+    fprintf(f, "[ -d /tmp ] && cd . || echo \"step %d: no /tmp\" 'giving up' > /dev/null\n", i);
+  fclose(f);
+
+  static const char *const names[] = {
+    "stdio getline", "read and compile whole", "mapped", "pipe", "script, no cache", "script, cached",
+  };
+  for (int how = 0; how < (int)NELEMS_B(names); how++)
+    {
+      if (how == 5)
+        {
+          struct program prog;
+          TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, path, NULL));
+          program_destroy(&prog);
+        }
+      int rounds = how == 1 ? 5 : 200;
+      printf("5 MB script, first command, %-24s %10.1f us\n", names[how], first_command_us(how, path, rounds));
+    }
+  unlink(cache);
+  unlink(path);
+  rmdir(dir);
+}
+
+/*
+ * Per call benchmarks timed by TEST_BENCH, their fixtures are set up in
+ * main.
+ */
+static struct cmd_line fixture_cl;
+static char *fixture_line_80, *fixture_line_4k;
+static size_t fixture_len_80, fixture_len_4k;
+static struct shell fixture_sh;
+static struct env_store fixture_env;
+static char **fixture_env_names, **fixture_env_values;
+
+static void tokenize_80_byte_line(void)
+{
+  TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(&fixture_cl, fixture_line_80, fixture_len_80));
+}
+
+static void tokenize_4k_line(void)
+{
+  TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(&fixture_cl, fixture_line_4k, fixture_len_4k));
+}
+
+static void builtin_lookup_100(void)
+{
+  static const char *const names[] = {"cd", "ls", "history", "grep", "pwd", "make", "jobs", "sed"};
+  size_t found = 0;
+  for (size_t i = 0; i < 100; i++)
+    found += builtin_lookup(names[i % NELEMS_B(names)]) != NULL;
+  TEST_ASSERT_EQUAL_size_t(50, found);
+}
+
+static void spawn_and_wait(void)
+{
+  char *argv[] = {"/bin/true", NULL};
+  struct launch l;
+  launch_init(&l, argv);
+  l.path = argv[0];
+  pid_t pid = lab_spawn(&l);
+  TEST_ASSERT_TRUE(pid > 0);
+  waitpid(pid, NULL, 0);
+}
+
+static void env_prepare_500(void)
+{
+  static unsigned n;
+  TEST_ASSERT_EQUAL_INT(0, env_set(&fixture_env, fixture_env_names[n++ % 500], "changed", true));
+  TEST_ASSERT_NOT_NULL(env_envp(&fixture_env)[0]);
+}
+
+static void run_builtin_line(void)
+{
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&fixture_sh, "cd . && cd .", 12));
+}
+
+static void file_test_line(void)
+{
+  static const char line[] = "[ -e /etc/passwd ] && [ -f /etc/passwd ] && [ -r /etc/passwd ]";
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&fixture_sh, line, sizeof(line) - 1));
+}
+
+int main(int argc, char **argv) {
+  int rc = UnityParseOptions(argc, argv);
+  if (rc != 0)
+    return rc < 0 ? 0 : rc;
+  cmd_line_init(&fixture_cl);
+  fixture_line_80 = make_line(80, &fixture_len_80);
+  fixture_line_4k = make_line(4 * 1024, &fixture_len_4k);
+  sh_init(&fixture_sh);
+  make_env(&fixture_env, &fixture_env_names, &fixture_env_values, 500);
+
+  UNITY_BEGIN();
+  TEST_BENCH(tokenize_80_byte_line, 100000);
+  TEST_BENCH(tokenize_4k_line, 10000);
+  TEST_BENCH(builtin_lookup_100, 100000);
+  TEST_BENCH(spawn_and_wait, 500);
+  TEST_BENCH(run_builtin_line, 10000);
+  TEST_BENCH(env_prepare_500, 100000);
+  TEST_BENCH(file_test_line, 100000);
+  RUN_TEST(bench_tokenize);
+  RUN_TEST(bench_cmd_parse_strdup_baseline);
+  RUN_TEST(bench_spawn_vs_rss);
+  RUN_TEST(bench_zygote_vs_spawn);
+  RUN_TEST(bench_builtin_dispatch);
+  RUN_TEST(bench_history);
+  RUN_TEST(bench_completion);
+  RUN_TEST(bench_env_prepare);
+  RUN_TEST(bench_file_tests);
+  RUN_TEST(bench_utility_builtins);
+  RUN_TEST(bench_optimizer);
+  RUN_TEST(bench_threaded_pipelines);
+  RUN_TEST(bench_compiled_script);
+  RUN_TEST(bench_script_startup);
+  rc = UNITY_END();
+  for (size_t i = 0; i < 500; i++)
+    {
+      free(fixture_env_names[i]);
+      free(fixture_env_values[i]);
+    }
+  free(fixture_env_names);
+  free(fixture_env_values);
+  env_destroy(&fixture_env);
+  sh_destroy(&fixture_sh);
+  cmd_line_destroy(&fixture_cl);
+  free(fixture_line_80);
+  free(fixture_line_4k);
+  return rc;
+}
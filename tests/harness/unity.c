@@ -15,6 +15,90 @@
 void UNITY_OUTPUT_CHAR(int);
 #endif
 
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+#include <stdio.h>
+#include <string.h>
+#endif
+
+#ifdef UNITY_OUTPUT_BUFFERED
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static UNITY_THREAD_LOCAL char UnityOutputBuffer[UNITY_OUTPUT_BUFFER_SIZE];
+static UNITY_THREAD_LOCAL size_t UnityOutputUsed;
+
+void UnityBufferedOutputChar(int c)
+{
+    if (UnityOutputUsed == sizeof(UnityOutputBuffer))
+    {
+        UnityBufferedOutputFlush();
+    }
+    UnityOutputBuffer[UnityOutputUsed++] = (char)c;
+}
+
+void UnityBufferedOutputFlush(void)
+{
+    const char* p = UnityOutputBuffer;
+    size_t left = UnityOutputUsed;
+
+    (void)fflush(stdout);
+    while (left > 0)
+    {
+        ssize_t n = write(UNITY_OUTPUT_FD, p, left);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    UnityOutputUsed = 0;
+}
+#endif
+
+#if defined(UNITY_INCLUDE_EXEC_TIME) && defined(UNITY_EXEC_TIME_NS)
+unsigned long long UnityClockNs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+#endif
+
+#ifdef UNITY_INCLUDE_BENCH
+#include <stdlib.h>
+#include <time.h>
+
+/* Statistics of the TEST_BENCH that is concluding */
+static struct
+{
+    int valid;
+    unsigned long long iterations;
+    unsigned long long min;
+    unsigned long long median;
+    unsigned long long p99;
+    unsigned long long stddev;
+} UnityBench;
+#endif
+
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+static void UnityReportTest(const char* status);
+static void UnityReportEnd(void);
+#ifdef UNITY_INCLUDE_BENCH
+static int UnityBenchBaseline(const char* name, unsigned long long* median, unsigned int* threshold);
+static void UnityBenchSave(const char* name, unsigned long long median);
+#endif
+#ifdef UNITY_INCLUDE_PARALLEL
+static int UnityQueueTest(UnityTestFunction Func, const char* FuncName, const int FuncLineNum, const UNITY_UINT32 Iterations, int Bench);
+static void UnityRunQueue(void);
+#endif
+#endif
+
 /* Helpful macros for us to use here in Assert functions */
 #define UNITY_FAIL_AND_BAIL         do { Unity.CurrentTestFailed  = 1; UNITY_OUTPUT_FLUSH(); TEST_ABORT(); } while (0)
 #define UNITY_IGNORE_AND_BAIL       do { Unity.CurrentTestIgnored = 1; UNITY_OUTPUT_FLUSH(); TEST_ABORT(); } while (0)
@@ -557,6 +641,12 @@ void UnityConcludeTest(void)
     {
         Unity.TestFailures++;
     }
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+    UnityReportTest(Unity.CurrentTestIgnored ? "IGNORE" : Unity.CurrentTestFailed ? "FAIL" : "PASS");
+#endif
+#ifdef UNITY_INCLUDE_BENCH
+    UnityBench.valid = 0;
+#endif
 
     Unity.CurrentTestFailed = 0;
     Unity.CurrentTestIgnored = 0;
@@ -2189,10 +2279,30 @@ void UnityMessage(const char* msg, const UNITY_LINE_TYPE line)
 /*-----------------------------------------------*/
 /* If we have not defined our own test runner, then include our default test runner to make life easier */
 #ifndef UNITY_SKIP_DEFAULT_RUNNER
+static void UnityRunTestBody(UnityTestFunction Func);
+
 void UnityDefaultTestRun(UnityTestFunction Func, const char* FuncName, const int FuncLineNum)
 {
     Unity.CurrentTestName = FuncName;
     Unity.CurrentTestLineNumber = (UNITY_LINE_TYPE)FuncLineNum;
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+    if (!UnityTestMatches())
+    {
+        return;
+    }
+#ifdef UNITY_INCLUDE_PARALLEL
+    if (UnityQueueTest(Func, FuncName, FuncLineNum, 0, 0))
+    {
+        return;
+    }
+#endif
+#endif
+    UnityRunTestBody(Func);
+}
+
+/* Runs one test whose name and line are already current */
+static void UnityRunTestBody(UnityTestFunction Func)
+{
     Unity.NumberOfTests++;
     UNITY_CLR_DETAILS();
     UNITY_EXEC_TIME_START();
@@ -2210,6 +2320,166 @@ void UnityDefaultTestRun(UnityTestFunction Func, const char* FuncName, const int
 }
 #endif
 
+/*-----------------------------------------------
+ * Benchmarks
+ *-----------------------------------------------*/
+#ifdef UNITY_INCLUDE_BENCH
+static unsigned long long UnityBenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static int UnityCompareSamples(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* Newton's method, so the harness does not need libm */
+static double UnityBenchSqrt(double x)
+{
+    double r = x;
+    int i;
+    if (x <= 0.0)
+    {
+        return 0.0;
+    }
+    for (i = 0; i < 64; i++)
+    {
+        r = 0.5 * (r + x / r);
+    }
+    return r;
+}
+
+static void UnityBenchStatistics(unsigned long long* samples, unsigned long long n)
+{
+    unsigned long long i;
+    double mean = 0.0;
+    double var = 0.0;
+
+    qsort(samples, (size_t)n, sizeof(samples[0]), UnityCompareSamples);
+    for (i = 0; i < n; i++)
+    {
+        mean += (double)samples[i];
+    }
+    mean /= (double)n;
+    for (i = 0; i < n; i++)
+    {
+        double d = (double)samples[i] - mean;
+        var += d * d;
+    }
+    UnityBench.valid = 1;
+    UnityBench.iterations = n;
+    UnityBench.min = samples[0];
+    UnityBench.median = (n % 2) ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    UnityBench.p99 = samples[(99 * n + 99) / 100 - 1];
+    UnityBench.stddev = (unsigned long long)(UnityBenchSqrt(var / (double)n) + 0.5);
+}
+
+static void UnityRunBenchBody(UnityTestFunction Func, const UNITY_UINT32 Iterations);
+
+static void UnityBenchPrintStat(const char* label, unsigned long long ns)
+{
+    UnityPrint(label);
+    UnityPrintNumberUnsigned((UNITY_UINT)ns);
+    UnityPrint(" ns");
+}
+
+void UnityDefaultBenchRun(UnityTestFunction Func, const char* FuncName, const UNITY_UINT32 Iterations, const int FuncLineNum)
+{
+    Unity.CurrentTestName = FuncName;
+    Unity.CurrentTestLineNumber = (UNITY_LINE_TYPE)FuncLineNum;
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+    if (!UnityTestMatches())
+    {
+        return;
+    }
+#ifdef UNITY_INCLUDE_PARALLEL
+    if (UnityQueueTest(Func, FuncName, FuncLineNum, Iterations, 1))
+    {
+        return;
+    }
+#endif
+#endif
+    UnityRunBenchBody(Func, Iterations);
+}
+
+/* Runs one benchmark whose name and line are already current */
+static void UnityRunBenchBody(UnityTestFunction Func, const UNITY_UINT32 Iterations)
+{
+    const char* FuncName = Unity.CurrentTestName;
+    const int FuncLineNum = (int)Unity.CurrentTestLineNumber;
+    unsigned long long* samples;
+    unsigned long long n = 0;
+    UNITY_UINT32 i;
+
+    Unity.NumberOfTests++;
+    UNITY_CLR_DETAILS();
+    samples = (unsigned long long*)malloc((Iterations ? Iterations : 1) * sizeof(*samples));
+    UNITY_EXEC_TIME_START();
+    if (TEST_PROTECT())
+    {
+        setUp();
+        if (samples == NULL)
+        {
+            UnityFail("Out of memory for benchmark samples", (UNITY_LINE_TYPE)FuncLineNum);
+        }
+        for (i = 0; i < UNITY_BENCH_WARMUP(Iterations); i++)
+        {
+            Func();
+        }
+        for (i = 0; i < Iterations; i++)
+        {
+            unsigned long long start = UnityBenchNow();
+            Func();
+            samples[n++] = UnityBenchNow() - start;
+        }
+    }
+    if (TEST_PROTECT())
+    {
+        tearDown();
+    }
+    UNITY_EXEC_TIME_STOP();
+
+    if (!Unity.CurrentTestFailed && !Unity.CurrentTestIgnored && n > 0)
+    {
+        UnityBenchStatistics(samples, n);
+        UnityTestResultsBegin(Unity.TestFile, (UNITY_LINE_TYPE)FuncLineNum);
+        UnityPrint("BENCH ");
+        UnityPrintNumberUnsigned((UNITY_UINT)n);
+        UnityPrint(" iterations:");
+        UnityBenchPrintStat(" min ", UnityBench.min);
+        UnityBenchPrintStat(", median ", UnityBench.median);
+        UnityBenchPrintStat(", p99 ", UnityBench.p99);
+        UnityBenchPrintStat(", stddev ", UnityBench.stddev);
+        UNITY_PRINT_EOL();
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+        {
+            unsigned long long baseline;
+            unsigned int threshold;
+            UnityBenchSave(FuncName, UnityBench.median);
+            if (UnityBenchBaseline(FuncName, &baseline, &threshold) &&
+                UnityBench.median * 100 > baseline * (100 + threshold))
+            {
+                UnityTestResultsFailBegin((UNITY_LINE_TYPE)FuncLineNum);
+                UnityBenchPrintStat(" Median ", UnityBench.median);
+                UnityPrint(" regressed more than ");
+                UnityPrintNumberUnsigned((UNITY_UINT)threshold);
+                UnityPrint("% past baseline");
+                UnityBenchPrintStat(" ", baseline);
+                Unity.CurrentTestFailed = 1;
+            }
+        }
+#endif
+    }
+    free(samples);
+    UnityConcludeTest();
+}
+#endif
+
 /*-----------------------------------------------*/
 void UnitySetTestFile(const char* filename)
 {
@@ -2235,6 +2505,9 @@ void UnityBegin(const char* filename)
 /*-----------------------------------------------*/
 int UnityEnd(void)
 {
+#if defined(UNITY_USE_COMMAND_LINE_ARGS) && defined(UNITY_INCLUDE_PARALLEL)
+    UnityRunQueue();
+#endif
     UNITY_PRINT_EOL();
     UnityPrint(UnityStrBreaker);
     UNITY_PRINT_EOL();
@@ -2259,6 +2532,9 @@ int UnityEnd(void)
     UNITY_PRINT_EOL();
     UNITY_FLUSH_CALL();
     UNITY_OUTPUT_COMPLETE();
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+    UnityReportEnd();
+#endif
     return (int)(Unity.TestFailures);
 }
 
@@ -2271,10 +2547,540 @@ char* UnityOptionIncludeNamed = NULL;
 char* UnityOptionExcludeNamed = NULL;
 int UnityVerbosity            = 1;
 
+/* --shard=i/n runs every n-th matching test, starting with the i-th */
+static unsigned int UnityOptionShardIndex = 0;
+static unsigned int UnityOptionShardCount = 0;
+static unsigned int UnityShardCounter = 0;
+
+#ifdef UNITY_INCLUDE_BENCH
+/*-----------------------------------------------
+ * Benchmark baselines, lines of "name median_ns"
+ *-----------------------------------------------*/
+static const char* UnityOptionBenchBaseline = NULL;
+static unsigned int UnityOptionBenchThreshold = 10;
+static FILE* UnityBenchSaveFile = NULL;
+
+static int UnityBenchBaseline(const char* name, unsigned long long* median, unsigned int* threshold)
+{
+    char line[256];
+    char entry[200];
+    unsigned long long value;
+    int found = 0;
+    FILE* f;
+
+    if (UnityOptionBenchBaseline == NULL || (f = fopen(UnityOptionBenchBaseline, "r")) == NULL)
+    {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%199s %llu", entry, &value) == 2 && strcmp(entry, name) == 0)
+        {
+            *median = value;
+            *threshold = UnityOptionBenchThreshold;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void UnityBenchSave(const char* name, unsigned long long median)
+{
+    if (UnityBenchSaveFile != NULL)
+    {
+        fprintf(UnityBenchSaveFile, "%s %llu\n", name, median);
+        fflush(UnityBenchSaveFile);
+    }
+}
+#endif
+
+/*-----------------------------------------------
+ * JSON report, one object per concluded test
+ *-----------------------------------------------*/
+static FILE* UnityReportFile = NULL;
+static unsigned long UnityReportCount = 0;
+
+static void UnityReportString(const char* string)
+{
+    const char* p;
+
+    fputc('"', UnityReportFile);
+    for (p = string; p && *p; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if ((c == '"') || (c == '\\'))
+        {
+            fprintf(UnityReportFile, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(UnityReportFile, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, UnityReportFile);
+        }
+    }
+    fputc('"', UnityReportFile);
+}
+
+#ifdef UNITY_INCLUDE_PARALLEL
+static void UnityWorkerSend(const char* status);
+static int UnityWorkerFd = -1;
+#endif
+
+static void UnityReportTest(const char* status)
+{
+#ifdef UNITY_INCLUDE_PARALLEL
+    if (UnityWorkerFd >= 0)
+    {
+        UnityWorkerSend(status);
+        return;
+    }
+#endif
+    if (UnityReportFile == NULL)
+    {
+        return;
+    }
+    fprintf(UnityReportFile, "%s\n    {\"name\": ", UnityReportCount++ ? "," : "");
+    UnityReportString(Unity.CurrentTestName);
+    fprintf(UnityReportFile, ", \"file\": ");
+    UnityReportString(Unity.TestFile);
+    fprintf(UnityReportFile, ", \"line\": %lu, \"status\": \"%s\"",
+            (unsigned long)Unity.CurrentTestLineNumber, status);
+#if defined(UNITY_INCLUDE_EXEC_TIME) && defined(UNITY_EXEC_TIME_NS)
+    fprintf(UnityReportFile, ", \"wall_ns\": %llu, \"cpu_ns\": %llu",
+            Unity.CurrentTestStopTime - Unity.CurrentTestStartTime,
+            Unity.CurrentTestStopCpu - Unity.CurrentTestStartCpu);
+#endif
+#ifdef UNITY_INCLUDE_BENCH
+    if (UnityBench.valid)
+    {
+        fprintf(UnityReportFile,
+                ", \"bench\": {\"iterations\": %llu, \"min_ns\": %llu, \"median_ns\": %llu, "
+                "\"p99_ns\": %llu, \"stddev_ns\": %llu}",
+                UnityBench.iterations, UnityBench.min, UnityBench.median, UnityBench.p99, UnityBench.stddev);
+    }
+#endif
+    fputc('}', UnityReportFile);
+    /* nothing stays buffered for a child the test forks to write again */
+    fflush(UnityReportFile);
+}
+
+static void UnityReportEnd(void)
+{
+#ifdef UNITY_INCLUDE_BENCH
+    if (UnityBenchSaveFile != NULL)
+    {
+        fclose(UnityBenchSaveFile);
+        UnityBenchSaveFile = NULL;
+    }
+#endif
+    if (UnityReportFile == NULL)
+    {
+        return;
+    }
+    fprintf(UnityReportFile, "\n  ],\n  \"tests_run\": %lu,\n  \"failures\": %lu,\n  \"ignored\": %lu\n}\n",
+            (unsigned long)Unity.NumberOfTests, (unsigned long)Unity.TestFailures,
+            (unsigned long)Unity.TestIgnores);
+    fclose(UnityReportFile);
+    UnityReportFile = NULL;
+}
+
+static int UnityReportOpen(const char* path)
+{
+    UnityReportFile = fopen(path, "w");
+    if (UnityReportFile == NULL)
+    {
+        UnityPrint("ERROR: Cannot write report ");
+        UnityPrint(path);
+        UNITY_PRINT_EOL();
+        return 1;
+    }
+    UnityReportCount = 0;
+    fprintf(UnityReportFile, "{\n  \"tests\": [");
+    fflush(UnityReportFile);
+    return 0;
+}
+
+#ifdef UNITY_INCLUDE_PARALLEL
+/*-----------------------------------------------
+ * Parallel runner: RUN_TEST only queues while -j is given, and UnityEnd
+ * forks one worker per test, at most UnityOptionJobs at a time.  A worker
+ * writes its stdout and stderr to temporary files and its result to a
+ * pipe; the parent prints each test's output in RUN_TEST order and merges
+ * the result into the summary and the report.
+ *-----------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define UNITY_WORKER_MAGIC 0x556e5772u
+
+static int UnityOptionJobs = 0;
+
+struct UnityQueuedTest
+{
+    UnityTestFunction Func;
+    const char* Name;
+    int Line;
+    UNITY_UINT32 Iterations;
+    int Bench;
+};
+
+/* Sent by a worker when its test concludes */
+struct UnityWorkerResult
+{
+    unsigned int Magic;
+    char Status[8];
+    unsigned long long WallNs;
+    unsigned long long CpuNs;
+    int BenchValid;
+    unsigned long long Iterations;
+    unsigned long long Min;
+    unsigned long long Median;
+    unsigned long long P99;
+    unsigned long long Stddev;
+};
+
+struct UnityWorker
+{
+    pid_t Pid;
+    int ResultFd;
+    FILE* Out;
+    FILE* Err;
+    int Done;
+    int WaitStatus;
+    int HaveResult;
+    struct UnityWorkerResult Result;
+};
+
+static struct UnityQueuedTest* UnityQueue = NULL;
+static size_t UnityQueueLen = 0;
+static size_t UnityQueueCap = 0;
+
+static int UnityQueueTest(UnityTestFunction Func, const char* FuncName, const int FuncLineNum, const UNITY_UINT32 Iterations, int Bench)
+{
+    struct UnityQueuedTest* t;
+
+    if (UnityOptionJobs <= 0)
+    {
+        return 0;
+    }
+    if (UnityQueueLen == UnityQueueCap)
+    {
+        size_t cap = UnityQueueCap ? UnityQueueCap * 2 : 64;
+        t = (struct UnityQueuedTest*)realloc(UnityQueue, cap * sizeof(*t));
+        if (t == NULL)
+        {
+            return 0; /* run it in process instead */
+        }
+        UnityQueue = t;
+        UnityQueueCap = cap;
+    }
+    t = &UnityQueue[UnityQueueLen++];
+    t->Func = Func;
+    t->Name = FuncName;
+    t->Line = FuncLineNum;
+    t->Iterations = Iterations;
+    t->Bench = Bench;
+    return 1;
+}
+
+static void UnityWorkerSend(const char* status)
+{
+    struct UnityWorkerResult r;
+
+    memset(&r, 0, sizeof(r));
+    r.Magic = UNITY_WORKER_MAGIC;
+    strncpy(r.Status, status, sizeof(r.Status) - 1);
+#if defined(UNITY_INCLUDE_EXEC_TIME) && defined(UNITY_EXEC_TIME_NS)
+    r.WallNs = Unity.CurrentTestStopTime - Unity.CurrentTestStartTime;
+    r.CpuNs = Unity.CurrentTestStopCpu - Unity.CurrentTestStartCpu;
+#endif
+#ifdef UNITY_INCLUDE_BENCH
+    r.BenchValid = UnityBench.valid;
+    r.Iterations = UnityBench.iterations;
+    r.Min = UnityBench.min;
+    r.Median = UnityBench.median;
+    r.P99 = UnityBench.p99;
+    r.Stddev = UnityBench.stddev;
+#endif
+    /* smaller than PIPE_BUF, so a single write that never blocks */
+    if (write(UnityWorkerFd, &r, sizeof(r)) != (ssize_t)sizeof(r))
+    {
+        _exit(125);
+    }
+}
+
+static void UnityCopyFile(FILE* from, int fd)
+{
+    char buf[4096];
+    size_t n;
+
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+    {
+        const char* p = buf;
+        while (n > 0)
+        {
+            ssize_t w = write(fd, p, n);
+            if (w < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (w <= 0)
+            {
+                return;
+            }
+            p += w;
+            n -= (size_t)w;
+        }
+    }
+}
+
+static void UnityStartWorker(const struct UnityQueuedTest* t, struct UnityWorker* w)
+{
+    int fds[2];
+
+    w->Pid = -1;
+    w->ResultFd = -1;
+    w->Out = tmpfile();
+    w->Err = tmpfile();
+    if (w->Out == NULL || w->Err == NULL || pipe(fds) < 0)
+    {
+        w->Done = 1;
+        return;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    /* a worker must not inherit anything still buffered */
+    UNITY_OUTPUT_FLUSH();
+    fflush(NULL);
+    w->Pid = fork();
+    if (w->Pid == 0)
+    {
+        close(fds[0]);
+        dup2(fileno(w->Out), STDOUT_FILENO);
+        dup2(fileno(w->Err), STDERR_FILENO);
+        UnityWorkerFd = fds[1];
+        UnityOptionJobs = 0;
+        UnityReportFile = NULL;
+#ifdef UNITY_INCLUDE_BENCH
+        UnityBenchSaveFile = NULL;
+#endif
+        Unity.CurrentTestName = t->Name;
+        Unity.CurrentTestLineNumber = (UNITY_LINE_TYPE)t->Line;
+#ifdef UNITY_INCLUDE_BENCH
+        if (t->Bench)
+        {
+            UnityRunBenchBody(t->Func, t->Iterations);
+        }
+        else
+#endif
+        {
+#ifndef UNITY_SKIP_DEFAULT_RUNNER
+            UnityRunTestBody(t->Func);
+#endif
+        }
+        UNITY_OUTPUT_FLUSH();
+        fflush(NULL);
+        _exit(0);
+    }
+    close(fds[1]);
+    w->ResultFd = fds[0];
+    if (w->Pid < 0)
+    {
+        close(fds[0]);
+        w->ResultFd = -1;
+        w->Done = 1;
+    }
+}
+
+static void UnityMergeWorker(const struct UnityQueuedTest* t, struct UnityWorker* w)
+{
+    const char* status;
+
+    if (w->Out != NULL)
+    {
+        UnityCopyFile(w->Out, STDOUT_FILENO);
+        fclose(w->Out);
+    }
+    if (w->Err != NULL)
+    {
+        UnityCopyFile(w->Err, STDERR_FILENO);
+        fclose(w->Err);
+    }
+
+    Unity.CurrentTestName = t->Name;
+    Unity.CurrentTestLineNumber = (UNITY_LINE_TYPE)t->Line;
+    Unity.NumberOfTests++;
+    if (w->HaveResult)
+    {
+        status = w->Result.Status;
+        if (strcmp(status, "FAIL") == 0)
+        {
+            Unity.TestFailures++;
+        }
+        else if (strcmp(status, "IGNORE") == 0)
+        {
+            Unity.TestIgnores++;
+        }
+#if defined(UNITY_INCLUDE_EXEC_TIME) && defined(UNITY_EXEC_TIME_NS)
+        Unity.CurrentTestStartTime = 0;
+        Unity.CurrentTestStopTime = w->Result.WallNs;
+        Unity.CurrentTestStartCpu = 0;
+        Unity.CurrentTestStopCpu = w->Result.CpuNs;
+#endif
+#ifdef UNITY_INCLUDE_BENCH
+        UnityBench.valid = w->Result.BenchValid;
+        UnityBench.iterations = w->Result.Iterations;
+        UnityBench.min = w->Result.Min;
+        UnityBench.median = w->Result.Median;
+        UnityBench.p99 = w->Result.P99;
+        UnityBench.stddev = w->Result.Stddev;
+        if (UnityBench.valid)
+        {
+            UnityBenchSave(t->Name, UnityBench.median);
+        }
+#endif
+    }
+    else
+    {
+        /* the worker died before its test concluded */
+        status = "FAIL";
+        Unity.TestFailures++;
+        UnityTestResultsFailBegin((UNITY_LINE_TYPE)t->Line);
+        if (w->Pid < 0)
+        {
+            UnityPrint(" Cannot start a worker");
+        }
+        else if (WIFSIGNALED(w->WaitStatus))
+        {
+            UnityPrint(" Worker killed by signal ");
+            UnityPrintNumber((UNITY_INT)WTERMSIG(w->WaitStatus));
+        }
+        else
+        {
+            UnityPrint(" Worker exited with status ");
+            UnityPrintNumber((UNITY_INT)WEXITSTATUS(w->WaitStatus));
+        }
+        UNITY_PRINT_EOL();
+#if defined(UNITY_INCLUDE_EXEC_TIME) && defined(UNITY_EXEC_TIME_NS)
+        Unity.CurrentTestStartTime = Unity.CurrentTestStopTime = 0;
+        Unity.CurrentTestStartCpu = Unity.CurrentTestStopCpu = 0;
+#endif
+    }
+    UnityReportTest(status);
+#ifdef UNITY_INCLUDE_BENCH
+    UnityBench.valid = 0;
+#endif
+    UNITY_FLUSH_CALL();
+}
+
+/* 0 or an empty string picks one worker per online core */
+static int UnityParseJobs(const char* arg)
+{
+    int n = atoi(arg);
+    if (n <= 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cores > 0 ? (int)cores : 1;
+    }
+    return n;
+}
+
+/* Benchmarks run alone so that other workers do not skew their timings */
+static void UnityRunQueue(void)
+{
+    struct UnityWorker* workers;
+    size_t next = 0;
+    size_t printed = 0;
+    size_t running = 0;
+    int exclusive = 0;
+
+    if (UnityQueueLen == 0)
+    {
+        return;
+    }
+    workers = (struct UnityWorker*)calloc(UnityQueueLen, sizeof(*workers));
+    if (workers == NULL)
+    {
+        UnityPrint("ERROR: Out of memory for test workers");
+        UNITY_PRINT_EOL();
+        Unity.TestFailures++;
+        return;
+    }
+    while (printed < UnityQueueLen)
+    {
+        pid_t pid;
+        int ws;
+        size_t i;
+
+        while (next < UnityQueueLen && !exclusive && (int)running < UnityOptionJobs &&
+               !(UnityQueue[next].Bench && running > 0))
+        {
+            UnityStartWorker(&UnityQueue[next], &workers[next]);
+            if (!workers[next].Done)
+            {
+                running++;
+                exclusive = UnityQueue[next].Bench;
+            }
+            next++;
+        }
+        if (running > 0)
+        {
+            pid = waitpid(-1, &ws, 0);
+            if (pid < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            for (i = printed; i < next && workers[i].Pid != pid; i++)
+            {
+            }
+            if (i == next || workers[i].Done)
+            {
+                continue; /* not one of ours */
+            }
+            workers[i].Done = 1;
+            workers[i].WaitStatus = ws;
+            workers[i].HaveResult =
+                read(workers[i].ResultFd, &workers[i].Result, sizeof(workers[i].Result)) == (ssize_t)sizeof(workers[i].Result) &&
+                workers[i].Result.Magic == UNITY_WORKER_MAGIC;
+            close(workers[i].ResultFd);
+            running--;
+            if (UnityQueue[i].Bench)
+            {
+                exclusive = 0;
+            }
+        }
+        while (printed < next && workers[printed].Done)
+        {
+            UnityMergeWorker(&UnityQueue[printed], &workers[printed]);
+            printed++;
+        }
+    }
+    free(workers);
+    free(UnityQueue);
+    UnityQueue = NULL;
+    UnityQueueLen = UnityQueueCap = 0;
+}
+#endif
+
 /*-----------------------------------------------*/
 int UnityParseOptions(int argc, char** argv)
 {
     int i;
+    int report = 0;
+    const char* reportPath = "unity-report.json";
     UnityOptionIncludeNamed = NULL;
     UnityOptionExcludeNamed = NULL;
 
@@ -2284,6 +3090,68 @@ int UnityParseOptions(int argc, char** argv)
         {
             switch (argv[i][1])
             {
+                case '-': /* long options */
+                    if (strcmp(argv[i], "--report=json") == 0)
+                    {
+                        report = 1;
+                    }
+                    else if (strncmp(argv[i], "--report-file=", 14) == 0)
+                    {
+                        reportPath = &argv[i][14];
+                    }
+                    else if (strncmp(argv[i], "--shard=", 8) == 0)
+                    {
+                        if (sscanf(&argv[i][8], "%u/%u", &UnityOptionShardIndex, &UnityOptionShardCount) != 2 ||
+                            UnityOptionShardIndex < 1 || UnityOptionShardIndex > UnityOptionShardCount)
+                        {
+                            UnityPrint("ERROR: Expected --shard=i/n with 1 <= i <= n");
+                            UNITY_PRINT_EOL();
+                            UNITY_OUTPUT_FLUSH();
+                            return 1;
+                        }
+                        UnityShardCounter = 0;
+                    }
+#ifdef UNITY_INCLUDE_PARALLEL
+                    else if (strncmp(argv[i], "--jobs=", 7) == 0)
+                    {
+                        UnityOptionJobs = UnityParseJobs(&argv[i][7]);
+                    }
+#endif
+#ifdef UNITY_INCLUDE_BENCH
+                    else if (strncmp(argv[i], "--bench-baseline=", 17) == 0)
+                    {
+                        UnityOptionBenchBaseline = &argv[i][17];
+                    }
+                    else if (strncmp(argv[i], "--bench-threshold=", 18) == 0)
+                    {
+                        UnityOptionBenchThreshold = (unsigned int)atoi(&argv[i][18]);
+                    }
+                    else if (strncmp(argv[i], "--bench-save=", 13) == 0)
+                    {
+                        if (UnityBenchSaveFile != NULL)
+                        {
+                            fclose(UnityBenchSaveFile);
+                        }
+                        UnityBenchSaveFile = fopen(&argv[i][13], "w");
+                        if (UnityBenchSaveFile == NULL)
+                        {
+                            UnityPrint("ERROR: Cannot write ");
+                            UnityPrint(&argv[i][13]);
+                            UNITY_PRINT_EOL();
+                            UNITY_OUTPUT_FLUSH();
+                            return 1;
+                        }
+                    }
+#endif
+                    else
+                    {
+                        UnityPrint("ERROR: Unknown Option ");
+                        UnityPrint(argv[i]);
+                        UNITY_PRINT_EOL();
+                        UNITY_OUTPUT_FLUSH();
+                        return 1;
+                    }
+                    break;
                 case 'l': /* list tests */
                     return -1;
                 case 'n': /* include tests with name including this string */
@@ -2303,6 +3171,22 @@ int UnityParseOptions(int argc, char** argv)
                         return 1;
                     }
                     break;
+#ifdef UNITY_INCLUDE_PARALLEL
+                case 'j': /* run tests in N forked workers, one per core without N */
+                    if (argv[i][2] != 0)
+                    {
+                        UnityOptionJobs = UnityParseJobs(&argv[i][2]);
+                    }
+                    else if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9')
+                    {
+                        UnityOptionJobs = UnityParseJobs(argv[++i]);
+                    }
+                    else
+                    {
+                        UnityOptionJobs = UnityParseJobs("");
+                    }
+                    break;
+#endif
                 case 'q': /* quiet */
                     UnityVerbosity = 0;
                     break;
@@ -2337,15 +3221,33 @@ int UnityParseOptions(int argc, char** argv)
                     UnityPrint("-f NAME   Filter to run only tests whose name includes NAME"); UNITY_PRINT_EOL();
                     UnityPrint("-n NAME   (deprecated) alias of -f"); UNITY_PRINT_EOL();
                     UnityPrint("-h        show this Help menu"); UNITY_PRINT_EOL();
+#ifdef UNITY_INCLUDE_PARALLEL
+                    UnityPrint("-j [N]    run tests in N forked workers, one per core by default"); UNITY_PRINT_EOL();
+#endif
                     UnityPrint("-q        Quiet/decrease verbosity"); UNITY_PRINT_EOL();
                     UnityPrint("-v        increase Verbosity"); UNITY_PRINT_EOL();
                     UnityPrint("-x NAME   eXclude tests whose name includes NAME"); UNITY_PRINT_EOL();
+                    UnityPrint("--report=json       write a JSON report of every test"); UNITY_PRINT_EOL();
+                    UnityPrint("--report-file=FILE  where to write it, unity-report.json by default"); UNITY_PRINT_EOL();
+                    UnityPrint("--shard=I/N         run only the I-th of every N matching tests"); UNITY_PRINT_EOL();
+#ifdef UNITY_INCLUDE_PARALLEL
+                    UnityPrint("--jobs=N            same as -j N"); UNITY_PRINT_EOL();
+#endif
+#ifdef UNITY_INCLUDE_BENCH
+                    UnityPrint("--bench-baseline=FILE  fail benchmarks whose median regressed past FILE"); UNITY_PRINT_EOL();
+                    UnityPrint("--bench-threshold=PCT  allowed regression, 10% by default"); UNITY_PRINT_EOL();
+                    UnityPrint("--bench-save=FILE      write the medians as a new baseline"); UNITY_PRINT_EOL();
+#endif
                     UNITY_OUTPUT_FLUSH();
                     return 1;
             }
         }
     }
 
+    if (report)
+    {
+        return UnityReportOpen(reportPath);
+    }
     return 0;
 }
 
@@ -2480,6 +3382,12 @@ int UnityTestMatches(void)
         }
     }
 
+    /* Deal the remaining tests round robin across the shards */
+    if (retval && UnityOptionShardCount > 0)
+    {
+        retval = (UnityShardCounter++ % UnityOptionShardCount) + 1 == UnityOptionShardIndex;
+    }
+
     return retval;
 }
 
@@ -93,6 +93,19 @@ void verifyTest(void);
 
  * Tests with Arguments
  *     - you'll want to define UNITY_USE_COMMAND_LINE_ARGS if you have the test runner passing arguments to Unity
+ *     - with it, --report=json writes each test's name, file, line, status and times to --report-file (default unity-report.json)
+ *     - --shard=I/N runs only the I-th of every N tests that pass the -f and -x filters
+ *     - define UNITY_INCLUDE_PARALLEL as well for -j N, which forks every test into a worker process, N at a time,
+ *       and prints their output in RUN_TEST order; TEST_BENCH benchmarks still run one at a time
+
+ * Benchmarks
+ *     - define UNITY_INCLUDE_BENCH for TEST_BENCH(func, iterations), which times every call of func after a warmup
+ *     - with UNITY_USE_COMMAND_LINE_ARGS, --bench-baseline=FILE fails benchmarks whose median regressed more than
+ *       --bench-threshold=PCT percent past FILE, and --bench-save=FILE writes the medians to use as a baseline
+
+ * Execution Time
+ *     - define UNITY_INCLUDE_EXEC_TIME to print how long each test took
+ *     - define UNITY_EXEC_TIME_NS as well to measure with CLOCK_MONOTONIC in nanoseconds and record CPU time for the report
 
  *-------------------------------------------------------
  * Basic Fail and Ignore
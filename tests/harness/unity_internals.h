@@ -300,6 +300,35 @@ typedef UNITY_FLOAT_TYPE UNITY_FLOAT;
 
 #endif
 
+/*-------------------------------------------------------
+ * Output Method: buffered write(2)
+ *-------------------------------------------------------*/
+/* Collects output in a per-thread buffer written to UNITY_OUTPUT_FD when it
+ * fills up, when a test concludes, when a test bails out and at UnityEnd.
+ * stdout is flushed before every write so text a test prints with stdio
+ * comes first. */
+#ifdef UNITY_OUTPUT_BUFFERED
+  #ifndef UNITY_OUTPUT_BUFFER_SIZE
+  #define UNITY_OUTPUT_BUFFER_SIZE 4096
+  #endif
+  #ifndef UNITY_OUTPUT_FD
+  #define UNITY_OUTPUT_FD 1
+  #endif
+  #ifndef UNITY_THREAD_LOCAL
+    #if defined(__GNUC__) || defined(__clang__)
+    #define UNITY_THREAD_LOCAL __thread
+    #elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+    #define UNITY_THREAD_LOCAL _Thread_local
+    #else
+    #define UNITY_THREAD_LOCAL
+    #endif
+  #endif
+  void UnityBufferedOutputChar(int c);
+  void UnityBufferedOutputFlush(void);
+  #define UNITY_OUTPUT_CHAR(a) UnityBufferedOutputChar(a)
+  #define UNITY_OUTPUT_FLUSH() UnityBufferedOutputFlush()
+#endif
+
 /*-------------------------------------------------------
  * Output Method: stdout (DEFAULT)
  *-------------------------------------------------------*/
@@ -366,6 +395,25 @@ typedef UNITY_FLOAT_TYPE UNITY_FLOAT;
         UnityPrintNumberUnsigned(execTimeMs); \
         UnityPrint(" ms)"); \
         }
+    #elif (defined(__unix__) || defined(__APPLE__)) && defined(UNITY_EXEC_TIME_NS)
+      /* Nanoseconds of CLOCK_MONOTONIC, and of the CPU time used by the
+       * process (all threads, not its children) for the report */
+      #include <time.h>
+      #define UNITY_TIME_TYPE unsigned long long
+      #define UNITY_EXEC_TIME_START() do { \
+        Unity.CurrentTestStartTime = UnityClockNs(CLOCK_MONOTONIC); \
+        Unity.CurrentTestStartCpu = UnityClockNs(CLOCK_PROCESS_CPUTIME_ID); \
+        } while (0)
+      #define UNITY_EXEC_TIME_STOP() do { \
+        Unity.CurrentTestStopTime = UnityClockNs(CLOCK_MONOTONIC); \
+        Unity.CurrentTestStopCpu = UnityClockNs(CLOCK_PROCESS_CPUTIME_ID); \
+        } while (0)
+      #define UNITY_PRINT_EXEC_TIME() { \
+        UnityPrint(" ("); \
+        UnityPrintNumberUnsigned((UNITY_UINT)(Unity.CurrentTestStopTime - Unity.CurrentTestStartTime)); \
+        UnityPrint(" ns)"); \
+        }
+      unsigned long long UnityClockNs(clockid_t clock);
     #elif defined(_WIN32)
       #include <time.h>
       #define UNITY_TIME_TYPE clock_t
@@ -515,6 +563,10 @@ struct UNITY_STORAGE_T
 #ifdef UNITY_INCLUDE_EXEC_TIME
     UNITY_TIME_TYPE CurrentTestStartTime;
     UNITY_TIME_TYPE CurrentTestStopTime;
+#ifdef UNITY_EXEC_TIME_NS
+    UNITY_TIME_TYPE CurrentTestStartCpu;
+    UNITY_TIME_TYPE CurrentTestStopCpu;
+#endif
 #endif
 #ifndef UNITY_EXCLUDE_SETJMP_H
     jmp_buf AbortFrame;
@@ -538,6 +590,18 @@ void UnityDefaultTestRun(UnityTestFunction Func, const char* FuncName, const int
 #define UNITY_SKIP_DEFAULT_RUNNER
 #endif
 
+#ifdef UNITY_INCLUDE_BENCH
+/* Runs Func for warmup and then Iterations timed calls between one setUp
+ * and tearDown, and reports min, median, p99 and stddev of the calls */
+void UnityDefaultBenchRun(UnityTestFunction Func, const char* FuncName, const UNITY_UINT32 Iterations, const int FuncLineNum);
+#ifndef UNITY_BENCH_WARMUP
+#define UNITY_BENCH_WARMUP(iterations) ((iterations) / 10 + 1)
+#endif
+#ifndef TEST_BENCH
+#define TEST_BENCH(func, iterations) UnityDefaultBenchRun(func, #func, (UNITY_UINT32)(iterations), __LINE__)
+#endif
+#endif
+
 /*-------------------------------------------------------
  * Details Support
  *-------------------------------------------------------*/
@@ -1,3 +1,16 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+#include <readline/history.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -10,12 +23,1581 @@ void tearDown(void) {
   // clean stuff up here
 }
 
-void test_stuff(void){
-  // test stuff here
+static void tokenize(struct cmd_line *cl, const char *line)
+{
+  TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(cl, line, strlen(line)));
 }
 
-int main(void) {
+void test_tokenize_words(void)
+{
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+  tokenize(&cl, "  ls   -la\t/tmp  ");
+  TEST_ASSERT_EQUAL_size_t(3, cl.ntok);
+  TEST_ASSERT_EQUAL_STRING("ls", cl.tok[0].str);
+  TEST_ASSERT_EQUAL_STRING("-la", cl.tok[1].str);
+  TEST_ASSERT_EQUAL_STRING("/tmp", cl.tok[2].str);
+  TEST_ASSERT_EQUAL_size_t(4, cl.tok[2].len);
+  cmd_line_destroy(&cl);
+}
+
+void test_tokenize_quotes(void)
+{
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+  tokenize(&cl, "echo 'a  b' \"c \\\"d\\\" $x\" e\\ f g'h'\"i\" ''");
+  TEST_ASSERT_EQUAL_size_t(6, cl.ntok);
+  TEST_ASSERT_EQUAL_STRING("a  b", cl.tok[1].str);
+  TEST_ASSERT_EQUAL_STRING("c \"d\" $x", cl.tok[2].str);
+  TEST_ASSERT_EQUAL_STRING("e f", cl.tok[3].str);
+  TEST_ASSERT_EQUAL_STRING("ghi", cl.tok[4].str);
+  TEST_ASSERT_EQUAL_STRING("", cl.tok[5].str);
+  TEST_ASSERT_EQUAL_INT(TOK_WORD, cl.tok[5].kind);
+  cmd_line_destroy(&cl);
+}
+
+void test_tokenize_operators(void)
+{
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+  tokenize(&cl, "a|b&&c||d&e;f<in >out 2>>err 2>&1 '|'");
+  enum tok_kind want[] = {TOK_WORD, TOK_PIPE, TOK_WORD, TOK_AND_IF, TOK_WORD,
+                          TOK_OR_IF, TOK_WORD, TOK_AMP, TOK_WORD, TOK_SEMI,
+                          TOK_WORD, TOK_LESS, TOK_WORD, TOK_GREAT, TOK_WORD,
+                          TOK_DGREAT, TOK_WORD, TOK_GREATAND, TOK_WORD, TOK_WORD};
+  TEST_ASSERT_EQUAL_size_t(sizeof(want) / sizeof(want[0]), cl.ntok);
+  for (size_t i = 0; i < cl.ntok; i++)
+    TEST_ASSERT_EQUAL_INT(want[i], cl.tok[i].kind);
+  TEST_ASSERT_EQUAL_INT(-1, cl.tok[13].io_number);
+  TEST_ASSERT_EQUAL_INT(2, cl.tok[15].io_number);
+  TEST_ASSERT_EQUAL_INT(2, cl.tok[17].io_number);
+  TEST_ASSERT_EQUAL_STRING("1", cl.tok[18].str);
+  TEST_ASSERT_EQUAL_STRING("|", cl.tok[19].str);
+  cmd_line_destroy(&cl);
+}
+
+void test_tokenize_dbracket(void)
+{
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+  tokenize(&cl, "[[ a < b && c > d || ! -e f ]] && e ; x [[ y && z");
+  enum tok_kind want[] = {TOK_WORD, TOK_WORD, TOK_WORD, TOK_WORD, TOK_WORD, TOK_WORD,
+                          TOK_WORD, TOK_WORD, TOK_WORD, TOK_WORD, TOK_WORD, TOK_WORD,
+                          TOK_WORD, TOK_AND_IF, TOK_WORD, TOK_SEMI, TOK_WORD, TOK_WORD,
+                          TOK_WORD, TOK_AND_IF, TOK_WORD};
+  TEST_ASSERT_EQUAL_size_t(sizeof(want) / sizeof(want[0]), cl.ntok);
+  for (size_t i = 0; i < cl.ntok; i++)
+    TEST_ASSERT_EQUAL_INT(want[i], cl.tok[i].kind);
+  TEST_ASSERT_EQUAL_STRING("<", cl.tok[2].str);
+  TEST_ASSERT_EQUAL_STRING("||", cl.tok[8].str);
+  cmd_line_destroy(&cl);
+}
+
+void test_tokenize_errors_and_comments(void)
+{
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+  TEST_ASSERT_EQUAL_INT(-1, cmd_tokenize(&cl, "echo 'oops", 10));
+  TEST_ASSERT_NOT_NULL(cl.error);
+  TEST_ASSERT_EQUAL_INT(-1, cmd_tokenize(&cl, "echo \"oops", 10));
+  tokenize(&cl, "echo a#b # comment");
+  TEST_ASSERT_EQUAL_size_t(2, cl.ntok);
+  TEST_ASSERT_EQUAL_STRING("a#b", cl.tok[1].str);
+  cmd_line_destroy(&cl);
+}
+
+void test_tokenize_arena_reuse(void)
+{
+  struct cmd_line cl;
+  cmd_line_init(&cl);
+  char *big = malloc(300000);
+  for (size_t i = 0; i < 300000; i += 3)
+    memcpy(big + i, "ab ", 3);
+  TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(&cl, big, 300000));
+  TEST_ASSERT_EQUAL_size_t(100000, cl.ntok);
+  TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(&cl, big, 300000));
+  size_t before = cl.arena.mallocs;
+  TEST_ASSERT_EQUAL_INT(0, cmd_tokenize(&cl, big, 300000));
+  TEST_ASSERT_EQUAL_size_t(before, cl.arena.mallocs);
+  free(big);
+  cmd_line_destroy(&cl);
+}
+
+void test_cmd_parse(void)
+{
+  char **argv = cmd_parse("grep -e 'x y' file");
+  TEST_ASSERT_NOT_NULL(argv);
+  TEST_ASSERT_EQUAL_STRING("grep", argv[0]);
+  TEST_ASSERT_EQUAL_STRING("x y", argv[2]);
+  TEST_ASSERT_EQUAL_STRING("file", argv[3]);
+  TEST_ASSERT_NULL(argv[4]);
+  cmd_free(argv);
+  TEST_ASSERT_NULL(cmd_parse("echo \"open"));
+}
+
+static int wait_status(pid_t pid)
+{
+  int status;
+  TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+  TEST_ASSERT_TRUE(WIFEXITED(status));
+  return WEXITSTATUS(status);
+}
+
+static void read_file(const char *path, char *buf, size_t size)
+{
+  FILE *f = fopen(path, "r");
+  TEST_ASSERT_NOT_NULL(f);
+  size_t n = fread(buf, 1, size - 1, f);
+  buf[n] = '\0';
+  fclose(f);
+}
+
+static void check_spawn_redirects(int flags)
+{
+  char out[] = "/tmp/test-lab-XXXXXX";
+  int fd = mkstemp(out);
+  TEST_ASSERT_TRUE(fd >= 0);
+  close(fd);
+
+  char *argv[] = {"sh", "-c", "echo out; echo err >&2; exit 3", NULL};
+  struct redir r[] = {
+      {REDIR_OUT, 1, out, -1},
+      {REDIR_DUP, 2, NULL, 1},
+  };
+  struct launch l;
+  launch_init(&l, argv);
+  l.redirs = r;
+  l.nredir = 2;
+  l.flags = flags;
+  pid_t pid = lab_spawn(&l);
+  TEST_ASSERT_TRUE(pid > 0);
+  TEST_ASSERT_EQUAL_INT(3, wait_status(pid));
+
+  char buf[64];
+  read_file(out, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("out\nerr\n", buf);
+  unlink(out);
+}
+
+void test_spawn_redirects(void)
+{
+  check_spawn_redirects(0);
+}
+
+void test_spawn_redirects_fork(void)
+{
+  check_spawn_redirects(LAUNCH_FORCE_FORK);
+}
+
+void test_spawn_missing_command(void)
+{
+  char *argv[] = {"/nonexistent/command", NULL};
+  struct launch l;
+  launch_init(&l, argv);
+  TEST_ASSERT_EQUAL_INT(-1, lab_spawn(&l));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+  l.flags = LAUNCH_FORCE_FORK;
+  TEST_ASSERT_EQUAL_INT(-1, lab_spawn(&l));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+}
+
+static int child_exit_seven(void *arg)
+{
+  return *(int *)arg;
+}
+
+void test_spawn_child_fn(void)
+{
+  int code = 7;
+  struct launch l;
+  launch_init(&l, NULL);
+  l.child_fn = child_exit_seven;
+  l.child_arg = &code;
+  l.pgid = 0;
+  pid_t pid = lab_spawn(&l);
+  TEST_ASSERT_TRUE(pid > 0);
+  TEST_ASSERT_EQUAL_INT(7, wait_status(pid));
+}
+
+void test_zygote(void)
+{
+  struct zygote z;
+  zygote_init(&z);
+  TEST_ASSERT_EQUAL_INT(0, zygote_start(&z));
+
+  /* redirections, the working directory and a new process group */
+  char out[] = "/tmp/test-lab-XXXXXX";
+  int fd = mkstemp(out);
+  TEST_ASSERT_TRUE(fd >= 0);
+  close(fd);
+  char *argv[] = {"sh", "-c", "pwd; echo err >&2; [ $(ps -o pgid= $$) = $$ ] && exit 3", NULL};
+  struct redir r[] = {
+      {REDIR_OUT, 1, out, -1},
+      {REDIR_DUP, 2, NULL, 1},
+  };
+  struct launch l;
+  launch_init(&l, argv);
+  l.path = "/bin/sh";
+  l.redirs = r;
+  l.nredir = 2;
+  l.pgid = 0;
+  l.dir_fd = open("/usr", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  pid_t pid = zygote_spawn(&z, &l);
+  TEST_ASSERT_TRUE(pid > 0);
+  TEST_ASSERT_EQUAL_INT(3, wait_status(pid));
+  close(l.dir_fd);
+  char buf[64];
+  read_file(out, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("/usr\nerr\n", buf);
+  unlink(out);
+
+  /* stdin from a pipe */
+  int pfd[2];
+  TEST_ASSERT_EQUAL_INT(0, pipe(pfd));
+  char *exit_argv[] = {"sh", "-c", "read x; exit $x", NULL};
+  launch_init(&l, exit_argv);
+  l.path = "/bin/sh";
+  l.fd_in = pfd[0];
+  pid = zygote_spawn(&z, &l);
+  TEST_ASSERT_TRUE(pid > 0);
+  close(pfd[0]);
+  TEST_ASSERT_EQUAL_INT(2, write(pfd[1], "5\n", 2));
+  close(pfd[1]);
+  TEST_ASSERT_EQUAL_INT(5, wait_status(pid));
+
+  char *missing[] = {"/nonexistent/command", NULL};
+  launch_init(&l, missing);
+  l.path = missing[0];
+  TEST_ASSERT_EQUAL_INT(-1, zygote_spawn(&z, &l));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+  l.path = NULL;
+  TEST_ASSERT_EQUAL_INT(-1, zygote_spawn(&z, &l));
+  TEST_ASSERT_EQUAL_INT(ENOTSUP, errno);
+
+  zygote_stop(&z);
+  TEST_ASSERT_EQUAL_INT(-1, zygote_spawn(&z, &l));
+  TEST_ASSERT_EQUAL_INT(EPIPE, errno);
+}
+
+void test_cmd_build(void)
+{
+  struct cmd_line cl;
+  struct cmd_list list;
+  cmd_line_init(&cl);
+  tokenize(&cl, "a x < in | b 2>&1 | c >> out && d ; e &");
+  TEST_ASSERT_EQUAL_INT(0, cmd_build(&cl, &list));
+  TEST_ASSERT_EQUAL_size_t(3, list.npipes);
+  TEST_ASSERT_EQUAL_size_t(3, list.pipes[0].ncmds);
+  TEST_ASSERT_EQUAL_INT(LIST_AND, list.pipes[0].op);
+  TEST_ASSERT_EQUAL_INT(LIST_SEQ, list.pipes[1].op);
+  TEST_ASSERT_EQUAL_INT(LIST_BG, list.pipes[2].op);
+
+  struct command *a = &list.pipes[0].cmds[0];
+  TEST_ASSERT_EQUAL_size_t(2, a->argc);
+  TEST_ASSERT_NULL(a->argv[2]);
+  TEST_ASSERT_EQUAL_size_t(1, a->nredir);
+  TEST_ASSERT_EQUAL_INT(REDIR_IN, a->redirs[0].kind);
+  TEST_ASSERT_EQUAL_INT(0, a->redirs[0].fd);
+  TEST_ASSERT_EQUAL_STRING("in", a->redirs[0].target);
+
+  struct command *b = &list.pipes[0].cmds[1];
+  TEST_ASSERT_EQUAL_INT(REDIR_DUP, b->redirs[0].kind);
+  TEST_ASSERT_EQUAL_INT(2, b->redirs[0].fd);
+  TEST_ASSERT_EQUAL_INT(1, b->redirs[0].dup_fd);
+  TEST_ASSERT_EQUAL_INT(REDIR_APPEND, list.pipes[0].cmds[2].redirs[0].kind);
+
+  tokenize(&cl, "a | | b");
+  TEST_ASSERT_EQUAL_INT(-1, cmd_build(&cl, &list));
+  tokenize(&cl, "a >");
+  TEST_ASSERT_EQUAL_INT(-1, cmd_build(&cl, &list));
+  tokenize(&cl, "a &&");
+  TEST_ASSERT_EQUAL_INT(-1, cmd_build(&cl, &list));
+  cmd_line_destroy(&cl);
+}
+
+static char tmp_path[64];
+
+static const char *make_tmp(void)
+{
+  strcpy(tmp_path, "/tmp/test-lab-XXXXXX");
+  int fd = mkstemp(tmp_path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  close(fd);
+  return tmp_path;
+}
+
+/* Runs line in a fresh shell with each %s replaced by a temporary file and
+ * returns the file's contents in buf */
+static int run_line(const char *fmt, char *buf, size_t size)
+{
+  char line[512];
+  const char *path = make_tmp();
+  snprintf(line, sizeof(line), fmt, path, path, path);
+  struct shell sh;
+  sh_init(&sh);
+  int status = sh_execute(&sh, line, strlen(line));
+  sh_destroy(&sh);
+  read_file(path, buf, size);
+  unlink(path);
+  return status;
+}
+
+void test_pipeline_external(void)
+{
+  char buf[256];
+  TEST_ASSERT_EQUAL_INT(0, run_line("printf 'b\\na\\nc\\n' | sort | head -n 2 > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("a\nb\n", buf);
+  TEST_ASSERT_EQUAL_INT(3, run_line("sh -c 'exit 3' | sh -c 'cat > %s; exit 3'", buf, sizeof(buf)));
+}
+
+void test_pipeline_builtin_stage(void)
+{
+  char buf[PATH_MAX + 16];
+  char cwd[PATH_MAX];
+  TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+  strcat(cwd, "\n");
+  TEST_ASSERT_EQUAL_INT(0, run_line("pwd | cat | cat > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING(cwd, buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("pwd > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING(cwd, buf);
+}
+
+void test_utility_builtins(void)
+{
+  char buf[256];
+  TEST_ASSERT_EQUAL_INT(0, run_line("seq 1 1000 | head -n 3 | tail -n +2 > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("2\n3\n", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("seq 1 100000 | tail -n 2 | wc -l > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("2\n", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("printf '%%s-%%03d|' b 7 x > %s; echo -e 'x\\ty\\cz' >> %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("b-007|x-000|x\ty", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("printf 'one two\\n\\nthree' | wc > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("      2       3      14\n", buf);
+  /* options the shell does not implement go to the command from PATH */
+  TEST_ASSERT_EQUAL_INT(0, run_line("echo q | cat -n | tr -d ' \t' > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("1q\n", buf);
+  TEST_ASSERT_EQUAL_INT(2, run_line("builtin cat -n 2> %s", buf, sizeof(buf)));
+
+  /* Without PATH only the builtins can run */
+  const char *path = make_tmp();
+  char line[256];
+  struct shell sh;
+  sh_init(&sh);
+  sh_setenv(&sh, "PATH", "/nonexistent");
+  snprintf(line, sizeof(line), "echo hi | cat | head -c 2 > %s", path);
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&sh, line, strlen(line)));
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("hi", buf);
+  snprintf(line, sizeof(line), "builtin --external echo hi 2> %s", path);
+  TEST_ASSERT_EQUAL_INT(127, sh_execute(&sh, line, strlen(line)));
+  snprintf(line, sizeof(line), "set +o coreutils; echo hi 2> %s", path);
+  TEST_ASSERT_EQUAL_INT(127, sh_execute(&sh, line, strlen(line)));
+  snprintf(line, sizeof(line), "builtin echo hi > %s", path);
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&sh, line, strlen(line)));
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("hi\n", buf);
+  sh_destroy(&sh);
+  unlink(path);
+}
+
+/* Runs line in a fresh shell in dir, with or without set -o optimize, and
+ * returns its status and what it left in dir/out */
+static int run_in_dir(const char *dir, const char *line, bool optimize, char *buf, size_t size)
+{
+  char out[PATH_MAX];
+  snprintf(out, sizeof(out), "%s/out", dir);
+  close(open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  struct shell sh;
+  sh_init(&sh);
+  sh.optimize = optimize;
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  int status = sh_execute(&sh, line, strlen(line));
+  sh_destroy(&sh);
+  read_file(out, buf, size);
+  return status;
+}
+
+void test_optimizer(void)
+{
+  static const char *const lines[] = {
+    "cat in | grep b | head -n 1 > out",
+    "cat in | cat | wc -l > out",
+    "cat in | sort -r | cat | head -n 2 > out",
+    "cat in | cat > out",
+    "cat in | builtin --external head -n 2 > out",
+    "cat in | wc -c < in > out",
+    "cat missing | wc -l > out",
+    "false | cat | cat > out",
+    "cat in | false",
+    "printf 'x\\ny\\n' | cat | cat | tail -n 1 > out",
+    "cat in | cat | cat | cat | sort | cat | cat > out",
+  };
+  char dir[] = "/tmp/test-lab-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/in", dir);
+  FILE *f = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fputs("abc\nbcd\ncde\n", f);
+  fclose(f);
+
+  /* the optimized pipelines write the same and end the same */
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+    {
+      char plain[256], optimized[256];
+      int expect = run_in_dir(dir, lines[i], false, plain, sizeof(plain));
+      TEST_ASSERT_EQUAL_INT_MESSAGE(expect, run_in_dir(dir, lines[i], true, optimized, sizeof(optimized)), lines[i]);
+      TEST_ASSERT_EQUAL_STRING_MESSAGE(plain, optimized, lines[i]);
+    }
+
+  /* the plan */
+  struct shell sh;
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  snprintf(path, sizeof(path), "%s/out", dir);
+  int fd = open(path, O_WRONLY | O_TRUNC);
+  TEST_ASSERT_TRUE(fd >= 0);
+  const char *line = "cat in | grep 'b c' | cat | head -n 1 2>&1; ls | cat";
+  TEST_ASSERT_EQUAL_INT(0, sh_explain(&sh, line, strlen(line), fd));
+  close(fd);
+  char buf[1024];
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("cat in | grep 'b c' | cat | head -n 1 2>&1\n"
+                           "  cat between two stages copies its input unchanged: dropped\n"
+                           "  cat in at the start: the next stage reads the file itself\n"
+                           "  head: the stages before it get SIGPIPE when it exits\n"
+                           "  => grep 'b c' < in | head -n 1 2>&1\n"
+                           "ls | cat\n"
+                           "  => ls | cat\n",
+                           buf);
+  TEST_ASSERT_EQUAL_INT(-1, sh_explain(&sh, "a |", 3, open("/dev/null", O_WRONLY | O_CLOEXEC)));
+
+  /* head done, the producer is ended rather than left to sleep, with
+   * head in the shell and as a child */
+  static const char *const cut[] = {"sh -c 'echo a; exec sleep 5' | head -n 1 > out",
+                                    "sh -c 'echo a; exec sleep 5' | builtin --external head -n 1 > out"};
+  for (size_t i = 0; i < 2; i++)
+    {
+      struct timespec t0, t1;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      TEST_ASSERT_EQUAL_INT(0, run_in_dir(dir, cut[i], true, buf, sizeof(buf)));
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      TEST_ASSERT_EQUAL_STRING("a\n", buf);
+      TEST_ASSERT_TRUE_MESSAGE(t1.tv_sec - t0.tv_sec < 3, cut[i]);
+    }
+  sh_destroy(&sh);
+
+  char cmd[PATH_MAX];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  TEST_ASSERT_EQUAL_INT(0, system(cmd));
+}
+
+struct ring_writer
+{
+  struct ring *ring;
+  size_t total;
+  int result;
+};
+
+/* Writes the bytes i % 251 for i up to total in chunks of changing size */
+static void *ring_writer_main(void *p)
+{
+  struct ring_writer *w = p;
+  unsigned char chunk[777];
+  size_t i = 0;
+  w->result = 0;
+  while (i < w->total && w->result == 0)
+    {
+      size_t n = 1 + i % sizeof(chunk);
+      if (n > w->total - i)
+        n = w->total - i;
+      for (size_t k = 0; k < n; k++)
+        chunk[k] = (unsigned char)((i + k) % 251);
+      w->result = ring_write(w->ring, chunk, n);
+      i += n;
+    }
+  ring_close_write(w->ring);
+  return NULL;
+}
+
+void test_ring(void)
+{
+  struct ring r;
+  TEST_ASSERT_EQUAL_INT(0, ring_init(&r, 1000));
+  struct ring_writer w = {&r, 100000, -1};
+  pthread_t t;
+  TEST_ASSERT_EQUAL_INT(0, pthread_create(&t, NULL, ring_writer_main, &w));
+  /* wrapping around a ring smaller than what goes through it */
+  unsigned char buf[300];
+  size_t got = 0, n;
+  while ((n = ring_read(&r, buf, 1 + got % sizeof(buf))) > 0)
+    for (size_t k = 0; k < n; k++, got++)
+      TEST_ASSERT_EQUAL_UINT8(got % 251, buf[k]);
+  TEST_ASSERT_EQUAL_size_t(100000, got);
+  TEST_ASSERT_EQUAL_INT(0, pthread_join(t, NULL));
+  TEST_ASSERT_EQUAL_INT(0, w.result);
+  TEST_ASSERT_EQUAL_size_t(0, ring_read(&r, buf, sizeof(buf)));
+
+  /* a reader that stops releases the writer blocked on a full ring */
+  ring_reset(&r);
+  w.total = 1 << 20;
+  TEST_ASSERT_EQUAL_INT(0, pthread_create(&t, NULL, ring_writer_main, &w));
+  TEST_ASSERT_TRUE(ring_read(&r, buf, 10) > 0);
+  ring_close_read(&r);
+  TEST_ASSERT_EQUAL_INT(0, pthread_join(t, NULL));
+  TEST_ASSERT_EQUAL_INT(-1, w.result);
+  errno = 0;
+  TEST_ASSERT_NULL(ring_reserve(&r, &n));
+  TEST_ASSERT_EQUAL_INT(EPIPE, errno);
+  ring_destroy(&r);
+}
+
+void test_threaded_pipelines(void)
+{
+  static const char *const lines[] = {
+    "cat in | cat | cat | cat | cat | cat | cat | cat | cat | wc -l > out",
+    "cat in | head -n 3 | tail -n 1 > out",
+    "cat in | tail -c 100 | wc > out",
+    "cat in | tail -n +5000 | head -c 50 > out",
+    "cat in | cat in - in | wc -c > out",
+    "cat in | head -n 2 | cat - in | head -c 20 > out",
+    "cat in | cat < in | wc -l > out",
+    "cat in | cat | sort -r | head -n 2 | cat > out",
+    "cat in | head -n 1 2>&1 | wc > out",
+    "cat in | cat | builtin --external wc -l > out",
+    "cat in | cat missing | wc -l > out 2>&1",
+  };
+  char dir[] = "/tmp/test-lab-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/in", dir);
+  FILE *f = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  /* larger than a ring, so the stages have to take turns */
+  for (int i = 0; i < 100000; i++)
+    fprintf(f, "line %d\n", i);
+  fclose(f);
+
+  /* on threads the stages write the same and end the same as one after
+   * the other */
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+    {
+      char line[256], plain[256], threaded[256];
+      snprintf(line, sizeof(line), "set +o threads; %s", lines[i]);
+      int expect = run_in_dir(dir, line, false, plain, sizeof(plain));
+      TEST_ASSERT_EQUAL_INT_MESSAGE(expect, run_in_dir(dir, lines[i], false, threaded, sizeof(threaded)), lines[i]);
+      TEST_ASSERT_EQUAL_STRING_MESSAGE(plain, threaded, lines[i]);
+    }
+
+  /* stages stream: an endless producer ends when head is done, without a
+   * word about the closed ring */
+  char buf[256];
+  TEST_ASSERT_EQUAL_INT(0, run_in_dir(dir, "cat /dev/zero 2> out | cat 2>> out | head -c 300000 > /dev/null", false,
+                                      buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_in_dir(dir, "cat /dev/zero | cat | head -c 300000 | wc -c > out", false, buf,
+                                      sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("300000\n", buf);
+
+  /* the workers outlive a run and serve the next */
+  struct shell sh;
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  for (int i = 0; i < 50; i++)
+    {
+      const char *line = "cat in | cat | head -n 2 | tail -n 1 > out";
+      TEST_ASSERT_EQUAL_INT(0, sh_execute(&sh, line, strlen(line)));
+    }
+  TEST_ASSERT_EQUAL_size_t(3, sh.nworkers);
+  sh_destroy(&sh);
+  snprintf(path, sizeof(path), "%s/out", dir);
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("line 1\n", buf);
+
+  char cmd[PATH_MAX];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  TEST_ASSERT_EQUAL_INT(0, system(cmd));
+}
+
+void test_batch_input(void)
+{
+  /* a file is mapped, a pipe goes through the buffer; lines longer than
+   * the buffer and a last line without a newline come out whole */
+  size_t long_len = BATCH_BUFFER + 100;
+  char *text = malloc(long_len + 64);
+  TEST_ASSERT_NOT_NULL(text);
+  strcpy(text, "one\n\n");
+  memset(text + 5, 'x', long_len);
+  strcpy(text + 5 + long_len, "\nlast");
+  size_t total = strlen(text);
+  char path[PATH_MAX];
+  strcpy(path, make_tmp());
+  int fd = open(path, O_WRONLY | O_TRUNC);
+  TEST_ASSERT_EQUAL_INT((int)total, (int)write(fd, text, total));
+  close(fd);
+
+  for (int piped = 0; piped < 2; piped++)
+    {
+      int p[2];
+      pid_t writer = -1;
+      if (piped)
+        {
+          TEST_ASSERT_EQUAL_INT(0, pipe(p));
+          writer = fork();
+          if (writer == 0)
+            {
+              close(p[0]);
+              _exit(write(p[1], text, total) == (ssize_t)total ? 0 : 1);
+            }
+          close(p[1]);
+          fd = p[0];
+        }
+      else
+        {
+          fd = open(path, O_RDONLY);
+        }
+      struct batch_input in;
+      TEST_ASSERT_EQUAL_INT(0, batch_open(&in, fd));
+      TEST_ASSERT_EQUAL(!piped, in.mapped);
+      size_t len;
+      const char *line = batch_line(&in, &len);
+      TEST_ASSERT_EQUAL_size_t(4, len);
+      TEST_ASSERT_EQUAL_MEMORY("one\n", line, 4);
+      line = batch_line(&in, &len);
+      TEST_ASSERT_EQUAL_size_t(1, len);
+      line = batch_line(&in, &len);
+      TEST_ASSERT_EQUAL_size_t(long_len + 1, len);
+      TEST_ASSERT_EQUAL_MEMORY(text + 5, line, len);
+      line = batch_line(&in, &len);
+      TEST_ASSERT_EQUAL_size_t(4, len);
+      TEST_ASSERT_EQUAL_MEMORY("last", line, 4);
+      TEST_ASSERT_NULL(batch_line(&in, &len));
+      TEST_ASSERT_EQUAL_INT(0, in.error);
+      TEST_ASSERT_EQUAL_size_t(4, in.line);
+      batch_close(&in);
+      close(fd);
+      if (piped)
+        {
+          int ws;
+          waitpid(writer, &ws, 0);
+          TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(ws));
+        }
+    }
+  free(text);
+
+  /* a command reading the script starts after its own line, and the
+   * script goes on after what it read */
+  static const char script[] = "echo a > %s\nhead -n 1 >> %s\necho skipped >> %s\necho b >> %s\nexit 3\necho c >> %s\n";
+  char out[PATH_MAX];
+  strcpy(out, make_tmp());
+  char text2[6 * PATH_MAX];
+  snprintf(text2, sizeof(text2), script, out, out, out, out, out);
+  fd = open(path, O_WRONLY | O_TRUNC);
+  TEST_ASSERT_EQUAL_INT((int)strlen(text2), (int)write(fd, text2, strlen(text2)));
+  close(fd);
+  /* as batch mode runs it: the script is the shell's stdin */
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      fd = open(path, O_RDONLY);
+      dup2(fd, STDIN_FILENO);
+      close(fd);
+      struct shell sh;
+      sh_init(&sh);
+      int status = sh_run_batch(&sh, STDIN_FILENO);
+      sh_destroy(&sh);
+      _exit(status);
+    }
+  int ws;
+  TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &ws, 0));
+  TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(ws));
+  char buf[PATH_MAX + 64], expect[PATH_MAX + 64];
+  read_file(out, buf, sizeof(buf));
+  snprintf(expect, sizeof(expect), "a\necho skipped >> %s\nb\n", out);
+  TEST_ASSERT_EQUAL_STRING(expect, buf);
+  unlink(out);
+  unlink(path);
+}
+
+void test_compiled_script(void)
+{
+  static const char script[] = "# provisioning\n"
+                               "echo one > out\n"
+                               "\n"
+                               "false && echo no >> out || echo yes >> out\n"
+                               "true || echo no >> out; echo \"two words\" | wc -c >> out\n"
+                               "echo 'unterminated >> out\n"
+                               "cat out | head -n 2 | tail -n 1 >> out 2>&1\n"
+                               "exit 4\n"
+                               "echo after exit >> out\n";
+  char dir[] = "/tmp/test-lab-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char path[PATH_MAX], cache[PATH_MAX + 8], out[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/script.sh", dir);
+  snprintf(cache, sizeof(cache), "%s%s", path, PROGRAM_SUFFIX);
+  snprintf(out, sizeof(out), "%s/out", dir);
+  FILE *f = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fputs(script, f);
+  fclose(f);
+
+  /* the lines one at a time, as a script on stdin runs */
+  struct shell sh;
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  for (const char *line = script; *line && !sh.exit_requested;)
+    {
+      const char *nl = strchr(line, '\n');
+      sh_execute(&sh, line, (size_t)(nl - line) + 1);
+      line = nl + 1;
+    }
+  int expect = sh.last_status;
+  sh_destroy(&sh);
+  char plain[256], buf[256];
+  read_file(out, plain, sizeof(plain));
+  TEST_ASSERT_EQUAL_STRING("one\nyes\n10\nyes\n", plain);
+
+  /* compiled as it runs: exiting before the last line leaves no cache */
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  TEST_ASSERT_EQUAL_INT(expect, sh_run_script(&sh, path));
+  sh_destroy(&sh);
+  read_file(out, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING(plain, buf);
+  TEST_ASSERT_EQUAL_INT(-1, access(cache, R_OK));
+
+  /* compiled up front, then run from the cache */
+  struct program prog;
+  bool cached;
+  TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, path, &cached));
+  TEST_ASSERT_FALSE(cached);
+  program_destroy(&prog);
+  TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, path, &cached));
+  TEST_ASSERT_TRUE(cached);
+  TEST_ASSERT_EQUAL_size_t(1, prog.errors);
+  program_destroy(&prog);
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  TEST_ASSERT_EQUAL_INT(expect, sh_run_script(&sh, path));
+  sh_destroy(&sh);
+  read_file(out, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING(plain, buf);
+
+  /* a script that runs to its end leaves a cache behind */
+  char whole[PATH_MAX + 8];
+  snprintf(whole, sizeof(whole), "%s/whole.sh", dir);
+  f = fopen(whole, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fputs("echo whole > out\nfalse\n", f);
+  fclose(f);
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  TEST_ASSERT_EQUAL_INT(1, sh_run_script(&sh, whole));
+  sh_destroy(&sh);
+  TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, whole, &cached));
+  TEST_ASSERT_TRUE(cached);
+  program_destroy(&prog);
+
+  /* a changed script is compiled again and replaces the cache */
+  f = fopen(path, "a");
+  TEST_ASSERT_NOT_NULL(f);
+  fputs("echo appended\n", f);
+  fclose(f);
+  struct stat st;
+  TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+  TEST_ASSERT_EQUAL_INT(-1, program_open(&prog, cache, &st));
+  TEST_ASSERT_EQUAL_INT(ESTALE, errno);
+  TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, path, &cached));
+  TEST_ASSERT_FALSE(cached);
+  program_destroy(&prog);
+  TEST_ASSERT_EQUAL_INT(0, script_compile(&prog, path, &cached));
+  TEST_ASSERT_TRUE(cached);
+  program_destroy(&prog);
+
+  /* a damaged cache is ignored */
+  TEST_ASSERT_EQUAL_INT(0, truncate(cache, 100));
+  TEST_ASSERT_EQUAL_INT(-1, program_open(&prog, cache, &st));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, dir));
+  TEST_ASSERT_EQUAL_INT(expect, sh_run_script(&sh, path));
+  sh_destroy(&sh);
+  read_file(out, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING(plain, buf);
+
+  snprintf(path, sizeof(path), "%s/missing.sh", dir);
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(-1, sh_run_script(&sh, path));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+  sh_destroy(&sh);
+
+  char cmd[PATH_MAX];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  TEST_ASSERT_EQUAL_INT(0, system(cmd));
+}
+
+void test_list_operators(void)
+{
+  char buf[64];
+  TEST_ASSERT_EQUAL_INT(0, run_line("false && echo no > %s || echo yes > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("yes\n", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("echo a > %s ; echo b >> %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("a\nb\n", buf);
+  TEST_ASSERT_EQUAL_INT(127, run_line("/no/such/cmd > %s", buf, sizeof(buf)));
+}
+
+void test_relay(void)
+{
+  const char *msg = "relay through a pipe\n";
+  int p[2];
+  TEST_ASSERT_EQUAL_INT(0, pipe(p));
+  TEST_ASSERT_EQUAL_INT((int)strlen(msg), (int)write(p[1], msg, strlen(msg)));
+  close(p[1]);
+
+  const char *path = make_tmp();
+  int fd = open(path, O_WRONLY | O_TRUNC);
+  TEST_ASSERT_EQUAL_INT((int)strlen(msg), (int)lab_relay(p[0], fd, (size_t)-1));
+  close(fd);
+  close(p[0]);
+
+  /* file to file takes the sendfile path */
+  char copy[64];
+  strcpy(copy, path);
+  const char *path2 = make_tmp();
+  int in = open(copy, O_RDONLY);
+  int out = open(path2, O_WRONLY | O_TRUNC);
+  TEST_ASSERT_EQUAL_INT((int)strlen(msg), (int)lab_relay(in, out, (size_t)-1));
+  close(in);
+  close(out);
+
+  char buf[64];
+  read_file(path2, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING(msg, buf);
+  unlink(copy);
+  unlink(path2);
+}
+
+void test_path_cache_table(void)
+{
+  struct path_cache pc;
+  char name[32], path[64];
+  path_cache_init(&pc);
+  for (int i = 0; i < 2000; i++)
+    {
+      snprintf(name, sizeof(name), "cmd%d", i);
+      snprintf(path, sizeof(path), "/bin/cmd%d", i);
+      TEST_ASSERT_EQUAL_INT(0, path_cache_insert(&pc, name, path));
+    }
+  TEST_ASSERT_EQUAL_size_t(2000, pc.count);
+  for (int i = 0; i < 2000; i += 2)
+    {
+      snprintf(name, sizeof(name), "cmd%d", i);
+      path_cache_remove(&pc, name);
+    }
+  TEST_ASSERT_EQUAL_size_t(1000, pc.count);
+  /* every survivor must still be reachable after the backward shifts */
+  for (int i = 1; i < 2000; i += 2)
+    {
+      snprintf(name, sizeof(name), "cmd%d", i);
+      snprintf(path, sizeof(path), "/bin/cmd%d", i);
+      TEST_ASSERT_EQUAL_INT(0, path_cache_insert(&pc, name, path));
+    }
+  TEST_ASSERT_EQUAL_size_t(1000, pc.count);
+  path_cache_destroy(&pc);
+}
+
+static void write_script(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fputs("#!/bin/sh\nexit 0\n", f);
+  fclose(f);
+  TEST_ASSERT_EQUAL_INT(0, chmod(path, 0755));
+}
+
+void test_path_cache_inotify(void)
+{
+  char dir[] = "/tmp/test-lab-path-XXXXXX";
+  char bin[128];
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  snprintf(bin, sizeof(bin), "%s/labtool", dir);
+  char *saved = strdup(getenv("PATH"));
+  setenv("PATH", dir, 1);
+
+  struct path_cache pc;
+  path_cache_init(&pc);
+  TEST_ASSERT_NULL(path_cache_lookup(&pc, "labtool"));
+  write_script(bin);
+  TEST_ASSERT_EQUAL_STRING(bin, path_cache_lookup(&pc, "labtool"));
+  TEST_ASSERT_EQUAL_STRING(bin, path_cache_lookup(&pc, "labtool"));
+  TEST_ASSERT_EQUAL_size_t(1, pc.hits);
+
+  /* removing the binary drops the entry without any stat from us */
+  unlink(bin);
+  TEST_ASSERT_NULL(path_cache_lookup(&pc, "labtool"));
+  TEST_ASSERT_EQUAL_size_t(0, pc.count);
+
+  path_cache_destroy(&pc);
+  setenv("PATH", saved, 1);
+  free(saved);
+  rmdir(dir);
+}
+
+void test_hash_builtin(void)
+{
+  char buf[256];
+  TEST_ASSERT_EQUAL_INT(0, run_line("hash -p /opt/x/tool tool; hash > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("tool\t/opt/x/tool\n", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("hash -p /opt/x/tool tool; hash -r; hash > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("", buf);
+  TEST_ASSERT_EQUAL_INT(1, run_line("hash no-such-command-xyz 2> %s", buf, sizeof(buf)));
+}
+
+void test_builtin_dispatch(void)
+{
+  TEST_ASSERT_TRUE(builtin_table_size >= 5);
+  for (size_t i = 0; i < builtin_table_size; i++)
+    TEST_ASSERT_EQUAL_PTR(&builtin_table[i], builtin_lookup(builtin_table[i].name));
+  TEST_ASSERT_NOT_NULL(builtin_lookup("cd"));
+  TEST_ASSERT_NOT_NULL(builtin_lookup("pwd"));
+  TEST_ASSERT_NULL(builtin_lookup("ls"));
+  TEST_ASSERT_NULL(builtin_lookup(""));
+  TEST_ASSERT_NULL(builtin_lookup("cdx"));
+}
+
+void test_parallel_builtin(void)
+{
+  char buf[256];
+  TEST_ASSERT_EQUAL_INT(0, run_line("printf 'a\\nb\\nc\\n' | parallel -j 2 echo x{}y | sort > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("xay\nxby\nxcy\n", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("printf '1\\n2\\n' | parallel -j1 echo n > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("n 1\nn 2\n", buf);
+
+  /* each job's output stays in one piece even with all of them running */
+  TEST_ASSERT_EQUAL_INT(0, run_line("printf 'a\\nb\\nc\\nd\\n' | parallel -j 4 sh -c 'echo {}; sleep 0.05; echo {} >&2' > %s",
+                                    buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_size_t(16, strlen(buf));
+  for (size_t i = 0; i < 16; i += 4)
+    {
+      TEST_ASSERT_EQUAL_CHAR(buf[i], buf[i + 2]);
+      TEST_ASSERT_EQUAL_CHAR('\n', buf[i + 1]);
+    }
+
+  /* status is the number of failed jobs */
+  TEST_ASSERT_EQUAL_INT(2, run_line("printf '0\\n1\\n2\\n' | parallel sh -c 'exit {}' > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(0, run_line("parallel -a /dev/null echo > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("", buf);
+  TEST_ASSERT_EQUAL_INT(127, run_line("echo x | parallel no-such-command-xyz 2> %s", buf, sizeof(buf)));
+}
+
+void test_history_store(void)
+{
+  char path[64], idx[80];
+  strcpy(path, make_tmp());
+  snprintf(idx, sizeof(idx), "%s.idx", path);
+
+  struct hist_store h;
+  TEST_ASSERT_EQUAL_INT(0, hist_open(&h, path));
+  static const char *const lines[] = {"make all", "git status", "make all", "ls -l", "git stash pop"};
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+    TEST_ASSERT_EQUAL_INT(0, hist_add(&h, lines[i]));
+  size_t distinct;
+  TEST_ASSERT_EQUAL_size_t(5, hist_count(&h, &distinct));
+  TEST_ASSERT_EQUAL_size_t(4, distinct);
+
+  /* trigram and short queries both return each line once, newest first */
+  TEST_ASSERT_EQUAL_STRING("git stash pop", hist_search(&h, "git st", 0));
+  TEST_ASSERT_EQUAL_STRING("git status", hist_search(&h, "git st", 1));
+  TEST_ASSERT_NULL(hist_search(&h, "git st", 2));
+  TEST_ASSERT_EQUAL_STRING("make all", hist_search(&h, "ake", 0));
+  TEST_ASSERT_NULL(hist_search(&h, "ake", 1));
+  TEST_ASSERT_NULL(hist_search(&h, "nothing", 0));
+  TEST_ASSERT_EQUAL_STRING("git stash pop", hist_search(&h, "a", 0));
+  TEST_ASSERT_EQUAL_STRING("make all", hist_search(&h, "a", 1));
+  TEST_ASSERT_EQUAL_STRING("git status", hist_search(&h, "a", 2));
+  TEST_ASSERT_NULL(hist_search(&h, "a", 3));
+  TEST_ASSERT_EQUAL_INT(0, hist_add(&h, "git status"));
+  TEST_ASSERT_EQUAL_STRING("git status", hist_search(&h, "git st", 0));
+  TEST_ASSERT_EQUAL_STRING("git status", hist_search(&h, "s", 0));
+  hist_close(&h);
+
+  /* reopening reads neither the log nor the index, removing the index
+   * rebuilds it */
+  for (int pass = 0; pass < 2; pass++)
+    {
+      TEST_ASSERT_EQUAL_INT(0, hist_open(&h, path));
+      TEST_ASSERT_EQUAL_size_t(6, hist_count(&h, &distinct));
+      TEST_ASSERT_EQUAL_size_t(4, distinct);
+      const char *recent[3];
+      TEST_ASSERT_EQUAL_size_t(3, hist_recent(&h, recent, 3));
+      TEST_ASSERT_EQUAL_STRING("ls -l", recent[0]);
+      TEST_ASSERT_EQUAL_STRING("git stash pop", recent[1]);
+      TEST_ASSERT_EQUAL_STRING("git status", recent[2]);
+      TEST_ASSERT_EQUAL_STRING("make all", hist_search(&h, "make", 0));
+      hist_close(&h);
+      unlink(idx);
+    }
+
+  /* the export is a plain history file readline can load */
+  TEST_ASSERT_EQUAL_INT(0, hist_open(&h, path));
+  char out[64], buf[256];
+  strcpy(out, make_tmp());
+  int fd = open(out, O_WRONLY | O_TRUNC);
+  TEST_ASSERT_EQUAL_INT(0, hist_export(&h, fd));
+  close(fd);
+  hist_close(&h);
+  read_file(out, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("make all\ngit status\nmake all\nls -l\ngit stash pop\ngit status\n", buf);
+  clear_history();
+  TEST_ASSERT_EQUAL_INT(0, read_history(out));
+  TEST_ASSERT_EQUAL_INT(6, history_length);
+  TEST_ASSERT_EQUAL_STRING("git status", history_get(history_base + 5)->line);
+  clear_history();
+  unlink(out);
+  unlink(path);
+  unlink(idx);
+}
+
+static void touch_in(const char *dir, const char *name, bool exec)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (exec)
+    write_script(path);
+  else
+    {
+      int fd = open(path, O_WRONLY | O_CREAT, 0644);
+      TEST_ASSERT_TRUE(fd >= 0);
+      close(fd);
+    }
+}
+
+void test_completion(void)
+{
+  char d1[] = "/tmp/test-lab-comp-XXXXXX", d2[] = "/tmp/test-lab-comp-XXXXXX";
+  char path[128], sub[128];
+  TEST_ASSERT_NOT_NULL(mkdtemp(d1));
+  TEST_ASSERT_NOT_NULL(mkdtemp(d2));
+  touch_in(d1, "labtool-a", true);
+  touch_in(d1, "labtool-b", true);
+  touch_in(d1, "labtoolbox", true);
+  touch_in(d1, "labtool-c", false);
+  touch_in(d1, ".labtool-hidden", true);
+  touch_in(d2, "labtool-a", true);
+  snprintf(sub, sizeof(sub), "%s/labtool-d", d1);
+  TEST_ASSERT_EQUAL_INT(0, mkdir(sub, 0755));
+  snprintf(path, sizeof(path), "%s:%s", d1, d2);
+
+  struct completer c;
+  completer_init(&c);
+  char *const *names;
+  TEST_ASSERT_EQUAL_size_t(0, completer_commands(&c, "labtool", &names));
+  TEST_ASSERT_EQUAL_INT(0, completer_start(&c, path));
+  completer_wait(&c);
+  TEST_ASSERT_EQUAL_size_t(3, completer_commands(&c, "labtool", &names));
+  TEST_ASSERT_EQUAL_STRING("labtool-a", names[0]);
+  TEST_ASSERT_EQUAL_STRING("labtool-b", names[1]);
+  TEST_ASSERT_EQUAL_STRING("labtoolbox", names[2]);
+  TEST_ASSERT_EQUAL_size_t(1, completer_commands(&c, "labtoolb", &names));
+  TEST_ASSERT_EQUAL_size_t(0, completer_commands(&c, "labtoolx", &names));
+  TEST_ASSERT_EQUAL_size_t(1, completer_commands(&c, ".lab", &names));
+  TEST_ASSERT_EQUAL_size_t(1, completer_commands(&c, "cd", &names));
+
+  /* listings are reused until the directory's mtime moves */
+  TEST_ASSERT_EQUAL_size_t(4, completer_files(&c, d1, "labtool-", &names));
+  TEST_ASSERT_EQUAL_STRING("labtool-d", names[3]);
+  TEST_ASSERT_EQUAL_size_t(5, completer_files(&c, d1, "", &names));
+  TEST_ASSERT_EQUAL_size_t(1, completer_files(&c, d1, ".", &names));
+  TEST_ASSERT_EQUAL_size_t(1, c.dir_misses);
+  TEST_ASSERT_EQUAL_size_t(2, c.dir_hits);
+  touch_in(d1, "labtool-e", false);
+  TEST_ASSERT_EQUAL_size_t(5, completer_files(&c, d1, "labtool-", &names));
+  TEST_ASSERT_EQUAL_size_t(2, c.dir_misses);
+  TEST_ASSERT_EQUAL_size_t(0, completer_files(&c, "/no/such/dir", "", &names));
+
+  /* a new executable in a PATH directory triggers a rebuild */
+  char *saved = strdup(getenv("PATH"));
+  setenv("PATH", path, 1);
+  completer_refresh(&c, NULL);
+  completer_wait(&c);
+  touch_in(d2, "labtool-new", true);
+  completer_refresh(&c, NULL);
+  completer_wait(&c);
+  TEST_ASSERT_EQUAL_size_t(4, completer_commands(&c, "labtool", &names));
+  setenv("PATH", saved, 1);
+  free(saved);
+  completer_destroy(&c);
+
+  char cmd[300];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s %s", d1, d2);
+  TEST_ASSERT_EQUAL_INT(0, system(cmd));
+}
+
+void test_submit_does_not_block(void)
+{
+  char line[128];
+  char buf[64];
+  const char *path = make_tmp();
+  snprintf(line, sizeof(line), "sleep 0.1 && echo done > %s", path);
+
+  struct shell sh;
+  sh_init(&sh);
+  TEST_ASSERT_TRUE(sh_submit(&sh, line, strlen(line)));
+  TEST_ASSERT_NOT_NULL(sh.fg);
+  TEST_ASSERT_EQUAL_size_t(1, sh.fg->nprocs);
+
+  /* drive the line from pidfd readiness the way the event loop does */
+  bool waiting = true;
+  while (waiting)
+    {
+      struct pollfd pfd = {sh.fg->procs[0].pidfd, POLLIN, 0};
+      TEST_ASSERT_EQUAL_INT(1, poll(&pfd, 1, 5000));
+      waiting = sh_job_event(&sh, sh.fg->procs[0].pid);
+    }
+  TEST_ASSERT_NULL(sh.fg);
+  TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+  sh_destroy(&sh);
+
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("done\n", buf);
+  unlink(path);
+}
+
+void test_background_job(void)
+{
+  struct shell sh;
+  sh_init(&sh);
+  const char *line = "sleep 0.05 &";
+  TEST_ASSERT_FALSE(sh_submit(&sh, line, strlen(line)));
+  struct job *j = job_table_get(&sh.jobs, 1);
+  TEST_ASSERT_NOT_NULL(j);
+  TEST_ASSERT_TRUE(j->background);
+  TEST_ASSERT_EQUAL_STRING("sleep 0.05", j->text);
+  TEST_ASSERT_EQUAL_PTR(j, job_table_find_pid(&sh.jobs, j->procs[0].pid, NULL));
+  TEST_ASSERT_EQUAL_size_t(1, sh.jobs.nbackground);
+  TEST_ASSERT_EQUAL_INT(1, sh_reap_ready(&sh, 5000));
+  TEST_ASSERT_NULL(job_table_get(&sh.jobs, 1));
+  TEST_ASSERT_EQUAL_size_t(0, sh.jobs.nbackground);
+  sh_destroy(&sh);
+}
+
+void test_job_builtins(void)
+{
+  char buf[256];
+  TEST_ASSERT_EQUAL_INT(0, run_line("sleep 0.2 & sleep 0.2 | cat & jobs > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("[1]   Running                sleep 0.2\n[2]+  Running                sleep 0.2 | cat\n", buf);
+  TEST_ASSERT_EQUAL_INT(3, run_line("true > %s; sh -c 'exit 3' & wait %%1", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(127, run_line("true > %s; wait %%4 2>/dev/null", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(0, run_line("sleep 0.01 & wait; jobs > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("", buf);
+}
+
+/* envp holds exactly the exported variables of e, each once */
+static void check_envp(struct env_store *e, size_t exported)
+{
+  char *const *envp = env_envp(e);
+  size_t n = 0;
+  for (; envp[n]; n++)
+    {
+      char name[64];
+      const char *eq = strchr(envp[n], '=');
+      TEST_ASSERT_NOT_NULL(eq);
+      snprintf(name, sizeof(name), "%.*s", (int)(eq - envp[n]), envp[n]);
+      TEST_ASSERT_EQUAL_STRING(eq + 1, env_get(e, name));
+    }
+  TEST_ASSERT_EQUAL_size_t(exported, n);
+}
+
+void test_env_store(void)
+{
+  char *vars[] = {"A=1", "B=2", "NOEQUALS", "C=x=y", NULL};
+  struct env_store e, clone;
+  TEST_ASSERT_EQUAL_INT(0, env_init(&e, vars));
+  TEST_ASSERT_EQUAL_STRING("x=y", env_get(&e, "C"));
+  TEST_ASSERT_NULL(env_get(&e, "NOEQUALS"));
+  check_envp(&e, 3);
+
+  TEST_ASSERT_EQUAL_INT(0, env_set(&e, "LOCAL", "v", false));
+  check_envp(&e, 3);
+  TEST_ASSERT_EQUAL_INT(0, env_export(&e, "LOCAL", true));
+  check_envp(&e, 4);
+  TEST_ASSERT_EQUAL_INT(0, env_export(&e, "A", false));
+  check_envp(&e, 3);
+  TEST_ASSERT_EQUAL_STRING("1", env_get(&e, "A"));
+  TEST_ASSERT_EQUAL_INT(-1, env_export(&e, "MISSING", true));
+  TEST_ASSERT_EQUAL_INT(-1, env_set(&e, "", "v", true));
+
+  /* the clone shares until one side writes */
+  env_clone(&clone, &e);
+  TEST_ASSERT_EQUAL_PTR(env_envp(&e), env_envp(&clone));
+  TEST_ASSERT_EQUAL_INT(0, env_set(&clone, "B", "changed", true));
+  TEST_ASSERT_EQUAL_INT(0, env_unset(&clone, "C"));
+  TEST_ASSERT_EQUAL_STRING("2", env_get(&e, "B"));
+  TEST_ASSERT_EQUAL_STRING("x=y", env_get(&e, "C"));
+  TEST_ASSERT_EQUAL_STRING("changed", env_get(&clone, "B"));
+  TEST_ASSERT_NULL(env_get(&clone, "C"));
+  check_envp(&e, 3);
+  check_envp(&clone, 2);
+  env_destroy(&clone);
+
+  /* grow well past the initial table, then remove every other variable */
+  char name[32], value[32];
+  for (int i = 0; i < 2000; i++)
+    {
+      snprintf(name, sizeof(name), "VAR_%d", i);
+      snprintf(value, sizeof(value), "%d", i);
+      TEST_ASSERT_EQUAL_INT(0, env_set(&e, name, value, i % 3 != 0));
+    }
+  for (int i = 0; i < 2000; i += 2)
+    {
+      snprintf(name, sizeof(name), "VAR_%d", i);
+      TEST_ASSERT_EQUAL_INT(0, env_unset(&e, name));
+    }
+  size_t exported = 3;
+  for (int i = 1; i < 2000; i += 2)
+    {
+      snprintf(name, sizeof(name), "VAR_%d", i);
+      snprintf(value, sizeof(value), "%d", i);
+      TEST_ASSERT_EQUAL_STRING(value, env_get(&e, name));
+      exported += i % 3 != 0;
+    }
+  check_envp(&e, exported);
+  env_destroy(&e);
+}
+
+void test_subshell_env(void)
+{
+  struct shell sh, sub;
+  char buf[64];
+  sh_init(&sh);
+  sh_setenv(&sh, "LAB_SCOPE", "parent");
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, "/"));
+  sh_init_subshell(&sub, &sh);
+  TEST_ASSERT_EQUAL_PTR(env_envp(&sh.env), env_envp(&sub.env));
+  TEST_ASSERT_EQUAL_STRING("/", sub.cwd);
+  sh_setenv(&sub, "LAB_SCOPE", "child");
+
+  const char *path = make_tmp();
+  char line[128];
+  snprintf(line, sizeof(line), "sh -c 'echo $LAB_SCOPE' > %s", path);
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&sh, line, strlen(line)));
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("parent\n", buf);
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&sub, line, strlen(line)));
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_STRING("child\n", buf);
+  unlink(path);
+  sh_destroy(&sub);
+  sh_destroy(&sh);
+}
+
+struct instance_arg
+{
+  char dir[64];
+  int id;
+  int status;
+};
+
+static void *run_instance(void *p)
+{
+  struct instance_arg *a = p;
+  char id[16], line[256];
+  struct shell sh;
+  sh_init(&sh);
+  snprintf(id, sizeof(id), "%d", a->id);
+  sh_setenv(&sh, "LAB_ID", id);
+  snprintf(line, sizeof(line), "cd %s && echo start > out && echo rel > rel.txt", a->dir);
+  a->status = sh_execute(&sh, line, strlen(line));
+  for (int i = 0; i < 20 && a->status == 0; i++)
+    {
+      const char *more = "sh -c 'echo $LAB_ID' >> out; cat rel.txt >> out; pwd | cat >> out";
+      a->status = sh_execute(&sh, more, strlen(more));
+    }
+  sh_destroy(&sh);
+  return NULL;
+}
+
+/* Shells on different threads keep their own environment and directory */
+void test_shell_instances(void)
+{
+  enum { NSHELLS = 8 };
+  struct instance_arg args[NSHELLS];
+  pthread_t threads[NSHELLS];
+  char cwd[PATH_MAX], after[PATH_MAX];
+  TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+  for (int i = 0; i < NSHELLS; i++)
+    {
+      strcpy(args[i].dir, "/tmp/lab-instance-XXXXXX");
+      TEST_ASSERT_NOT_NULL(mkdtemp(args[i].dir));
+      args[i].id = i;
+      TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, run_instance, &args[i]));
+    }
+  for (int i = 0; i < NSHELLS; i++)
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[i], NULL));
+
+  for (int i = 0; i < NSHELLS; i++)
+    {
+      char path[128], expect[2048], buf[2048], cmd[128];
+      size_t len = (size_t)snprintf(expect, sizeof(expect), "start\n");
+      for (int k = 0; k < 20; k++)
+        len += (size_t)snprintf(expect + len, sizeof(expect) - len, "%d\nrel\n%s\n", i, args[i].dir);
+      snprintf(path, sizeof(path), "%s/out", args[i].dir);
+      read_file(path, buf, sizeof(buf));
+      TEST_ASSERT_EQUAL_INT(0, args[i].status);
+      TEST_ASSERT_EQUAL_STRING(expect, buf);
+      snprintf(cmd, sizeof(cmd), "rm -rf %s", args[i].dir);
+      TEST_ASSERT_EQUAL_INT(0, system(cmd));
+    }
+  TEST_ASSERT_NOT_NULL(getcwd(after, sizeof(after)));
+  TEST_ASSERT_EQUAL_STRING(cwd, after);
+  TEST_ASSERT_NULL(getenv("LAB_ID"));
+}
+
+void test_shell_env_and_cd(void)
+{
+  struct shell sh;
+  char buf[256];
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh_setenv(&sh, "LAB_VAR", "one"));
+  TEST_ASSERT_EQUAL_INT(0, sh_setenv(&sh, "LAB_VAR", "two"));
+  TEST_ASSERT_EQUAL_STRING("two", sh_getenv(&sh, "LAB_VAR"));
+  TEST_ASSERT_EQUAL_INT(-1, sh_setenv(&sh, "A=B", "x"));
+  TEST_ASSERT_EQUAL_INT(0, sh_setenv(&sh, "LAB_VAR", NULL));
+  TEST_ASSERT_NULL(sh_getenv(&sh, "LAB_VAR"));
+
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, "/usr"));
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, "bin/.."));
+  TEST_ASSERT_EQUAL_STRING("/usr", sh.cwd);
+  TEST_ASSERT_EQUAL_STRING("/usr", sh_getenv(&sh, "PWD"));
+  TEST_ASSERT_EQUAL_INT(-1, sh_chdir(&sh, "no-such-dir"));
+  TEST_ASSERT_EQUAL_STRING("/usr", sh.cwd);
+  const char *path = make_tmp();
+  snprintf(buf, sizeof(buf), "cd / ; ls -d bin > %s", path);
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&sh, buf, strlen(buf)));
+  sh_destroy(&sh);
+  read_file(path, buf, sizeof(buf));
+  unlink(path);
+  TEST_ASSERT_EQUAL_STRING("bin\n", buf);
+}
+
+void test_shell_zygote(void)
+{
+  char buf[64];
+  TEST_ASSERT_EQUAL_INT(0, run_line("set -o zygote; echo b a | tr ' ' '\\n' | sort > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("a\nb\n", buf);
+  TEST_ASSERT_EQUAL_INT(0, run_line("set -o zygote; cd /usr; ls -d bin > %s", buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("bin\n", buf);
+  TEST_ASSERT_EQUAL_INT(127, run_line("set -o zygote; /no/such/cmd 2> %s", buf, sizeof(buf)));
+}
+
+void test_server(void)
+{
+  char sock[64], line[256], buf[PATH_MAX];
+  snprintf(sock, sizeof(sock), "/tmp/test-lab-%d.sock", (int)getpid());
+  pid_t server = fork();
+  TEST_ASSERT_TRUE(server >= 0);
+  if (server == 0)
+    _exit(sh_server(sock, 1) == 0 ? 0 : 1);
+  int status = -1;
+  for (int i = 0; i < 200 && status < 0; i++)
+    if ((status = sh_client(sock, "true", 4)) < 0)
+      usleep(10000);
+  TEST_ASSERT_EQUAL_INT(0, status);
+
+  /* the client's working directory and environment, the command's status */
+  const char *path = make_tmp();
+  char cwd[PATH_MAX];
+  TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+  setenv("LAB_SERVER_TEST", "from-client", 1);
+  snprintf(line, sizeof(line), "pwd > %s; sh -c 'echo $LAB_SERVER_TEST' >> %s; exit 3", path, path);
+  TEST_ASSERT_EQUAL_INT(3, sh_client(sock, line, strlen(line)));
+  unsetenv("LAB_SERVER_TEST");
+  read_file(path, buf, sizeof(buf));
+  strcat(cwd, "\nfrom-client\n");
+  TEST_ASSERT_EQUAL_STRING(cwd, buf);
+
+  /* the worker stays warm between requests */
+  TEST_ASSERT_EQUAL_INT(0, sh_client(sock, "hash -p /opt/x/tool tool", 24));
+  snprintf(line, sizeof(line), "hash > %s", path);
+  TEST_ASSERT_EQUAL_INT(0, sh_client(sock, line, strlen(line)));
+  read_file(path, buf, sizeof(buf));
+  TEST_ASSERT_NOT_NULL(strstr(buf, "tool\t/opt/x/tool\n"));
+  TEST_ASSERT_NOT_NULL(strstr(buf, "true\t"));
+  unlink(path);
+
+  TEST_ASSERT_EQUAL_INT(0, kill(server, SIGTERM));
+  TEST_ASSERT_EQUAL_INT(0, wait_status(server));
+  TEST_ASSERT_EQUAL_INT(-1, sh_client(sock, "true", 4));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+}
+
+static int run_test(struct shell *sh, const char *line)
+{
+  return sh_execute(sh, line, strlen(line));
+}
+
+void test_test_builtins(void)
+{
+  struct shell sh;
+  sh_init(&sh);
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ -d / ]"));
+  TEST_ASSERT_EQUAL_INT(1, run_test(&sh, "test -f /"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ ! -e /no/such/file ]"));
+  TEST_ASSERT_EQUAL_INT(1, run_test(&sh, "[ ]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ -n ]"));
+  TEST_ASSERT_EQUAL_INT(1, run_test(&sh, "[ '' ]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ ! != x ]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ abc = abc -a 3 -lt 10 ]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ x = y -o ( -z '' -a ! 2 -ge 3 ) ]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ a \\< b ]"));
+  TEST_ASSERT_EQUAL_INT(2, run_test(&sh, "[ 1 -eq x ] 2> /dev/null"));
+  TEST_ASSERT_EQUAL_INT(2, run_test(&sh, "[ -d / 2> /dev/null"));
+  TEST_ASSERT_EQUAL_INT(2, run_test(&sh, "[ ( -d / ] 2> /dev/null"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[[ -d / && abc == a* ]]"));
+  TEST_ASSERT_EQUAL_INT(1, run_test(&sh, "[[ -f / || abc != a?c ]]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[[ b > a && ab =~ ^a.$ ]]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[[ 1 -eq 2 ]] || echo ok > /dev/null"));
+
+  /* relative to the shell's directory, not the process's */
+  TEST_ASSERT_EQUAL_INT(0, sh_chdir(&sh, "/"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ -d usr -a -x usr -a usr -ef /usr ]"));
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "set -o statcache; set +o statcache"));
+  TEST_ASSERT_FALSE(sh.stats.enabled);
+  TEST_ASSERT_EQUAL_INT(2, run_test(&sh, "set -o nonsense 2> /dev/null"));
+  sh_destroy(&sh);
+}
+
+void test_stat_cache(void)
+{
+  struct shell sh;
+  char line[256];
+  sh_init(&sh);
+  const char *path = make_tmp();
+
+  /* one fstatat for every test of the line, misses included */
+  snprintf(line, sizeof(line), "[ -e %s ] && [ -f %s ] && [[ -r %s && ! -s %s ]]", path, path, path, path);
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, line));
+  TEST_ASSERT_EQUAL_size_t(1, sh.stats.misses);
+  TEST_ASSERT_EQUAL_size_t(3, sh.stats.hits);
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, "[ -e /no/such ] || [ ! -d /no/such ]"));
+  TEST_ASSERT_EQUAL_size_t(2, sh.stats.misses);
+  TEST_ASSERT_EQUAL_size_t(4, sh.stats.hits);
+
+  /* other commands invalidate what the tests before them saw */
+  unlink(path);
+  snprintf(line, sizeof(line), "[ -e %s ] || touch %s && [ -e %s ]", path, path, path);
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, line));
+  snprintf(line, sizeof(line), "[ -e %s ] && echo x > %s && [ -s %s ]", path, path, path);
+  TEST_ASSERT_EQUAL_INT(0, run_test(&sh, line));
+
+  struct stat st;
+  struct stat_cache sc;
+  stat_cache_init(&sc);
+  TEST_ASSERT_EQUAL_INT(0, stat_cache_get(&sc, AT_FDCWD, path, true, &st));
+  TEST_ASSERT_EQUAL_INT(2, st.st_size);
+  unlink(path);
+  TEST_ASSERT_EQUAL_INT(0, stat_cache_get(&sc, AT_FDCWD, path, true, &st));
+  TEST_ASSERT_EQUAL_INT(-1, stat_cache_get(&sc, AT_FDCWD, path, false, &st));
+  TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+  stat_cache_clear(&sc);
+  TEST_ASSERT_EQUAL_INT(-1, stat_cache_get(&sc, AT_FDCWD, path, true, &st));
+  for (int i = 0; i < 2 * STAT_CACHE_SIZE; i++)
+    {
+      snprintf(line, sizeof(line), "/no/such/%d", i);
+      TEST_ASSERT_EQUAL_INT(-1, stat_cache_get(&sc, AT_FDCWD, line, true, &st));
+    }
+  TEST_ASSERT_EQUAL_size_t(STAT_CACHE_SIZE, sc.count);
+  TEST_ASSERT_EQUAL_size_t(1, sc.hits);
+
+  sh.stats.enabled = false;
+  size_t misses = sh.stats.misses;
+  TEST_ASSERT_EQUAL_INT(1, run_test(&sh, "[ -e /no/such ] || [ -d /no/such ]"));
+  TEST_ASSERT_EQUAL_size_t(misses, sh.stats.misses);
+  sh_destroy(&sh);
+}
+
+/* Many outstanding children: lookups stay O(1) and wait reaps them all */
+void test_job_table_10k_children(void)
+{
+  const size_t nchildren = 10000;
+  struct rlimit rl;
+  TEST_ASSERT_EQUAL_INT(0, getrlimit(RLIMIT_NOFILE, &rl));
+  if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < nchildren + 256)
+    TEST_IGNORE_MESSAGE("RLIMIT_NOFILE too low for one pidfd per child");
+  struct rlimit raised = {nchildren + 256, rl.rlim_max};
+  if (rl.rlim_cur < raised.rlim_cur)
+    TEST_ASSERT_EQUAL_INT(0, setrlimit(RLIMIT_NOFILE, &raised));
+
+  struct shell sh;
+  sh_init(&sh);
+  const char *line = "/bin/true &";
+  for (size_t i = 0; i < nchildren; i++)
+    TEST_ASSERT_FALSE(sh_submit(&sh, line, strlen(line)));
+  TEST_ASSERT_EQUAL_size_t(nchildren, sh.jobs.count);
+
+  /* job ids and pids both resolve to the same job */
+  for (int id = 1; id <= (int)nchildren; id += 997)
+    {
+      struct job *j = job_table_get(&sh.jobs, id);
+      TEST_ASSERT_NOT_NULL(j);
+      TEST_ASSERT_EQUAL_PTR(j, job_table_find_pid(&sh.jobs, j->procs[0].pid, NULL));
+    }
+
+  const char *wait_all = "wait";
+  TEST_ASSERT_EQUAL_INT(0, sh_execute(&sh, wait_all, strlen(wait_all)));
+  TEST_ASSERT_EQUAL_size_t(0, sh.jobs.count);
+  TEST_ASSERT_EQUAL_size_t(0, sh.jobs.pid_count);
+  TEST_ASSERT_EQUAL_size_t(0, sh.jobs.nbackground);
+  sh_destroy(&sh);
+  setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+int main(int argc, char **argv) {
+  int rc = UnityParseOptions(argc, argv);
+  if (rc != 0)
+    return rc < 0 ? 0 : rc;
   UNITY_BEGIN();
-  RUN_TEST(test_stuff);
+  RUN_TEST(test_tokenize_words);
+  RUN_TEST(test_tokenize_quotes);
+  RUN_TEST(test_tokenize_operators);
+  RUN_TEST(test_tokenize_dbracket);
+  RUN_TEST(test_tokenize_errors_and_comments);
+  RUN_TEST(test_tokenize_arena_reuse);
+  RUN_TEST(test_cmd_parse);
+  RUN_TEST(test_spawn_redirects);
+  RUN_TEST(test_spawn_redirects_fork);
+  RUN_TEST(test_spawn_missing_command);
+  RUN_TEST(test_spawn_child_fn);
+  RUN_TEST(test_zygote);
+  RUN_TEST(test_cmd_build);
+  RUN_TEST(test_pipeline_external);
+  RUN_TEST(test_pipeline_builtin_stage);
+  RUN_TEST(test_utility_builtins);
+  RUN_TEST(test_optimizer);
+  RUN_TEST(test_ring);
+  RUN_TEST(test_threaded_pipelines);
+  RUN_TEST(test_compiled_script);
+  RUN_TEST(test_batch_input);
+  RUN_TEST(test_list_operators);
+  RUN_TEST(test_relay);
+  RUN_TEST(test_path_cache_table);
+  RUN_TEST(test_path_cache_inotify);
+  RUN_TEST(test_hash_builtin);
+  RUN_TEST(test_builtin_dispatch);
+  RUN_TEST(test_parallel_builtin);
+  RUN_TEST(test_history_store);
+  RUN_TEST(test_completion);
+  RUN_TEST(test_submit_does_not_block);
+  RUN_TEST(test_background_job);
+  RUN_TEST(test_job_builtins);
+  RUN_TEST(test_shell_instances);
+  RUN_TEST(test_shell_env_and_cd);
+  RUN_TEST(test_env_store);
+  RUN_TEST(test_subshell_env);
+  RUN_TEST(test_shell_zygote);
+  RUN_TEST(test_server);
+  RUN_TEST(test_test_builtins);
+  RUN_TEST(test_stat_cache);
+  RUN_TEST(test_job_table_10k_children);
   return UNITY_END();
 }
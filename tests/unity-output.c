@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+#include "harness/unity.h"
+
+/*
+ * Exercises the Unity print paths with passing, failing and ignored tests.
+ * The Makefile builds it with the putchar and the buffered output backend,
+ * and with the parallel runner, and checks that all print exactly the same.
+ */
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void output_pass(void)
+{
+  TEST_ASSERT_EQUAL_INT(1, 1);
+}
+
+void output_pass_with_printf(void)
+{
+  printf("printed by the test itself\n");
+  TEST_ASSERT_TRUE(1);
+}
+
+void output_fail_int(void)
+{
+  TEST_ASSERT_EQUAL_INT(-42, 17);
+}
+
+void output_fail_hex(void)
+{
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(0xdeadbeef, 0xfeedface, "hex values");
+}
+
+void output_fail_uint64(void)
+{
+  TEST_ASSERT_EQUAL_UINT64(18446744073709551615ull, 1ull);
+}
+
+void output_fail_float(void)
+{
+  TEST_ASSERT_EQUAL_FLOAT(1.5f, 2.25f);
+}
+
+void output_fail_string(void)
+{
+  TEST_ASSERT_EQUAL_STRING_MESSAGE("a long expected string that does not fit a small buffer in one piece",
+                                   "another long string, also longer than the smallest output buffer",
+                                   "strings differ");
+}
+
+void output_fail_array(void)
+{
+  int expected[] = {1, 2, 3, 4};
+  int actual[] = {1, 2, 5, 4};
+  TEST_ASSERT_EQUAL_INT_ARRAY(expected, actual, 4);
+}
+
+void output_fail_memory(void)
+{
+  TEST_ASSERT_EQUAL_MEMORY("abcd", "abXd", 4);
+}
+
+void output_ignore(void)
+{
+  TEST_IGNORE_MESSAGE("not yet");
+}
+
+void output_message(void)
+{
+  TEST_MESSAGE("an informational message");
+}
+
+int main(int argc, char **argv) {
+#ifdef UNITY_USE_COMMAND_LINE_ARGS
+  if (UnityParseOptions(argc, argv) != 0)
+    return 1;
+#else
+  (void)argc;
+  (void)argv;
+#endif
+  UNITY_BEGIN();
+  RUN_TEST(output_pass_with_printf);
+  RUN_TEST(output_fail_int);
+  RUN_TEST(output_fail_hex);
+  RUN_TEST(output_fail_uint64);
+  RUN_TEST(output_fail_float);
+  RUN_TEST(output_fail_string);
+  RUN_TEST(output_fail_array);
+  RUN_TEST(output_fail_memory);
+  RUN_TEST(output_ignore);
+  RUN_TEST(output_message);
+  for (int i = 0; i < 100; i++)
+    RUN_TEST(output_pass);
+  return UNITY_END();
+}
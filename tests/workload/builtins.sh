@@ -0,0 +1,18 @@
+# Builtins only: tokenizing, dispatch and redirections, no process is started
+cd /
+pwd > /dev/null
+cd /tmp
+pwd > /dev/null; pwd > /dev/null; pwd > /dev/null
+cd /usr/bin; pwd >> /dev/null
+hash ls cat sort wc head tail grep sed awk > /dev/null
+hash -r
+hash ls cat sort wc > /dev/null
+hash -p /bin/true t
+hash t > /dev/null
+hash > /dev/null
+jobs
+cd "/usr" ; cd 'lib' ; pwd > /dev/null
+pwd "quoted argument" 'single quoted' unquoted words that are ignored > /dev/null
+cd /; pwd 2> /dev/null > /dev/null; cd /tmp ; pwd > /dev/null ; cd / ; pwd > /dev/null
+history > /dev/null
+wait
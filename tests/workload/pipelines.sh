@@ -0,0 +1,8 @@
+# Pipelines mixing builtins and external commands
+echo one two three | wc -w > /dev/null
+cat /etc/passwd | sort | uniq | wc -l > /dev/null
+pwd | cat > /dev/null
+ls / | head -3 | tail -1 > /dev/null
+echo x | cat | cat | cat | cat > /dev/null
+printf '1\n2\n3\n4\n' | parallel -j4 echo {} > /dev/null
+hash ls | cat > /dev/null
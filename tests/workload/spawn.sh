@@ -0,0 +1,13 @@
+# External commands: path lookup, spawning and waiting
+true
+/bin/true
+false
+echo spawn workload > /dev/null
+ls / > /dev/null
+true; true; true
+echo a b c d e f > /dev/null 2>&1
+/bin/sh -c true
+true &
+true &
+wait
+cat < /dev/null
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Compares cold invocations of the shell with warm ones served by
+# --server.
+#
+# Every command is run ROUNDS times, once as BINARY -c COMMAND starting a
+# new shell each time and once as CLIENT -c COMMAND with LAB_SERVER
+# pointing at a server started from BINARY.  The mean time per
+# invocation is reported in microseconds.
+#
+# usage: bench-server.sh BINARY CLIENT ROUNDS COMMAND...
+#
+set -e
+
+bin=$1
+client=$2
+rounds=$3
+shift 3
+
+tmp=$(mktemp -d)
+sock=$tmp/server.sock
+"$bin" --server "$sock" --workers 2 &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -rf "$tmp"' EXIT
+while [ ! -S "$sock" ]; do
+  sleep 0.05
+done
+
+# mean_us binary command
+mean_us() {
+  start=$(date +%s%N)
+  i=0
+  while [ $i -lt "$rounds" ]; do
+    "$1" -c "$2" > /dev/null 2>&1 || true
+    i=$((i + 1))
+  done
+  echo $((($(date +%s%N) - start) / rounds / 1000))
+}
+
+echo "$rounds invocations of $bin -c COMMAND (cold) and $client -c COMMAND (warm)"
+printf '%-20s %12s %12s %8s\n' command cold warm speedup
+for cmd in "$@"; do
+  cold=$(unset LAB_SERVER; mean_us "$bin" "$cmd")
+  warm=$(LAB_SERVER=$sock; export LAB_SERVER; mean_us "$client" "$cmd")
+  awk -v c="$cmd" -v cold="$cold" -v warm="$warm" \
+    'BEGIN { printf "%-20s %9d us %9d us %7.2fx\n", c, cold, warm, cold / warm }'
+done
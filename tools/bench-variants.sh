@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Times the workload scripts with several builds of the shell.
+#
+# A run feeds one script ROUNDS times through one shell process, which
+# reads it from stdin like any script.  Every binary does RUNS such runs
+# per script, and the best one is reported in milliseconds together with
+# the speedup relative to the first binary.
+#
+# usage: bench-variants.sh ROUNDS SCRIPT... -- NAME=BINARY...
+#
+set -e
+
+RUNS=${RUNS:-5}
+rounds=$1
+shift
+scripts=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+  scripts="$scripts $1"
+  shift
+done
+shift
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+for script in $scripts; do
+  i=0
+  while [ $i -lt "$rounds" ]; do
+    cat "$script"
+    i=$((i + 1))
+  done > "$tmp/$(basename "$script")"
+done
+
+# best_ns binary workload
+best_ns() {
+  best=
+  r=0
+  while [ $r -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$1" < "$2" > /dev/null 2>&1 || true
+    ns=$(($(date +%s%N) - start))
+    if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+      best=$ns
+    fi
+    r=$((r + 1))
+  done
+  echo "$best"
+}
+
+echo "$rounds rounds of every script, best of $RUNS runs"
+printf '%-10s' variant
+for script in $scripts; do
+  printf ' %20s' "$(basename "$script" .sh)"
+done
+echo
+
+for variant in "$@"; do
+  name=${variant%%=*}
+  bin=${variant#*=}
+  printf '%-10s' "$name"
+  for script in $scripts; do
+    w=$(basename "$script")
+    ns=$(best_ns "$bin" "$tmp/$w")
+    [ -f "$tmp/$w.base" ] || echo "$ns" > "$tmp/$w.base"
+    awk -v ns="$ns" -v base="$(cat "$tmp/$w.base")" \
+      'BEGIN { printf " %11.1f ms %5.2fx", ns / 1e6, base / ns }'
+  done
+  echo
+done
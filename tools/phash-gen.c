@@ -0,0 +1,167 @@
+/*
+ * Build time generator for the builtin dispatch table.
+ *
+ * Reads BUILTIN(id, "name", function) lines from a .def file and writes a
+ * header with a minimal perfect hash over the names: one g table of
+ * displacements and a BUILTIN_SLOT_<id> constant for every builtin.
+ *
+ * usage: phash-gen builtins.def > builtins_phash.h
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phash.h"
+
+#define MAX_KEYS 256
+#define MAX_NAME 64
+#define MAX_SEED 10000000u
+
+struct key
+{
+  char id[MAX_NAME];
+  char name[MAX_NAME];
+};
+
+static struct key keys[MAX_KEYS];
+static size_t nkeys;
+
+static int read_def(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    {
+      perror(path);
+      return -1;
+    }
+  char line[512];
+  while (fgets(line, sizeof(line), f))
+    {
+      struct key k;
+      if (sscanf(line, " BUILTIN ( %63[^, ] , \"%63[^\"]\"", k.id, k.name) != 2)
+        continue;
+      if (nkeys == MAX_KEYS)
+        {
+          fprintf(stderr, "%s: too many builtins\n", path);
+          fclose(f);
+          return -1;
+        }
+      for (size_t i = 0; i < nkeys; i++)
+        if (strcmp(keys[i].name, k.name) == 0)
+          {
+            fprintf(stderr, "%s: duplicate builtin %s\n", path, k.name);
+            fclose(f);
+            return -1;
+          }
+      keys[nkeys++] = k;
+    }
+  fclose(f);
+  if (nkeys == 0)
+    {
+      fprintf(stderr, "%s: no builtins found\n", path);
+      return -1;
+    }
+  return 0;
+}
+
+static int cmp_bucket_size(const void *a, const void *b, void *sizes)
+{
+  const size_t *sz = sizes;
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return sz[y] > sz[x] ? 1 : sz[y] < sz[x] ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      fprintf(stderr, "usage: %s builtins.def\n", argv[0]);
+      return 2;
+    }
+  if (read_def(argv[1]) < 0)
+    return 1;
+
+  uint32_t n = (uint32_t)nkeys;
+  size_t bucket_of[MAX_KEYS], sizes[MAX_KEYS] = {0}, order[MAX_KEYS];
+  int32_t g[MAX_KEYS] = {0};
+  int slot_key[MAX_KEYS];
+  for (uint32_t i = 0; i < n; i++)
+    {
+      bucket_of[i] = phash_str(0, keys[i].name) % n;
+      sizes[bucket_of[i]]++;
+      order[i] = i;
+      slot_key[i] = -1;
+    }
+  qsort_r(order, n, sizeof(order[0]), cmp_bucket_size, sizes);
+
+  /* Largest buckets first: search a seed that scatters the bucket into
+   * free, distinct slots */
+  size_t b;
+  for (b = 0; b < n && sizes[order[b]] > 1; b++)
+    {
+      size_t bucket = order[b];
+      uint32_t seed;
+      for (seed = 1; seed < MAX_SEED; seed++)
+        {
+          uint32_t used[MAX_KEYS];
+          size_t nused = 0;
+          size_t i;
+          for (i = 0; i < n; i++)
+            {
+              if (bucket_of[i] != bucket)
+                continue;
+              uint32_t s = phash_str(seed, keys[i].name) % n;
+              size_t j;
+              for (j = 0; j < nused && used[j] != s; j++)
+                ;
+              if (slot_key[s] >= 0 || j < nused)
+                break;
+              used[nused++] = s;
+            }
+          if (i == n)
+            break;
+        }
+      if (seed == MAX_SEED)
+        {
+          fprintf(stderr, "no perfect hash found\n");
+          return 1;
+        }
+      g[bucket] = (int32_t)seed;
+      for (uint32_t i = 0; i < n; i++)
+        if (bucket_of[i] == bucket)
+          slot_key[phash_str(seed, keys[i].name) % n] = (int)i;
+    }
+
+  /* Singletons go straight into the remaining slots */
+  uint32_t free_slot = 0;
+  for (; b < n && sizes[order[b]] == 1; b++)
+    {
+      size_t bucket = order[b];
+      while (slot_key[free_slot] >= 0)
+        free_slot++;
+      for (uint32_t i = 0; i < n; i++)
+        if (bucket_of[i] == bucket)
+          slot_key[free_slot] = (int)i;
+      g[bucket] = -(int32_t)free_slot - 1;
+    }
+
+  for (uint32_t i = 0; i < n; i++)
+    if ((int)i != slot_key[phash_slot(g, n, keys[i].name)])
+      {
+        fprintf(stderr, "internal error: %s does not hash to its slot\n", keys[i].name);
+        return 1;
+      }
+
+  printf("/* Generated by tools/phash-gen from %s, do not edit */\n", argv[1]);
+  printf("#ifndef BUILTINS_PHASH_H\n#define BUILTINS_PHASH_H\n\n");
+  printf("#define BUILTIN_PHASH_N %uu\n\n", n);
+  printf("static const int32_t builtin_phash_g[BUILTIN_PHASH_N] = {");
+  for (uint32_t i = 0; i < n; i++)
+    printf("%s%s%d", i ? "," : "", i % 8 ? " " : "\n    ", g[i]);
+  printf("\n};\n\n");
+  for (uint32_t s = 0; s < n; s++)
+    printf("#define BUILTIN_SLOT_%s %u /* %s */\n", keys[slot_key[s]].id, s, keys[slot_key[s]].name);
+  printf("\n#endif\n");
+  return 0;
+}